@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "arena.h"
+
+#include <algorithm>
+
+namespace lox {
+
+void Arena::Reset() {
+  if (blocks_.empty()) return;
+  // Later blocks are only needed by unusually large compilations, so only
+  // the first is kept.
+  blocks_.resize(1);
+  next_ = blocks_.front().get();
+  end_ = next_ + kBlockSize;
+}
+
+void *Arena::AllocateSlow(std::size_t size) {
+  // new[] aligns blocks for any type, so a fresh block needs no padding.
+  // Requests too large for a block get one of their own, leaving what is
+  // left of the current block in use. The first block is always at least
+  // kBlockSize long, since Reset() keeps it.
+  if (size > kBlockSize / 4 && !blocks_.empty()) {
+    return blocks_.emplace_back(std::make_unique<std::byte[]>(size)).get();
+  }
+  std::size_t block_size = std::max(size, kBlockSize);
+  next_ = blocks_.emplace_back(std::make_unique<std::byte[]>(block_size)).get();
+  end_ = next_ + block_size;
+  void *result = next_;
+  next_ += size;
+  return result;
+}
+
+}  // namespace lox
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_ARENA_H
+#define LOX_SRC_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace lox {
+
+// Hands out memory by bumping a pointer through large blocks, for the
+// temporaries of a compilation, which are all dropped at once. Nothing is
+// freed on its own: Reset() takes everything back in one go, keeping the
+// first block for reuse, and the arena's destructor frees the blocks.
+// Objects in an arena must be destroyed before it is reset, but their
+// memory is never given back to it.
+class Arena {
+ public:
+  static constexpr auto kBlockSize = std::size_t{16} << 10;
+
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns size bytes aligned to align, which must be a power of two no
+  // larger than alignof(std::max_align_t).
+  void *Allocate(std::size_t size, std::size_t align) {
+    auto offset = (align - reinterpret_cast<std::uintptr_t>(next_)) &
+                  (align - 1);
+    if (offset + size > static_cast<std::size_t>(end_ - next_)) {
+      return AllocateSlow(size);
+    }
+    void *result = next_ + offset;
+    next_ += offset + size;
+    return result;
+  }
+  void Reset();
+
+ private:
+  void *AllocateSlow(std::size_t size);
+
+  std::vector<std::unique_ptr<std::byte[]>> blocks_;
+  std::byte *next_ = nullptr;
+  std::byte *end_ = nullptr;
+};
+
+// Lets standard containers allocate from an arena. Deallocation does
+// nothing; the memory comes back when the arena is reset.
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+
+  explicit ArenaAllocator(Arena *arena) noexcept : arena_(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) noexcept  // NOLINT
+      : arena_(other.get_arena()) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(arena_->Allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T * /*pointer*/, std::size_t /*n*/) noexcept {}
+
+  [[nodiscard]] Arena *get_arena() const noexcept { return arena_; }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U> &other) const noexcept {
+    return arena_ == other.get_arena();
+  }
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U> &other) const noexcept {
+    return arena_ != other.get_arena();
+  }
+
+ private:
+  Arena *arena_;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+}  // namespace lox
+
+#endif  // LOX_SRC_ARENA_H
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <thread>
+
+#include "verifier.h"
+
+namespace lox {
+
+std::shared_ptr<const Chunk> CompileShared(std::string_view source,
+                                           OptimizationLevel level) {
+  auto compiler = Compiler{source, level};
+  return CompileShared(&compiler);
+}
+
+std::shared_ptr<const Chunk> CompileShared(Compiler *compiler) {
+  auto chunk = std::make_shared<Chunk>();
+  if (!compiler->Compile(chunk.get())) return nullptr;
+
+  auto verifier = Verifier{};
+  verifier.Verify(chunk.get());
+  chunk->Freeze();
+  return chunk;
+}
+
+std::vector<BatchResult> RunBatch(
+    const std::vector<std::shared_ptr<const Chunk>> &chunks, std::size_t jobs,
+    bool jit) {
+  auto results = std::vector<BatchResult>(chunks.size());
+  auto next = std::atomic<std::size_t>{0};
+
+  // Workers take the next chunk until none are left, so long scripts do not
+  // hold up a fixed share of the batch.
+  auto work = [&chunks, &results, &next, jit]() {
+    auto vm = VirtualMachine{};
+    vm.set_jit_enabled(jit);
+    for (std::size_t i = next++; i < chunks.size(); i = next++) {
+      BatchResult &result = results[i];
+      if (chunks[i] == nullptr) {
+        result.result = InterpretResult::kCompileError;
+        continue;
+      }
+      auto out = std::ostringstream{};
+      auto errors = std::ostringstream{};
+      vm.set_output(&out);
+      vm.set_error_output(&errors);
+      // Each script starts with its own globals, undefined.
+      if (const auto &globals = chunks[i]->GetGlobalTable()) {
+        vm.ResetGlobals(globals);
+      }
+      result.result = vm.Execute(*chunks[i]);
+      result.output = out.str();
+      result.errors = errors.str();
+    }
+  };
+
+  jobs = std::clamp<std::size_t>(jobs, 1, std::max<std::size_t>(chunks.size(), 1));
+  auto workers = std::vector<std::thread>{};
+  for (auto i = std::size_t{1}; i < jobs; ++i) workers.emplace_back(work);
+  work();
+  for (auto &worker : workers) worker.join();
+  return results;
+}
+
+}  // namespace lox
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_BATCH_H
+#define LOX_SRC_BATCH_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "ir.h"
+#include "vm.h"
+
+namespace lox {
+
+// Compiles source into a verified, frozen chunk that can be shared between
+// threads. Returns nullptr after reporting a compile error.
+std::shared_ptr<const Chunk> CompileShared(
+    std::string_view source,
+    OptimizationLevel level = OptimizationLevel::kO0);
+// As above, with a compiler that has already been given its inputs and
+// natives.
+std::shared_ptr<const Chunk> CompileShared(Compiler *compiler);
+
+struct BatchResult {
+  InterpretResult result;
+  // What the script returned and the runtime errors it reported.
+  std::string output;
+  std::string errors;
+};
+
+// Runs every chunk on a pool of jobs worker threads, each with its own
+// VirtualMachine. A null chunk, for a script that failed to compile, yields
+// kCompileError. Results are in the order of the chunks.
+std::vector<BatchResult> RunBatch(
+    const std::vector<std::shared_ptr<const Chunk>> &chunks, std::size_t jobs,
+    bool jit = false);
+
+}  // namespace lox
+
+#endif  // LOX_SRC_BATCH_H
@@ -2,10 +2,19 @@
 
 #include "chunk.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <iostream>
+#include <new>
 
 namespace {
 
+std::uint64_t NextChunkId() {
+  static auto next_id = std::atomic<std::uint64_t>{1};
+  return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
 std::size_t SimpleInstruction(std::string_view name, std::size_t offset) {
   std::cout << name << '\n';
   return offset + 1;
@@ -20,72 +29,555 @@ std::ostream &operator<<(std::ostream &os, Opcode opcode) {
   return os;
 }
 
+std::optional<InstructionInfo> GetInstructionInfo(const std::uint8_t *code,
+                                                  std::size_t available) {
+  if (available == 0) return std::nullopt;
+
+  auto info = InstructionInfo{};
+  auto opcode = static_cast<Opcode>(code[0]);
+  switch (opcode) {
+    case Opcode::kConstant:
+      info = {2, 0, 1};
+      break;
+    case Opcode::kConstantLong:
+      info = {4, 0, 1};
+      break;
+    case Opcode::kNil:
+    case Opcode::kTrue:
+    case Opcode::kFalse:
+      info = {1, 0, 1};
+      break;
+    case Opcode::kEqual:
+    case Opcode::kNotEqual:
+    case Opcode::kGreater:
+    case Opcode::kGreaterEqual:
+    case Opcode::kLess:
+    case Opcode::kLessEqual:
+    case Opcode::kAdd:
+    case Opcode::kSubtract:
+    case Opcode::kMultiply:
+    case Opcode::kDivide:
+    case Opcode::kAddNumber:
+    case Opcode::kAddString:
+    case Opcode::kSubtractNumber:
+    case Opcode::kMultiplyNumber:
+    case Opcode::kDivideNumber:
+    case Opcode::kGreaterNumber:
+    case Opcode::kGreaterEqualNumber:
+    case Opcode::kLessNumber:
+    case Opcode::kLessEqualNumber:
+      info = {1, 2, 1};
+      break;
+    case Opcode::kNot:
+    case Opcode::kNegate:
+    case Opcode::kNegateNumber:
+      info = {1, 1, 1};
+      break;
+    case Opcode::kReturn:
+      info = {1, 1, 0};
+      break;
+    case Opcode::kGetInput:
+      info = {2, 0, 1};
+      break;
+    case Opcode::kDefineGlobal:
+      info = {2, 1, 0};
+      break;
+    case Opcode::kDefineGlobalLong:
+      info = {4, 1, 0};
+      break;
+    case Opcode::kGetGlobal:
+      info = {2, 0, 1};
+      break;
+    case Opcode::kGetGlobalLong:
+      info = {4, 0, 1};
+      break;
+    case Opcode::kSetGlobal:
+      info = {2, 1, 1};
+      break;
+    case Opcode::kSetGlobalLong:
+      info = {4, 1, 1};
+      break;
+    case Opcode::kPop:
+    case Opcode::kPrint:
+      info = {1, 1, 0};
+      break;
+    case Opcode::kGetLocal:
+      info = {2, 0, 1};
+      break;
+    case Opcode::kGetLocalLong:
+      info = {4, 0, 1};
+      break;
+    case Opcode::kSetLocal:
+      info = {2, 1, 1};
+      break;
+    case Opcode::kSetLocalLong:
+      info = {4, 1, 1};
+      break;
+    case Opcode::kPopN:
+      if (available < 2) return std::nullopt;
+      info = {2, code[1], 0};
+      break;
+    case Opcode::kJump:
+    case Opcode::kLoop:
+      info = {3, 0, 0};
+      break;
+    case Opcode::kJumpIfFalse:
+      info = {3, 1, 1};
+      break;
+    case Opcode::kCallNative:
+      if (available < 3) return std::nullopt;
+      info = {3, code[2], 1};
+      break;
+    case Opcode::kCall:
+    case Opcode::kTailCall:
+      if (available < 2) return std::nullopt;
+      info = {2, std::size_t{code[1]} + 1, 1};
+      break;
+    case Opcode::kClosure:
+    case Opcode::kGetUpvalue:
+      info = {2, 0, 1};
+      break;
+    case Opcode::kClosureLong:
+      info = {4, 0, 1};
+      break;
+    case Opcode::kSetUpvalue:
+      info = {2, 1, 1};
+      break;
+    case Opcode::kCloseUpvalues:
+      if (available < 2) return std::nullopt;
+      info = {2, code[1], 0};
+      break;
+    case Opcode::kClass:
+      info = {4, 0, 1};
+      break;
+    // These pop the class or instance beneath and push it back, so that it
+    // must exist.
+    case Opcode::kMethod:
+    case Opcode::kSetProperty:
+    case Opcode::kGetSuper:
+      info = {4, 2, 1};
+      break;
+    case Opcode::kInherit:
+      info = {1, 2, 1};
+      break;
+    case Opcode::kGetProperty:
+      info = {4, 1, 1};
+      break;
+    case Opcode::kInvoke:
+      if (available < 5) return std::nullopt;
+      info = {5, std::size_t{code[4]} + 1, 1};
+      break;
+    case Opcode::kBuildList:
+      if (available < 2) return std::nullopt;
+      info = {2, code[1], 1};
+      break;
+    case Opcode::kGetIndex:
+      info = {1, 2, 1};
+      break;
+    case Opcode::kSetIndex:
+      info = {1, 3, 1};
+      break;
+    case Opcode::kBuildMap:
+      if (available < 2) return std::nullopt;
+      info = {2, std::size_t{code[1]} * 2, 1};
+      break;
+    case Opcode::kPick:
+    case Opcode::kSlide: {
+      if (available < 2) return std::nullopt;
+      // Both read the slot their operand refers to, so that much of the
+      // stack must exist.
+      std::size_t depth = code[1];
+      info = opcode == Opcode::kPick ? InstructionInfo{2, depth + 1, depth + 2}
+                                     : InstructionInfo{2, depth + 1, 1};
+      break;
+    }
+    default:
+      return std::nullopt;
+  }
+
+  if (info.length > available) return std::nullopt;
+  return info;
+}
+
+Opcode SpecialiseOpcode(Opcode generic, ValueType a, ValueType b) {
+  bool numbers = a == ValueType::kNumber && b == ValueType::kNumber;
+  switch (generic) {
+    case Opcode::kAdd:
+      if (numbers) return Opcode::kAddNumber;
+      if (a == ValueType::kString && b == ValueType::kString) {
+        return Opcode::kAddString;
+      }
+      return generic;
+    case Opcode::kSubtract:
+      return numbers ? Opcode::kSubtractNumber : generic;
+    case Opcode::kMultiply:
+      return numbers ? Opcode::kMultiplyNumber : generic;
+    case Opcode::kDivide:
+      return numbers ? Opcode::kDivideNumber : generic;
+    case Opcode::kGreater:
+      return numbers ? Opcode::kGreaterNumber : generic;
+    case Opcode::kGreaterEqual:
+      return numbers ? Opcode::kGreaterEqualNumber : generic;
+    case Opcode::kLess:
+      return numbers ? Opcode::kLessNumber : generic;
+    case Opcode::kLessEqual:
+      return numbers ? Opcode::kLessEqualNumber : generic;
+    case Opcode::kNegate:
+      return a == ValueType::kNumber ? Opcode::kNegateNumber : generic;
+    default:
+      return generic;
+  }
+}
+
+ValueType GetResultType(Opcode generic, ValueType a, ValueType b) {
+  switch (generic) {
+    case Opcode::kEqual:
+    case Opcode::kNotEqual:
+    case Opcode::kGreater:
+    case Opcode::kGreaterEqual:
+    case Opcode::kLess:
+    case Opcode::kLessEqual:
+    case Opcode::kNot:
+      return ValueType::kBool;
+    case Opcode::kAdd:
+      return a == b && (a == ValueType::kNumber || a == ValueType::kString)
+                 ? a
+                 : ValueType::kUnknown;
+    // The other arithmetic fails at runtime unless given numbers, so a
+    // number is all it can leave behind.
+    case Opcode::kSubtract:
+    case Opcode::kMultiply:
+    case Opcode::kDivide:
+    case Opcode::kNegate:
+      return ValueType::kNumber;
+    default:
+      return ValueType::kUnknown;
+  }
+}
+
+Chunk::Chunk() noexcept : id_(NextChunkId()) {}
+
+Chunk::~Chunk() noexcept {
+  for (auto i = std::size_t{0}; i < frozen_constant_count_; ++i) {
+    frozen_constants_[i].~Value();
+  }
+}
+
+void Chunk::Reserve(std::size_t code_size, std::size_t constant_count) {
+  assert(!IsFrozen());
+  code_.reserve(code_size);
+  lines_.reserve(code_size);
+  constants_.reserve(constant_count);
+}
+
 void Chunk::Write(std::uint8_t code, std::size_t line) noexcept {
+  assert(!IsFrozen());
   code_.push_back(code);
   lines_.push_back(line);
+  verified_ = false;
 }
 
 void Chunk::Write(Opcode code, std::size_t line) noexcept {
+  assert(!IsFrozen());
   code_.push_back(static_cast<std::uint8_t>(code));
   lines_.push_back(line);
+  verified_ = false;
 }
 
-void Chunk::Disassemble(std::string_view name) noexcept {
+void Chunk::Disassemble(std::string_view name) const noexcept {
   std::cout << "== " << name << " ==\n";
 
   auto offset = std::size_t{0};
-  while (offset < code_.size()) {
+  while (offset < GetCodeSize()) {
     offset = DisassembleInstruction(offset);
   }
 }
 
 void Chunk::WriteConstant(Value value, std::size_t line) noexcept {
-  constants_.push_back(value);
-  std::size_t index = constants_.size() - 1;
-  if (index < 255) {
-    Write(Opcode::kConstant, line);
-    Write(static_cast<uint8_t>(constants_.size() - 1), line);
+  WriteWithOperand(Opcode::kConstant, Opcode::kConstantLong,
+                   AddConstant(std::move(value)), line);
+}
+
+std::size_t Chunk::AddConstant(Value value) noexcept {
+  assert(!IsFrozen());
+  constants_.push_back(std::move(value));
+  return constants_.size() - 1;
+}
+
+void Chunk::WriteWithOperand(Opcode code, Opcode long_code,
+                             std::size_t operand, std::size_t line) noexcept {
+  if (operand <= UINT8_MAX) {
+    Write(code, line);
+    Write(static_cast<std::uint8_t>(operand), line);
   } else {
-    Write(Opcode::kConstantLong, line);
-    Write((index & 0x00ff0000) >> 16, line);
-    Write((index & 0x0000ff00) >> 8, line);
-    Write(index & 0x000000ff, line);
+    Write(long_code, line);
+    Write(static_cast<std::uint8_t>((operand & 0x00ff0000) >> 16), line);
+    Write(static_cast<std::uint8_t>((operand & 0x0000ff00) >> 8), line);
+    Write(static_cast<std::uint8_t>(operand & 0x000000ff), line);
   }
 }
 
-const std::uint8_t *Chunk::GetCodePtr() const noexcept { return code_.data(); }
+void Chunk::SetCodeAtIndex(std::size_t index, std::uint8_t byte) noexcept {
+  assert(!IsFrozen());
+  code_[index] = byte;
+  verified_ = false;
+}
 
-std::size_t Chunk::GetLineAtIndex(std::size_t index) { return lines_[index]; }
+void Chunk::Truncate(std::size_t code_size, std::size_t constant_count,
+                     std::size_t inline_cache_count) noexcept {
+  assert(!IsFrozen() && code_size <= code_.size() &&
+         constant_count <= constants_.size() &&
+         inline_cache_count <= inline_caches_.size());
+  code_.resize(code_size);
+  lines_.resize(code_size);
+  constants_.resize(constant_count);
+  // Inline caches cannot be moved, so they are only ever added or removed
+  // at the end.
+  while (inline_caches_.size() > inline_cache_count) {
+    inline_caches_.pop_back();
+  }
+  verified_ = false;
+}
 
-Value Chunk::GetValueAtIndex(std::size_t index) { return constants_[index]; }
+const std::uint8_t *Chunk::GetCodePtr() const noexcept {
+  return frozen_ ? frozen_code_ : code_.data();
+}
+
+std::size_t Chunk::GetCodeSize() const noexcept {
+  return frozen_ ? frozen_code_size_ : code_.size();
+}
+
+std::size_t Chunk::GetConstantCount() const noexcept {
+  return frozen_ ? frozen_constant_count_ : constants_.size();
+}
+
+std::size_t Chunk::GetLineAtIndex(std::size_t index) const {
+  return frozen_ ? frozen_lines_[index] : lines_[index];
+}
+
+const Value &Chunk::GetValueAtIndex(std::size_t index) const {
+  return frozen_ ? frozen_constants_[index] : constants_[index];
+}
+
+bool Chunk::IsVerified() const noexcept { return verified_; }
+
+std::size_t Chunk::GetMaxStackDepth() const noexcept {
+  return max_stack_depth_;
+}
+
+void Chunk::MarkVerified(std::size_t max_stack_depth) noexcept {
+  verified_ = true;
+  max_stack_depth_ = max_stack_depth;
+}
+
+std::size_t Chunk::AddNative(std::shared_ptr<const NativeFunction> native) {
+  auto it = std::find(natives_.begin(), natives_.end(), native);
+  if (it != natives_.end()) {
+    return static_cast<std::size_t>(it - natives_.begin());
+  }
+  natives_.push_back(std::move(native));
+  verified_ = false;
+  return natives_.size() - 1;
+}
+
+std::size_t Chunk::GetNativeCount() const noexcept { return natives_.size(); }
+
+const NativeFunction &Chunk::GetNative(std::size_t index) const {
+  return *natives_[index];
+}
+
+void Chunk::SetGlobalTable(std::shared_ptr<GlobalTable> globals) noexcept {
+  globals_ = std::move(globals);
+  verified_ = false;
+}
+
+const std::shared_ptr<GlobalTable> &Chunk::GetGlobalTable() const noexcept {
+  return globals_;
+}
+
+void Chunk::SetHasResult(bool has_result) noexcept {
+  has_result_ = has_result;
+}
+
+bool Chunk::HasResult() const noexcept { return has_result_; }
+
+void Chunk::SetArgumentSlots(std::size_t slots) noexcept {
+  argument_slots_ = slots;
+  verified_ = false;
+}
+
+std::size_t Chunk::GetArgumentSlots() const noexcept {
+  return argument_slots_;
+}
+
+void Chunk::SetUpvalueCount(std::size_t count) noexcept {
+  upvalue_count_ = count;
+  verified_ = false;
+}
+
+std::size_t Chunk::GetUpvalueCount() const noexcept { return upvalue_count_; }
+
+void InlineCache::Insert(std::uint64_t shape_id,
+                         std::uint32_t resolution) const {
+  if (shape_id > kMaxShapeId || resolution > kMaxResolution) return;
+  std::uint64_t bits = shape_id << kResolutionBits | resolution;
+  for (std::atomic<std::uint64_t> &entry : entries_) {
+    auto expected = std::uint64_t{0};
+    if (entry.compare_exchange_strong(expected, bits,
+                                      std::memory_order_relaxed)) {
+      return;
+    }
+    // Another machine may have cached the same shape meanwhile.
+    if (expected >> kResolutionBits == shape_id) return;
+  }
+}
+
+std::size_t Chunk::AddInlineCache(std::string name) {
+  inline_caches_.emplace_back(std::move(name));
+  verified_ = false;
+  return inline_caches_.size() - 1;
+}
+
+std::size_t Chunk::GetInlineCacheCount() const noexcept {
+  return inline_caches_.size();
+}
+
+void Chunk::SetInputTypes(std::vector<ValueType> types) noexcept {
+  input_types_ = std::move(types);
+  verified_ = false;
+}
+
+const std::vector<ValueType> &Chunk::GetInputTypes() const noexcept {
+  return input_types_;
+}
+
+void Chunk::Freeze() {
+  if (IsFrozen()) return;
+
+  // Constants come first, so the allocation's alignment suits them, and the
+  // line table follows at a multiple of sizeof(Value).
+  static_assert(sizeof(Value) % alignof(std::size_t) == 0);
+  std::size_t constants_size = constants_.size() * sizeof(Value);
+  std::size_t lines_size = lines_.size() * sizeof(std::size_t);
+  frozen_ =
+      std::make_unique<std::byte[]>(constants_size + lines_size + code_.size());
+
+  auto *constants = reinterpret_cast<Value *>(frozen_.get());
+  for (auto i = std::size_t{0}; i < constants_.size(); ++i) {
+    new (&constants[i]) Value{std::move(constants_[i])};
+  }
+  auto *lines = reinterpret_cast<std::size_t *>(frozen_.get() + constants_size);
+  std::copy(lines_.begin(), lines_.end(), lines);
+  auto *code = reinterpret_cast<std::uint8_t *>(frozen_.get() + constants_size +
+                                                lines_size);
+  std::copy(code_.begin(), code_.end(), code);
+
+  frozen_constants_ = constants;
+  frozen_lines_ = lines;
+  frozen_code_ = code;
+  frozen_code_size_ = code_.size();
+  frozen_constant_count_ = constants_.size();
+
+  code_ = {};
+  lines_ = {};
+  constants_ = {};
+}
+
+bool Chunk::IsFrozen() const noexcept { return frozen_ != nullptr; }
+
+std::size_t Chunk::ByteInstruction(std::string_view name,
+                                   std::size_t offset) const noexcept {
+  std::uint8_t operand = GetCodePtr()[offset + 1];
+  std::printf("%-16s %4d\n", name.data(), operand);
+  return offset + 2;
+}
+
+std::size_t Chunk::JumpInstruction(std::string_view name, int sign,
+                                   std::size_t offset) const noexcept {
+  auto jump = static_cast<long>(ReadJumpOffset(GetCodePtr() + offset + 1));
+  std::printf("%-16s %4zu -> %ld\n", name.data(), offset,
+              static_cast<long>(offset) + 3 + sign * jump);
+  return offset + 3;
+}
+
+std::size_t Chunk::SlotInstruction(std::string_view name, std::size_t offset,
+                                   bool is_long) const noexcept {
+  const std::uint8_t *code = GetCodePtr();
+  std::size_t slot =
+      is_long ? ReadLongOperand(code + offset + 1) : code[offset + 1];
+  std::printf("%-16s %4zu\n", name.data(), slot);
+  return offset + (is_long ? 4 : 2);
+}
+
+std::size_t Chunk::GlobalInstruction(std::string_view name,
+                                     std::size_t offset,
+                                     bool is_long) const noexcept {
+  const std::uint8_t *code = GetCodePtr();
+  std::size_t slot =
+      is_long ? ReadLongOperand(code + offset + 1) : code[offset + 1];
+  std::printf("%-16s %4zu '", name.data(), slot);
+  if (globals_ != nullptr && slot < globals_->GetCount()) {
+    std::cout << globals_->GetName(slot);
+  }
+  std::cout << "'\n";
+  return offset + (is_long ? 4 : 2);
+}
+
+std::size_t Chunk::NativeInstruction(std::string_view name,
+                                     std::size_t offset) const noexcept {
+  const std::uint8_t *code = GetCodePtr();
+  std::printf("%-16s %4d '", name.data(), code[offset + 1]);
+  if (code[offset + 1] < GetNativeCount()) {
+    std::cout << GetNative(code[offset + 1]).get_name();
+  }
+  std::printf("' (%d args)\n", code[offset + 2]);
+  return offset + 3;
+}
 
 std::size_t Chunk::ConstantInstruction(std::string_view name,
-                                       std::size_t offset) noexcept {
-  std::uint8_t constant = code_[offset + 1];
+                                       std::size_t offset) const noexcept {
+  std::uint8_t constant = GetCodePtr()[offset + 1];
   std::printf("%-16s %4d '", name.data(), constant);
-  std::cout << constants_[constant] << "'\n";
+  std::cout << GetValueAtIndex(constant) << "'\n";
   return offset + 2;
 }
 
 std::size_t Chunk::ConstantLongInstruction(std::string_view name,
-                                           std::size_t offset) noexcept {
+                                           std::size_t offset) const noexcept {
+  const std::uint8_t *code = GetCodePtr();
   auto constant =
-      (code_[offset + 1] << 16) | (code_[offset + 2] << 8) | code_[offset + 3];
+      (code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3];
   std::printf("%-16s %4d '", name.data(), constant);
-  std::cout << constants_[static_cast<std::size_t>(constant)] << "'\n";
+  std::cout << GetValueAtIndex(static_cast<std::size_t>(constant)) << "'\n";
+  return offset + 4;
+}
+
+std::size_t Chunk::PropertyInstruction(std::string_view name,
+                                       std::size_t offset) const noexcept {
+  const std::uint8_t *code = GetCodePtr();
+  std::size_t index = ReadLongOperand(code + offset + 1);
+  std::printf("%-16s %4zu '", name.data(), index);
+  if (index < GetInlineCacheCount()) {
+    std::cout << GetInlineCache(index).get_name();
+  }
+  if (static_cast<Opcode>(code[offset]) == Opcode::kInvoke) {
+    std::printf("' (%d args)\n", code[offset + 4]);
+    return offset + 5;
+  }
+  std::cout << "'\n";
   return offset + 4;
 }
 
-std::size_t Chunk::DisassembleInstruction(std::size_t offset) noexcept {
+std::size_t Chunk::DisassembleInstruction(std::size_t offset) const noexcept {
   std::printf("%04lu ", offset);
 
-  if (offset > 0 && lines_[offset] == lines_[offset - 1]) {
+  if (offset > 0 && GetLineAtIndex(offset) == GetLineAtIndex(offset - 1)) {
     std::cout << "   | ";
   } else {
-    std::printf("%4lu ", lines_[offset]);
+    std::printf("%4lu ", GetLineAtIndex(offset));
   }
 
-  auto instruction = static_cast<Opcode>(code_[offset]);
+  auto instruction = static_cast<Opcode>(GetCodePtr()[offset]);
   switch (instruction) {
     case Opcode::kConstant:
       return ConstantInstruction("OP_CONSTANT", offset);
@@ -123,6 +615,102 @@ std::size_t Chunk::DisassembleInstruction(std::size_t offset) noexcept {
       return SimpleInstruction("OP_NEGATE", offset);
     case Opcode::kReturn:
       return SimpleInstruction("OP_RETURN", offset);
+    case Opcode::kAddNumber:
+      return SimpleInstruction("OP_ADD_NUMBER", offset);
+    case Opcode::kAddString:
+      return SimpleInstruction("OP_ADD_STRING", offset);
+    case Opcode::kSubtractNumber:
+      return SimpleInstruction("OP_SUBTRACT_NUMBER", offset);
+    case Opcode::kMultiplyNumber:
+      return SimpleInstruction("OP_MULTIPLY_NUMBER", offset);
+    case Opcode::kDivideNumber:
+      return SimpleInstruction("OP_DIVIDE_NUMBER", offset);
+    case Opcode::kGreaterNumber:
+      return SimpleInstruction("OP_GREATER_NUMBER", offset);
+    case Opcode::kGreaterEqualNumber:
+      return SimpleInstruction("OP_GREATER_EQUAL_NUMBER", offset);
+    case Opcode::kLessNumber:
+      return SimpleInstruction("OP_LESS_NUMBER", offset);
+    case Opcode::kLessEqualNumber:
+      return SimpleInstruction("OP_LESS_EQUAL_NUMBER", offset);
+    case Opcode::kNegateNumber:
+      return SimpleInstruction("OP_NEGATE_NUMBER", offset);
+    case Opcode::kPick:
+      return ByteInstruction("OP_PICK", offset);
+    case Opcode::kSlide:
+      return ByteInstruction("OP_SLIDE", offset);
+    case Opcode::kGetInput:
+      return ByteInstruction("OP_GET_INPUT", offset);
+    case Opcode::kCallNative:
+      return NativeInstruction("OP_CALL_NATIVE", offset);
+    case Opcode::kDefineGlobal:
+      return GlobalInstruction("OP_DEFINE_GLOBAL", offset, false);
+    case Opcode::kDefineGlobalLong:
+      return GlobalInstruction("OP_DEFINE_GLOBAL_LONG", offset, true);
+    case Opcode::kGetGlobal:
+      return GlobalInstruction("OP_GET_GLOBAL", offset, false);
+    case Opcode::kGetGlobalLong:
+      return GlobalInstruction("OP_GET_GLOBAL_LONG", offset, true);
+    case Opcode::kSetGlobal:
+      return GlobalInstruction("OP_SET_GLOBAL", offset, false);
+    case Opcode::kSetGlobalLong:
+      return GlobalInstruction("OP_SET_GLOBAL_LONG", offset, true);
+    case Opcode::kPop:
+      return SimpleInstruction("OP_POP", offset);
+    case Opcode::kPrint:
+      return SimpleInstruction("OP_PRINT", offset);
+    case Opcode::kGetLocal:
+      return SlotInstruction("OP_GET_LOCAL", offset, false);
+    case Opcode::kGetLocalLong:
+      return SlotInstruction("OP_GET_LOCAL_LONG", offset, true);
+    case Opcode::kSetLocal:
+      return SlotInstruction("OP_SET_LOCAL", offset, false);
+    case Opcode::kSetLocalLong:
+      return SlotInstruction("OP_SET_LOCAL_LONG", offset, true);
+    case Opcode::kPopN:
+      return ByteInstruction("OP_POP_N", offset);
+    case Opcode::kJump:
+      return JumpInstruction("OP_JUMP", 1, offset);
+    case Opcode::kJumpIfFalse:
+      return JumpInstruction("OP_JUMP_IF_FALSE", 1, offset);
+    case Opcode::kLoop:
+      return JumpInstruction("OP_LOOP", -1, offset);
+    case Opcode::kCall:
+      return ByteInstruction("OP_CALL", offset);
+    case Opcode::kTailCall:
+      return ByteInstruction("OP_TAIL_CALL", offset);
+    case Opcode::kClosure:
+      return ConstantInstruction("OP_CLOSURE", offset);
+    case Opcode::kClosureLong:
+      return ConstantLongInstruction("OP_CLOSURE_LONG", offset);
+    case Opcode::kGetUpvalue:
+      return ByteInstruction("OP_GET_UPVALUE", offset);
+    case Opcode::kSetUpvalue:
+      return ByteInstruction("OP_SET_UPVALUE", offset);
+    case Opcode::kCloseUpvalues:
+      return ByteInstruction("OP_CLOSE_UPVALUES", offset);
+    case Opcode::kClass:
+      return ConstantLongInstruction("OP_CLASS", offset);
+    case Opcode::kMethod:
+      return ConstantLongInstruction("OP_METHOD", offset);
+    case Opcode::kInherit:
+      return SimpleInstruction("OP_INHERIT", offset);
+    case Opcode::kGetProperty:
+      return PropertyInstruction("OP_GET_PROPERTY", offset);
+    case Opcode::kSetProperty:
+      return PropertyInstruction("OP_SET_PROPERTY", offset);
+    case Opcode::kInvoke:
+      return PropertyInstruction("OP_INVOKE", offset);
+    case Opcode::kGetSuper:
+      return PropertyInstruction("OP_GET_SUPER", offset);
+    case Opcode::kBuildList:
+      return ByteInstruction("OP_BUILD_LIST", offset);
+    case Opcode::kGetIndex:
+      return SimpleInstruction("OP_GET_INDEX", offset);
+    case Opcode::kSetIndex:
+      return SimpleInstruction("OP_SET_INDEX", offset);
+    case Opcode::kBuildMap:
+      return ByteInstruction("OP_BUILD_MAP", offset);
     default:
       std::cout << "Unknown opcode " << instruction << '\n';
       return offset + 1;
@@ -3,10 +3,19 @@
 #ifndef LOX_SRC_CHUNK_H
 #define LOX_SRC_CHUNK_H
 
+#include <array>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <vector>
 
+#include "globals.h"
+#include "native.h"
 #include "value.h"
 
 namespace lox {
@@ -29,38 +38,320 @@ enum class Opcode : std::uint8_t {
   kDivide,
   kNot,
   kNegate,
-  kReturn
+  kReturn,
+  // Type-specialised forms of the above, emitted when the compiler has proven
+  // the operand types. The verifier re-checks the proof, so the VM does not
+  // test the operands of these when running a verified chunk.
+  kAddNumber,
+  kAddString,
+  kSubtractNumber,
+  kMultiplyNumber,
+  kDivideNumber,
+  kGreaterNumber,
+  kGreaterEqualNumber,
+  kLessNumber,
+  kLessEqualNumber,
+  kNegateNumber,
+  // Stack shuffling used when lowering optimised expressions: kPick pushes a
+  // copy of the value its operand slots below the top, kSlide drops its
+  // operand count of values from beneath the top one.
+  kPick,
+  kSlide,
+  // Pushes the host-supplied input its operand indexes, which is how a chunk
+  // compiled with declared inputs reads them.
+  kGetInput,
+  // Calls the chunk's native function indexed by the first operand on as
+  // many arguments as the second operand, replacing them with its result.
+  kCallNative,
+  // Global variables, by slot. kDefineGlobal pops the value it defines;
+  // kSetGlobal leaves the value on the stack as the assignment's result. The
+  // long forms take a three-byte slot.
+  kDefineGlobal,
+  kDefineGlobalLong,
+  kGetGlobal,
+  kGetGlobalLong,
+  kSetGlobal,
+  kSetGlobalLong,
+  kPop,
+  kPrint,
+  // Local variables, by slot counted from the bottom of the stack. They live
+  // in the stack itself, so declaring one emits no instruction and kPopN
+  // discards a whole scope's worth. kSetLocal leaves the value on the stack.
+  kGetLocal,
+  kGetLocalLong,
+  kSetLocal,
+  kSetLocalLong,
+  kPopN,
+  // Jumps by a two-byte offset from the end of the instruction, forwards or,
+  // for kLoop, backwards. kJumpIfFalse leaves the condition on the stack.
+  kJump,
+  kJumpIfFalse,
+  kLoop,
+  // Calls the function beneath its operand count of arguments. The callee
+  // and its arguments stay where they are to become the slots of its frame,
+  // and are replaced by the result when it returns.
+  kCall,
+  // A call whose result the function returns at once, always followed by
+  // kReturn. When it calls a function, the callee's frame replaces the
+  // caller's, so recursion in tail position runs in constant stack; when it
+  // does not, it behaves like kCall and the kReturn returns its result.
+  kTailCall,
+  // Closures. kClosure pushes a closure of the function in the constant its
+  // operand indexes, capturing the variables the function lists. The
+  // upvalue instructions read and write the current closure's captured
+  // variables by index, and kCloseUpvalues discards its operand count of
+  // locals like kPopN, first moving those captured into their upvalues.
+  kClosure,
+  kClosureLong,
+  kGetUpvalue,
+  kSetUpvalue,
+  kCloseUpvalues,
+  // Classes. kClass pushes a new class named by the constant its
+  // three-byte operand indexes; kMethod pops a method and adds it to the
+  // class beneath under the name its operand indexes, and kInherit pops a
+  // class after copying into it the methods of the superclass beneath.
+  kClass,
+  kMethod,
+  kInherit,
+  // Property access through the inline cache its three-byte operand
+  // indexes, which holds the property's name. kGetProperty replaces an
+  // instance with the property's value, kSetProperty pops a value and
+  // stores it in the instance beneath, replacing the instance with it, and
+  // kInvoke calls the property of the instance beneath its second operand
+  // count of arguments, like kCall but without binding a method first.
+  // kGetSuper pops a superclass and replaces the instance beneath with the
+  // superclass's method bound to it.
+  kGetProperty,
+  kSetProperty,
+  kInvoke,
+  kGetSuper,
+  // Lists. kBuildList replaces its operand count of values with a list of
+  // them, kGetIndex replaces a list and an index with the element there,
+  // and kSetIndex pops a value and stores it in the list beneath at the
+  // index beneath that, replacing both with the value.
+  kBuildList,
+  kGetIndex,
+  kSetIndex,
+  // Maps. kBuildMap replaces its operand count of key and value pairs with
+  // a map of them. Maps are indexed with kGetIndex and kSetIndex.
+  kBuildMap,
 };
 
 std::ostream &operator<<(std::ostream &os, Opcode opcode);
 
+// Reads the three-byte operand of a long instruction.
+inline std::size_t ReadLongOperand(const std::uint8_t *operand) {
+  return static_cast<std::size_t>((operand[0] << 16) | (operand[1] << 8) |
+                                  operand[2]);
+}
+
+// Reads the two-byte offset of a jump.
+inline std::size_t ReadJumpOffset(const std::uint8_t *operand) {
+  return static_cast<std::size_t>((operand[0] << 8) | operand[1]);
+}
+
+// Static properties of a single instruction, used to validate bytecode before
+// (or while) it is executed.
+struct InstructionInfo {
+  std::size_t length;  // The opcode byte plus its operands.
+  std::size_t pops;
+  std::size_t pushes;
+};
+
+// Decodes the instruction at the start of code, of which only available bytes
+// may be read. Returns std::nullopt for unknown opcodes and for instructions
+// whose operands are cut off.
+std::optional<InstructionInfo> GetInstructionInfo(const std::uint8_t *code,
+                                                  std::size_t available);
+
+// Returns the type-specialised form of a generic instruction given what is
+// known about its operand types, or the generic instruction itself if no
+// specialised form applies. Unary instructions only look at a.
+Opcode SpecialiseOpcode(Opcode generic, ValueType a,
+                        ValueType b = ValueType::kUnknown);
+
+// The type of the value a generic instruction leaves on the stack if it
+// succeeds, given what is known about its operand types.
+ValueType GetResultType(Opcode generic, ValueType a,
+                        ValueType b = ValueType::kUnknown);
+
+// The inline cache of a property access: the name accessed, and for up to
+// kWays receiver shapes seen there, what the access resolved to, so that
+// the machine need not look the name up again for a shape it has seen. A
+// cache holding one shape is monomorphic and one holding several is
+// polymorphic; once it is full, other shapes are looked up every time.
+// Each entry is a single word, read and written atomically, so machines on
+// different threads can share a frozen chunk's caches, and since shape ids
+// are never reused, an entry one machine made only ever misses in another.
+class InlineCache {
+ public:
+  static constexpr auto kWays = std::size_t{4};
+  // Entries pack a shape id above what it resolved to, so both are limited.
+  static constexpr auto kResolutionBits = 24;
+  static constexpr auto kMaxShapeId =
+      (std::uint64_t{1} << (64 - kResolutionBits)) - 1;
+  static constexpr auto kMaxResolution =
+      (std::uint32_t{1} << kResolutionBits) - 1;
+
+  explicit InlineCache(std::string name) : name_(std::move(name)) {}
+
+  [[nodiscard]] const std::string &get_name() const { return name_; }
+  // Returns what the access resolved to for the shape with id shape_id, if
+  // it has been cached.
+  [[nodiscard]] std::optional<std::uint32_t> Find(
+      std::uint64_t shape_id) const {
+    for (const std::atomic<std::uint64_t> &entry : entries_) {
+      std::uint64_t bits = entry.load(std::memory_order_relaxed);
+      if (bits == 0) break;
+      if (bits >> kResolutionBits == shape_id) {
+        return static_cast<std::uint32_t>(bits & kMaxResolution);
+      }
+    }
+    return std::nullopt;
+  }
+  // Caches resolution for the shape with id shape_id, unless the cache is
+  // full or either does not fit an entry.
+  void Insert(std::uint64_t shape_id, std::uint32_t resolution) const;
+
+ private:
+  std::string name_;
+  mutable std::array<std::atomic<std::uint64_t>, kWays> entries_{};
+};
+
 class Chunk {
  public:
-  Chunk() noexcept = default;
+  Chunk() noexcept;
   Chunk(const Chunk &) = delete;
   Chunk(Chunk &&) = delete;
   void operator=(const Chunk &) = delete;
   void operator=(Chunk &&) = delete;
-  ~Chunk() noexcept = default;
+  ~Chunk() noexcept;
 
-  void Disassemble(std::string_view name) noexcept;
+  // Unique among all chunks ever created in the process, so that what a
+  // machine keeps about a chunk's code is never mistaken for another's
+  // that came to live at the same address.
+  [[nodiscard]] std::uint64_t get_id() const noexcept { return id_; }
+  void Disassemble(std::string_view name) const noexcept;
+  // Makes room for code_size bytes of code and constant_count constants, so
+  // that writing that much does not reallocate along the way. Freeze()
+  // drops whatever room is left over.
+  void Reserve(std::size_t code_size, std::size_t constant_count);
   void Write(Opcode code, std::size_t line) noexcept;
   void Write(std::uint8_t code, std::size_t line) noexcept;
   void WriteConstant(Value value, std::size_t line) noexcept;
+  // Adds a constant without writing an instruction, returning its index.
+  std::size_t AddConstant(Value value) noexcept;
+  // Writes code with a one-byte operand, or long_code with a three-byte one
+  // if operand does not fit in a byte.
+  void WriteWithOperand(Opcode code, Opcode long_code, std::size_t operand,
+                        std::size_t line) noexcept;
+  // Overwrites a byte of code already written, such as a jump's offset.
+  void SetCodeAtIndex(std::size_t index, std::uint8_t byte) noexcept;
+  // Discards the code from code_size on, and the constants and inline
+  // caches added after there were constant_count and inline_cache_count,
+  // which the compiler does to compile a loop again once it knows more
+  // about it.
+  void Truncate(std::size_t code_size, std::size_t constant_count,
+                std::size_t inline_cache_count) noexcept;
   [[nodiscard]] const std::uint8_t *GetCodePtr() const noexcept;
-  std::size_t GetLineAtIndex(std::size_t index);
-  Value GetValueAtIndex(std::size_t index);
-  std::size_t DisassembleInstruction(std::size_t offset) noexcept;
+  [[nodiscard]] std::size_t GetCodeSize() const noexcept;
+  [[nodiscard]] std::size_t GetConstantCount() const noexcept;
+  [[nodiscard]] std::size_t GetLineAtIndex(std::size_t index) const;
+  [[nodiscard]] const Value &GetValueAtIndex(std::size_t index) const;
+  std::size_t DisassembleInstruction(std::size_t offset) const noexcept;
+
+  [[nodiscard]] bool IsVerified() const noexcept;
+  [[nodiscard]] std::size_t GetMaxStackDepth() const noexcept;
+  void MarkVerified(std::size_t max_stack_depth) noexcept;
+
+  // The types declared for the inputs kGetInput reads, by index. kUnknown
+  // accepts any value; anything else must be matched by the host.
+  // Adds a native function for kCallNative to call, returning its index.
+  std::size_t AddNative(std::shared_ptr<const NativeFunction> native);
+  [[nodiscard]] std::size_t GetNativeCount() const noexcept;
+  [[nodiscard]] const NativeFunction &GetNative(std::size_t index) const;
+
+  // The table the chunk's global slots were resolved against, or null if it
+  // uses no globals.
+  void SetGlobalTable(std::shared_ptr<GlobalTable> globals) noexcept;
+  [[nodiscard]] const std::shared_ptr<GlobalTable> &GetGlobalTable()
+      const noexcept;
+
+  // Whether the script ends in an expression whose value it returns, rather
+  // than in a statement, after which it returns nil.
+  void SetHasResult(bool has_result) noexcept;
+  [[nodiscard]] bool HasResult() const noexcept;
+
+  // How many values the caller leaves on the stack before the chunk runs:
+  // for a function, the function itself followed by its arguments, which
+  // are its first locals; for a script, none.
+  void SetArgumentSlots(std::size_t slots) noexcept;
+  [[nodiscard]] std::size_t GetArgumentSlots() const noexcept;
+
+  // How many variables the closure running the chunk has captured, for
+  // kGetUpvalue and kSetUpvalue to index.
+  void SetUpvalueCount(std::size_t count) noexcept;
+  [[nodiscard]] std::size_t GetUpvalueCount() const noexcept;
+
+  // Adds an inline cache for accesses to the property called name,
+  // returning its index.
+  std::size_t AddInlineCache(std::string name);
+  [[nodiscard]] std::size_t GetInlineCacheCount() const noexcept;
+  [[nodiscard]] const InlineCache &GetInlineCache(std::size_t index) const {
+    return inline_caches_[index];
+  }
+
+  void SetInputTypes(std::vector<ValueType> types) noexcept;
+  [[nodiscard]] const std::vector<ValueType> &GetInputTypes() const noexcept;
+
+  // Moves the code, line table and constants into one contiguous allocation,
+  // after which the chunk must not be written to again. A frozen chunk is
+  // never modified, other than its inline caches, which are safe to update
+  // concurrently, so any number of threads can run it at once.
+  void Freeze();
+  [[nodiscard]] bool IsFrozen() const noexcept;
 
  private:
+  std::size_t ByteInstruction(std::string_view name,
+                              std::size_t offset) const noexcept;
   std::size_t ConstantInstruction(std::string_view name,
-                                  std::size_t offset) noexcept;
+                                  std::size_t offset) const noexcept;
+  std::size_t JumpInstruction(std::string_view name, int sign,
+                              std::size_t offset) const noexcept;
+  std::size_t SlotInstruction(std::string_view name, std::size_t offset,
+                              bool is_long) const noexcept;
+  std::size_t GlobalInstruction(std::string_view name, std::size_t offset,
+                                bool is_long) const noexcept;
+  std::size_t NativeInstruction(std::string_view name,
+                                std::size_t offset) const noexcept;
   std::size_t ConstantLongInstruction(std::string_view name,
-                                      std::size_t offset) noexcept;
+                                      std::size_t offset) const noexcept;
+  std::size_t PropertyInstruction(std::string_view name,
+                                  std::size_t offset) const noexcept;
 
+  std::uint64_t id_;
   std::vector<std::uint8_t> code_;
   std::vector<std::size_t> lines_;
   std::vector<Value> constants_;
+  std::vector<ValueType> input_types_;
+  std::vector<std::shared_ptr<const NativeFunction>> natives_;
+  std::shared_ptr<GlobalTable> globals_;
+  bool has_result_ = true;
+  std::size_t argument_slots_ = 0;
+  std::size_t upvalue_count_ = 0;
+  // A deque, since caches hold atomics and so cannot be moved.
+  std::deque<InlineCache> inline_caches_;
+  // Once frozen, the contents live in frozen_ rather than in the vectors:
+  // first the constants, then the line table and then the code.
+  std::unique_ptr<std::byte[]> frozen_;
+  const Value *frozen_constants_ = nullptr;
+  const std::size_t *frozen_lines_ = nullptr;
+  const std::uint8_t *frozen_code_ = nullptr;
+  std::size_t frozen_code_size_ = 0;
+  std::size_t frozen_constant_count_ = 0;
+  // Set by the Verifier; cleared again if the chunk is modified afterwards.
+  bool verified_ = false;
+  std::size_t max_stack_depth_ = 0;
 };
 
 }  // namespace lox
@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "chunk_cache.h"
+
+namespace {
+
+// Roughly what an entry keeps alive: its source, the chunk's code and line
+// table, its constants and their strings, and the bookkeeping around them.
+std::size_t EstimateSize(std::string_view source, const lox::Chunk &chunk) {
+  std::size_t size = sizeof(lox::Chunk) + 2 * source.size() + 128;
+  size += chunk.GetCodeSize() * (1 + sizeof(std::size_t));
+  for (auto i = std::size_t{0}; i < chunk.GetConstantCount(); ++i) {
+    const lox::Value &value = chunk.GetValueAtIndex(i);
+    size += sizeof(value);
+    if (const auto *str = std::get_if<std::string>(&value)) {
+      size += str->capacity();
+    }
+  }
+  return size;
+}
+
+}  // namespace
+
+namespace lox {
+
+ChunkCache::ChunkCache(std::size_t capacity) : capacity_(capacity) {}
+
+std::shared_ptr<const Chunk> ChunkCache::Find(std::string_view source) {
+  if (capacity_ == 0) return nullptr;
+
+  auto it = index_.find(source);
+  if (it == index_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  ++hits_;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->chunk;
+}
+
+void ChunkCache::Insert(std::string_view source,
+                        std::shared_ptr<const Chunk> chunk) {
+  std::size_t size = EstimateSize(source, *chunk);
+  if (size > capacity_) return;
+
+  if (auto it = index_.find(source); it != index_.end()) {
+    size_ -= it->second->size;
+    entries_.erase(it->second);
+    index_.erase(it);
+  }
+  Shrink(capacity_ - size);
+
+  entries_.push_front(Entry{std::string{source}, std::move(chunk), size});
+  index_.emplace(entries_.front().source, entries_.begin());
+  size_ += size;
+}
+
+void ChunkCache::Clear() {
+  index_.clear();
+  entries_.clear();
+  size_ = 0;
+}
+
+void ChunkCache::set_capacity(std::size_t capacity) {
+  capacity_ = capacity;
+  Shrink(capacity);
+}
+
+std::size_t ChunkCache::get_capacity() const { return capacity_; }
+
+std::size_t ChunkCache::get_size() const { return size_; }
+
+std::size_t ChunkCache::get_entry_count() const { return entries_.size(); }
+
+std::size_t ChunkCache::get_hits() const { return hits_; }
+
+std::size_t ChunkCache::get_misses() const { return misses_; }
+
+std::size_t ChunkCache::get_evictions() const { return evictions_; }
+
+void ChunkCache::Shrink(std::size_t capacity) {
+  while (size_ > capacity) {
+    const Entry &victim = entries_.back();
+    index_.erase(victim.source);
+    size_ -= victim.size;
+    entries_.pop_back();
+    ++evictions_;
+  }
+}
+
+}  // namespace lox
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_CHUNK_CACHE_H
+#define LOX_SRC_CHUNK_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "chunk.h"
+
+namespace lox {
+
+// A least-recently-used cache of compiled chunks keyed by their source text,
+// bounded by an estimate of the memory the sources and chunks take up. Lookups
+// hash the source and compare it in full, so distinct sources never share a
+// chunk.
+class ChunkCache {
+ public:
+  explicit ChunkCache(std::size_t capacity);
+
+  // Returns the chunk compiled from source, or nullptr if it is not cached.
+  std::shared_ptr<const Chunk> Find(std::string_view source);
+  // Caches chunk as compiled from source, evicting the least recently used
+  // entries to make room. Chunks too large for the cache are not kept.
+  void Insert(std::string_view source, std::shared_ptr<const Chunk> chunk);
+  void Clear();
+
+  // The most bytes the cache may hold; 0 disables it.
+  void set_capacity(std::size_t capacity);
+  [[nodiscard]] std::size_t get_capacity() const;
+  [[nodiscard]] std::size_t get_size() const;
+  [[nodiscard]] std::size_t get_entry_count() const;
+  [[nodiscard]] std::size_t get_hits() const;
+  [[nodiscard]] std::size_t get_misses() const;
+  [[nodiscard]] std::size_t get_evictions() const;
+
+ private:
+  struct Entry {
+    std::string source;
+    std::shared_ptr<const Chunk> chunk;
+    std::size_t size;
+  };
+
+  // Evicts entries until at most capacity bytes are used.
+  void Shrink(std::size_t capacity);
+
+  std::size_t capacity_;
+  std::size_t size_ = 0;
+  std::size_t hits_ = 0;
+  std::size_t misses_ = 0;
+  std::size_t evictions_ = 0;
+  // Most recently used first. The index's keys point into the entries'
+  // sources, which list nodes never move.
+  std::list<Entry> entries_;
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_CHUNK_CACHE_H
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "class.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace {
+
+std::uint64_t NextShapeId() {
+  static auto next_id = std::atomic<std::uint64_t>{1};
+  return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+namespace lox {
+
+Shape::Shape() : id_(NextShapeId()) {}
+
+Shape::Shape(const Shape &parent, std::string_view name)
+    : id_(NextShapeId()), names_(parent.names_) {
+  names_.emplace_back(name);
+}
+
+std::optional<std::size_t> Shape::Find(std::string_view name) const {
+  for (auto slot = std::size_t{0}; slot < names_.size(); ++slot) {
+    if (names_[slot] == name) return slot;
+  }
+  return std::nullopt;
+}
+
+Shape *Shape::AddField(std::string_view name) {
+  for (const std::unique_ptr<Shape> &shape : transitions_) {
+    if (shape->names_.back() == name) return shape.get();
+  }
+  transitions_.push_back(std::unique_ptr<Shape>(new Shape{*this, name}));
+  return transitions_.back().get();
+}
+
+Class::Class(std::string name)
+    : Object(ObjectType::kClass), name_(std::move(name)) {}
+
+void Class::SetMethod(std::string_view name, std::shared_ptr<Object> method) {
+  std::optional<std::size_t> index = FindMethod(name);
+  if (!index) {
+    index = methods_.size();
+    method_names_.emplace_back(name);
+    methods_.emplace_back();
+  }
+  methods_[*index] = std::move(method);
+  if (name == "init") initializer_ = index;
+}
+
+void Class::Inherit(const Class &superclass) {
+  for (auto i = std::size_t{0}; i < superclass.methods_.size(); ++i) {
+    SetMethod(superclass.method_names_[i], superclass.methods_[i]);
+  }
+}
+
+std::optional<std::size_t> Class::FindMethod(std::string_view name) const {
+  auto it = std::find(method_names_.begin(), method_names_.end(), name);
+  if (it == method_names_.end()) return std::nullopt;
+  return static_cast<std::size_t>(it - method_names_.begin());
+}
+
+const std::shared_ptr<Object> &Class::GetInitializer() const {
+  static const auto kNone = std::shared_ptr<Object>{};
+  return initializer_ ? methods_[*initializer_] : kNone;
+}
+
+void Class::Print(std::ostream &os) const { os << name_; }
+
+Instance::Instance(std::shared_ptr<Class> klass)
+    : Object(ObjectType::kInstance),
+      class_(std::move(klass)),
+      shape_(class_->GetRootShape()) {}
+
+void Instance::AddField(std::string_view name, Value value) {
+  shape_ = shape_->AddField(name);
+  fields_.push_back(std::move(value));
+}
+
+void Instance::Print(std::ostream &os) const {
+  os << class_->get_name() << " instance";
+}
+
+BoundMethod::BoundMethod(Value receiver, std::shared_ptr<Object> method)
+    : Object(ObjectType::kBoundMethod),
+      receiver_(std::move(receiver)),
+      method_(std::move(method)) {}
+
+void BoundMethod::Print(std::ostream &os) const { method_->Print(os); }
+
+}  // namespace lox
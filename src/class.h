@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_CLASS_H
+#define LOX_SRC_CLASS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "value.h"
+
+namespace lox {
+
+// The layout of an instance's fields: the slot each of them is in. Shapes
+// form a tree for each class, rooted at the shape of an instance without
+// fields, in which each child has one field more than its parent, in the
+// next slot. Instances that gain the same fields in the same order share a
+// shape, so a field's slot can be cached per shape rather than looked up
+// by name on every access.
+class Shape {
+ public:
+  Shape();
+  Shape(const Shape &) = delete;
+  Shape(Shape &&) = delete;
+  void operator=(const Shape &) = delete;
+  void operator=(Shape &&) = delete;
+  ~Shape() = default;
+
+  // Unique among all shapes ever created in the process, and never 0, so
+  // that caches shared between machines can tell their shapes apart.
+  [[nodiscard]] std::uint64_t get_id() const { return id_; }
+  [[nodiscard]] std::size_t get_field_count() const { return names_.size(); }
+  [[nodiscard]] const std::string &GetName(std::size_t slot) const {
+    return names_[slot];
+  }
+  // Returns the slot of the field called name, if the shape has one.
+  [[nodiscard]] std::optional<std::size_t> Find(std::string_view name) const;
+  // Returns the shape of an instance of this shape once it gains a field
+  // called name, creating it the first time.
+  Shape *AddField(std::string_view name);
+
+ private:
+  Shape(const Shape &parent, std::string_view name);
+
+  std::uint64_t id_;
+  // The fields' names, by slot.
+  std::vector<std::string> names_;
+  // The shapes with one more field, which are few enough to search.
+  std::vector<std::unique_ptr<Shape>> transitions_;
+};
+
+class Class : public Object {
+ public:
+  explicit Class(std::string name);
+
+  [[nodiscard]] const std::string &get_name() const { return name_; }
+  // The shape new instances start with.
+  [[nodiscard]] Shape *GetRootShape() { return &root_shape_; }
+  // Adds a method, which is a function or a closure, replacing any
+  // inherited method of the same name.
+  void SetMethod(std::string_view name, std::shared_ptr<Object> method);
+  // Copies the methods of superclass, which the class's own methods then
+  // override, so that finding a method never searches a superclass.
+  void Inherit(const Class &superclass);
+  // Returns the index of the method called name, if there is one.
+  [[nodiscard]] std::optional<std::size_t> FindMethod(
+      std::string_view name) const;
+  [[nodiscard]] const std::shared_ptr<Object> &GetMethod(
+      std::size_t index) const {
+    return methods_[index];
+  }
+  [[nodiscard]] std::size_t get_method_count() const {
+    return methods_.size();
+  }
+  [[nodiscard]] const std::string &GetMethodName(std::size_t index) const {
+    return method_names_[index];
+  }
+  // The method called "init", or null.
+  [[nodiscard]] const std::shared_ptr<Object> &GetInitializer() const;
+
+  void Print(std::ostream &os) const override;
+
+ private:
+  std::string name_;
+  Shape root_shape_;
+  std::vector<std::string> method_names_;
+  std::vector<std::shared_ptr<Object>> methods_;
+  std::optional<std::size_t> initializer_;
+};
+
+// An instance of a class. Its fields are stored by slot, which its shape
+// maps their names to.
+class Instance : public Object {
+ public:
+  explicit Instance(std::shared_ptr<Class> klass);
+
+  [[nodiscard]] const Class &get_class() const { return *class_; }
+  [[nodiscard]] const Shape &get_shape() const { return *shape_; }
+  [[nodiscard]] Value &GetField(std::size_t slot) { return fields_[slot]; }
+  [[nodiscard]] const Value &GetField(std::size_t slot) const {
+    return fields_[slot];
+  }
+  // Adds a field the instance does not have yet, moving it to the next
+  // shape.
+  void AddField(std::string_view name, Value value);
+
+  void Print(std::ostream &os) const override;
+
+ private:
+  std::shared_ptr<Class> class_;
+  Shape *shape_;
+  std::vector<Value> fields_;
+};
+
+// A method read off an instance, which calls the method with the instance
+// as 'this'.
+class BoundMethod : public Object {
+ public:
+  BoundMethod(Value receiver, std::shared_ptr<Object> method);
+
+  [[nodiscard]] const Value &get_receiver() const { return receiver_; }
+  [[nodiscard]] const std::shared_ptr<Object> &get_method() const {
+    return method_;
+  }
+
+  void Print(std::ostream &os) const override;
+
+ private:
+  Value receiver_;
+  std::shared_ptr<Object> method_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_CLASS_H
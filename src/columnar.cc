@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "columnar.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// The kernels applied to a whole batch. Each has a scalar form and, where
+// SSE2 is available, a form working on two rows at once. Comparisons yield
+// 1.0 or 0.0, which is how booleans are stored in a slot.
+#if defined(__SSE2__)
+#define LOX_KERNEL(name, scalar, vector)                                   \
+  struct name {                                                            \
+    static double Apply(double a, [[maybe_unused]] double b) {             \
+      return scalar;                                                       \
+    }                                                                      \
+    static __m128d Apply(__m128d a, [[maybe_unused]] __m128d b) {          \
+      return vector;                                                       \
+    }                                                                      \
+  }
+#else
+#define LOX_KERNEL(name, scalar, vector)                       \
+  struct name {                                                \
+    static double Apply(double a, [[maybe_unused]] double b) { \
+      return scalar;                                           \
+    }                                                          \
+  }
+#endif
+
+LOX_KERNEL(AddKernel, a + b, _mm_add_pd(a, b));
+LOX_KERNEL(SubtractKernel, a - b, _mm_sub_pd(a, b));
+LOX_KERNEL(MultiplyKernel, a * b, _mm_mul_pd(a, b));
+LOX_KERNEL(DivideKernel, a / b, _mm_div_pd(a, b));
+LOX_KERNEL(GreaterKernel, a > b ? 1.0 : 0.0,
+           _mm_and_pd(_mm_cmpgt_pd(a, b), _mm_set1_pd(1.0)));
+LOX_KERNEL(GreaterEqualKernel, a >= b ? 1.0 : 0.0,
+           _mm_and_pd(_mm_cmpge_pd(a, b), _mm_set1_pd(1.0)));
+LOX_KERNEL(LessKernel, a < b ? 1.0 : 0.0,
+           _mm_and_pd(_mm_cmplt_pd(a, b), _mm_set1_pd(1.0)));
+LOX_KERNEL(LessEqualKernel, a <= b ? 1.0 : 0.0,
+           _mm_and_pd(_mm_cmple_pd(a, b), _mm_set1_pd(1.0)));
+LOX_KERNEL(EqualKernel, a == b ? 1.0 : 0.0,
+           _mm_and_pd(_mm_cmpeq_pd(a, b), _mm_set1_pd(1.0)));
+LOX_KERNEL(NotEqualKernel, a != b ? 1.0 : 0.0,
+           _mm_and_pd(_mm_cmpneq_pd(a, b), _mm_set1_pd(1.0)));
+// Negation and logical not only use their first operand.
+LOX_KERNEL(NegateKernel, -a, _mm_xor_pd(a, _mm_set1_pd(-0.0)));
+LOX_KERNEL(NotKernel, 1.0 - a, _mm_sub_pd(_mm_set1_pd(1.0), a));
+
+#undef LOX_KERNEL
+
+// out[i] = Kernel(a[i], b[i]) for count rows; out may be a.
+template <typename Kernel>
+void Apply(const double *a, const double *b, double *out, std::size_t count) {
+  auto i = std::size_t{0};
+#if defined(__SSE2__)
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i,
+                  Kernel::Apply(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+#endif
+  for (; i < count; ++i) out[i] = Kernel::Apply(a[i], b[i]);
+}
+
+template <typename Kernel>
+void Apply(double *a, std::size_t count) {
+  Apply<Kernel>(a, a, a, count);
+}
+
+// Marks the rows of errors where mask is set.
+void Mark(std::uint8_t *errors, const std::uint8_t *mask, std::size_t count) {
+  for (auto i = std::size_t{0}; i < count; ++i) errors[i] |= mask[i];
+}
+
+}  // namespace
+
+namespace lox {
+
+Value ColumnarResult::GetValue(std::size_t row) const {
+  if (errors[row] != 0 || nils[row] != 0) return std::monostate{};
+  switch (type) {
+    case ValueType::kNumber:
+      return values[row];
+    case ValueType::kBool:
+      return values[row] != 0.0;
+    default:
+      return std::monostate{};
+  }
+}
+
+bool ColumnarEvaluator::Evaluate(const Chunk &chunk,
+                                 const std::vector<Column> &columns,
+                                 std::size_t rows, ColumnarResult *result) {
+  error_.clear();
+  if (!chunk.IsVerified()) return Error("Chunk is not verified.");
+
+  const std::vector<ValueType> &declared = chunk.GetInputTypes();
+  if (columns.size() < declared.size()) {
+    return Error("Expected " + std::to_string(declared.size()) +
+                 " columns but got " + std::to_string(columns.size()) + ".");
+  }
+  for (auto i = std::size_t{0}; i < declared.size(); ++i) {
+    const Column &column = columns[i];
+    if (column.type == ValueType::kNumber ? column.numbers == nullptr
+        : column.type == ValueType::kBool ? column.bools == nullptr
+                                          : true) {
+      return Error("Column " + std::to_string(i) +
+                   " is neither numbers nor booleans.");
+    }
+    // Specialised instructions trust declared types, so they must hold for
+    // every row.
+    if (declared[i] != ValueType::kUnknown &&
+        (declared[i] != column.type || column.nils != nullptr)) {
+      return Error("Column " + std::to_string(i) +
+                   " does not have its declared type.");
+    }
+  }
+
+  if (slots_.size() < chunk.GetMaxStackDepth()) {
+    slots_.resize(chunk.GetMaxStackDepth());
+    for (Slot &slot : slots_) {
+      slot.values.resize(kBatchSize);
+      slot.nils.resize(kBatchSize);
+    }
+  }
+  errors_.resize(kBatchSize);
+
+  result->type = ValueType::kUnknown;
+  result->values.clear();
+  result->nils.clear();
+  result->errors.clear();
+  result->values.reserve(rows);
+  result->nils.reserve(rows);
+  result->errors.reserve(rows);
+
+  // An empty input still runs one empty batch, so that unsupported chunks
+  // are rejected regardless of the number of rows.
+  auto start = std::size_t{0};
+  do {
+    std::size_t count = std::min(kBatchSize, rows - start);
+    if (!RunBatch(chunk, columns, start, count, result)) return false;
+    start += count;
+  } while (start < rows);
+  return true;
+}
+
+const std::string &ColumnarEvaluator::get_error() const { return error_; }
+
+bool ColumnarEvaluator::RunBatch(const Chunk &chunk,
+                                 const std::vector<Column> &columns,
+                                 std::size_t start, std::size_t count,
+                                 ColumnarResult *result) {
+  std::fill_n(errors_.begin(), count, std::uint8_t{0});
+  auto height = std::size_t{0};
+
+  auto push = [this, &height](ValueType type, bool nullable) -> Slot & {
+    Slot &slot = slots_[height++];
+    slot.type = type;
+    slot.nullable = nullable;
+    return slot;
+  };
+  auto push_constant = [this, &push, count](const Value &value) -> bool {
+    if (const auto *number = std::get_if<double>(&value)) {
+      std::fill_n(push(ValueType::kNumber, false).values.begin(), count,
+                  *number);
+    } else if (const auto *b = std::get_if<bool>(&value)) {
+      std::fill_n(push(ValueType::kBool, false).values.begin(), count,
+                  *b ? 1.0 : 0.0);
+    } else if (std::holds_alternative<std::monostate>(value)) {
+      std::fill_n(push(ValueType::kNil, true).nils.begin(), count,
+                  std::uint8_t{1});
+    } else {
+      return Error("Strings cannot be evaluated columnwise.");
+    }
+    return true;
+  };
+  // Rows where an operand is nil fail, as do all rows if the operand is not
+  // a number at all.
+  auto require_number = [this, count](const Slot &slot) {
+    if (slot.type != ValueType::kNumber) {
+      std::fill_n(errors_.begin(), count, std::uint8_t{1});
+    } else if (slot.nullable) {
+      Mark(errors_.data(), slot.nils.data(), count);
+    }
+  };
+
+  // Pops the operands of a binary instruction, leaving the result in a.
+  auto binary = [this, &height]() -> std::pair<Slot &, Slot &> {
+    --height;
+    return {slots_[height - 1], slots_[height]};
+  };
+
+  auto arithmetic = [&binary, &require_number, count](auto kernel,
+                                                      ValueType type) {
+    auto [a, b] = binary();
+    require_number(a);
+    require_number(b);
+    Apply<decltype(kernel)>(a.values.data(), b.values.data(), a.values.data(),
+                            count);
+    a.type = type;
+    a.nullable = false;
+  };
+
+  auto equality = [&binary, count](bool equal) {
+    auto [a, b] = binary();
+    if (a.type == b.type) {
+      if (equal) {
+        Apply<EqualKernel>(a.values.data(), b.values.data(), a.values.data(),
+                           count);
+      } else {
+        Apply<NotEqualKernel>(a.values.data(), b.values.data(),
+                              a.values.data(), count);
+      }
+    } else {
+      std::fill_n(a.values.begin(), count, equal ? 0.0 : 1.0);
+    }
+    // nil equals nil and nothing else.
+    if (a.nullable || b.nullable) {
+      for (auto i = std::size_t{0}; i < count; ++i) {
+        bool a_nil = a.nullable && a.nils[i] != 0;
+        bool b_nil = b.nullable && b.nils[i] != 0;
+        if (a_nil || b_nil) {
+          a.values[i] = (a_nil && b_nil) == equal ? 1.0 : 0.0;
+        }
+      }
+    }
+    a.type = ValueType::kBool;
+    a.nullable = false;
+  };
+
+  const std::uint8_t *code = chunk.GetCodePtr();
+  auto offset = std::size_t{0};
+  while (offset < chunk.GetCodeSize()) {
+    auto instruction = static_cast<Opcode>(code[offset]);
+    switch (instruction) {
+      case Opcode::kConstant:
+        if (!push_constant(chunk.GetValueAtIndex(code[offset + 1]))) {
+          return false;
+        }
+        break;
+      case Opcode::kConstantLong:
+        if (!push_constant(chunk.GetValueAtIndex(static_cast<std::size_t>(
+                (code[offset + 1] << 16) | (code[offset + 2] << 8) |
+                code[offset + 3])))) {
+          return false;
+        }
+        break;
+      case Opcode::kNil:
+        push_constant(std::monostate{});
+        break;
+      case Opcode::kTrue:
+        push_constant(true);
+        break;
+      case Opcode::kFalse:
+        push_constant(false);
+        break;
+      case Opcode::kEqual:
+        equality(true);
+        break;
+      case Opcode::kNotEqual:
+        equality(false);
+        break;
+      case Opcode::kGreater:
+      case Opcode::kGreaterNumber:
+        arithmetic(GreaterKernel{}, ValueType::kBool);
+        break;
+      case Opcode::kGreaterEqual:
+      case Opcode::kGreaterEqualNumber:
+        arithmetic(GreaterEqualKernel{}, ValueType::kBool);
+        break;
+      case Opcode::kLess:
+      case Opcode::kLessNumber:
+        arithmetic(LessKernel{}, ValueType::kBool);
+        break;
+      case Opcode::kLessEqual:
+      case Opcode::kLessEqualNumber:
+        arithmetic(LessEqualKernel{}, ValueType::kBool);
+        break;
+      // Without strings, addition is only defined on numbers.
+      case Opcode::kAdd:
+      case Opcode::kAddNumber:
+        arithmetic(AddKernel{}, ValueType::kNumber);
+        break;
+      case Opcode::kSubtract:
+      case Opcode::kSubtractNumber:
+        arithmetic(SubtractKernel{}, ValueType::kNumber);
+        break;
+      case Opcode::kMultiply:
+      case Opcode::kMultiplyNumber:
+        arithmetic(MultiplyKernel{}, ValueType::kNumber);
+        break;
+      case Opcode::kDivide:
+      case Opcode::kDivideNumber:
+        arithmetic(DivideKernel{}, ValueType::kNumber);
+        break;
+      case Opcode::kNot: {
+        Slot &a = slots_[height - 1];
+        if (a.type == ValueType::kBool) {
+          Apply<NotKernel>(a.values.data(), count);
+        } else {
+          std::fill_n(a.values.begin(), count, 0.0);
+        }
+        if (a.nullable) {
+          for (auto i = std::size_t{0}; i < count; ++i) {
+            if (a.nils[i] != 0) a.values[i] = 1.0;
+          }
+        }
+        a.type = ValueType::kBool;
+        a.nullable = false;
+        break;
+      }
+      case Opcode::kNegate:
+      case Opcode::kNegateNumber: {
+        Slot &a = slots_[height - 1];
+        require_number(a);
+        Apply<NegateKernel>(a.values.data(), count);
+        a.type = ValueType::kNumber;
+        a.nullable = false;
+        break;
+      }
+      case Opcode::kReturn: {
+        const Slot &a = slots_[0];
+        result->type = a.type;
+        result->values.insert(result->values.end(), a.values.data(),
+                              a.values.data() + count);
+        if (a.nullable) {
+          result->nils.insert(result->nils.end(), a.nils.data(),
+                              a.nils.data() + count);
+        } else {
+          result->nils.resize(result->nils.size() + count);
+        }
+        result->errors.insert(result->errors.end(), errors_.data(),
+                              errors_.data() + count);
+        return true;
+      }
+      case Opcode::kPick: {
+        const Slot &source = slots_[height - 1 - code[offset + 1]];
+        Slot &slot = push(source.type, source.nullable);
+        std::copy_n(source.values.begin(), count, slot.values.begin());
+        if (source.nullable) {
+          std::copy_n(source.nils.begin(), count, slot.nils.begin());
+        }
+        break;
+      }
+      case Opcode::kSlide:
+        std::swap(slots_[height - 1 - code[offset + 1]], slots_[height - 1]);
+        height -= code[offset + 1];
+        break;
+      case Opcode::kGetInput: {
+        const Column &column = columns[code[offset + 1]];
+        Slot &slot = push(column.type, column.nils != nullptr);
+        if (column.type == ValueType::kNumber) {
+          std::copy_n(column.numbers + start, count, slot.values.begin());
+        } else {
+          std::transform(column.bools + start, column.bools + start + count,
+                         slot.values.begin(),
+                         [](bool b) { return b ? 1.0 : 0.0; });
+        }
+        if (column.nils != nullptr) {
+          std::copy_n(column.nils + start, count, slot.nils.begin());
+        }
+        break;
+      }
+      default:
+        return Error("Instruction at offset " + std::to_string(offset) +
+                     " cannot be evaluated columnwise.");
+    }
+
+    offset += GetInstructionInfo(code + offset, chunk.GetCodeSize() - offset)
+                  ->length;
+  }
+
+  // Verified chunks always end with a return.
+  return Error("Chunk does not end with a return.");
+}
+
+bool ColumnarEvaluator::Error(std::string message) {
+  error_ = std::move(message);
+  return false;
+}
+
+}  // namespace lox
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_COLUMNAR_H
+#define LOX_SRC_COLUMNAR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chunk.h"
+#include "value.h"
+
+namespace lox {
+
+// One input of a columnar evaluation: a number or boolean per row, and
+// optionally a mask of the rows where the input is nil instead.
+struct Column {
+  ValueType type = ValueType::kNumber;  // kNumber or kBool.
+  const double *numbers = nullptr;      // The rows, when type is kNumber.
+  const bool *bools = nullptr;          // The rows, when type is kBool.
+  const std::uint8_t *nils = nullptr;   // Nonzero where a row is nil.
+};
+
+// What an expression evaluated to for every row.
+struct ColumnarResult {
+  // kNumber or kBool, or kNil if every row is nil.
+  ValueType type = ValueType::kUnknown;
+  // The value of each row, with booleans stored as 0 and 1.
+  std::vector<double> values;
+  std::vector<std::uint8_t> nils;
+  // Nonzero where evaluating the row raised a runtime error, in which case
+  // its value is meaningless.
+  std::vector<std::uint8_t> errors;
+
+  // The value of row as the VM would have returned it, or nil for rows that
+  // raised an error.
+  [[nodiscard]] Value GetValue(std::size_t row) const;
+};
+
+// Evaluates one compiled expression over many rows of inputs at once, the way
+// a columnar query engine does: each instruction is applied to a whole batch
+// of rows before moving on to the next, so dispatch costs are paid per batch
+// rather than per row and arithmetic runs as SIMD loops. Rows that fail, say
+// by adding nil, are marked in an error mask instead of stopping the others.
+class ColumnarEvaluator {
+ public:
+  static constexpr auto kBatchSize = std::size_t{1024};
+
+  // Evaluates a verified chunk for rows rows, reading kGetInput i from
+  // columns[i], which must cover at least rows rows. Inputs the chunk
+  // declares a type for must have that type and no nils. Returns false if the
+  // chunk uses something that cannot be evaluated columnwise, such as
+  // strings.
+  bool Evaluate(const Chunk &chunk, const std::vector<Column> &columns,
+                std::size_t rows, ColumnarResult *result);
+  [[nodiscard]] const std::string &get_error() const;
+
+ private:
+  // A stack slot holding one value per row of the batch.
+  struct Slot {
+    // The type of the rows that are not nil, or kNil if none are.
+    ValueType type = ValueType::kNil;
+    bool nullable = false;  // Whether nils means anything.
+    std::vector<double> values;
+    std::vector<std::uint8_t> nils;
+  };
+
+  bool RunBatch(const Chunk &chunk, const std::vector<Column> &columns,
+                std::size_t start, std::size_t count, ColumnarResult *result);
+  bool Error(std::string message);
+
+  std::vector<Slot> slots_;
+  std::vector<std::uint8_t> errors_;
+  std::string error_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_COLUMNAR_H
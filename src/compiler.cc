@@ -2,69 +2,364 @@
 
 #include "compiler.h"
 
+#include <algorithm>
 #include <iostream>
 
-#define DEBUG_PRINT_CODE
+// #define DEBUG_PRINT_CODE
 
 namespace {
 
 constexpr auto kNoParseRule =
     lox::ParseRule{nullptr, nullptr, lox::Precedence::kNone};
 
+// Rough ratios of source characters to bytes of code and to constants, for
+// sizing a chunk before compiling into it.
+constexpr auto kSourcePerCodeByte = std::size_t{3};
+constexpr auto kSourcePerConstant = std::size_t{24};
+
 }
 
 namespace lox {
 
-Compiler::Compiler(std::string_view source) : parser_(source) {}
+Compiler::Compiler(std::string_view source,
+                   OptimizationLevel optimization_level)
+    : parser_(source),
+      optimization_level_(optimization_level),
+      source_(source) {}
+
+Compiler::Compiler(const Function &function, std::string_view source)
+    : parser_(source, function.get_line()),
+      optimization_level_(function.get_context()->optimization_level),
+      source_(source),
+      source_offset_(function.get_start()),
+      function_(&function),
+      context_(function.get_context()) {
+  globals_ = context_->globals;
+  input_names_ = context_->input_names;
+  input_types_ = context_->input_types;
+  natives_ = context_->natives.get();
+}
 
 bool Compiler::Compile(Chunk *chunk) {
   compiling_chunk_ = chunk;
-  Expression();
-  parser_.Consume(TokenType::kEof, "Expected end of expression");
+  chunk->Reserve(source_.size() / kSourcePerCodeByte + 1,
+                 source_.size() / kSourcePerConstant);
+  chunk->SetInputTypes(input_types_);
+  if (function_ != nullptr) {
+    FunctionBody();
+    chunk->SetArgumentSlots(function_->get_arity() + 1);
+    chunk->SetUpvalueCount(function_->get_captures().size());
+  } else {
+    while (!parser_.Match(TokenType::kEof)) {
+      Declaration();
+    }
+  }
+
+  if (!has_result_) EmitImplicitResult();
+  chunk->SetHasResult(has_result_);
+  if (uses_globals_) chunk->SetGlobalTable(globals_);
   StopCompiling();
   return !parser_.had_error();
 }
 
+bool Compiler::DeclareInput(std::string name, ValueType type) {
+  if (input_names_.size() == kMaxInputs) return false;
+  input_names_.push_back(std::move(name));
+  input_types_.push_back(type);
+  return true;
+}
+
+void Compiler::set_natives(const NativeTable *natives) { natives_ = natives; }
+
+void Compiler::set_globals(std::shared_ptr<GlobalTable> globals) {
+  globals_ = std::move(globals);
+}
+
+void Compiler::set_error_output(std::ostream *errors) {
+  parser_.set_error_output(errors);
+}
+
+bool Compiler::AddLocal(std::string_view name) {
+  if (locals_.size() == kMaxLocals) {
+    parser_.ErrorAtPrevious("Too many local variables.");
+    return false;
+  }
+  locals_.push_back({name, -1, ValueType::kUnknown, false, false});
+  return true;
+}
+
+void Compiler::And() {
+  if (graph_ != nullptr) {
+    // Short-circuiting needs jumps, which graphs do not have.
+    graph_unsupported_ = true;
+    ParsePrecedence(Precedence::kAnd);
+    return;
+  }
+
+  ValueType left_type = last_type_;
+  std::size_t end_jump = EmitJump(Opcode::kJumpIfFalse);
+  auto types = GetLocalTypes();
+  EmitByte(Opcode::kPop);
+  ParsePrecedence(Precedence::kAnd);
+  PatchJump(end_jump);
+  MergeLocalTypes(types);
+  if (last_type_ != left_type) last_type_ = ValueType::kUnknown;
+}
+
+std::uint8_t Compiler::ArgumentList() {
+  auto count = std::size_t{0};
+  if (!parser_.Check(TokenType::kRightParen)) {
+    do {
+      Expression();
+      if (count == UINT8_MAX) {
+        parser_.ErrorAtPrevious("Can't have more than 255 arguments.");
+      }
+      ++count;
+    } while (parser_.Match(TokenType::kComma));
+  }
+  parser_.Consume(TokenType::kRightParen, "Expected ')' after arguments.");
+  return static_cast<std::uint8_t>(count);
+}
+
+void Compiler::BeginScope() { ++scope_depth_; }
+
 void Compiler::Binary() {
   auto operator_type = parser_.get_previous().type;
   auto rule = GetParseRule(operator_type);
+  ValueType left_type = last_type_;
+  [[maybe_unused]] ExpressionGraph::NodeId left_node = last_node_;
   ParsePrecedence(
       static_cast<Precedence>(static_cast<int>(rule.precedence) + 1));
+  ValueType right_type = last_type_;
 
+  Opcode generic;
   switch (operator_type) {
     case TokenType::kBangEqual:
-      EmitByte(Opcode::kNotEqual);
+      generic = Opcode::kNotEqual;
       break;
     case TokenType::kEqualEqual:
-      EmitByte(Opcode::kEqual);
+      generic = Opcode::kEqual;
       break;
     case TokenType::kGreater:
-      EmitByte(Opcode::kGreater);
+      generic = Opcode::kGreater;
       break;
     case TokenType::kGreaterEqual:
-      EmitByte(Opcode::kGreaterEqual);
+      generic = Opcode::kGreaterEqual;
       break;
     case TokenType::kLess:
-      EmitByte(Opcode::kLess);
+      generic = Opcode::kLess;
       break;
     case TokenType::kLessEqual:
-      EmitByte(Opcode::kLessEqual);
+      generic = Opcode::kLessEqual;
       break;
     case TokenType::kPlus:
-      EmitByte(Opcode::kAdd);
+      generic = Opcode::kAdd;
       break;
     case TokenType::kMinus:
-      EmitByte(Opcode::kSubtract);
+      generic = Opcode::kSubtract;
       break;
     case TokenType::kStar:
-      EmitByte(Opcode::kMultiply);
+      generic = Opcode::kMultiply;
       break;
     case TokenType::kSlash:
-      EmitByte(Opcode::kDivide);
+      generic = Opcode::kDivide;
       break;
     default:
       return;
   }
+
+  if (graph_ != nullptr) {
+    // An operand the graph could not represent left no node to build on;
+    // the expression is about to be compiled again without a graph.
+    if (graph_unsupported_) return;
+    last_node_ = graph_->AddBinary(generic, left_node, last_node_,
+                                   parser_.get_previous().line);
+    last_type_ = graph_->GetType(last_node_);
+    return;
+  }
+
+  EmitByte(SpecialiseOpcode(generic, left_type, right_type));
+  last_type_ = GetResultType(generic, left_type, right_type);
+}
+
+void Compiler::Block() {
+  while (!parser_.Check(TokenType::kRightBrace) &&
+         !parser_.Check(TokenType::kEof)) {
+    Declaration();
+  }
+  parser_.Consume(TokenType::kRightBrace, "Expected '}' after block.");
+}
+
+void Compiler::Call() {
+  // Calls run code that graphs know nothing about.
+  if (graph_ != nullptr) graph_unsupported_ = true;
+  std::uint8_t count = ArgumentList();
+  last_type_ = ValueType::kUnknown;
+  if (graph_ == nullptr) {
+    last_call_ = GetCurrentChunk()->GetCodeSize();
+    EmitBytes({static_cast<std::uint8_t>(Opcode::kCall), count});
+  }
+}
+
+void Compiler::CallNative(std::shared_ptr<const NativeFunction> native) {
+  // Claim the native's index now, so that a chunk calling too many distinct
+  // natives is rejected even when the call is lowered from a graph later.
+  std::size_t index = GetCurrentChunk()->AddNative(native);
+  if (index > UINT8_MAX) {
+    parser_.ErrorAtPrevious("Too many native functions in one chunk.");
+    return;
+  }
+
+  parser_.Consume(TokenType::kLeftParen, "Expected '(' after native name.");
+  auto arguments = ArenaVector<ExpressionGraph::NodeId>{
+      ArenaAllocator<ExpressionGraph::NodeId>{&arena_}};
+  if (!parser_.Check(TokenType::kRightParen)) {
+    do {
+      Expression();
+      arguments.push_back(last_node_);
+    } while (parser_.Match(TokenType::kComma));
+  }
+  parser_.Consume(TokenType::kRightParen, "Expected ')' after arguments.");
+
+  if (arguments.size() != native->get_arity()) {
+    parser_.ErrorAtPrevious("Expected " + std::to_string(native->get_arity()) +
+                            " arguments but got " +
+                            std::to_string(arguments.size()) + ".");
+    return;
+  }
+
+  last_type_ = native->get_result_type();
+  if (graph_ != nullptr) {
+    if (graph_unsupported_) return;
+    last_node_ = graph_->AddCall(std::move(native), arguments,
+                                 parser_.get_previous().line);
+    return;
+  }
+  EmitBytes({static_cast<std::uint8_t>(Opcode::kCallNative),
+             static_cast<std::uint8_t>(index),
+             static_cast<std::uint8_t>(arguments.size())});
+}
+
+void Compiler::ClassDeclaration() {
+  parser_.Consume(TokenType::kIdentifier, "Expected class name.");
+  Token name = parser_.get_previous();
+  auto slot = DeclareVariable();
+  EmitWithLongOperand(Opcode::kClass,
+                      GetCurrentChunk()->AddConstant(std::string{name.lexeme}));
+  last_type_ = ValueType::kObject;
+  DefineVariable(slot);
+  // Pushes the class again, from wherever it was just stored.
+  bool is_global = scope_depth_ == 0;
+  auto load_class = [this, &name, slot, is_global] {
+    if (is_global) {
+      NamedGlobal(name.lexeme, false);
+    } else if (slot) {
+      NamedLocal(*slot, false);
+    }
+  };
+
+  // The superclass is kept in a local called "super" around the methods,
+  // which capture it if they use it.
+  bool has_superclass = parser_.Match(TokenType::kLess);
+  if (has_superclass) {
+    parser_.Consume(TokenType::kIdentifier, "Expected superclass name.");
+    if (parser_.get_previous().lexeme == name.lexeme) {
+      parser_.ErrorAtPrevious("A class can't inherit from itself.");
+    }
+    can_assign_ = false;
+    Variable();
+    BeginScope();
+    if (AddLocal("super")) locals_.back().depth = scope_depth_;
+    load_class();
+    EmitByte(Opcode::kInherit);
+  }
+
+  load_class();
+  parser_.Consume(TokenType::kLeftBrace, "Expected '{' before class body.");
+  while (!parser_.Check(TokenType::kRightBrace) &&
+         !parser_.Check(TokenType::kEof)) {
+    Method();
+  }
+  parser_.Consume(TokenType::kRightBrace, "Expected '}' after class body.");
+  EmitByte(Opcode::kPop);
+  if (has_superclass) EndScope();
+}
+
+void Compiler::Declaration() {
+  if (parser_.Match(TokenType::kClass)) {
+    ClassDeclaration();
+  } else if (parser_.Match(TokenType::kFun)) {
+    FunDeclaration();
+  } else if (parser_.Match(TokenType::kVar)) {
+    VarDeclaration();
+  } else {
+    Statement();
+  }
+
+  if (parser_.panic_mode()) parser_.Synchronize();
+}
+
+std::optional<std::size_t> Compiler::DeclareVariable() {
+  std::string_view name = parser_.get_previous().lexeme;
+  if (scope_depth_ > 0) {
+    for (auto it = locals_.rbegin();
+         it != locals_.rend() && it->depth >= scope_depth_; ++it) {
+      if (it->name == name) {
+        parser_.ErrorAtPrevious(
+            "Already a variable with this name in this scope.");
+      }
+    }
+    if (!AddLocal(name)) return std::nullopt;
+    return locals_.size() - 1;
+  }
+  // Inputs and natives are looked up first, so such a global could never be
+  // read.
+  if (std::find(input_names_.begin(), input_names_.end(), name) !=
+          input_names_.end() ||
+      (natives_ != nullptr && natives_->Find(name) != nullptr)) {
+    parser_.ErrorAtPrevious("Already an input or native function.");
+  }
+  return ResolveGlobal(name);
+}
+
+void Compiler::DefineVariable(std::optional<std::size_t> slot) {
+  if (!slot) return;
+  if (scope_depth_ > 0) {
+    // The value is left where it is, in the local's slot.
+    locals_[*slot].depth = scope_depth_;
+    SetLocalType(*slot, last_type_);
+    return;
+  }
+  GetCurrentChunk()->WriteWithOperand(Opcode::kDefineGlobal,
+                                      Opcode::kDefineGlobalLong, *slot,
+                                      parser_.get_previous().line);
+}
+
+void Compiler::Dot() {
+  bool can_assign = can_assign_;
+  // Properties live in instances, which graphs know nothing about.
+  if (graph_ != nullptr) graph_unsupported_ = true;
+  parser_.Consume(TokenType::kIdentifier, "Expected property name after '.'.");
+  std::string_view name = parser_.get_previous().lexeme;
+
+  Opcode instruction = Opcode::kGetProperty;
+  auto count = std::uint8_t{0};
+  if (can_assign && parser_.Match(TokenType::kEqual)) {
+    Expression();
+    instruction = Opcode::kSetProperty;
+  } else if (parser_.Match(TokenType::kLeftParen)) {
+    // Calling a method straight away need not bind it to the instance.
+    count = ArgumentList();
+    instruction = Opcode::kInvoke;
+    last_type_ = ValueType::kUnknown;
+  } else {
+    last_type_ = ValueType::kUnknown;
+  }
+  if (graph_ != nullptr) return;
+
+  EmitWithLongOperand(instruction,
+                      GetCurrentChunk()->AddInlineCache(std::string{name}));
+  if (instruction == Opcode::kInvoke) EmitByte(count);
 }
 
 void Compiler::EmitByte(std::uint8_t byte) {
@@ -87,12 +382,248 @@ void Compiler::EmitBytes(std::initializer_list<Opcode> codes) {
   }
 }
 
+void Compiler::EmitWithLongOperand(Opcode code, std::size_t operand) {
+  EmitByte(code);
+  EmitBytes({static_cast<std::uint8_t>((operand >> 16) & 0xff),
+             static_cast<std::uint8_t>((operand >> 8) & 0xff),
+             static_cast<std::uint8_t>(operand & 0xff)});
+}
+
+void Compiler::EmitFunction(std::shared_ptr<Function> function) {
+  if (function->get_captures().empty()) {
+    EmitConstant(Value{std::shared_ptr<Object>{std::move(function)}});
+    return;
+  }
+  std::size_t index = GetCurrentChunk()->AddConstant(
+      Value{std::shared_ptr<Object>{std::move(function)}});
+  GetCurrentChunk()->WriteWithOperand(Opcode::kClosure, Opcode::kClosureLong,
+                                      index, parser_.get_previous().line);
+  last_type_ = ValueType::kObject;
+}
+
+void Compiler::EmitImplicitResult() {
+  if (function_ != nullptr &&
+      function_->get_kind() == FunctionKind::kInitializer) {
+    EmitBytes({static_cast<std::uint8_t>(Opcode::kGetLocal), 0});
+  } else {
+    EmitByte(Opcode::kNil);
+  }
+}
+
+std::size_t Compiler::EmitJump(Opcode instruction) {
+  EmitByte(instruction);
+  EmitBytes({0xff, 0xff});
+  return GetCurrentChunk()->GetCodeSize() - 2;
+}
+
+void Compiler::EmitLoop(std::size_t loop_start) {
+  EmitByte(Opcode::kLoop);
+  std::size_t jump = GetCurrentChunk()->GetCodeSize() + 2 - loop_start;
+  if (jump > UINT16_MAX) parser_.ErrorAtPrevious("Loop body too large.");
+  EmitBytes({static_cast<std::uint8_t>((jump >> 8) & 0xff),
+             static_cast<std::uint8_t>(jump & 0xff)});
+}
+
+void Compiler::EmitConstant(Value value) {
+  last_type_ = GetValueType(value);
+  if (graph_ != nullptr) {
+    last_node_ =
+        graph_->AddConstant(std::move(value), parser_.get_previous().line);
+    return;
+  }
+  GetCurrentChunk()->WriteConstant(std::move(value),
+                                   parser_.get_previous().line);
+}
+
+void Compiler::EmitLiteral(Opcode code, Value value) {
+  if (graph_ != nullptr) {
+    EmitConstant(std::move(value));
+    return;
+  }
+  last_type_ = GetValueType(value);
+  EmitByte(code);
+}
+
 void Compiler::EmitReturn() { EmitByte(Opcode::kReturn); }
 
-void Compiler::Expression() { ParsePrecedence(Precedence::kAssignment); }
+void Compiler::EndScope() {
+  --scope_depth_;
+  auto count = std::size_t{0};
+  auto captured = false;
+  while (!locals_.empty() && locals_.back().depth > scope_depth_) {
+    captured = captured || locals_.back().captured;
+    locals_.pop_back();
+    ++count;
+  }
+  // The scope's locals are on top of the stack, so dropping them is all it
+  // takes to discard them, once any that closures captured are moved into
+  // their upvalues.
+  Opcode pop_n = captured ? Opcode::kCloseUpvalues : Opcode::kPopN;
+  while (count > 0) {
+    std::size_t popped = std::min<std::size_t>(count, UINT8_MAX);
+    if (popped == 1 && !captured) {
+      EmitByte(Opcode::kPop);
+    } else {
+      EmitBytes({static_cast<std::uint8_t>(pop_n),
+                 static_cast<std::uint8_t>(popped)});
+    }
+    count -= popped;
+  }
+}
+
+void Compiler::Expression() {
+  if (optimization_level_ == OptimizationLevel::kO0 || graph_ != nullptr ||
+      !graphs_enabled_) {
+    ParsePrecedence(Precedence::kAssignment);
+    return;
+  }
+
+  // Build the whole expression as a graph, optimise it and only then lower
+  // it into the chunk. Nothing from the previous expression's graph is
+  // still alive, so its memory can all be reused.
+  arena_.Reset();
+  auto checkpoint = parser_;
+  auto graph = ExpressionGraph{optimization_level_, &arena_};
+  graph_ = &graph;
+  ParsePrecedence(Precedence::kAssignment);
+  graph_ = nullptr;
+
+  if (parser_.had_error()) return;
+  if (graph_unsupported_) {
+    // Back up and compile the expression straight from the parser instead.
+    graph_unsupported_ = false;
+    parser_ = checkpoint;
+    graphs_enabled_ = false;
+    ParsePrecedence(Precedence::kAssignment);
+    graphs_enabled_ = true;
+    return;
+  }
+  graph.Lower(last_node_, GetCurrentChunk());
+}
+
+void Compiler::ExpressionStatement() {
+  Expression();
+  // A script may end in an expression without a ';', whose value it
+  // returns.
+  if (function_ == nullptr && nesting_ == 1 &&
+      parser_.Check(TokenType::kEof)) {
+    has_result_ = true;
+    return;
+  }
+  parser_.Consume(TokenType::kSemicolon, "Expected ';' after expression.");
+  EmitByte(Opcode::kPop);
+}
+
+void Compiler::ForStatement() {
+  BeginScope();
+  parser_.Consume(TokenType::kLeftParen, "Expected '(' after 'for'.");
+  if (parser_.Match(TokenType::kSemicolon)) {
+    // No initializer.
+  } else if (parser_.Match(TokenType::kVar)) {
+    VarDeclaration();
+  } else {
+    ExpressionStatement();
+  }
+
+  Loop([this] {
+    std::size_t loop_start = GetCurrentChunk()->GetCodeSize();
+    auto types = GetLocalTypes();
+    auto exit_jump = std::optional<std::size_t>{};
+    if (!parser_.Match(TokenType::kSemicolon)) {
+      Expression();
+      parser_.Consume(TokenType::kSemicolon,
+                      "Expected ';' after loop condition.");
+      exit_jump = EmitJump(Opcode::kJumpIfFalse);
+      EmitByte(Opcode::kPop);
+    }
+    auto body_types = GetLocalTypes();
+
+    // The increment comes before the body in the code but runs after it,
+    // so it is compiled for the types the body starts with and the body
+    // has to end with them too.
+    if (!parser_.Match(TokenType::kRightParen)) {
+      std::size_t body_jump = EmitJump(Opcode::kJump);
+      std::size_t increment_start = GetCurrentChunk()->GetCodeSize();
+      Expression();
+      EmitByte(Opcode::kPop);
+      parser_.Consume(TokenType::kRightParen,
+                      "Expected ')' after for clauses.");
+      LoopEdge(types);
+      EmitLoop(loop_start);
+      loop_start = increment_start;
+      types = body_types;
+      PatchJump(body_jump);
+      SetLocalTypes(body_types);
+    }
+
+    Statement();
+    LoopEdge(types);
+    EmitLoop(loop_start);
+    if (exit_jump) {
+      PatchJump(*exit_jump);
+      EmitByte(Opcode::kPop);
+    }
+    SetLocalTypes(body_types);
+  });
+  EndScope();
+}
+
+void Compiler::FunDeclaration() {
+  parser_.Consume(TokenType::kIdentifier, "Expected function name.");
+  std::string_view name = parser_.get_previous().lexeme;
+  auto slot = DeclareVariable();
+  // A local function can call itself, so it is in scope in its own body.
+  if (slot && scope_depth_ > 0) locals_[*slot].depth = scope_depth_;
+  std::shared_ptr<Function> function =
+      ScanFunction(name, FunctionKind::kFunction);
+  if (function == nullptr) return;
+  EmitFunction(std::move(function));
+  DefineVariable(slot);
+}
+
+void Compiler::FunctionBody() {
+  // The function itself is in slot 0, where no name can reach it, or for a
+  // method, the instance as 'this'. Its arguments follow in the slots of
+  // its parameters.
+  BeginScope();
+  std::string_view self =
+      function_->get_kind() == FunctionKind::kFunction ? "" : "this";
+  locals_.push_back({self, scope_depth_, ValueType::kUnknown, false, false});
+  parser_.Consume(TokenType::kLeftParen, "Expected '(' after function name.");
+  if (!parser_.Check(TokenType::kRightParen)) {
+    do {
+      parser_.Consume(TokenType::kIdentifier, "Expected parameter name.");
+      if (auto slot = DeclareVariable()) locals_[*slot].depth = scope_depth_;
+    } while (parser_.Match(TokenType::kComma));
+  }
+  parser_.Consume(TokenType::kRightParen, "Expected ')' after parameters.");
+  parser_.Consume(TokenType::kLeftBrace, "Expected '{' before function body.");
+  Block();
+}
 
 Chunk *Compiler::GetCurrentChunk() { return compiling_chunk_; }
 
+std::shared_ptr<const FunctionContext> Compiler::GetFunctionContext() {
+  if (context_ == nullptr) {
+    if (globals_ == nullptr) globals_ = std::make_shared<GlobalTable>();
+    auto natives = natives_ != nullptr
+                       ? std::make_shared<const NativeTable>(*natives_)
+                       : nullptr;
+    context_ = std::make_shared<const FunctionContext>(
+        FunctionContext{std::string{source_}, optimization_level_,
+                        input_names_, input_types_, std::move(natives),
+                        globals_});
+  }
+  return context_;
+}
+
+std::vector<ValueType> Compiler::GetLocalTypes() const {
+  auto types = std::vector<ValueType>{};
+  types.reserve(locals_.size());
+  for (const Local &local : locals_) types.push_back(local.type);
+  return types;
+}
+
 constexpr ParseRule Compiler::GetParseRule(TokenType type) {
   switch (type) {
     case TokenType::kBang:
@@ -110,7 +641,17 @@ constexpr ParseRule Compiler::GetParseRule(TokenType type) {
     case TokenType::kNil:
       return {&Compiler::Literal, nullptr, Precedence::kNone};
     case TokenType::kLeftParen:
-      return {&Compiler::Grouping, nullptr, Precedence::kNone};
+      return {&Compiler::Grouping, &Compiler::Call, Precedence::kCall};
+    case TokenType::kLeftBracket:
+      return {&Compiler::ListLiteral, &Compiler::Index, Precedence::kCall};
+    case TokenType::kLeftBrace:
+      return {&Compiler::MapLiteral, nullptr, Precedence::kNone};
+    case TokenType::kDot:
+      return {nullptr, &Compiler::Dot, Precedence::kCall};
+    case TokenType::kThis:
+      return {&Compiler::This, nullptr, Precedence::kNone};
+    case TokenType::kSuper:
+      return {&Compiler::Super, nullptr, Precedence::kNone};
     case TokenType::kMinus:
       return {&Compiler::Unary, &Compiler::Binary, Precedence::kTerm};
     case TokenType::kPlus:
@@ -122,6 +663,12 @@ constexpr ParseRule Compiler::GetParseRule(TokenType type) {
       return {&Compiler::String, nullptr, Precedence::kNone};
     case TokenType::kNumber:
       return {&Compiler::Number, nullptr, Precedence::kNone};
+    case TokenType::kIdentifier:
+      return {&Compiler::Variable, nullptr, Precedence::kNone};
+    case TokenType::kAnd:
+      return {nullptr, &Compiler::And, Precedence::kAnd};
+    case TokenType::kOr:
+      return {nullptr, &Compiler::Or, Precedence::kOr};
     default:
       return kNoParseRule;
   }
@@ -132,27 +679,282 @@ void Compiler::Grouping() {
   parser_.Consume(TokenType::kRightParen, "Expected ')' after expression");
 }
 
+void Compiler::IfStatement() {
+  parser_.Consume(TokenType::kLeftParen, "Expected '(' after 'if'.");
+  Expression();
+  parser_.Consume(TokenType::kRightParen, "Expected ')' after condition.");
+
+  std::size_t then_jump = EmitJump(Opcode::kJumpIfFalse);
+  EmitByte(Opcode::kPop);
+  auto types = GetLocalTypes();
+  Statement();
+  std::size_t else_jump = EmitJump(Opcode::kJump);
+
+  PatchJump(then_jump);
+  EmitByte(Opcode::kPop);
+  auto then_types = GetLocalTypes();
+  SetLocalTypes(types);
+  if (parser_.Match(TokenType::kElse)) Statement();
+  PatchJump(else_jump);
+  MergeLocalTypes(then_types);
+}
+
+template <typename CompileFunc>
+void Compiler::Loop(CompileFunc compile) {
+  auto checkpoint = parser_;
+  Chunk *chunk = GetCurrentChunk();
+  std::size_t code_size = chunk->GetCodeSize();
+  std::size_t constant_count = chunk->GetConstantCount();
+  std::size_t inline_cache_count = chunk->GetInlineCacheCount();
+  auto types = GetLocalTypes();
+  auto widened = std::vector<bool>{};
+  for (const Local &local : locals_) widened.push_back(local.widened);
+  auto outer_widens = std::move(loop_widens_);
+
+  // Start from what compiling the loop before found, if an enclosing loop
+  // is compiling it again, so that it is compiled only once more.
+  std::vector<bool> &known =
+      loop_widened_[checkpoint.get_previous().lexeme.data()];
+  for (auto i = std::size_t{0}; i < known.size() && i < locals_.size(); ++i) {
+    if (known[i]) locals_[i].widened = true;
+  }
+  SetLocalTypes(types);
+
+  while (true) {
+    loop_widens_.assign(locals_.size(), false);
+    compile();
+    if (parser_.had_error() ||
+        std::find(loop_widens_.begin(), loop_widens_.end(), true) ==
+            loop_widens_.end()) {
+      break;
+    }
+    // Some locals change type around the loop, so code assuming the type
+    // they had on entry would be wrong from the second iteration on.
+    known.resize(loop_widens_.size());
+    for (auto i = std::size_t{0}; i < loop_widens_.size(); ++i) {
+      if (loop_widens_[i]) locals_[i].widened = known[i] = true;
+    }
+    parser_ = checkpoint;
+    chunk->Truncate(code_size, constant_count, inline_cache_count);
+    SetLocalTypes(types);
+  }
+
+  for (auto i = std::size_t{0}; i < widened.size(); ++i) {
+    locals_[i].widened = widened[i];
+  }
+  loop_widens_ = std::move(outer_widens);
+}
+
+void Compiler::LoopEdge(const std::vector<ValueType> &expected) {
+  for (auto i = std::size_t{0};
+       i < loop_widens_.size() && i < expected.size(); ++i) {
+    if (expected[i] != ValueType::kUnknown &&
+        locals_[i].type != expected[i]) {
+      loop_widens_[i] = true;
+    }
+  }
+}
+
+void Compiler::MergeLocalTypes(const std::vector<ValueType> &types) {
+  for (auto i = std::size_t{0}; i < locals_.size() && i < types.size(); ++i) {
+    if (locals_[i].type != types[i]) locals_[i].type = ValueType::kUnknown;
+  }
+}
+
+void Compiler::Index() {
+  bool can_assign = can_assign_;
+  // Lists and maps live on the heap, which graphs know nothing about.
+  if (graph_ != nullptr) graph_unsupported_ = true;
+  Expression();
+  parser_.Consume(TokenType::kRightBracket, "Expected ']' after index.");
+
+  Opcode instruction = Opcode::kGetIndex;
+  if (can_assign && parser_.Match(TokenType::kEqual)) {
+    // The assignment's result is the value, of whatever type it has.
+    Expression();
+    instruction = Opcode::kSetIndex;
+  } else {
+    last_type_ = ValueType::kUnknown;
+  }
+  if (graph_ == nullptr) EmitByte(instruction);
+}
+
 void Compiler::Number() {
-  auto value = std::stod(parser_.get_previous().lexeme.data());
-  GetCurrentChunk()->WriteConstant(value, parser_.get_previous().line);
+  EmitConstant(Scanner::ParseNumber(parser_.get_previous().lexeme));
 }
 
 void Compiler::Literal() {
   switch (parser_.get_previous().type) {
     case TokenType::kFalse:
-      EmitByte(Opcode::kFalse);
+      EmitLiteral(Opcode::kFalse, false);
       break;
     case TokenType::kTrue:
-      EmitByte(Opcode::kTrue);
+      EmitLiteral(Opcode::kTrue, true);
       break;
     case TokenType::kNil:
-      EmitByte(Opcode::kNil);
+      EmitLiteral(Opcode::kNil, std::monostate{});
       break;
     default:
       return;
   }
 }
 
+void Compiler::ListLiteral() {
+  if (graph_ != nullptr) graph_unsupported_ = true;
+  auto count = std::size_t{0};
+  if (!parser_.Check(TokenType::kRightBracket)) {
+    do {
+      Expression();
+      if (count == UINT8_MAX) {
+        parser_.ErrorAtPrevious(
+            "Can't have more than 255 elements in a list literal.");
+      }
+      ++count;
+    } while (parser_.Match(TokenType::kComma));
+  }
+  parser_.Consume(TokenType::kRightBracket, "Expected ']' after elements.");
+  last_type_ = ValueType::kObject;
+  if (graph_ == nullptr) {
+    EmitBytes({static_cast<std::uint8_t>(Opcode::kBuildList),
+               static_cast<std::uint8_t>(count)});
+  }
+}
+
+void Compiler::MapLiteral() {
+  if (graph_ != nullptr) graph_unsupported_ = true;
+  auto count = std::size_t{0};
+  if (!parser_.Check(TokenType::kRightBrace)) {
+    do {
+      Expression();
+      parser_.Consume(TokenType::kColon, "Expected ':' after map key.");
+      Expression();
+      if (count == UINT8_MAX) {
+        parser_.ErrorAtPrevious(
+            "Can't have more than 255 entries in a map literal.");
+      }
+      ++count;
+    } while (parser_.Match(TokenType::kComma));
+  }
+  parser_.Consume(TokenType::kRightBrace, "Expected '}' after entries.");
+  last_type_ = ValueType::kObject;
+  if (graph_ == nullptr) {
+    EmitBytes({static_cast<std::uint8_t>(Opcode::kBuildMap),
+               static_cast<std::uint8_t>(count)});
+  }
+}
+
+bool Compiler::LoadImplicitVariable(std::string_view name) {
+  if (auto slot = ResolveLocal(name)) {
+    NamedLocal(*slot, false);
+    return true;
+  }
+  if (auto index = ResolveUpvalue(name)) {
+    NamedUpvalue(*index, false);
+    return true;
+  }
+  return false;
+}
+
+void Compiler::Method() {
+  parser_.Consume(TokenType::kIdentifier, "Expected method name.");
+  std::string_view name = parser_.get_previous().lexeme;
+  FunctionKind kind =
+      name == "init" ? FunctionKind::kInitializer : FunctionKind::kMethod;
+  std::size_t constant = GetCurrentChunk()->AddConstant(std::string{name});
+  std::shared_ptr<Function> method = ScanFunction(name, kind);
+  if (method == nullptr) return;
+  EmitFunction(std::move(method));
+  EmitWithLongOperand(Opcode::kMethod, constant);
+}
+
+void Compiler::NamedGlobal(std::string_view name, bool can_assign) {
+  auto slot = ResolveGlobal(name);
+  if (!slot) return;
+
+  if (can_assign && parser_.Match(TokenType::kEqual)) {
+    // The assignment has to happen in order with the loads around it,
+    // which a graph does not capture.
+    if (graph_ != nullptr) graph_unsupported_ = true;
+    Expression();
+    if (graph_ == nullptr) {
+      GetCurrentChunk()->WriteWithOperand(Opcode::kSetGlobal,
+                                          Opcode::kSetGlobalLong, *slot,
+                                          parser_.get_previous().line);
+    }
+    return;
+  }
+
+  last_type_ = ValueType::kUnknown;
+  if (graph_ != nullptr) {
+    last_node_ = graph_->AddGlobal(*slot, parser_.get_previous().line);
+    return;
+  }
+  GetCurrentChunk()->WriteWithOperand(Opcode::kGetGlobal,
+                                      Opcode::kGetGlobalLong, *slot,
+                                      parser_.get_previous().line);
+}
+
+void Compiler::NamedLocal(std::size_t slot, bool can_assign) {
+  if (can_assign && parser_.Match(TokenType::kEqual)) {
+    if (graph_ != nullptr) {
+      graph_unsupported_ = true;
+      Expression();
+      return;
+    }
+    Expression();
+    GetCurrentChunk()->WriteWithOperand(Opcode::kSetLocal,
+                                        Opcode::kSetLocalLong, slot,
+                                        parser_.get_previous().line);
+    SetLocalType(slot, last_type_);
+    return;
+  }
+
+  last_type_ = locals_[slot].type;
+  if (graph_ != nullptr) {
+    last_node_ =
+        graph_->AddLocal(slot, last_type_, parser_.get_previous().line);
+    return;
+  }
+  GetCurrentChunk()->WriteWithOperand(Opcode::kGetLocal, Opcode::kGetLocalLong,
+                                      slot, parser_.get_previous().line);
+}
+
+void Compiler::NamedUpvalue(std::size_t index, bool can_assign) {
+  // Graphs have no way to reach captured variables.
+  if (graph_ != nullptr) graph_unsupported_ = true;
+  auto operand = static_cast<std::uint8_t>(index);
+  if (can_assign && parser_.Match(TokenType::kEqual)) {
+    Expression();
+    if (graph_ == nullptr) {
+      EmitBytes({static_cast<std::uint8_t>(Opcode::kSetUpvalue), operand});
+    }
+    return;
+  }
+  last_type_ = ValueType::kUnknown;
+  if (graph_ == nullptr) {
+    EmitBytes({static_cast<std::uint8_t>(Opcode::kGetUpvalue), operand});
+  }
+}
+
+void Compiler::Or() {
+  if (graph_ != nullptr) {
+    graph_unsupported_ = true;
+    ParsePrecedence(Precedence::kOr);
+    return;
+  }
+
+  ValueType left_type = last_type_;
+  std::size_t else_jump = EmitJump(Opcode::kJumpIfFalse);
+  std::size_t end_jump = EmitJump(Opcode::kJump);
+  PatchJump(else_jump);
+  auto types = GetLocalTypes();
+  EmitByte(Opcode::kPop);
+  ParsePrecedence(Precedence::kOr);
+  PatchJump(end_jump);
+  MergeLocalTypes(types);
+  if (last_type_ != left_type) last_type_ = ValueType::kUnknown;
+}
+
 void Compiler::ParsePrecedence(Precedence precedence) {
   parser_.Advance();
   auto prefixRule = GetParseRule(parser_.get_previous().type).prefix_func;
@@ -161,13 +963,230 @@ void Compiler::ParsePrecedence(Precedence precedence) {
     return;
   }
 
+  bool can_assign = precedence <= Precedence::kAssignment;
+  can_assign_ = can_assign;
   (this->*prefixRule)();
 
   while (precedence <= GetParseRule(parser_.get_current().type).precedence) {
     parser_.Advance();
+    can_assign_ = can_assign;
     auto infix_rule = GetParseRule(parser_.get_previous().type).infix_func;
     (this->*infix_rule)();
   }
+
+  if (can_assign && parser_.Match(TokenType::kEqual)) {
+    parser_.ErrorAtPrevious("Invalid assignment target.");
+  }
+}
+
+void Compiler::PatchJump(std::size_t jump) {
+  // The offset is counted from the end of the jump instruction.
+  std::size_t offset = GetCurrentChunk()->GetCodeSize() - jump - 2;
+  if (offset > UINT16_MAX) {
+    parser_.ErrorAtPrevious("Too much code to jump over.");
+  }
+  GetCurrentChunk()->SetCodeAtIndex(
+      jump, static_cast<std::uint8_t>((offset >> 8) & 0xff));
+  GetCurrentChunk()->SetCodeAtIndex(jump + 1,
+                                    static_cast<std::uint8_t>(offset & 0xff));
+}
+
+void Compiler::PrintStatement() {
+  Expression();
+  parser_.Consume(TokenType::kSemicolon, "Expected ';' after value.");
+  EmitByte(Opcode::kPrint);
+}
+
+void Compiler::ReturnStatement() {
+  if (function_ == nullptr) {
+    parser_.ErrorAtPrevious("Can't return from top-level code.");
+  }
+  if (parser_.Match(TokenType::kSemicolon)) {
+    EmitImplicitResult();
+  } else {
+    if (function_ != nullptr &&
+        function_->get_kind() == FunctionKind::kInitializer) {
+      parser_.ErrorAtPrevious("Can't return a value from an initializer.");
+    }
+    std::size_t start = GetCurrentChunk()->GetCodeSize();
+    Expression();
+    parser_.Consume(TokenType::kSemicolon, "Expected ';' after return value.");
+    // A call whose result is returned as it is, as in 'return f(x);' or
+    // 'return x or f(x);', is in tail position.
+    Chunk *chunk = GetCurrentChunk();
+    if (last_call_ && *last_call_ >= start &&
+        *last_call_ + 2 == chunk->GetCodeSize()) {
+      chunk->SetCodeAtIndex(*last_call_,
+                            static_cast<std::uint8_t>(Opcode::kTailCall));
+    }
+  }
+  // Returning discards the function's frame, locals and all.
+  EmitReturn();
+}
+
+std::optional<std::size_t> Compiler::ResolveGlobal(std::string_view name) {
+  if (globals_ == nullptr) globals_ = std::make_shared<GlobalTable>();
+  auto slot = globals_->Resolve(name);
+  if (!slot) {
+    parser_.ErrorAtPrevious("Too many global variables.");
+    return std::nullopt;
+  }
+  uses_globals_ = true;
+  return slot;
+}
+
+std::optional<std::size_t> Compiler::ResolveLocal(std::string_view name) {
+  for (auto slot = locals_.size(); slot-- > 0;) {
+    if (locals_[slot].name != name) continue;
+    if (locals_[slot].depth == -1) {
+      parser_.ErrorAtPrevious(
+          "Can't read local variable in its own initializer.");
+    }
+    return slot;
+  }
+  return std::nullopt;
+}
+
+std::shared_ptr<Function> Compiler::ScanFunction(std::string_view name,
+                                                 FunctionKind kind) {
+  auto offset = [this](const Token &token) {
+    return source_offset_ +
+           static_cast<std::size_t>(token.lexeme.data() - source_.data());
+  };
+  std::size_t start = offset(parser_.get_current());
+  std::size_t line = parser_.get_current().line;
+  parser_.Consume(TokenType::kLeftParen, "Expected '(' after function name.");
+  auto parameters = std::vector<std::string_view>{};
+  if (!parser_.Check(TokenType::kRightParen)) {
+    do {
+      if (parameters.size() == UINT8_MAX) {
+        parser_.ErrorAtCurrent("Can't have more than 255 parameters.");
+      }
+      parser_.Consume(TokenType::kIdentifier, "Expected parameter name.");
+      parameters.push_back(parser_.get_previous().lexeme);
+    } while (parser_.Match(TokenType::kComma));
+  }
+  parser_.Consume(TokenType::kRightParen, "Expected ')' after parameters.");
+  parser_.Consume(TokenType::kLeftBrace, "Expected '{' before function body.");
+
+  // Captures the variable called name if it belongs to an enclosing
+  // function, returning false if it may be a global instead. A parameter
+  // hides whatever it is named after throughout the body.
+  auto captures = std::vector<Capture>{};
+  auto capture = [this, &parameters, &captures](std::string_view name) {
+    auto named = [name](const auto &other) { return other == name; };
+    if (std::any_of(parameters.begin(), parameters.end(), named) ||
+        std::any_of(captures.begin(), captures.end(),
+                    [name](const Capture &c) { return c.name == name; })) {
+      return true;
+    }
+    auto local = std::optional<std::size_t>{};
+    for (auto slot = locals_.size(); slot-- > 0;) {
+      if (locals_[slot].name == name && locals_[slot].depth != -1) {
+        local = slot;
+        break;
+      }
+    }
+    if (local) {
+      captures.push_back({std::string{name}, true, *local});
+      locals_[*local].captured = true;
+      locals_[*local].type = ValueType::kUnknown;
+      return true;
+    }
+    if (auto upvalue = ResolveUpvalue(name)) {
+      captures.push_back({std::string{name}, false, *upvalue});
+      return true;
+    }
+    return false;
+  };
+
+  // Skip to the matching brace. A name after a '.' is a property, which
+  // never refers to a variable.
+  for (auto depth = 1; depth > 0;) {
+    if (parser_.Check(TokenType::kEof)) {
+      parser_.ErrorAtCurrent("Expected '}' after function body.");
+      return nullptr;
+    }
+    bool is_property = parser_.get_previous().type == TokenType::kDot;
+    parser_.Advance();
+    switch (parser_.get_previous().type) {
+      case TokenType::kLeftBrace:
+        ++depth;
+        break;
+      case TokenType::kRightBrace:
+        --depth;
+        break;
+      case TokenType::kIdentifier:
+        // Every other name gets a global slot now in case it is a global,
+        // so that compiling the body later never adds to the table, which
+        // other threads may be reading by then.
+        if (!is_property && !capture(parser_.get_previous().lexeme)) {
+          ResolveGlobal(parser_.get_previous().lexeme);
+        }
+        break;
+      case TokenType::kThis:
+        // A method has a 'this' of its own.
+        if (kind == FunctionKind::kFunction) capture("this");
+        break;
+      case TokenType::kSuper:
+        capture("super");
+        break;
+      default:
+        break;
+    }
+  }
+  if (captures.size() > std::size_t{UINT8_MAX} + 1) {
+    parser_.ErrorAtPrevious("Too many closure variables in function.");
+  }
+  if (parser_.had_error()) return nullptr;
+
+  std::size_t end = offset(parser_.get_previous()) + 1;
+  return std::make_shared<Function>(
+      std::string{name}, kind, parameters.size(), GetFunctionContext(), start,
+      end, line, std::move(captures));
+}
+
+std::optional<std::size_t> Compiler::ResolveUpvalue(
+    std::string_view name) const {
+  if (function_ == nullptr) return std::nullopt;
+  const std::vector<Capture> &captures = function_->get_captures();
+  for (auto i = std::size_t{0}; i < captures.size(); ++i) {
+    if (captures[i].name == name) return i;
+  }
+  return std::nullopt;
+}
+
+void Compiler::SetLocalType(std::size_t slot, ValueType type) {
+  Local &local = locals_[slot];
+  local.type = local.widened || local.captured ? ValueType::kUnknown : type;
+}
+
+void Compiler::SetLocalTypes(const std::vector<ValueType> &types) {
+  for (auto i = std::size_t{0}; i < locals_.size() && i < types.size(); ++i) {
+    SetLocalType(i, types[i]);
+  }
+}
+
+void Compiler::Statement() {
+  ++nesting_;
+  if (parser_.Match(TokenType::kPrint)) {
+    PrintStatement();
+  } else if (parser_.Match(TokenType::kFor)) {
+    ForStatement();
+  } else if (parser_.Match(TokenType::kIf)) {
+    IfStatement();
+  } else if (parser_.Match(TokenType::kReturn)) {
+    ReturnStatement();
+  } else if (parser_.Match(TokenType::kWhile)) {
+    WhileStatement();
+  } else if (parser_.Match(TokenType::kLeftBrace)) {
+    BeginScope();
+    Block();
+    EndScope();
+  } else {
+    ExpressionStatement();
+  }
+  --nesting_;
 }
 
 void Compiler::StopCompiling() {
@@ -180,10 +1199,36 @@ void Compiler::StopCompiling() {
 }
 
 void Compiler::String() {
-  GetCurrentChunk()->WriteConstant(
-      std::string{parser_.get_previous().lexeme.begin() + 1,
-                  parser_.get_previous().lexeme.end() - 1},
-      parser_.get_previous().line);
+  EmitConstant(std::string{parser_.get_previous().lexeme.begin() + 1,
+                           parser_.get_previous().lexeme.end() - 1});
+}
+
+void Compiler::Super() {
+  parser_.Consume(TokenType::kDot, "Expected '.' after 'super'.");
+  parser_.Consume(TokenType::kIdentifier, "Expected superclass method name.");
+  std::string_view name = parser_.get_previous().lexeme;
+  if (!LoadImplicitVariable("this")) {
+    parser_.ErrorAtPrevious("Can't use 'super' outside of a class.");
+    return;
+  }
+  if (!LoadImplicitVariable("super")) {
+    parser_.ErrorAtPrevious(
+        "Can't use 'super' in a class with no superclass.");
+    return;
+  }
+  last_type_ = ValueType::kUnknown;
+  if (graph_ != nullptr) {
+    graph_unsupported_ = true;
+    return;
+  }
+  EmitWithLongOperand(Opcode::kGetSuper,
+                      GetCurrentChunk()->AddInlineCache(std::string{name}));
+}
+
+void Compiler::This() {
+  if (!LoadImplicitVariable("this")) {
+    parser_.ErrorAtPrevious("Can't use 'this' outside of a class.");
+  }
 }
 
 void Compiler::Unary() {
@@ -192,16 +1237,97 @@ void Compiler::Unary() {
   // Compile the operand
   ParsePrecedence(Precedence::kUnary);
 
+  Opcode generic;
   switch (operator_type) {
     case TokenType::kBang:
-      EmitByte(Opcode::kNot);
+      generic = Opcode::kNot;
       break;
     case TokenType::kMinus:
-      EmitByte(Opcode::kNegate);
+      generic = Opcode::kNegate;
       break;
     default:
       return;
   }
+
+  if (graph_ != nullptr) {
+    if (graph_unsupported_) return;
+    last_node_ = graph_->AddUnary(generic, last_node_,
+                                  parser_.get_previous().line);
+    last_type_ = graph_->GetType(last_node_);
+    return;
+  }
+
+  EmitByte(SpecialiseOpcode(generic, last_type_));
+  last_type_ = GetResultType(generic, last_type_);
+}
+
+void Compiler::VarDeclaration() {
+  parser_.Consume(TokenType::kIdentifier, "Expected variable name.");
+  auto slot = DeclareVariable();
+
+  if (parser_.Match(TokenType::kEqual)) {
+    Expression();
+  } else {
+    EmitByte(Opcode::kNil);
+    last_type_ = ValueType::kNil;
+  }
+  parser_.Consume(TokenType::kSemicolon,
+                  "Expected ';' after variable declaration.");
+  DefineVariable(slot);
+}
+
+void Compiler::Variable() {
+  bool can_assign = can_assign_;
+  std::string_view name = parser_.get_previous().lexeme;
+  if (auto slot = ResolveLocal(name)) {
+    NamedLocal(*slot, can_assign);
+    return;
+  }
+  if (auto index = ResolveUpvalue(name)) {
+    NamedUpvalue(*index, can_assign);
+    return;
+  }
+
+  // Later declarations shadow earlier ones of the same name.
+  auto it = std::find(input_names_.rbegin(), input_names_.rend(), name);
+  if (it == input_names_.rend()) {
+    if (auto native = natives_ != nullptr ? natives_->Find(name) : nullptr) {
+      CallNative(std::move(native));
+    } else {
+      NamedGlobal(name, can_assign);
+    }
+    return;
+  }
+
+  auto index = static_cast<std::uint8_t>(input_names_.rend() - it - 1);
+  last_type_ = input_types_[index];
+  if (graph_ != nullptr) {
+    last_node_ =
+        graph_->AddInput(index, last_type_, parser_.get_previous().line);
+    return;
+  }
+  EmitBytes({static_cast<std::uint8_t>(Opcode::kGetInput), index});
+}
+
+void Compiler::WhileStatement() {
+  Loop([this] {
+    std::size_t loop_start = GetCurrentChunk()->GetCodeSize();
+    auto types = GetLocalTypes();
+    parser_.Consume(TokenType::kLeftParen, "Expected '(' after 'while'.");
+    Expression();
+    parser_.Consume(TokenType::kRightParen, "Expected ')' after condition.");
+
+    std::size_t exit_jump = EmitJump(Opcode::kJumpIfFalse);
+    EmitByte(Opcode::kPop);
+    auto exit_types = GetLocalTypes();
+    Statement();
+    LoopEdge(types);
+    EmitLoop(loop_start);
+
+    PatchJump(exit_jump);
+    EmitByte(Opcode::kPop);
+    SetLocalTypes(exit_types);
+  });
 }
 
 }  // namespace lox
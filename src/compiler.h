@@ -3,7 +3,19 @@
 #ifndef LOX_SRC_COMPILER_H
 #define LOX_SRC_COMPILER_H
 
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
 #include "chunk.h"
+#include "function.h"
+#include "globals.h"
+#include "ir.h"
+#include "native.h"
 #include "parser.h"
 #include "scanner.h"
 
@@ -35,29 +47,205 @@ struct ParseRule {
 
 class Compiler {
  public:
-  explicit Compiler(std::string_view source);
+  explicit Compiler(std::string_view source,
+                    OptimizationLevel optimization_level = OptimizationLevel::kO0);
+  // Compiles the body of function, whose parameter list and body source
+  // holds, with the settings of the script that declared it.
+  Compiler(const Function &function, std::string_view source);
   bool Compile(Chunk *chunk);
+  // Makes name refer to the next input of the compiled chunk, which the host
+  // supplies when running it. A type other than kUnknown is a promise that
+  // lets the compiler specialise code using the input. Returns false once
+  // kMaxInputs have been declared.
+  bool DeclareInput(std::string name, ValueType type = ValueType::kUnknown);
+
+  // Makes the functions in natives callable from the compiled code. The
+  // table must outlive the compiler, but not the chunk.
+  void set_natives(const NativeTable *natives);
+  // Resolves global variables against globals, which code compiled earlier
+  // may share. Without one, the compiler starts a table of its own.
+  void set_globals(std::shared_ptr<GlobalTable> globals);
+  // Reports compile errors to errors rather than std::cerr.
+  void set_error_output(std::ostream *errors);
+
+  static constexpr auto kMaxInputs = std::size_t{256};
+  static constexpr auto kMaxLocals = std::size_t{1} << 16;
 
  private:
+  struct Local {
+    std::string_view name;
+    // The depth of the scope the local belongs to, or -1 while its
+    // initializer is being compiled.
+    int depth;
+    // What is known about the local's type where code is being emitted.
+    ValueType type;
+    // Set while compiling a loop around which the local's type changes, so
+    // that its type is kUnknown throughout the loop.
+    bool widened;
+    // Set once a closure captures the local, after which any call may
+    // change it, so its type is kUnknown from then on.
+    bool captured;
+  };
+
+  // Declares a local, uninitialised, in the next stack slot. Returns false
+  // after reporting an error if there are too many.
+  bool AddLocal(std::string_view name);
+  void And();
+  // Compiles a call's arguments and returns how many there were.
+  std::uint8_t ArgumentList();
+  void BeginScope();
   void Binary();
+  void Block();
+  void Call();
+  void CallNative(std::shared_ptr<const NativeFunction> native);
+  void ClassDeclaration();
+  void Declaration();
+  // Declares the variable the previous token names: a local, uninitialised,
+  // inside a scope and a global otherwise. Returns its slot, or std::nullopt
+  // after reporting an error.
+  std::optional<std::size_t> DeclareVariable();
+  // Initialises the variable in slot with the value on top of the stack.
+  void DefineVariable(std::optional<std::size_t> slot);
   void EmitByte(std::uint8_t byte);
   void EmitByte(Opcode code);
   void EmitBytes(std::initializer_list<std::uint8_t> bytes);
   void EmitBytes(std::initializer_list<Opcode> codes);
+  // Emits code with a three-byte operand.
+  void EmitWithLongOperand(Opcode code, std::size_t operand);
+  // Emits a function declared in the code being compiled: a closure if it
+  // captures anything, and otherwise the function itself.
+  void EmitFunction(std::shared_ptr<Function> function);
+  // Pushes what the function being compiled returns when it returns no
+  // value: nil, or for an initializer, the instance.
+  void EmitImplicitResult();
+  // Emits a jump with a placeholder offset, to be patched by PatchJump().
+  std::size_t EmitJump(Opcode instruction);
+  void EmitLoop(std::size_t loop_start);
+  // Emits a constant, or adds it to the expression graph when optimising.
+  void EmitConstant(Value value);
+  // Emits one of kNil, kTrue or kFalse; value is the constant it pushes.
+  void EmitLiteral(Opcode code, Value value);
   void EmitReturn();
+  void EndScope();
+  void Dot();
   void Expression();
+  void ExpressionStatement();
+  void ForStatement();
+  void FunDeclaration();
+  // Compiles the parameter list and body of the function being compiled.
+  void FunctionBody();
   Chunk *GetCurrentChunk();
+  std::shared_ptr<const FunctionContext> GetFunctionContext();
+  [[nodiscard]] std::vector<ValueType> GetLocalTypes() const;
   static constexpr ParseRule GetParseRule(TokenType type);
   void Grouping();
+  void IfStatement();
+  // Compiles a subscript, list[index] or map[key], which may be assigned to.
+  void Index();
+  // Compiles a loop with compile, which is called again for as long as the
+  // types of locals change around the loop, each time with more of them
+  // treated as unknown, until the code it emits holds on every iteration.
+  template <typename CompileFunc>
+  void Loop(CompileFunc compile);
+  // Notes that control flows from here to code compiled for locals of the
+  // types in expected, which has to be compiled again if that was wrong.
+  void LoopEdge(const std::vector<ValueType> &expected);
+  // Merges types, which the locals have on another path to here, into what
+  // is known about them.
+  void MergeLocalTypes(const std::vector<ValueType> &types);
   void Number();
   void Literal();
+  void ListLiteral();
+  void MapLiteral();
+  // Pushes 'this' or 'super', which are locals or captured variables where
+  // they exist at all. Returns false if name is neither.
+  bool LoadImplicitVariable(std::string_view name);
+  void Method();
+  void NamedGlobal(std::string_view name, bool can_assign);
+  void NamedLocal(std::size_t slot, bool can_assign);
+  void NamedUpvalue(std::size_t index, bool can_assign);
+  void Or();
   void ParsePrecedence(Precedence precedence);
+  void PatchJump(std::size_t jump);
+  void PrintStatement();
+  void ReturnStatement();
+  std::optional<std::size_t> ResolveGlobal(std::string_view name);
+  // Returns the slot of the innermost local named name, if any.
+  std::optional<std::size_t> ResolveLocal(std::string_view name);
+  // Returns the index of the variable named name that the function being
+  // compiled captured, if any.
+  std::optional<std::size_t> ResolveUpvalue(std::string_view name) const;
+  // Parses a function declaration's parameter list and finds where its body
+  // ends, without compiling it. Any name in the body that could refer to a
+  // variable of this function is captured, so a function only needs to
+  // become a closure if its body mentions one. Returns nullptr after
+  // reporting an error.
+  std::shared_ptr<Function> ScanFunction(std::string_view name,
+                                         FunctionKind kind);
+  // Records that the local in slot holds a value of type, unless its type
+  // is not being tracked.
+  void SetLocalType(std::size_t slot, ValueType type);
+  void SetLocalTypes(const std::vector<ValueType> &types);
+  void Statement();
   void StopCompiling();
   void String();
+  void Super();
+  void This();
   void Unary();
+  void VarDeclaration();
+  void Variable();
+  void WhileStatement();
 
   Chunk *compiling_chunk_ = nullptr;
   Parser parser_;
+  // The inferred type of the expression compiled last, used to pick
+  // type-specialised opcodes.
+  ValueType last_type_ = ValueType::kUnknown;
+  OptimizationLevel optimization_level_;
+  // The graph of the expression being compiled when optimising, in which case
+  // the parse functions build nodes instead of emitting code, and the node
+  // for the expression compiled last.
+  ExpressionGraph *graph_ = nullptr;
+  ExpressionGraph::NodeId last_node_ = 0;
+  // Holds the graph being built and everything else only needed while
+  // compiling one expression, and is reset before the next.
+  Arena arena_;
+  // Set while building a graph for an expression that needs something
+  // graphs cannot express, after which the expression is compiled again
+  // without one.
+  bool graph_unsupported_ = false;
+  bool graphs_enabled_ = true;
+  // Where the kCall emitted last starts, if there was one.
+  std::optional<std::size_t> last_call_;
+  // Whether the expression being parsed may be the target of an assignment.
+  bool can_assign_ = false;
+  // Whether the script ended in an expression, whose value it returns.
+  bool has_result_ = false;
+  std::shared_ptr<GlobalTable> globals_;
+  bool uses_globals_ = false;
+  // The locals in scope, by stack slot.
+  std::vector<Local> locals_;
+  int scope_depth_ = 0;
+  // How many statements enclose the code being compiled.
+  int nesting_ = 0;
+  // For the loop being compiled, which of the locals declared outside it
+  // have to be widened because their types change around it.
+  std::vector<bool> loop_widens_;
+  // Which locals each loop compiled so far widened, by where the loop
+  // starts in the source. Compiling a loop again, as part of an enclosing
+  // loop that widened, starts from them rather than finding them again.
+  std::unordered_map<const char *, std::vector<bool>> loop_widened_;
+  // The declared inputs, in index order.
+  std::vector<std::string> input_names_;
+  std::vector<ValueType> input_types_;
+  const NativeTable *natives_ = nullptr;
+  // The text being compiled, which starts source_offset_ characters into
+  // the script, and for a function body, the function.
+  std::string_view source_;
+  std::size_t source_offset_ = 0;
+  const Function *function_ = nullptr;
+  // Shared by the functions declared in the script, once there are any.
+  std::shared_ptr<const FunctionContext> context_;
 };
 
 }  // namespace lox
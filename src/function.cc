@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "function.h"
+
+#include <sstream>
+
+#include "batch.h"
+#include "compiler.h"
+
+namespace lox {
+
+Function::Function(std::string name, FunctionKind kind, std::size_t arity,
+                   std::shared_ptr<const FunctionContext> context,
+                   std::size_t start, std::size_t end, std::size_t line,
+                   std::vector<Capture> captures)
+    : Object(ObjectType::kFunction),
+      name_(std::move(name)),
+      kind_(kind),
+      arity_(arity),
+      context_(std::move(context)),
+      start_(start),
+      end_(end),
+      line_(line),
+      captures_(std::move(captures)) {}
+
+const Chunk *Function::GetChunk(std::ostream &errors) const {
+  std::call_once(compiled_, [this] {
+    // The scanner stops at a NUL, so the body is copied out of the script
+    // rather than scanned in place.
+    auto source = std::string{GetSource()};
+    auto compiler = Compiler{*this, source};
+    auto diagnostics = std::ostringstream{};
+    compiler.set_error_output(&diagnostics);
+    chunk_ = CompileShared(&compiler);
+    if (chunk_ == nullptr) errors_ = std::move(diagnostics).str();
+    has_chunk_.store(true, std::memory_order_release);
+  });
+  if (chunk_ == nullptr) errors << errors_;
+  return chunk_.get();
+}
+
+std::shared_ptr<const Chunk> Function::GetCompiledChunk() const {
+  return has_chunk_.load(std::memory_order_acquire) ? chunk_ : nullptr;
+}
+
+void Function::SetChunk(std::shared_ptr<const Chunk> chunk) {
+  std::call_once(compiled_, [this, &chunk] {
+    chunk_ = std::move(chunk);
+    has_chunk_.store(true, std::memory_order_release);
+  });
+}
+
+std::string_view Function::GetSource() const {
+  return std::string_view{context_->source}.substr(start_, end_ - start_);
+}
+
+void Function::Print(std::ostream &os) const { os << "<fn " << name_ << '>'; }
+
+Closure::Closure(std::shared_ptr<const Function> function,
+                 std::vector<std::shared_ptr<Upvalue>> upvalues)
+    : Object(ObjectType::kClosure),
+      function_(std::move(function)),
+      upvalues_(std::move(upvalues)) {}
+
+void Closure::Print(std::ostream &os) const { function_->Print(os); }
+
+}  // namespace lox
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_FUNCTION_H
+#define LOX_SRC_FUNCTION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chunk.h"
+#include "globals.h"
+#include "ir.h"
+#include "native.h"
+#include "value.h"
+
+namespace lox {
+
+// What compiling a function's body needs from the script it was declared
+// in, shared by all the functions declared there: the script's source, and
+// the settings and names the script itself was compiled with.
+struct FunctionContext {
+  std::string source;
+  OptimizationLevel optimization_level;
+  std::vector<std::string> input_names;
+  std::vector<ValueType> input_types;
+  // A copy of the natives the script could call, since the table it was
+  // compiled with need not outlive it.
+  std::shared_ptr<const NativeTable> natives;
+  std::shared_ptr<GlobalTable> globals;
+};
+
+// What a function is declared as. Methods find their instance as 'this' in
+// slot 0, and initializers always return it.
+enum class FunctionKind : std::uint8_t { kFunction, kMethod, kInitializer };
+
+// A variable of an enclosing function that a function refers to: either
+// one of the enclosing function's locals, by slot, or one of the variables
+// it captured itself, by index.
+struct Capture {
+  std::string name;
+  bool is_local;
+  std::size_t index;
+};
+
+// A function declared in Lox. Loading a script only finds where each body
+// ends; the body is compiled into a chunk of its own the first time the
+// function is called, so functions that never run cost next to nothing.
+class Function : public Object {
+ public:
+  // The function's parameter list and body are source[start, end) in
+  // context, starting on line. A function with captures is only called
+  // through a Closure.
+  Function(std::string name, FunctionKind kind, std::size_t arity,
+           std::shared_ptr<const FunctionContext> context, std::size_t start,
+           std::size_t end, std::size_t line, std::vector<Capture> captures);
+
+  // Compiles the body if this is the first call, and returns its verified,
+  // frozen chunk, or nullptr after writing the compile errors to errors.
+  // Every caller of a body that does not compile gets its errors, not just
+  // the first. Safe to call from several threads at once.
+  [[nodiscard]] const Chunk *GetChunk(std::ostream &errors) const;
+  // Returns the chunk if the body has been compiled already, or nullptr.
+  [[nodiscard]] std::shared_ptr<const Chunk> GetCompiledChunk() const;
+  // Gives the function a chunk compiled for its body before, such as one
+  // restored from a snapshot, unless it has been compiled already.
+  void SetChunk(std::shared_ptr<const Chunk> chunk);
+  // The parameter list and body.
+  [[nodiscard]] std::string_view GetSource() const;
+  [[nodiscard]] const std::string &get_name() const { return name_; }
+  [[nodiscard]] FunctionKind get_kind() const { return kind_; }
+  [[nodiscard]] std::size_t get_arity() const { return arity_; }
+  [[nodiscard]] const std::shared_ptr<const FunctionContext> &get_context()
+      const {
+    return context_;
+  }
+  [[nodiscard]] std::size_t get_start() const { return start_; }
+  [[nodiscard]] std::size_t get_end() const { return end_; }
+  [[nodiscard]] std::size_t get_line() const { return line_; }
+  [[nodiscard]] const std::vector<Capture> &get_captures() const {
+    return captures_;
+  }
+
+  void Print(std::ostream &os) const override;
+
+ private:
+  std::string name_;
+  FunctionKind kind_;
+  std::size_t arity_;
+  std::shared_ptr<const FunctionContext> context_;
+  std::size_t start_;
+  std::size_t end_;
+  std::size_t line_;
+  std::vector<Capture> captures_;
+  mutable std::once_flag compiled_;
+  mutable std::shared_ptr<const Chunk> chunk_;
+  // What compiling the body reported, if it did not compile.
+  mutable std::string errors_;
+  // Set once chunk_ is, since compiled_ cannot be asked.
+  mutable std::atomic<bool> has_chunk_{false};
+};
+
+// A captured variable. While the variable is still on the stack the upvalue
+// is open and points at its slot; when the variable goes out of scope, the
+// upvalue is closed by moving the value into the upvalue itself.
+struct Upvalue {
+  Value *location;
+  Value closed;
+};
+
+// A function together with the variables it captured, which it refers to
+// directly rather than through the scopes that declared them. Only
+// functions that capture something need one.
+class Closure : public Object {
+ public:
+  Closure(std::shared_ptr<const Function> function,
+          std::vector<std::shared_ptr<Upvalue>> upvalues);
+
+  [[nodiscard]] const Function &get_function() const { return *function_; }
+  [[nodiscard]] std::size_t get_upvalue_count() const {
+    return upvalues_.size();
+  }
+  [[nodiscard]] const std::shared_ptr<Upvalue> &GetUpvalue(
+      std::size_t index) const {
+    return upvalues_[index];
+  }
+
+  void Print(std::ostream &os) const override;
+
+ private:
+  std::shared_ptr<const Function> function_;
+  std::vector<std::shared_ptr<Upvalue>> upvalues_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_FUNCTION_H
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "globals.h"
+
+namespace lox {
+
+std::optional<std::size_t> GlobalTable::Resolve(std::string_view name) {
+  auto key = std::string{name};
+  if (auto it = slots_.find(key); it != slots_.end()) return it->second;
+  if (names_.size() == kMaxSlots) return std::nullopt;
+
+  std::size_t slot = names_.size();
+  names_.push_back(key);
+  slots_.emplace(std::move(key), slot);
+  return slot;
+}
+
+const std::string &GlobalTable::GetName(std::size_t slot) const {
+  return names_[slot];
+}
+
+std::size_t GlobalTable::GetCount() const { return names_.size(); }
+
+}  // namespace lox
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_GLOBALS_H
+#define LOX_SRC_GLOBALS_H
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace lox {
+
+// Assigns every global variable name a dense slot when code is compiled, so
+// that at runtime globals are read and written by index into an array rather
+// than looked up by name. Slots are never reused, so chunks compiled against
+// the table stay valid as it grows. Names are only needed again to report
+// undefined variables.
+class GlobalTable {
+ public:
+  static constexpr auto kMaxSlots = std::size_t{1} << 24;
+
+  // Returns the slot of name, giving it the next free one if it has none
+  // yet, or std::nullopt once kMaxSlots are in use.
+  std::optional<std::size_t> Resolve(std::string_view name);
+  [[nodiscard]] const std::string &GetName(std::size_t slot) const;
+  [[nodiscard]] std::size_t GetCount() const;
+
+ private:
+  std::unordered_map<std::string, std::size_t> slots_;
+  std::vector<std::string> names_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_GLOBALS_H
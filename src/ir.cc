@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ir.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <optional>
+
+namespace {
+
+// Evaluates op on two constants, or returns std::nullopt if doing so would
+// fail at runtime, in which case the operation is left for the VM so that it
+// reports the error.
+std::optional<lox::Value> FoldBinary(lox::Opcode op, const lox::Value &a,
+                                     const lox::Value &b) {
+  using lox::Opcode;
+  switch (op) {
+    case Opcode::kEqual:
+      return a == b;
+    case Opcode::kNotEqual:
+      return a != b;
+    case Opcode::kAdd:
+      if (std::holds_alternative<std::string>(a) &&
+          std::holds_alternative<std::string>(b)) {
+        return std::get<std::string>(a) + std::get<std::string>(b);
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (!(std::holds_alternative<double>(a) &&
+        std::holds_alternative<double>(b))) {
+    return std::nullopt;
+  }
+  double x = std::get<double>(a);
+  double y = std::get<double>(b);
+  switch (op) {
+    case Opcode::kAdd:
+      return x + y;
+    case Opcode::kSubtract:
+      return x - y;
+    case Opcode::kMultiply:
+      return x * y;
+    case Opcode::kDivide:
+      return x / y;
+    case Opcode::kGreater:
+      return x > y;
+    case Opcode::kGreaterEqual:
+      return x >= y;
+    case Opcode::kLess:
+      return x < y;
+    case Opcode::kLessEqual:
+      return x <= y;
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<lox::Value> FoldUnary(lox::Opcode op, const lox::Value &a) {
+  switch (op) {
+    case lox::Opcode::kNot:
+      return lox::IsFalsey(a);
+    case lox::Opcode::kNegate:
+      if (std::holds_alternative<double>(a)) return -std::get<double>(a);
+      return std::nullopt;
+    default:
+      return std::nullopt;
+  }
+}
+
+// Whether dividing by number is exactly the same as multiplying by its
+// reciprocal, which holds for (finite, normal) powers of two.
+bool HasExactReciprocal(double number) {
+  if (!std::isnormal(number)) return false;
+  int exponent = 0;
+  double mantissa = std::frexp(number, &exponent);
+  return std::fabs(mantissa) == 0.5 && std::isnormal(1.0 / number);
+}
+
+template <typename String, typename T>
+void AppendBytes(String *key, const T &value) {
+  key->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+}  // namespace
+
+namespace lox {
+
+class ExpressionGraph::Lowering {
+ public:
+  Lowering(const ExpressionGraph &graph, Chunk *chunk)
+      : graph_(graph),
+        chunk_(chunk),
+        slots_(graph.nodes_.size(), kNoSlot,
+               ArenaAllocator<std::size_t>{graph.arena_}) {}
+
+  void Run(NodeId root) {
+    // Count the uses of every node reachable from the root. Operands are
+    // always added before their users, so one pass down from the root sees
+    // each node only after all of its users.
+    auto uses = ArenaVector<std::uint32_t>(
+        graph_.nodes_.size(), ArenaAllocator<std::uint32_t>{graph_.arena_});
+    auto reachable = ArenaVector<bool>(graph_.nodes_.size(),
+                                       ArenaAllocator<bool>{graph_.arena_});
+    auto has_calls = false;
+    reachable[root] = true;
+    auto use = [&uses, &reachable](NodeId operand) {
+      if (operand == kNoOperand) return;
+      ++uses[operand];
+      reachable[operand] = true;
+    };
+    for (auto id = root + 1; id-- > 0;) {
+      if (!reachable[id]) continue;
+      const Node &node = graph_.nodes_[id];
+      use(node.left);
+      use(node.right);
+      for (auto i = std::uint32_t{0}; i < node.argument_count; ++i) {
+        use(node.arguments[i]);
+      }
+      has_calls = has_calls || node.op == Opcode::kCallNative;
+    }
+
+    // Compute every non-trivial node with several users up front and keep
+    // it on the stack, to be picked up again wherever it is used. That
+    // changes the order of evaluation, which only calls could observe.
+    auto shared = std::uint8_t{0};
+    if (graph_.level_ == OptimizationLevel::kO2 && !has_calls) {
+      for (auto id = NodeId{0}; id < root && shared < 255; ++id) {
+        if (!reachable[id] || uses[id] < 2 || graph_.IsLeaf(id)) continue;
+        Emit(id);
+        slots_[id] = height_ - 1;
+        ++shared;
+      }
+    }
+
+    Emit(root);
+
+    if (shared > 0) {
+      std::size_t line = graph_.nodes_[root].line;
+      chunk_->Write(Opcode::kSlide, line);
+      chunk_->Write(shared, line);
+    }
+  }
+
+ private:
+  static constexpr auto kNoSlot = ~std::size_t{0};
+
+  void Emit(NodeId id) {
+    const Node &node = graph_.nodes_[id];
+
+    if (slots_[id] != kNoSlot && height_ - 1 - slots_[id] <= 255) {
+      chunk_->Write(Opcode::kPick, node.line);
+      chunk_->Write(static_cast<std::uint8_t>(height_ - 1 - slots_[id]),
+                    node.line);
+      ++height_;
+      return;
+    }
+
+    if (node.op == Opcode::kConstant) {
+      if (std::holds_alternative<std::monostate>(node.value)) {
+        chunk_->Write(Opcode::kNil, node.line);
+      } else if (const auto *b = std::get_if<bool>(&node.value)) {
+        chunk_->Write(*b ? Opcode::kTrue : Opcode::kFalse, node.line);
+      } else {
+        chunk_->WriteConstant(node.value, node.line);
+      }
+      ++height_;
+      return;
+    }
+
+    if (node.op == Opcode::kCallNative) {
+      for (auto i = std::uint32_t{0}; i < node.argument_count; ++i) {
+        Emit(node.arguments[i]);
+      }
+      std::size_t index = chunk_->AddNative(node.native);
+      chunk_->Write(Opcode::kCallNative, node.line);
+      chunk_->Write(static_cast<std::uint8_t>(index), node.line);
+      chunk_->Write(static_cast<std::uint8_t>(node.argument_count), node.line);
+      height_ = height_ + 1 - node.argument_count;
+      return;
+    }
+
+    if (node.op == Opcode::kGetInput) {
+      chunk_->Write(Opcode::kGetInput, node.line);
+      chunk_->Write(static_cast<std::uint8_t>(node.index), node.line);
+      ++height_;
+      return;
+    }
+
+    if (node.op == Opcode::kGetGlobal) {
+      chunk_->WriteWithOperand(Opcode::kGetGlobal, Opcode::kGetGlobalLong,
+                               node.index, node.line);
+      ++height_;
+      return;
+    }
+
+    if (node.op == Opcode::kGetLocal) {
+      chunk_->WriteWithOperand(Opcode::kGetLocal, Opcode::kGetLocalLong,
+                               node.index, node.line);
+      ++height_;
+      return;
+    }
+
+    Emit(node.left);
+    ValueType left_type = graph_.GetType(node.left);
+    if (node.right == kNoOperand) {
+      chunk_->Write(SpecialiseOpcode(node.op, left_type), node.line);
+      return;
+    }
+
+    Emit(node.right);
+    chunk_->Write(
+        SpecialiseOpcode(node.op, left_type, graph_.GetType(node.right)),
+        node.line);
+    --height_;
+  }
+
+  const ExpressionGraph &graph_;
+  Chunk *chunk_;
+  // Where each shared node's value lives on the stack, counting from the
+  // bottom of the expression's part of it.
+  ArenaVector<std::size_t> slots_;
+  std::size_t height_ = 0;
+};
+
+ExpressionGraph::ExpressionGraph(OptimizationLevel level, Arena *arena)
+    : level_(level),
+      arena_(arena),
+      nodes_(ArenaAllocator<Node>{arena}),
+      interned_(0, KeyHash{}, std::equal_to<Key>{},
+                ArenaAllocator<std::pair<const Key, NodeId>>{arena}) {}
+
+ExpressionGraph::NodeId ExpressionGraph::AddConstant(Value value,
+                                                     std::size_t line) {
+  ValueType type = GetValueType(value);
+  return AddNode(
+      {Opcode::kConstant, kNoOperand, kNoOperand, type, line, std::move(value)});
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddInput(std::uint8_t index,
+                                                  ValueType type,
+                                                  std::size_t line) {
+  return AddNode({Opcode::kGetInput, kNoOperand, kNoOperand, type, line,
+                  Value{}, index});
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddGlobal(std::size_t slot,
+                                                   std::size_t line) {
+  return AddNode({Opcode::kGetGlobal, kNoOperand, kNoOperand,
+                  ValueType::kUnknown, line, Value{},
+                  static_cast<std::uint32_t>(slot)});
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddLocal(std::size_t slot,
+                                                  ValueType type,
+                                                  std::size_t line) {
+  return AddNode({Opcode::kGetLocal, kNoOperand, kNoOperand, type, line,
+                  Value{}, static_cast<std::uint32_t>(slot)});
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddCall(
+    std::shared_ptr<const NativeFunction> native,
+    const ArenaVector<NodeId> &arguments, std::size_t line) {
+  auto id = static_cast<NodeId>(nodes_.size());
+  ValueType type = native->get_result_type();
+  auto *copy = static_cast<NodeId *>(
+      arena_->Allocate(arguments.size() * sizeof(NodeId), alignof(NodeId)));
+  std::copy(arguments.begin(), arguments.end(), copy);
+  nodes_.push_back({Opcode::kCallNative, kNoOperand, kNoOperand, type, line,
+                    Value{}, 0, copy,
+                    static_cast<std::uint32_t>(arguments.size()),
+                    std::move(native)});
+  return id;
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddUnary(Opcode op, NodeId operand,
+                                                  std::size_t line) {
+  if (IsConstant(operand)) {
+    if (auto folded = FoldUnary(op, nodes_[operand].value)) {
+      return AddConstant(std::move(*folded), line);
+    }
+  }
+
+  // --x is x for numbers and !!x is x for booleans.
+  const Node &inner = nodes_[operand];
+  if (inner.op == op && inner.right == kNoOperand) {
+    ValueType type = GetType(inner.left);
+    if ((op == Opcode::kNegate && type == ValueType::kNumber) ||
+        (op == Opcode::kNot && type == ValueType::kBool)) {
+      return inner.left;
+    }
+  }
+
+  return AddNode({op, operand, kNoOperand,
+                  GetResultType(op, GetType(operand)), line, Value{}});
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddBinary(Opcode op, NodeId left,
+                                                   NodeId right,
+                                                   std::size_t line) {
+  if (IsConstant(left) && IsConstant(right)) {
+    if (auto folded = FoldBinary(op, nodes_[left].value, nodes_[right].value)) {
+      return AddConstant(std::move(*folded), line);
+    }
+  }
+
+  // Identities only hold once both operands are known to be numbers; with
+  // anything else the VM has to report the type error. x + 0 is not x for
+  // x = -0, but x + -0 is.
+  if (GetType(left) == ValueType::kNumber &&
+      GetType(right) == ValueType::kNumber) {
+    switch (op) {
+      case Opcode::kAdd:
+        if (IsNumberConstant(right, -0.0)) return left;
+        if (IsNumberConstant(left, -0.0)) return right;
+        break;
+      case Opcode::kSubtract:
+        if (IsNumberConstant(right, 0.0)) return left;
+        break;
+      case Opcode::kMultiply:
+        if (IsNumberConstant(right, 1.0)) return left;
+        if (IsNumberConstant(left, 1.0)) return right;
+        if (level_ == OptimizationLevel::kO2) {
+          if (IsNumberConstant(right, -1.0)) {
+            return AddUnary(Opcode::kNegate, left, line);
+          }
+          if (IsNumberConstant(left, -1.0)) {
+            return AddUnary(Opcode::kNegate, right, line);
+          }
+        }
+        break;
+      case Opcode::kDivide:
+        if (IsNumberConstant(right, 1.0)) return left;
+        // Division is several times slower than multiplication.
+        if (level_ == OptimizationLevel::kO2 && IsConstant(right) &&
+            HasExactReciprocal(std::get<double>(nodes_[right].value))) {
+          NodeId reciprocal = AddConstant(
+              1.0 / std::get<double>(nodes_[right].value), line);
+          return AddBinary(Opcode::kMultiply, left, reciprocal, line);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  return AddNode({op, left, right,
+                  GetResultType(op, GetType(left), GetType(right)), line,
+                  Value{}});
+}
+
+ValueType ExpressionGraph::GetType(NodeId id) const { return nodes_[id].type; }
+
+void ExpressionGraph::Lower(NodeId root, Chunk *chunk) const {
+  Lowering{*this, chunk}.Run(root);
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddNode(Node node) {
+  auto id = static_cast<NodeId>(nodes_.size());
+  if (level_ != OptimizationLevel::kO2) {
+    nodes_.push_back(std::move(node));
+    return id;
+  }
+
+  auto key = Key{ArenaAllocator<char>{arena_}};
+  AppendBytes(&key, node.op);
+  AppendBytes(&key, node.left);
+  AppendBytes(&key, node.right);
+  AppendBytes(&key, node.index);
+  if (node.op == Opcode::kConstant) {
+    AppendBytes(&key, node.value.index());
+    if (const auto *number = std::get_if<double>(&node.value)) {
+      // Compare bit patterns, so that 0 and -0 stay apart.
+      auto bits = std::uint64_t{0};
+      std::memcpy(&bits, number, sizeof(bits));
+      AppendBytes(&key, bits);
+    } else if (const auto *b = std::get_if<bool>(&node.value)) {
+      AppendBytes(&key, *b);
+    } else if (const auto *str = std::get_if<std::string>(&node.value)) {
+      key.append(str->data(), str->size());
+    }
+  }
+
+  auto [it, inserted] = interned_.try_emplace(std::move(key), id);
+  if (inserted) nodes_.push_back(std::move(node));
+  return it->second;
+}
+
+bool ExpressionGraph::IsConstant(NodeId id) const {
+  return nodes_[id].op == Opcode::kConstant;
+}
+
+bool ExpressionGraph::IsLeaf(NodeId id) const {
+  return nodes_[id].op == Opcode::kConstant ||
+         nodes_[id].op == Opcode::kGetInput ||
+         nodes_[id].op == Opcode::kGetGlobal ||
+         nodes_[id].op == Opcode::kGetLocal;
+}
+
+bool ExpressionGraph::IsNumberConstant(NodeId id, double number) const {
+  if (!IsConstant(id)) return false;
+  const auto *value = std::get_if<double>(&nodes_[id].value);
+  return value != nullptr && *value == number &&
+         std::signbit(*value) == std::signbit(number);
+}
+
+}  // namespace lox
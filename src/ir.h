@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_IR_H
+#define LOX_SRC_IR_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "arena.h"
+#include "chunk.h"
+#include "value.h"
+
+namespace lox {
+
+enum class OptimizationLevel : std::uint8_t {
+  // Emit bytecode straight from the parser.
+  kO0,
+  // Build an expression graph, fold constants, simplify algebraically and
+  // emit only what the result depends on.
+  kO1,
+  // As kO1, plus common subexpression elimination and strength reduction.
+  kO2,
+};
+
+// A DAG of the expression being compiled, built by the compiler's parse
+// functions when optimising. Nodes are optimised as they are added: constant
+// operands are folded, identities such as x * 1 are simplified away and, at
+// kO2, structurally identical nodes are shared. Lower() then emits the nodes
+// reachable from the root, computing each shared node only once. Nodes and
+// everything else the graph needs live in an arena, which must not be reset
+// before the graph is destroyed.
+class ExpressionGraph {
+ public:
+  using NodeId = std::uint32_t;
+
+  ExpressionGraph(OptimizationLevel level, Arena *arena);
+
+  NodeId AddConstant(Value value, std::size_t line);
+  NodeId AddInput(std::uint8_t index, ValueType type, std::size_t line);
+  NodeId AddGlobal(std::size_t slot, std::size_t line);
+  NodeId AddLocal(std::size_t slot, ValueType type, std::size_t line);
+  // Calls are never folded or shared, since natives may have side effects.
+  NodeId AddCall(std::shared_ptr<const NativeFunction> native,
+                 const ArenaVector<NodeId> &arguments, std::size_t line);
+  NodeId AddUnary(Opcode op, NodeId operand, std::size_t line);
+  NodeId AddBinary(Opcode op, NodeId left, NodeId right, std::size_t line);
+  [[nodiscard]] ValueType GetType(NodeId id) const;
+
+  // Writes code evaluating root to chunk, leaving its value on the stack.
+  void Lower(NodeId root, Chunk *chunk) const;
+
+ private:
+  static constexpr auto kNoOperand = NodeId{0xffffffff};
+
+  struct Node {
+    // A generic opcode, kConstant, kGetInput, kGetGlobal, kGetLocal or
+    // kCallNative.
+    Opcode op;
+    NodeId left;
+    NodeId right;
+    ValueType type;
+    std::size_t line;
+    Value value;  // Only used by constants.
+    // The input, global or local slot read by kGetInput, kGetGlobal or
+    // kGetLocal.
+    std::uint32_t index = 0;
+    // Only used by kCallNative, whose arguments are copied into the arena.
+    const NodeId *arguments = nullptr;
+    std::uint32_t argument_count = 0;
+    std::shared_ptr<const NativeFunction> native{};
+  };
+
+  using Key = std::basic_string<char, std::char_traits<char>,
+                                ArenaAllocator<char>>;
+  struct KeyHash {
+    std::size_t operator()(const Key &key) const noexcept {
+      return std::hash<std::string_view>{}({key.data(), key.size()});
+    }
+  };
+
+  class Lowering;
+
+  NodeId AddNode(Node node);
+  [[nodiscard]] bool IsConstant(NodeId id) const;
+  // Whether id is a constant or a load of an input or variable, which are as
+  // cheap to redo as to reuse.
+  [[nodiscard]] bool IsLeaf(NodeId id) const;
+  [[nodiscard]] bool IsNumberConstant(NodeId id, double number) const;
+
+  OptimizationLevel level_;
+  Arena *arena_;
+  ArenaVector<Node> nodes_;
+  // Maps a node's contents to its id for sharing identical nodes.
+  std::unordered_map<Key, NodeId, KeyHash, std::equal_to<Key>,
+                     ArenaAllocator<std::pair<const Key, NodeId>>>
+      interned_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_IR_H
@@ -0,0 +1,744 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "jit.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#if LOX_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+#include "runtime.h"
+
+namespace lox {
+
+// The runtime called from JIT code. Every helper takes the VM, the current
+// stack top, the instruction's operand and its offset in the chunk (to report
+// errors), and returns the new stack top, or nullptr after a runtime error.
+struct JitRuntime {
+  using Helper = Value *(*)(VirtualMachine *, Value *, std::uint32_t,
+                            std::uint32_t);
+
+  static const std::uint8_t *GetIp(VirtualMachine *vm, std::uint32_t offset) {
+    // RuntimeError expects ip to point past the opcode.
+    return vm->chunk_->GetCodePtr() + offset + 1;
+  }
+
+  static Value *Constant(VirtualMachine *vm, Value *top, std::uint32_t index,
+                         std::uint32_t /* unused */) {
+    *top = vm->chunk_->GetValueAtIndex(index);
+    return top + 1;
+  }
+
+  static Value *Nil(VirtualMachine * /* unused */, Value *top,
+                    std::uint32_t /* unused */, std::uint32_t /* unused */) {
+    *top = std::monostate{};
+    return top + 1;
+  }
+
+  static Value *Bool(VirtualMachine * /* unused */, Value *top,
+                     std::uint32_t value, std::uint32_t /* unused */) {
+    *top = value != 0;
+    return top + 1;
+  }
+
+  static Value *Equal(VirtualMachine * /* unused */, Value *top,
+                      std::uint32_t negate, std::uint32_t /* unused */) {
+    top[-2] = (top[-2] == top[-1]) != (negate != 0);
+    return top - 1;
+  }
+
+  template <typename Operator>
+  static Value *Binary(VirtualMachine *vm, Value *top,
+                       std::uint32_t /* unused */, std::uint32_t offset) {
+    if (const char *error = NumberOp(&top[-2], top[-1], Operator{})) {
+      vm->RuntimeError(GetIp(vm, offset), "%s", error);
+      return nullptr;
+    }
+    return top - 1;
+  }
+
+  static Value *Add(VirtualMachine *vm, Value *top, std::uint32_t /* unused */,
+                    std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->Add(GetIp(vm, offset))) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *AddString(VirtualMachine * /* unused */, Value *top,
+                          std::uint32_t /* unused */,
+                          std::uint32_t /* unused */) {
+    std::get_if<std::string>(&top[-2])->append(
+        *std::get_if<std::string>(&top[-1]));
+    return top - 1;
+  }
+
+  static Value *Not(VirtualMachine * /* unused */, Value *top,
+                    std::uint32_t /* unused */, std::uint32_t /* unused */) {
+    top[-1] = IsFalsey(top[-1]);
+    return top;
+  }
+
+  static Value *Negate(VirtualMachine *vm, Value *top,
+                       std::uint32_t /* unused */, std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->Negate(GetIp(vm, offset))) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *Pick(VirtualMachine * /* unused */, Value *top,
+                     std::uint32_t distance, std::uint32_t /* unused */) {
+    *top = top[-1 - static_cast<long>(distance)];
+    return top + 1;
+  }
+
+  static Value *Slide(VirtualMachine * /* unused */, Value *top,
+                      std::uint32_t count, std::uint32_t /* unused */) {
+    top[-1 - static_cast<long>(count)] = std::move(top[-1]);
+    return top - count;
+  }
+
+  static Value *Input(VirtualMachine *vm, Value *top, std::uint32_t index,
+                      std::uint32_t /* unused */) {
+    *top = (*vm->inputs_)[index];
+    return top + 1;
+  }
+
+  // The operand holds the native's index in its low byte and the argument
+  // count above it.
+  static Value *CallNative(VirtualMachine *vm, Value *top,
+                           std::uint32_t operand, std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->CallNative(GetIp(vm, offset),
+                        static_cast<std::uint8_t>(operand & 0xff),
+                        static_cast<std::uint8_t>(operand >> 8))) {
+      return nullptr;
+    }
+    return vm->stack_top_;
+  }
+
+  static Value *GetGlobal(VirtualMachine *vm, Value *top, std::uint32_t slot,
+                          std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->GetGlobal(GetIp(vm, offset), slot)) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *DefineGlobal(VirtualMachine *vm, Value *top, std::uint32_t slot,
+                             std::uint32_t /* unused */) {
+    vm->stack_top_ = top;
+    vm->DefineGlobal(slot);
+    return vm->stack_top_;
+  }
+
+  static Value *SetGlobal(VirtualMachine *vm, Value *top, std::uint32_t slot,
+                          std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->SetGlobal(GetIp(vm, offset), slot)) return nullptr;
+    return top;
+  }
+
+  static Value *GetLocal(VirtualMachine *vm, Value *top, std::uint32_t slot,
+                         std::uint32_t /* unused */) {
+    *top = vm->frames_[vm->frame_count_ - 1].slots[slot];
+    return top + 1;
+  }
+
+  static Value *SetLocal(VirtualMachine *vm, Value *top, std::uint32_t slot,
+                         std::uint32_t /* unused */) {
+    vm->frames_[vm->frame_count_ - 1].slots[slot] = top[-1];
+    return top;
+  }
+
+  static Value *PopN(VirtualMachine * /* unused */, Value *top,
+                     std::uint32_t count, std::uint32_t /* unused */) {
+    return top - count;
+  }
+
+  static Value *Closure(VirtualMachine *vm, Value *top, std::uint32_t index,
+                        std::uint32_t /* unused */) {
+    vm->stack_top_ = top;
+    vm->MakeClosure(index);
+    return vm->stack_top_;
+  }
+
+  static Value *CloseUpvalues(VirtualMachine *vm, Value *top,
+                              std::uint32_t count,
+                              std::uint32_t /* unused */) {
+    vm->CloseUpvalues(top - count);
+    return top - count;
+  }
+
+  // Runs the callee in the interpreter. The stack may move to make room for
+  // its frame, so the stack top is always taken from the VM afterwards.
+  static Value *Call(VirtualMachine *vm, Value *top, std::uint32_t count,
+                     std::uint32_t offset) {
+    vm->stack_top_ = top;
+    // Past the operand too, which is where a trace shows the call.
+    const std::uint8_t *ip = GetIp(vm, offset) + 1;
+    vm->frames_[vm->frame_count_ - 1].ip = ip;
+    std::size_t frames = vm->frame_count_;
+    if (!vm->CallValue(ip, static_cast<std::uint8_t>(count)) ||
+        !RunCallee(vm, frames)) {
+      return nullptr;
+    }
+    return vm->stack_top_;
+  }
+
+  // Runs the frame a call pushed, if it pushed one.
+  static bool RunCallee(VirtualMachine *vm, std::size_t frames) {
+    return vm->frame_count_ == frames ||
+           vm->RunFrame() == InterpretResult::kOk;
+  }
+
+  static Value *Class(VirtualMachine *vm, Value *top, std::uint32_t index,
+                      std::uint32_t /* unused */) {
+    vm->stack_top_ = top;
+    vm->DefineClass(index);
+    return vm->stack_top_;
+  }
+
+  static Value *Method(VirtualMachine *vm, Value *top, std::uint32_t index,
+                       std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->DefineMethod(GetIp(vm, offset), index)) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *Inherit(VirtualMachine *vm, Value *top,
+                        std::uint32_t /* unused */, std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->Inherit(GetIp(vm, offset))) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *GetProperty(VirtualMachine *vm, Value *top,
+                            std::uint32_t index, std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->GetProperty(GetIp(vm, offset), index)) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *SetProperty(VirtualMachine *vm, Value *top,
+                            std::uint32_t index, std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->SetProperty(GetIp(vm, offset), index)) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *GetSuper(VirtualMachine *vm, Value *top, std::uint32_t index,
+                         std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->GetSuper(GetIp(vm, offset), index)) return nullptr;
+    return vm->stack_top_;
+  }
+
+  // The operand holds the inline cache's index in its low three bytes and
+  // the argument count above them. Runs the callee like Call().
+  static Value *Invoke(VirtualMachine *vm, Value *top, std::uint32_t operand,
+                       std::uint32_t offset) {
+    vm->stack_top_ = top;
+    const std::uint8_t *ip = GetIp(vm, offset) + 4;
+    vm->frames_[vm->frame_count_ - 1].ip = ip;
+    std::size_t frames = vm->frame_count_;
+    if (!vm->Invoke(ip, operand & 0xffffff,
+                    static_cast<std::uint8_t>(operand >> 24)) ||
+        !RunCallee(vm, frames)) {
+      return nullptr;
+    }
+    return vm->stack_top_;
+  }
+
+  static Value *BuildList(VirtualMachine *vm, Value *top, std::uint32_t count,
+                          std::uint32_t /* unused */) {
+    vm->stack_top_ = top;
+    vm->BuildList(static_cast<std::uint8_t>(count));
+    return vm->stack_top_;
+  }
+
+  static Value *BuildMap(VirtualMachine *vm, Value *top, std::uint32_t count,
+                         std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->BuildMap(GetIp(vm, offset), static_cast<std::uint8_t>(count))) {
+      return nullptr;
+    }
+    return vm->stack_top_;
+  }
+
+  static Value *GetIndex(VirtualMachine *vm, Value *top,
+                         std::uint32_t /* unused */, std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->GetIndex(GetIp(vm, offset))) return nullptr;
+    return vm->stack_top_;
+  }
+
+  static Value *SetIndex(VirtualMachine *vm, Value *top,
+                         std::uint32_t /* unused */, std::uint32_t offset) {
+    vm->stack_top_ = top;
+    if (!vm->SetIndex(GetIp(vm, offset))) return nullptr;
+    return vm->stack_top_;
+  }
+
+  // Not a helper: tests the condition kJumpIfFalse branches on.
+  static bool IsTopFalsey(const Value *top) { return IsFalsey(top[-1]); }
+
+  static Value *Pop(VirtualMachine * /* unused */, Value *top,
+                    std::uint32_t /* unused */, std::uint32_t /* unused */) {
+    return top - 1;
+  }
+
+  static Value *Print(VirtualMachine *vm, Value *top,
+                      std::uint32_t /* unused */, std::uint32_t /* unused */) {
+    vm->out_.Print(top[-1]);
+    return top - 1;
+  }
+
+  static Value *Return(VirtualMachine *vm, Value *top,
+                       std::uint32_t /* unused */, std::uint32_t /* unused */) {
+    if (vm->result_ != nullptr) {
+      *vm->result_ = std::move(top[-1]);
+    } else if (vm->chunk_->HasResult()) {
+      vm->out_.Print(top[-1]);
+    }
+    return top - 1;
+  }
+};
+
+namespace {
+
+#if LOX_JIT_SUPPORTED
+
+using Entry = int (*)(VirtualMachine *vm, Value *top);
+
+// Encodes the handful of x86-64 instructions the stubs are made of. The VM is
+// kept in rbx and the stack top in r12, both callee-saved.
+class Assembler {
+ public:
+  void Prologue() {
+    Emit({0x53});                    // push rbx
+    Emit({0x41, 0x54});              // push r12
+    Emit({0x48, 0x83, 0xec, 0x08});  // sub rsp, 8 (realign to 16 bytes)
+    Emit({0x48, 0x89, 0xfb});        // mov rbx, rdi
+    Emit({0x49, 0x89, 0xf4});        // mov r12, rsi
+  }
+
+  void Epilogue(InterpretResult result) {
+    Emit({0xb8});  // mov eax, imm32
+    EmitImm32(static_cast<std::uint32_t>(result));
+    Emit({0x48, 0x83, 0xc4, 0x08});  // add rsp, 8
+    Emit({0x41, 0x5c});              // pop r12
+    Emit({0x5b});                    // pop rbx
+    Emit({0xc3});                    // ret
+  }
+
+  // Calls helper(vm, top, operand, offset) and takes its result as the new
+  // stack top, jumping to the error exit if it is null.
+  void CallHelper(JitRuntime::Helper helper, std::uint32_t operand,
+                  std::uint32_t offset) {
+    Emit({0x48, 0x89, 0xdf});  // mov rdi, rbx
+    Emit({0x4c, 0x89, 0xe6});  // mov rsi, r12
+    Emit({0xba});              // mov edx, imm32
+    EmitImm32(operand);
+    Emit({0xb9});  // mov ecx, imm32
+    EmitImm32(offset);
+    Emit({0x48, 0xb8});  // mov rax, imm64
+    auto address = reinterpret_cast<std::uintptr_t>(helper);
+    for (auto i = 0; i < 8; ++i) {
+      code_.push_back(static_cast<std::uint8_t>(address >> (8 * i)));
+    }
+    Emit({0xff, 0xd0});        // call rax
+    Emit({0x48, 0x85, 0xc0});  // test rax, rax
+    Emit({0x0f, 0x84});        // jz rel32
+    error_jumps_.push_back(code_.size());
+    EmitImm32(0);
+    Emit({0x49, 0x89, 0xc4});  // mov r12, rax
+  }
+
+  // Applies an SSE2 scalar double operation (0x58 add, 0x5c sub, 0x59 mul,
+  // 0x5e div) to the two numbers on top of the stack.
+  void NumberOp(std::uint8_t sse_opcode, std::int32_t slot_size,
+                std::int32_t payload) {
+    std::int32_t a = -2 * slot_size + payload;
+    std::int32_t b = -slot_size + payload;
+    Emit({0xf2, 0x41, 0x0f, 0x10, 0x84, 0x24});  // movsd xmm0, [r12 + a]
+    EmitImm32(static_cast<std::uint32_t>(a));
+    Emit({0xf2, 0x41, 0x0f, sse_opcode, 0x84, 0x24});  // op xmm0, [r12 + b]
+    EmitImm32(static_cast<std::uint32_t>(b));
+    Emit({0xf2, 0x41, 0x0f, 0x11, 0x84, 0x24});  // movsd [r12 + a], xmm0
+    EmitImm32(static_cast<std::uint32_t>(a));
+    Emit({0x49, 0x81, 0xec});  // sub r12, imm32
+    EmitImm32(static_cast<std::uint32_t>(slot_size));
+  }
+
+  // Flips the sign bit of the number on top of the stack.
+  void NegateNumber(std::int32_t slot_size, std::int32_t payload) {
+    std::int32_t a = -slot_size + payload;
+    Emit({0x49, 0x8b, 0x84, 0x24});  // mov rax, [r12 + a]
+    EmitImm32(static_cast<std::uint32_t>(a));
+    Emit({0x48, 0x0f, 0xba, 0xf8, 0x3f});  // btc rax, 63
+    Emit({0x49, 0x89, 0x84, 0x24});        // mov [r12 + a], rax
+    EmitImm32(static_cast<std::uint32_t>(a));
+  }
+
+  // Marks the current position as where the instruction at offset in the
+  // chunk starts, for jumps to it.
+  void Bind(std::size_t offset) {
+    if (labels_.size() <= offset) labels_.resize(offset + 1);
+    labels_[offset] = code_.size();
+  }
+
+  // Jumps to the instruction at target in the chunk.
+  void Jump(std::size_t target) {
+    Emit({0xe9});  // jmp rel32
+    jumps_.push_back({code_.size(), target});
+    EmitImm32(0);
+  }
+
+  // Jumps to target if the value on top of the stack is falsey.
+  void JumpIfFalse(std::size_t target) {
+    Emit({0x4c, 0x89, 0xe7});  // mov rdi, r12
+    Emit({0x48, 0xb8});        // mov rax, imm64
+    auto address = reinterpret_cast<std::uintptr_t>(&JitRuntime::IsTopFalsey);
+    for (auto i = 0; i < 8; ++i) {
+      code_.push_back(static_cast<std::uint8_t>(address >> (8 * i)));
+    }
+    Emit({0xff, 0xd0});  // call rax
+    Emit({0x84, 0xc0});  // test al, al
+    Emit({0x0f, 0x85});  // jnz rel32
+    jumps_.push_back({code_.size(), target});
+    EmitImm32(0);
+  }
+
+  // Points every jump at the code bound to its target.
+  void BindJumps() {
+    for (auto [jump, target] : jumps_) {
+      auto rel = static_cast<std::uint32_t>(labels_[target] - (jump + 4));
+      std::memcpy(&code_[jump], &rel, sizeof(rel));
+    }
+    jumps_.clear();
+  }
+
+  // Points every pending error jump at the current position.
+  void BindErrorJumps() {
+    for (std::size_t jump : error_jumps_) {
+      auto rel = static_cast<std::uint32_t>(code_.size() - (jump + 4));
+      std::memcpy(&code_[jump], &rel, sizeof(rel));
+    }
+    error_jumps_.clear();
+  }
+
+  [[nodiscard]] const std::vector<std::uint8_t> &get_code() const {
+    return code_;
+  }
+
+ private:
+  void Emit(std::initializer_list<std::uint8_t> bytes) {
+    code_.insert(code_.end(), bytes);
+  }
+
+  void EmitImm32(std::uint32_t value) {
+    for (auto i = 0; i < 4; ++i) {
+      code_.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+  }
+
+  std::vector<std::uint8_t> code_;
+  std::vector<std::size_t> error_jumps_;
+  // Where the code for each instruction of the chunk starts, and the jumps
+  // to patch once all of it is known, as (position, target offset).
+  std::vector<std::size_t> labels_;
+  std::vector<std::pair<std::size_t, std::size_t>> jumps_;
+};
+
+#endif  // LOX_JIT_SUPPORTED
+
+}  // namespace
+
+JitCode::JitCode(void *code, std::size_t size) noexcept
+    : code_(code), size_(size) {}
+
+JitCode::~JitCode() noexcept {
+#if LOX_JIT_SUPPORTED
+  munmap(code_, size_);
+#endif
+}
+
+std::unique_ptr<JitCode> JitCode::Compile(const Chunk &chunk) {
+#if LOX_JIT_SUPPORTED
+  // Inline arithmetic relies on the verifier's proof that the operands of
+  // the specialised instructions are numbers.
+  if (!chunk.IsVerified()) return nullptr;
+
+  // Where a double lives inside a stack slot.
+  auto probe = Value{0.0};
+  auto payload = static_cast<std::int32_t>(
+      reinterpret_cast<const char *>(std::get_if<double>(&probe)) -
+      reinterpret_cast<const char *>(&probe));
+  auto slot_size = static_cast<std::int32_t>(sizeof(Value));
+
+  auto assembler = Assembler{};
+  assembler.Prologue();
+
+  const std::uint8_t *code = chunk.GetCodePtr();
+  auto offset = std::size_t{0};
+  while (offset < chunk.GetCodeSize()) {
+    auto info = GetInstructionInfo(code + offset, chunk.GetCodeSize() - offset);
+    if (!info) return nullptr;
+
+    assembler.Bind(offset);
+    auto at = static_cast<std::uint32_t>(offset);
+    auto call = [&assembler, at](JitRuntime::Helper helper,
+                                 std::uint32_t operand = 0) {
+      assembler.CallHelper(helper, operand, at);
+    };
+
+    switch (static_cast<Opcode>(code[offset])) {
+      case Opcode::kConstant:
+        call(&JitRuntime::Constant, code[offset + 1]);
+        break;
+      case Opcode::kConstantLong:
+        call(&JitRuntime::Constant,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kNil:
+        call(&JitRuntime::Nil);
+        break;
+      case Opcode::kTrue:
+        call(&JitRuntime::Bool, 1);
+        break;
+      case Opcode::kFalse:
+        call(&JitRuntime::Bool, 0);
+        break;
+      case Opcode::kEqual:
+        call(&JitRuntime::Equal, 0);
+        break;
+      case Opcode::kNotEqual:
+        call(&JitRuntime::Equal, 1);
+        break;
+      case Opcode::kGreater:
+      case Opcode::kGreaterNumber:
+        call(&JitRuntime::Binary<std::greater<>>);
+        break;
+      case Opcode::kGreaterEqual:
+      case Opcode::kGreaterEqualNumber:
+        call(&JitRuntime::Binary<std::greater_equal<>>);
+        break;
+      case Opcode::kLess:
+      case Opcode::kLessNumber:
+        call(&JitRuntime::Binary<std::less<>>);
+        break;
+      case Opcode::kLessEqual:
+      case Opcode::kLessEqualNumber:
+        call(&JitRuntime::Binary<std::less_equal<>>);
+        break;
+      case Opcode::kAdd:
+        call(&JitRuntime::Add);
+        break;
+      case Opcode::kSubtract:
+        call(&JitRuntime::Binary<std::minus<>>);
+        break;
+      case Opcode::kMultiply:
+        call(&JitRuntime::Binary<std::multiplies<>>);
+        break;
+      case Opcode::kDivide:
+        call(&JitRuntime::Binary<std::divides<>>);
+        break;
+      case Opcode::kNot:
+        call(&JitRuntime::Not);
+        break;
+      case Opcode::kNegate:
+        call(&JitRuntime::Negate);
+        break;
+      case Opcode::kReturn:
+        call(&JitRuntime::Return);
+        assembler.Jump(chunk.GetCodeSize());
+        break;
+      case Opcode::kAddNumber:
+        assembler.NumberOp(0x58, slot_size, payload);
+        break;
+      case Opcode::kAddString:
+        call(&JitRuntime::AddString);
+        break;
+      case Opcode::kSubtractNumber:
+        assembler.NumberOp(0x5c, slot_size, payload);
+        break;
+      case Opcode::kMultiplyNumber:
+        assembler.NumberOp(0x59, slot_size, payload);
+        break;
+      case Opcode::kDivideNumber:
+        assembler.NumberOp(0x5e, slot_size, payload);
+        break;
+      case Opcode::kNegateNumber:
+        assembler.NegateNumber(slot_size, payload);
+        break;
+      case Opcode::kPick:
+        call(&JitRuntime::Pick, code[offset + 1]);
+        break;
+      case Opcode::kSlide:
+        call(&JitRuntime::Slide, code[offset + 1]);
+        break;
+      case Opcode::kGetInput:
+        call(&JitRuntime::Input, code[offset + 1]);
+        break;
+      case Opcode::kCallNative:
+        call(&JitRuntime::CallNative,
+             static_cast<std::uint32_t>(code[offset + 1] |
+                                        (code[offset + 2] << 8)));
+        break;
+      case Opcode::kDefineGlobal:
+        call(&JitRuntime::DefineGlobal, code[offset + 1]);
+        break;
+      case Opcode::kDefineGlobalLong:
+        call(&JitRuntime::DefineGlobal,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kGetGlobal:
+        call(&JitRuntime::GetGlobal, code[offset + 1]);
+        break;
+      case Opcode::kGetGlobalLong:
+        call(&JitRuntime::GetGlobal,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kSetGlobal:
+        call(&JitRuntime::SetGlobal, code[offset + 1]);
+        break;
+      case Opcode::kSetGlobalLong:
+        call(&JitRuntime::SetGlobal,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kPop:
+        call(&JitRuntime::Pop);
+        break;
+      case Opcode::kGetLocal:
+        call(&JitRuntime::GetLocal, code[offset + 1]);
+        break;
+      case Opcode::kGetLocalLong:
+        call(&JitRuntime::GetLocal,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kSetLocal:
+        call(&JitRuntime::SetLocal, code[offset + 1]);
+        break;
+      case Opcode::kSetLocalLong:
+        call(&JitRuntime::SetLocal,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kPopN:
+        call(&JitRuntime::PopN, code[offset + 1]);
+        break;
+      case Opcode::kJump:
+        assembler.Jump(offset + 3 + ReadJumpOffset(code + offset + 1));
+        break;
+      case Opcode::kJumpIfFalse:
+        assembler.JumpIfFalse(offset + 3 + ReadJumpOffset(code + offset + 1));
+        break;
+      case Opcode::kLoop:
+        assembler.Jump(offset + 3 - ReadJumpOffset(code + offset + 1));
+        break;
+      case Opcode::kPrint:
+        call(&JitRuntime::Print);
+        break;
+      case Opcode::kCall:
+      // The script's own frame is never replaced, so a tail call is just a
+      // call here.
+      case Opcode::kTailCall:
+        call(&JitRuntime::Call, code[offset + 1]);
+        break;
+      case Opcode::kClosure:
+        call(&JitRuntime::Closure, code[offset + 1]);
+        break;
+      case Opcode::kClosureLong:
+        call(&JitRuntime::Closure,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kCloseUpvalues:
+        call(&JitRuntime::CloseUpvalues, code[offset + 1]);
+        break;
+      case Opcode::kClass:
+        call(&JitRuntime::Class,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kMethod:
+        call(&JitRuntime::Method,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kInherit:
+        call(&JitRuntime::Inherit);
+        break;
+      case Opcode::kGetProperty:
+        call(&JitRuntime::GetProperty,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kSetProperty:
+        call(&JitRuntime::SetProperty,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kGetSuper:
+        call(&JitRuntime::GetSuper,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1)));
+        break;
+      case Opcode::kInvoke:
+        call(&JitRuntime::Invoke,
+             static_cast<std::uint32_t>(ReadLongOperand(code + offset + 1) |
+                                        std::size_t{code[offset + 4]} << 24));
+        break;
+      case Opcode::kBuildList:
+        call(&JitRuntime::BuildList, code[offset + 1]);
+        break;
+      case Opcode::kGetIndex:
+        call(&JitRuntime::GetIndex);
+        break;
+      case Opcode::kSetIndex:
+        call(&JitRuntime::SetIndex);
+        break;
+      case Opcode::kBuildMap:
+        call(&JitRuntime::BuildMap, code[offset + 1]);
+        break;
+      default:
+        return nullptr;
+    }
+
+    offset += info->length;
+  }
+
+  // Returns jump to just past the end of the chunk.
+  assembler.Bind(chunk.GetCodeSize());
+  assembler.BindJumps();
+  assembler.Epilogue(InterpretResult::kOk);
+  assembler.BindErrorJumps();
+  assembler.Epilogue(InterpretResult::kRuntimeError);
+
+  // Write the code, then make it executable but no longer writable.
+  const std::vector<std::uint8_t> &bytes = assembler.get_code();
+  std::size_t size = bytes.size();
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return nullptr;
+  std::memcpy(memory, bytes.data(), size);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return nullptr;
+  }
+  return std::unique_ptr<JitCode>(new JitCode{memory, size});
+#else
+  static_cast<void>(chunk);
+  return nullptr;
+#endif
+}
+
+InterpretResult JitCode::Run(VirtualMachine *vm) const {
+#if LOX_JIT_SUPPORTED
+  auto entry = reinterpret_cast<Entry>(code_);
+  auto result = static_cast<InterpretResult>(entry(vm, vm->stack_.data()));
+  vm->stack_top_ = vm->stack_.data();
+  return result;
+#else
+  static_cast<void>(vm);
+  return InterpretResult::kRuntimeError;
+#endif
+}
+
+}  // namespace lox
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_JIT_H
+#define LOX_SRC_JIT_H
+
+#include <cstddef>
+#include <memory>
+
+#include "chunk.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define LOX_JIT_SUPPORTED 1
+#else
+#define LOX_JIT_SUPPORTED 0
+#endif
+
+namespace lox {
+
+// Native x86-64 code for a whole chunk, produced by a template JIT: every
+// instruction is translated into a fixed machine-code stub, so nothing is
+// dispatched at runtime. Arithmetic on proven numbers is done inline on the
+// VM stack; everything else calls back into the runtime.
+class JitCode {
+ public:
+  JitCode(const JitCode &) = delete;
+  JitCode(JitCode &&) = delete;
+  void operator=(const JitCode &) = delete;
+  void operator=(JitCode &&) = delete;
+  ~JitCode() noexcept;
+
+  // Returns nullptr if the chunk cannot be compiled, because the platform is
+  // not supported or the chunk is not verified, in which case it has to be
+  // interpreted instead.
+  static std::unique_ptr<JitCode> Compile(const Chunk &chunk);
+
+  // Runs the code on vm, whose current chunk must be the compiled one.
+  InterpretResult Run(VirtualMachine *vm) const;
+
+ private:
+  JitCode(void *code, std::size_t size) noexcept;
+
+  void *code_;
+  std::size_t size_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_JIT_H
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_LIST_H
+#define LOX_SRC_LIST_H
+
+#include <cstddef>
+#include <optional>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+#include "value.h"
+
+namespace lox {
+
+// A growable list of values, written [a, b, c] and indexed from 0. A list
+// of nothing but numbers, which is what scripts crunching data build, keeps
+// them unboxed in one contiguous array of doubles, which the bulk methods
+// run over with SIMD instructions. Storing anything else in it boxes the
+// list, which from then on holds Values, until a bulk method finds it holds
+// only numbers again and unboxes it.
+class List : public Object {
+ public:
+  List();
+  explicit List(std::vector<double> numbers);
+  explicit List(std::vector<Value> values);
+
+  [[nodiscard]] std::size_t get_size() const {
+    return boxed_ ? values_.size() : numbers_.size();
+  }
+  [[nodiscard]] bool is_boxed() const { return boxed_; }
+  // The elements of an unboxed list.
+  [[nodiscard]] const std::vector<double> &get_numbers() const {
+    return numbers_;
+  }
+  [[nodiscard]] std::vector<double> &get_numbers() { return numbers_; }
+  [[nodiscard]] Value Get(std::size_t index) const;
+  void Set(std::size_t index, Value value);
+  void Push(Value value);
+  // Removes and returns the last element, which must exist.
+  Value Pop();
+  // Unboxes the list if all it holds are numbers, and returns whether it
+  // is unboxed.
+  bool Unbox();
+  // Returns the element index refers to, if index is a whole number within
+  // the list.
+  [[nodiscard]] std::optional<std::size_t> GetIndex(const Value &index) const;
+
+  void Print(std::ostream &os) const override;
+
+ private:
+  // Moves the numbers into values_.
+  void Box();
+
+  std::vector<double> numbers_;
+  std::vector<Value> values_;
+  bool boxed_ = false;
+};
+
+// A method built into every list, called as list.name(arguments). It runs
+// natively on the list and the arity arguments at args, storing its result
+// in *result, and returns the message of the runtime error it raised, or
+// nullptr.
+struct ListMethod {
+  std::string_view name;
+  std::size_t arity;
+  const char *(*function)(List *list, const Value *args, Value *result);
+};
+
+// Returns the method called name, or nullptr if lists have none.
+const ListMethod *FindListMethod(std::string_view name);
+
+}  // namespace lox
+
+#endif  // LOX_SRC_LIST_H
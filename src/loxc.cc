@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include <sysexits.h>
+
+#if defined(__APPLE__)
+#include <mach-o/dyld.h>
+#endif
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#include "compiler.h"
+#include "transpiler.h"
+#include "verifier.h"
+
+namespace lox {
+
+constexpr auto kUsage =
+    "Usage: loxc [-O0|-O1|-O2] [-S] [-o output] path\n"
+    "  -S  only write the generated C++ source (output.cc)\n"
+    "Scripts may declare functions, but not closures or classes.\n";
+
+std::string ReadFile(std::string_view path) {
+  auto stream = std::ifstream{std::string{path}};
+  stream.exceptions(std::ios::badbit);
+  auto buffer = std::ostringstream{};
+  buffer << stream.rdbuf();
+  return buffer.str();
+}
+
+std::string Quote(std::string_view argument) {
+  auto quoted = std::string{"'"};
+  for (char c : argument) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+// The directory loxc runs from, where the runtime library and its headers
+// are found relative to it, or nullopt if it cannot be told.
+std::optional<std::filesystem::path> GetExecutableDirectory(
+    const char *argv0) {
+  auto error = std::error_code{};
+#if defined(__APPLE__)
+  auto size = std::uint32_t{0};
+  _NSGetExecutablePath(nullptr, &size);
+  auto path = std::string(size, '\0');
+  auto executable = _NSGetExecutablePath(path.data(), &size) == 0
+                        ? std::filesystem::canonical(path.c_str(), error)
+                        : std::filesystem::path{};
+#elif defined(__linux__)
+  auto executable = std::filesystem::canonical("/proc/self/exe", error);
+#else
+  auto executable = std::filesystem::path{};
+#endif
+  // Elsewhere, argv[0] names the executable when it was run by its path.
+  if (executable.empty() || error) {
+    executable = std::filesystem::canonical(argv0, error);
+  }
+  if (error) return std::nullopt;
+  return executable.parent_path();
+}
+
+// Compiles the generated source against the runtime library, found in
+// runtime_root, with the C++ compiler lox itself was built with, or $CXX if
+// set.
+int BuildExecutable(const std::string &source, const std::string &output,
+                    const std::filesystem::path &runtime_root) {
+  const char *cxx = std::getenv("CXX");
+  std::filesystem::path include_dir =
+      (runtime_root / LOX_RUNTIME_INCLUDE_DIR).lexically_normal();
+  std::filesystem::path library =
+      (runtime_root / LOX_RUNTIME_LIBRARY).lexically_normal();
+  auto command = Quote(cxx != nullptr ? cxx : LOX_CXX_COMPILER) +
+                 " -std=c++17 -O2 -I" + Quote(include_dir.string()) + " " +
+                 Quote(source) + " " + Quote(library.string()) + " -o " +
+                 Quote(output);
+  if (std::system(command.c_str()) != 0) {
+    std::cerr << "loxc: C++ compilation failed: " << command << '\n';
+    return EX_SOFTWARE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int CompileFile(std::string_view path, std::string output,
+                OptimizationLevel level, bool source_only,
+                const char *argv0) {
+  std::string source = ReadFile(path);
+  auto compiler = Compiler{source, level};
+  auto chunk = Chunk{};
+  if (!compiler.Compile(&chunk)) return EX_DATAERR;
+
+  auto verifier = Verifier{};
+  if (!verifier.Verify(&chunk)) {
+    std::cerr << "loxc: " << verifier.get_error() << '\n';
+    return EX_SOFTWARE;
+  }
+
+  std::string cpp_path = output + ".cc";
+  auto cpp = std::ofstream{cpp_path};
+  auto transpiler = Transpiler{};
+  if (!transpiler.Transpile(chunk, path, cpp)) {
+    std::cerr << "loxc: " << transpiler.get_error() << '\n';
+    return EX_SOFTWARE;
+  }
+  cpp.close();
+  if (!cpp) {
+    std::cerr << "loxc: Could not write " << cpp_path << '\n';
+    return EX_CANTCREAT;
+  }
+
+  if (source_only) return EXIT_SUCCESS;
+  std::optional<std::filesystem::path> runtime_root =
+      GetExecutableDirectory(argv0);
+  if (!runtime_root) {
+    std::cerr << "loxc: Could not find the runtime library.\n";
+    return EX_SOFTWARE;
+  }
+  return BuildExecutable(cpp_path, output, *runtime_root);
+}
+
+}  // namespace lox
+
+int main(int argc, const char *argv[]) {
+  auto level = lox::OptimizationLevel::kO1;
+  auto source_only = false;
+  auto output = std::optional<std::string>{};
+  auto path = std::optional<std::string_view>{};
+
+  for (auto i = 1; i < argc; ++i) {
+    auto arg = std::string_view{argv[i]};
+    if (arg == "-O0") {
+      level = lox::OptimizationLevel::kO0;
+    } else if (arg == "-O1") {
+      level = lox::OptimizationLevel::kO1;
+    } else if (arg == "-O2") {
+      level = lox::OptimizationLevel::kO2;
+    } else if (arg == "-S") {
+      source_only = true;
+    } else if (arg == "-o" && i + 1 < argc) {
+      output = argv[++i];
+    } else if (!path && arg.front() != '-') {
+      path = arg;
+    } else {
+      std::cerr << lox::kUsage;
+      return EX_USAGE;
+    }
+  }
+
+  if (!path) {
+    std::cerr << lox::kUsage;
+    return EX_USAGE;
+  }
+
+  if (!output) {
+    // Default to the input's name without its extension.
+    auto name = std::string{*path};
+    auto slash = name.find_last_of('/');
+    auto dot = name.find_last_of('.');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+      name.erase(dot);
+    } else {
+      name += ".out";
+    }
+    output = name;
+  }
+
+  return lox::CompileFile(*path, *output, level, source_only, argv[0]);
+}
@@ -2,10 +2,21 @@
 
 #include <sysexits.h>
 
+#include <charconv>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "batch.h"
+#include "scheduler.h"
+#include "server.h"
+#include "snapshot.h"
 #include "vm.h"
 
 namespace lox {
@@ -26,8 +37,30 @@ std::string ReadFile(std::string_view path) {
   return result;
 }
 
-void Repl() {
+int ExitCode(InterpretResult result) {
+  switch (result) {
+    case InterpretResult::kOk:
+      return EXIT_SUCCESS;
+    case InterpretResult::kCompileError:
+      return EX_DATAERR;
+    case InterpretResult::kRuntimeError:
+    case InterpretResult::kSuspended:
+      return EX_SOFTWARE;
+  }
+  return EX_SOFTWARE;
+}
+
+// Starts a machine from the snapshot at image, if there is one.
+bool StartFrom(const std::optional<std::string> &image, VirtualMachine *vm) {
+  return !image || Snapshot::Load(*image, vm);
+}
+
+void Repl(OptimizationLevel level, bool jit,
+          const std::optional<std::string> &image) {
   auto vm = VirtualMachine{};
+  vm.set_optimization_level(level);
+  vm.set_jit_enabled(jit);
+  if (!StartFrom(image, &vm)) return;
   auto line = std::string{};
 
   while (std::cout << "> " && std::getline(std::cin, line)) {
@@ -36,32 +69,183 @@ void Repl() {
   }
 }
 
-int RunFile(std::string_view path) {
+int RunFile(std::string_view path, OptimizationLevel level, bool jit,
+            const std::optional<std::string> &image) {
   auto vm = VirtualMachine{};
+  vm.set_optimization_level(level);
+  vm.set_jit_enabled(jit);
+  if (!StartFrom(image, &vm)) return EX_NOINPUT;
   std::string source = ReadFile(path);
-  InterpretResult result = vm.Interpret(source);
+  return ExitCode(vm.Interpret(source));
+}
 
-  switch (result) {
-    case InterpretResult::kOk:
-      return EXIT_SUCCESS;
-    case InterpretResult::kCompileError:
-      return EX_DATAERR;
-    case InterpretResult::kRuntimeError:
-      return EX_SOFTWARE;
+// Runs the prelude at path and saves the state it leaves as a snapshot at
+// image, for later runs to start from.
+int SaveSnapshot(std::string_view path, const std::string &image,
+                 OptimizationLevel level) {
+  auto vm = VirtualMachine{};
+  vm.set_optimization_level(level);
+  InterpretResult result = vm.Interpret(ReadFile(path));
+  if (result != InterpretResult::kOk) return ExitCode(result);
+  return Snapshot::Save(vm, image) ? EXIT_SUCCESS : EX_CANTCREAT;
+}
+
+// Compiles every script once, runs them all on jobs threads and prints their
+// output in the order given. Exits with the status of the first failure.
+int RunBatchFiles(const std::vector<std::string_view> &paths,
+                  std::size_t jobs, OptimizationLevel level, bool jit) {
+  auto compiled = std::map<std::string_view, std::shared_ptr<const Chunk>>{};
+  auto chunks = std::vector<std::shared_ptr<const Chunk>>{};
+  for (auto path : paths) {
+    auto [it, inserted] = compiled.try_emplace(path);
+    if (inserted) it->second = CompileShared(ReadFile(path), level);
+    chunks.push_back(it->second);
   }
+
+  auto status = int{EXIT_SUCCESS};
+  for (const BatchResult &result : RunBatch(chunks, jobs, jit)) {
+    std::cout << result.output;
+    std::cerr << result.errors;
+    if (status == EXIT_SUCCESS) status = ExitCode(result.result);
+  }
+  return status;
+}
+
+// Compiles every script and runs them all on this thread as fibers taking
+// turns, failing any that uses more than fuel. Prints their output in the
+// order given and exits with the status of the first failure.
+int RunFiberFiles(const std::vector<std::string_view> &paths,
+                  std::size_t fuel, OptimizationLevel level) {
+  auto scheduler = Scheduler{};
+  for (auto path : paths) {
+    scheduler.Spawn(CompileShared(ReadFile(path), level), fuel);
+  }
+
+  auto status = int{EXIT_SUCCESS};
+  for (const BatchResult &result : scheduler.Run()) {
+    std::cout << result.output;
+    std::cerr << result.errors;
+    if (status == EXIT_SUCCESS) status = ExitCode(result.result);
+  }
+  return status;
+}
+
+// Runs scripts for clients of a socket at path until it fails, with jobs
+// workers, or one for each hardware thread.
+int Serve(const std::string &path, std::optional<std::size_t> jobs) {
+  auto server = Server{jobs.value_or(std::thread::hardware_concurrency())};
+  if (!server.Listen(path)) return EX_UNAVAILABLE;
+  server.Serve();
+  return EX_OSERR;
+}
+
+// Has the server listening on socket run the script at path, or with none,
+// the one on standard input, and prints its output as though it ran here.
+int RunFileOnServer(const std::string &socket,
+                    const std::vector<std::string_view> &paths,
+                    OptimizationLevel level, bool jit) {
+  auto request = ServerRequest{};
+  if (paths.empty()) {
+    request.script.assign(std::istreambuf_iterator<char>{std::cin}, {});
+  } else {
+    // The server need not be running where the client is.
+    request.script = std::filesystem::absolute(paths.front()).string();
+    request.is_path = true;
+  }
+  request.level = level;
+  request.jit = jit;
+  std::optional<BatchResult> result = RunOnServer(socket, request);
+  if (!result) {
+    std::cerr << "lox: No server answered on '" << socket << "'.\n";
+    return EX_UNAVAILABLE;
+  }
+  std::cout << result->output;
+  std::cerr << result->errors;
+  return ExitCode(result->result);
 }
 
 }  // namespace lox
 
 int main(int argc, const char *argv[]) {
-  if (argc == 1) {
-    lox::Repl();
-  } else if (argc == 2) {
-    return lox::RunFile(argv[1]);
-  } else {
-    std::cerr << "Usage: lox [path]\n";
+  constexpr auto usage =
+      "Usage: lox [-O0|-O1|-O2] [--jit] [path]\n"
+      "       lox [-O0|-O1|-O2] [--jit] --jobs N path...\n"
+      "       lox [-O0|-O1|-O2] --fuel N path...\n"
+      "       lox [-O0|-O1|-O2] --snapshot image prelude\n"
+      "       lox [-O0|-O1|-O2] [--jit] --from-snapshot image [path]\n"
+      "       lox [--jobs N] --serve socket\n"
+      "       lox [-O0|-O1|-O2] [--jit] --connect socket [path]\n";
+  auto level = lox::OptimizationLevel::kO0;
+  auto jit = false;
+  auto jobs = std::optional<std::size_t>{};
+  auto fuel = std::optional<std::size_t>{};
+  auto snapshot = std::optional<std::string>{};
+  auto from_snapshot = std::optional<std::string>{};
+  auto serve = std::optional<std::string>{};
+  auto connect = std::optional<std::string>{};
+  auto paths = std::vector<std::string_view>{};
+
+  for (auto i = 1; i < argc; ++i) {
+    auto arg = std::string_view{argv[i]};
+    if (arg == "-O0") {
+      level = lox::OptimizationLevel::kO0;
+    } else if (arg == "-O1") {
+      level = lox::OptimizationLevel::kO1;
+    } else if (arg == "-O2") {
+      level = lox::OptimizationLevel::kO2;
+    } else if (arg == "--jit") {
+      jit = true;
+    } else if ((arg == "--jobs" || arg == "--fuel") && i + 1 < argc) {
+      auto count = std::string_view{argv[++i]};
+      auto value = std::size_t{0};
+      auto [end, error] =
+          std::from_chars(count.data(), count.data() + count.size(), value);
+      if (error != std::errc{} || end != count.data() + count.size() ||
+          value == 0) {
+        std::cerr << usage;
+        return EX_USAGE;
+      }
+      (arg == "--jobs" ? jobs : fuel) = value;
+    } else if (arg == "--snapshot" && i + 1 < argc) {
+      snapshot = argv[++i];
+    } else if (arg == "--from-snapshot" && i + 1 < argc) {
+      from_snapshot = argv[++i];
+    } else if (arg == "--serve" && i + 1 < argc) {
+      serve = argv[++i];
+    } else if (arg == "--connect" && i + 1 < argc) {
+      connect = argv[++i];
+    } else if (arg.front() != '-') {
+      paths.push_back(arg);
+    } else {
+      std::cerr << usage;
+      return EX_USAGE;
+    }
+  }
+
+  if ((jobs && fuel) || (snapshot && (jobs || fuel || from_snapshot ||
+                                       paths.size() != 1)) ||
+      (from_snapshot && (jobs || fuel)) ||
+      (serve && (fuel || snapshot || from_snapshot || connect ||
+                 !paths.empty())) ||
+      (connect && (jobs || fuel || snapshot || from_snapshot ||
+                   paths.size() > 1))) {
+    std::cerr << usage;
     return EX_USAGE;
   }
+  if (serve) return lox::Serve(*serve, jobs);
+  if (connect) return lox::RunFileOnServer(*connect, paths, level, jit);
+  if (snapshot) return lox::SaveSnapshot(paths.front(), *snapshot, level);
+  if (jobs) return lox::RunBatchFiles(paths, *jobs, level, jit);
+  if (fuel) return lox::RunFiberFiles(paths, *fuel, level);
+
+  if (paths.size() > 1) {
+    std::cerr << usage;
+    return EX_USAGE;
+  }
+  if (paths.size() == 1) {
+    return lox::RunFile(paths.front(), level, jit, from_snapshot);
+  }
 
+  lox::Repl(level, jit, from_snapshot);
   return EXIT_SUCCESS;
 }
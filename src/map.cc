@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "map.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "list.h"
+
+// Like the list kernels, probing needs nothing beyond baseline x86-64.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define LOX_MAP_SIMD 1
+#else
+#define LOX_MAP_SIMD 0
+#endif
+
+namespace {
+
+using lox::Map;
+using lox::Value;
+
+// Control bytes: a full slot holds the low seven bits of its key's hash, so
+// only free slots have the high bit set.
+constexpr auto kEmpty = std::uint8_t{0x80};
+constexpr auto kDeleted = std::uint8_t{0xfe};
+
+// The finalizer of MurmurHash3, which spreads every bit of h over the rest,
+// since the table indexes by the high bits and the control bytes hold the
+// low ones.
+std::uint64_t Mix(std::uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Strings hash by their contents and numbers by their bits.
+std::uint64_t HashKey(const Value &key) {
+  if (const auto *str = std::get_if<std::string>(&key)) {
+    return Mix(std::hash<std::string_view>{}(*str));
+  }
+  double number = *std::get_if<double>(&key);
+  // -0 and 0 are the same key.
+  if (number == 0) number = 0;
+  auto bits = std::uint64_t{0};
+  std::memcpy(&bits, &number, sizeof(bits));
+  return Mix(bits);
+}
+
+// A bit for each of the group of control bytes at control that equals
+// byte.
+std::uint32_t Match(const std::uint8_t *control, std::uint8_t byte) {
+#if LOX_MAP_SIMD
+  __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(control));
+  __m128i bytes = _mm_set1_epi8(static_cast<char>(byte));
+  return static_cast<std::uint32_t>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(group, bytes)));
+#else
+  auto bits = std::uint32_t{0};
+  for (auto i = std::size_t{0}; i < Map::kGroupSize; ++i) {
+    if (control[i] == byte) bits |= std::uint32_t{1} << i;
+  }
+  return bits;
+#endif
+}
+
+// A bit for each of the group's slots that is empty or deleted.
+std::uint32_t MatchFree(const std::uint8_t *control) {
+#if LOX_MAP_SIMD
+  __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(control));
+  return static_cast<std::uint32_t>(_mm_movemask_epi8(group));
+#else
+  auto bits = std::uint32_t{0};
+  for (auto i = std::size_t{0}; i < Map::kGroupSize; ++i) {
+    if ((control[i] & 0x80) != 0) bits |= std::uint32_t{1} << i;
+  }
+  return bits;
+#endif
+}
+
+std::size_t FirstBit(std::uint32_t bits) {
+  return static_cast<std::size_t>(__builtin_ctz(bits));
+}
+
+// Walks the groups a hash probes, in an order that visits every group once
+// the number of groups is a power of two.
+class ProbeSequence {
+ public:
+  ProbeSequence(std::uint64_t hash, std::size_t capacity)
+      : mask_(capacity / Map::kGroupSize - 1),
+        group_(static_cast<std::size_t>(hash >> 7) & mask_) {}
+
+  [[nodiscard]] std::size_t get_offset() const {
+    return group_ * Map::kGroupSize;
+  }
+  void Next() {
+    ++step_;
+    group_ = (group_ + step_) & mask_;
+  }
+
+ private:
+  std::size_t mask_;
+  std::size_t group_;
+  std::size_t step_ = 0;
+};
+
+const char *Length(Map *map, const Value * /* unused */, Value *result) {
+  *result = static_cast<double>(map->get_size());
+  return nullptr;
+}
+
+const char *Has(Map *map, const Value *args, Value *result) {
+  if (const char *error = Map::CheckKey(args[0])) return error;
+  *result = map->Find(args[0]) != nullptr;
+  return nullptr;
+}
+
+const char *Remove(Map *map, const Value *args, Value *result) {
+  if (const char *error = Map::CheckKey(args[0])) return error;
+  *result = map->Remove(args[0]);
+  return nullptr;
+}
+
+// Returns a list of the keys, or with kValues the values, in insertion
+// order.
+template <bool kValues>
+const char *Elements(Map *map, const Value * /* unused */, Value *result) {
+  auto elements = std::vector<Value>{};
+  elements.reserve(map->get_size());
+  for (const Map::Entry &entry : map->get_entries()) {
+    if (std::holds_alternative<std::monostate>(entry.key)) continue;
+    elements.push_back(kValues ? entry.value : entry.key);
+  }
+  *result = std::shared_ptr<lox::Object>{
+      std::make_shared<lox::List>(std::move(elements))};
+  return nullptr;
+}
+
+constexpr lox::MapMethod kMapMethods[] = {
+    {"length", 0, &Length},        {"has", 1, &Has},
+    {"remove", 1, &Remove},        {"keys", 0, &Elements<false>},
+    {"values", 0, &Elements<true>},
+};
+
+}  // namespace
+
+namespace lox {
+
+Map::Map() : Object(ObjectType::kMap) {}
+
+const char *Map::CheckKey(const Value &key) {
+  if (std::holds_alternative<std::string>(key)) return nullptr;
+  if (const auto *number = std::get_if<double>(&key)) {
+    // NaN equals nothing, itself included, so it could never be found.
+    return std::isnan(*number) ? "Map key can't be NaN." : nullptr;
+  }
+  return "Map keys must be strings or numbers.";
+}
+
+const Value *Map::Find(const Value &key) const {
+  std::size_t slot = FindSlot(key, HashKey(key));
+  return slot == capacity_ ? nullptr : &entries_[slots_[slot]].value;
+}
+
+void Map::Set(const Value &key, Value value) {
+  std::uint64_t hash = HashKey(key);
+  std::size_t slot = FindSlot(key, hash);
+  if (slot != capacity_) {
+    entries_[slots_[slot]].value = std::move(value);
+    return;
+  }
+  // At most 7/8 of the slots are used, so that probing always ends in an
+  // empty slot, and soon.
+  if ((used_ + 1) * 8 > capacity_ * 7) Rehash();
+  entries_.push_back(Entry{key, std::move(value), hash});
+  ++size_;
+  Place(static_cast<std::uint32_t>(entries_.size() - 1));
+}
+
+bool Map::Remove(const Value &key) {
+  std::size_t slot = FindSlot(key, HashKey(key));
+  if (slot == capacity_) return false;
+  // The slot stays in use, so that probes for keys placed after it go on
+  // past it.
+  Entry &entry = entries_[slots_[slot]];
+  entry.key = std::monostate{};
+  entry.value = std::monostate{};
+  control_[slot] = kDeleted;
+  --size_;
+  // Iterating skips removed entries, which are dropped before they are
+  // most of them.
+  if (entries_.size() > 2 * size_ + kGroupSize) Rehash();
+  return true;
+}
+
+std::size_t Map::FindSlot(const Value &key, std::uint64_t hash) const {
+  if (capacity_ == 0) return capacity_;
+  auto h2 = static_cast<std::uint8_t>(hash & 0x7f);
+  for (auto probe = ProbeSequence{hash, capacity_};; probe.Next()) {
+    const std::uint8_t *control = control_.data() + probe.get_offset();
+    for (std::uint32_t bits = Match(control, h2); bits != 0;
+         bits &= bits - 1) {
+      std::size_t slot = probe.get_offset() + FirstBit(bits);
+      const Entry &entry = entries_[slots_[slot]];
+      if (entry.hash == hash && entry.key == key) return slot;
+    }
+    // A key is placed in the first free slot it probes, so it would have
+    // been placed here.
+    if (Match(control, kEmpty) != 0) return capacity_;
+  }
+}
+
+void Map::Rehash() {
+  entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                [](const Entry &entry) {
+                                  return std::holds_alternative<
+                                      std::monostate>(entry.key);
+                                }),
+                 entries_.end());
+  // Half the load that forces a rehash, so that the next is a while off.
+  capacity_ = kGroupSize;
+  while ((size_ + 1) * 16 > capacity_ * 7) capacity_ *= 2;
+  control_.assign(capacity_, kEmpty);
+  slots_.assign(capacity_, 0);
+  used_ = 0;
+  for (auto i = std::size_t{0}; i < entries_.size(); ++i) {
+    Place(static_cast<std::uint32_t>(i));
+  }
+}
+
+void Map::Place(std::uint32_t index) {
+  std::uint64_t hash = entries_[index].hash;
+  for (auto probe = ProbeSequence{hash, capacity_};; probe.Next()) {
+    std::uint32_t bits = MatchFree(control_.data() + probe.get_offset());
+    if (bits == 0) continue;
+    std::size_t slot = probe.get_offset() + FirstBit(bits);
+    if (control_[slot] == kEmpty) ++used_;
+    control_[slot] = static_cast<std::uint8_t>(hash & 0x7f);
+    slots_[slot] = index;
+    return;
+  }
+}
+
+void Map::Print(std::ostream &os) const {
+  // Like a list, a map that holds itself is only printed once.
+  thread_local auto printing = std::vector<const Map *>{};
+  if (std::find(printing.begin(), printing.end(), this) != printing.end()) {
+    os << "{...}";
+    return;
+  }
+  printing.push_back(this);
+  os << '{';
+  auto first = true;
+  for (const Entry &entry : entries_) {
+    if (std::holds_alternative<std::monostate>(entry.key)) continue;
+    if (!first) os << ", ";
+    first = false;
+    os << entry.key << ": " << entry.value;
+  }
+  os << '}';
+  printing.pop_back();
+}
+
+const MapMethod *FindMapMethod(std::string_view name) {
+  for (const MapMethod &method : kMapMethods) {
+    if (method.name == name) return &method;
+  }
+  return nullptr;
+}
+
+}  // namespace lox
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_MAP_H
+#define LOX_SRC_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+#include "value.h"
+
+namespace lox {
+
+// A map from strings and numbers to values, written {key: value, ...} and
+// indexed like a list, where a missing key reads as nil. Keys are equal as
+// Lox values are, so 1 and 1.0 are the same key.
+//
+// The entries are kept in insertion order in one dense array, which is
+// what iterating walks, and indexed by an open-addressing hash table in the
+// style of a Swiss table: every slot has a control byte holding seven bits
+// of its key's hash, or marking it empty or deleted, and a lookup compares
+// the control bytes of a group of 16 slots at a time with one SIMD
+// instruction, only looking at the entries whose bits match.
+class Map : public Object {
+ public:
+  // An entry, whose key is nil once it has been removed.
+  struct Entry {
+    Value key;
+    Value value;
+    std::uint64_t hash;
+  };
+
+  static constexpr auto kGroupSize = std::size_t{16};
+
+  Map();
+
+  // Returns the message of the runtime error using key would raise, or
+  // nullptr if it can be a key.
+  static const char *CheckKey(const Value &key);
+
+  [[nodiscard]] std::size_t get_size() const { return size_; }
+  // The entries, in insertion order, including removed ones.
+  [[nodiscard]] const std::vector<Entry> &get_entries() const {
+    return entries_;
+  }
+  // Returns the value key maps to, or nullptr if it is not in the map.
+  [[nodiscard]] const Value *Find(const Value &key) const;
+  // Maps key, which CheckKey() must accept, to value. A new key goes after
+  // all the others.
+  void Set(const Value &key, Value value);
+  // Removes key, returning whether it was in the map.
+  bool Remove(const Value &key);
+
+  void Print(std::ostream &os) const override;
+
+ private:
+  // Returns the slot whose entry has key, or capacity_ if there is none.
+  [[nodiscard]] std::size_t FindSlot(const Value &key,
+                                     std::uint64_t hash) const;
+  // Rebuilds the table with room for the entries and one more, dropping
+  // removed entries.
+  void Rehash();
+  // Puts the entry at index in the first free slot for its hash, which
+  // the table must have.
+  void Place(std::uint32_t index);
+
+  std::vector<Entry> entries_;
+  // One control byte and one entry index per slot. The table has capacity_
+  // slots, a power of two and a whole number of groups, or none at all.
+  std::vector<std::uint8_t> control_;
+  std::vector<std::uint32_t> slots_;
+  std::size_t capacity_ = 0;
+  // The entries in the map, and the slots not empty, which includes those
+  // whose entry was removed.
+  std::size_t size_ = 0;
+  std::size_t used_ = 0;
+};
+
+// A method built into every map, like a ListMethod.
+struct MapMethod {
+  std::string_view name;
+  std::size_t arity;
+  const char *(*function)(Map *map, const Value *args, Value *result);
+};
+
+// Returns the method called name, or nullptr if maps have none.
+const MapMethod *FindMapMethod(std::string_view name);
+
+}  // namespace lox
+
+#endif  // LOX_SRC_MAP_H
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_NATIVE_H
+#define LOX_SRC_NATIVE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "value.h"
+
+namespace lox {
+
+namespace internal {
+
+// How a native function's parameter of type T is read from a Value: Get
+// returns a pointer to the payload, or nullptr if the value has another type.
+template <typename T>
+struct NativeParameter;
+
+template <>
+struct NativeParameter<double> {
+  static const double *Get(const Value &value) {
+    return std::get_if<double>(&value);
+  }
+};
+
+template <>
+struct NativeParameter<bool> {
+  static const bool *Get(const Value &value) {
+    return std::get_if<bool>(&value);
+  }
+};
+
+template <>
+struct NativeParameter<std::string> {
+  static const std::string *Get(const Value &value) {
+    return std::get_if<std::string>(&value);
+  }
+};
+
+template <>
+struct NativeParameter<std::string_view> : NativeParameter<std::string> {};
+
+template <>
+struct NativeParameter<Value> {
+  static const Value *Get(const Value &value) { return &value; }
+};
+
+template <typename T>
+constexpr ValueType GetNativeResultType() {
+  if constexpr (std::is_void_v<T>) {
+    return ValueType::kNil;
+  } else if constexpr (std::is_same_v<T, double>) {
+    return ValueType::kNumber;
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return ValueType::kBool;
+  } else if constexpr (std::is_same_v<T, std::string>) {
+    return ValueType::kString;
+  } else {
+    static_assert(std::is_same_v<T, Value>,
+                  "Natives return void, double, bool, std::string or Value");
+    return ValueType::kUnknown;
+  }
+}
+
+template <typename Signature>
+struct NativeTraits;
+
+template <typename R, typename... Args>
+struct NativeTraits<R(Args...)> {
+  static constexpr std::size_t kArity = sizeof...(Args);
+  static constexpr ValueType kResultType = GetNativeResultType<R>();
+
+  // Calls function with the payloads of args, which are passed by reference
+  // into the stack rather than copied out of their Values.
+  template <typename F, std::size_t... I>
+  static bool Invoke(const F &function, [[maybe_unused]] const Value *args,
+                     Value *result,
+                     std::index_sequence<I...> /* unused */) {
+    auto parameters = std::make_tuple(
+        NativeParameter<std::remove_cv_t<std::remove_reference_t<Args>>>::Get(
+            args[I])...);
+    if (((std::get<I>(parameters) == nullptr) || ...)) return false;
+    if constexpr (std::is_void_v<R>) {
+      function(*std::get<I>(parameters)...);
+      *result = std::monostate{};
+    } else {
+      *result = function(*std::get<I>(parameters)...);
+    }
+    return true;
+  }
+
+  template <typename F>
+  static bool Trampoline(const void *function, const Value *args,
+                         Value *result) {
+    return Invoke(*static_cast<const F *>(function), args, result,
+                  std::index_sequence_for<Args...>{});
+  }
+};
+
+}  // namespace internal
+
+// A host function callable from Lox. Its C++ signature is fixed when it is
+// created, so calls unpack the arguments straight from the VM stack into the
+// function's parameters and store its result in place, with nothing boxed
+// or copied on the way. Parameters may be double, bool, std::string (by const
+// reference), std::string_view or Value; results void (nil), double, bool,
+// std::string or Value.
+class NativeFunction {
+ public:
+  template <typename Signature, typename F>
+  static std::shared_ptr<const NativeFunction> Create(std::string name,
+                                                      F function) {
+    using Traits = internal::NativeTraits<Signature>;
+    return std::shared_ptr<const NativeFunction>(new NativeFunction{
+        std::move(name), Traits::kArity, Traits::kResultType,
+        std::make_shared<F>(std::move(function)),
+        &Traits::template Trampoline<F>});
+  }
+
+  // Calls the function on args[0] to args[arity - 1] and stores its result in
+  // *result, which may be args[0]. Returns false, without calling it, if an
+  // argument does not have the parameter's type.
+  bool Call(const Value *args, Value *result) const {
+    return trampoline_(function_.get(), args, result);
+  }
+
+  [[nodiscard]] const std::string &get_name() const { return name_; }
+  [[nodiscard]] std::size_t get_arity() const { return arity_; }
+  [[nodiscard]] ValueType get_result_type() const { return result_type_; }
+
+ private:
+  using Trampoline = bool (*)(const void *, const Value *, Value *);
+
+  NativeFunction(std::string name, std::size_t arity, ValueType result_type,
+                 std::shared_ptr<const void> function, Trampoline trampoline)
+      : name_(std::move(name)),
+        arity_(arity),
+        result_type_(result_type),
+        function_(std::move(function)),
+        trampoline_(trampoline) {}
+
+  std::string name_;
+  std::size_t arity_;
+  ValueType result_type_;
+  std::shared_ptr<const void> function_;
+  Trampoline trampoline_;
+};
+
+// The native functions visible to compiled code, by name. Calls are bound
+// when compiling, so the table is not needed to run a chunk.
+class NativeTable {
+ public:
+  // Defines name as function, called with Signature, e.g.
+  //   natives.Define<double(double, double)>(
+  //       "max", [](double a, double b) { return std::fmax(a, b); });
+  // Returns false if name is already defined.
+  template <typename Signature, typename F>
+  bool Define(std::string name, F function) {
+    auto native = NativeFunction::Create<Signature>(name, std::move(function));
+    return functions_.try_emplace(std::move(name), std::move(native)).second;
+  }
+
+  template <typename R, typename... Args>
+  bool Define(std::string name, R (*function)(Args...)) {
+    return Define<R(Args...)>(std::move(name), function);
+  }
+
+  // Returns nullptr if name is not defined.
+  [[nodiscard]] std::shared_ptr<const NativeFunction> Find(
+      std::string_view name) const {
+    auto it = functions_.find(std::string{name});
+    return it == functions_.end() ? nullptr : it->second;
+  }
+
+ private:
+  std::unordered_map<std::string, std::shared_ptr<const NativeFunction>>
+      functions_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_NATIVE_H
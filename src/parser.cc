@@ -6,7 +6,10 @@
 
 namespace lox {
 
-Parser::Parser(std::string_view source) : scanner_(source) { Advance(); }
+Parser::Parser(std::string_view source, std::size_t line)
+    : scanner_(source, line), errors_(&std::cerr) {
+  Advance();
+}
 
 void Parser::Advance() {
   previous_ = current_;
@@ -19,6 +22,8 @@ void Parser::Advance() {
   }
 }
 
+bool Parser::Check(TokenType type) const { return current_.type == type; }
+
 void Parser::Consume(TokenType type, std::string_view message) {
   if (current_.type == type) {
     Advance();
@@ -27,12 +32,41 @@ void Parser::Consume(TokenType type, std::string_view message) {
   }
 }
 
+bool Parser::Match(TokenType type) {
+  if (!Check(type)) return false;
+  Advance();
+  return true;
+}
+
 const Token &Parser::get_current() const { return current_; }
 
 const Token &Parser::get_previous() const { return previous_; }
 
 bool Parser::had_error() const { return had_error_; }
 
+bool Parser::panic_mode() const { return panic_mode_; }
+
+void Parser::Synchronize() {
+  panic_mode_ = false;
+  while (current_.type != TokenType::kEof) {
+    if (previous_.type == TokenType::kSemicolon) return;
+    switch (current_.type) {
+      case TokenType::kClass:
+      case TokenType::kFun:
+      case TokenType::kVar:
+      case TokenType::kFor:
+      case TokenType::kIf:
+      case TokenType::kWhile:
+      case TokenType::kPrint:
+      case TokenType::kReturn:
+        return;
+      default:
+        break;
+    }
+    Advance();
+  }
+}
+
 void Parser::ErrorAtCurrent(std::string_view message) {
   ErrorAt(current_, message);
 }
@@ -40,19 +74,21 @@ void Parser::ErrorAtPrevious(std::string_view message) {
   ErrorAt(previous_, message);
 }
 
+void Parser::set_error_output(std::ostream *errors) { errors_ = errors; }
+
 void Parser::ErrorAt(const Token &token, std::string_view message) {
   if (panic_mode_) return;
   panic_mode_ = true;
-  std::cerr << "[line " << token.line << " Error";
+  *errors_ << "[line " << token.line << "] Error";
 
   if (token.type == TokenType::kEof) {
-    std::cerr << " at end";
+    *errors_ << " at end";
   } else if (token.type == TokenType::kError) {
   } else {
-    std::cerr << " at '" << token.lexeme << "'";
+    *errors_ << " at '" << token.lexeme << "'";
   }
 
-  std::cerr << ": " << message << '\n';
+  *errors_ << ": " << message << '\n';
   had_error_ = true;
 }
 
@@ -3,6 +3,7 @@
 #ifndef LOX_SRC_PARSER_H
 #define LOX_SRC_PARSER_H
 
+#include <ostream>
 #include <string_view>
 
 #include "scanner.h"
@@ -12,16 +13,25 @@ namespace lox {
 
 class Parser {
  public:
-  explicit Parser(std::string_view source);
+  explicit Parser(std::string_view source, std::size_t line = 1);
 
   void Advance();
+  [[nodiscard]] bool Check(TokenType type) const;
   void Consume(TokenType type, std::string_view message);
+  // Advances past the current token if it has the given type.
+  bool Match(TokenType type);
   [[nodiscard]] const Token &get_current() const;
   [[nodiscard]] const Token &get_previous() const;
   [[nodiscard]] bool had_error() const;
+  [[nodiscard]] bool panic_mode() const;
+  // Leaves panic mode, skipping tokens until what looks like the start of
+  // the next statement.
+  void Synchronize();
 
   void ErrorAtCurrent(std::string_view message);
   void ErrorAtPrevious(std::string_view message);
+  // Reports errors to errors rather than std::cerr.
+  void set_error_output(std::ostream *errors);
 
  private:
   bool panic_mode_ = false;
@@ -29,6 +39,7 @@ class Parser {
   Token current_;
   Token previous_;
   Scanner scanner_;
+  std::ostream *errors_;
 
   void ErrorAt(const Token &token, std::string_view message);
 };
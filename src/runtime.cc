@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "runtime.h"
+
+#include <ostream>
+#include <sstream>
+
+namespace lox {
+
+const char *Add(Value *a, const Value &b) {
+  if (auto *x = std::get_if<double>(a)) {
+    if (const auto *y = std::get_if<double>(&b)) {
+      *x += *y;
+      return nullptr;
+    }
+  } else if (auto *x = std::get_if<std::string>(a)) {
+    if (const auto *y = std::get_if<std::string>(&b)) {
+      x->append(*y);
+      return nullptr;
+    }
+  }
+  return kAddOperandsError;
+}
+
+const char *Negate(Value *a) {
+  auto *x = std::get_if<double>(a);
+  if (x == nullptr) return kNumberOperandError;
+  *x = -*x;
+  return nullptr;
+}
+
+void PrintResult(std::ostream &out, const Value &value) {
+  out << value << '\n';
+}
+
+OutputBuffer::OutputBuffer(std::ostream *out) : out_(out) {
+  buffer_.reserve(kCapacity);
+}
+
+OutputBuffer::~OutputBuffer() { Flush(); }
+
+void OutputBuffer::Print(const Value &value) {
+  if (const auto *number = std::get_if<double>(&value)) {
+    char digits[kMaxNumberLength];
+    buffer_.append(digits, FormatNumber(*number, digits));
+  } else if (const auto *str = std::get_if<std::string>(&value)) {
+    buffer_.append(*str);
+  } else {
+    auto text = std::ostringstream{};
+    text << value;
+    buffer_.append(text.str());
+  }
+  buffer_.push_back('\n');
+  if (buffer_.size() >= kCapacity) Flush();
+}
+
+void OutputBuffer::Flush() {
+  if (buffer_.empty()) return;
+  out_->write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+  buffer_.clear();
+}
+
+void OutputBuffer::set_output(std::ostream *out) {
+  Flush();
+  out_ = out;
+}
+
+void ReportRuntimeError(std::ostream &errors, std::string_view message,
+                        std::size_t line, std::string_view function) {
+  errors << message << '\n';
+  ReportCaller(errors, line, function);
+}
+
+void ReportCaller(std::ostream &errors, std::size_t line,
+                  std::string_view function) {
+  errors << "[line " << line << ']';
+  if (function.empty()) {
+    errors << " in script\n";
+  } else {
+    errors << " in " << function << "()\n";
+  }
+}
+
+}  // namespace lox
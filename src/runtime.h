@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_RUNTIME_H
+#define LOX_SRC_RUNTIME_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "value.h"
+
+namespace lox {
+
+// The semantics of Lox operations on values, shared by the virtual machine,
+// the JIT and the code generated by loxc. Every operation stores its result in
+// its left operand, which is the stack slot the result belongs in, and returns
+// the message of the runtime error it raised, or nullptr on success.
+
+inline constexpr const char *kNumberOperandsError = "Operands must be numbers.";
+inline constexpr const char *kAddOperandsError =
+    "Operands must be two numbers or two strings.";
+inline constexpr const char *kNumberOperandError = "Operand must be a number";
+
+const char *Add(Value *a, const Value &b);
+const char *Negate(Value *a);
+
+// Applies one of the std::plus<>, std::minus<>, std::multiplies<>,
+// std::divides<> or comparison function objects to two numbers.
+template <typename Operator>
+const char *NumberOp(Value *a, const Value &b, Operator op) {
+  auto *x = std::get_if<double>(a);
+  const auto *y = std::get_if<double>(&b);
+  if (x == nullptr || y == nullptr) return kNumberOperandsError;
+  // Arithmetic is done in place; only comparisons change the type.
+  if constexpr (std::is_same_v<decltype(op(*x, *y)), double>) {
+    *x = op(*x, *y);
+  } else {
+    *a = op(*x, *y);
+  }
+  return nullptr;
+}
+
+// Prints the value a script returns.
+void PrintResult(std::ostream &out, const Value &value);
+
+// Collects what scripts print and writes it to a stream in large pieces,
+// rather than one value at a time through the stream's formatting, which
+// costs several times as much as formatting the value itself.
+class OutputBuffer {
+ public:
+  static constexpr auto kCapacity = std::size_t{1} << 13;
+
+  explicit OutputBuffer(std::ostream *out);
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+  ~OutputBuffer();
+
+  // Prints value as PrintResult() does, once the buffer is flushed.
+  void Print(const Value &value);
+  // Writes everything printed so far to the stream.
+  void Flush();
+  // Flushes the buffer, and writes to out from then on.
+  void set_output(std::ostream *out);
+
+ private:
+  std::ostream *out_;
+  std::string buffer_;
+};
+
+// Prints a runtime error and where it happened: on line of the function
+// named function, or of the script if function is empty.
+void ReportRuntimeError(std::ostream &errors, std::string_view message,
+                        std::size_t line, std::string_view function = {});
+// Prints where a call that led to a runtime error was made, as the next
+// line of the trace ReportRuntimeError() started.
+void ReportCaller(std::ostream &errors, std::size_t line,
+                  std::string_view function = {});
+
+}  // namespace lox
+
+#endif  // LOX_SRC_RUNTIME_H
@@ -2,13 +2,15 @@
 
 #include "scanner.h"
 
+#include <charconv>
+#include <cstdint>
 #include <cstring>
 #include <locale>
 
 namespace lox {
 
-Scanner::Scanner(std::string_view source)
-    : start_{source.data()}, current_{source.data()} {}
+Scanner::Scanner(std::string_view source, std::size_t line)
+    : start_{source.data()}, current_{source.data()}, line_{line} {}
 
 Token Scanner::ScanToken() {
   SkipWhitespace();
@@ -18,7 +20,7 @@ Token Scanner::ScanToken() {
 
   char c = Advance();
 
-  if (std::isalpha(c)) return HandleIdentifier();
+  if (std::isalpha(c) || c == '_') return HandleIdentifier();
   if (std::isdigit(c)) return HandleNumber();
 
   switch (c) {
@@ -30,8 +32,14 @@ Token Scanner::ScanToken() {
       return MakeToken(TokenType::kLeftBrace);
     case '}':
       return MakeToken(TokenType::kRightBrace);
+    case '[':
+      return MakeToken(TokenType::kLeftBracket);
+    case ']':
+      return MakeToken(TokenType::kRightBracket);
     case ';':
       return MakeToken(TokenType::kSemicolon);
+    case ':':
+      return MakeToken(TokenType::kColon);
     case ',':
       return MakeToken(TokenType::kComma);
     case '.':
@@ -98,10 +106,14 @@ void Scanner::SkipWhitespace() {
       case '\t':
         Advance();
         break;
+      case '\n':
+        line_++;
+        Advance();
+        break;
       case '/':
-        if (PeekNext() == '/') {
-          while (Peek() != '\n' && !IsAtEnd()) Advance();
-        }
+        if (PeekNext() != '/') return;
+        while (Peek() != '\n' && !IsAtEnd()) Advance();
+        break;
       default:
         return;
     }
@@ -148,12 +160,12 @@ TokenType Scanner::FindIdentifierType() const {
     case 'r':
       return CheckKeyword(1, 5, "eturn", TokenType::kReturn);
     case 's':
-      return CheckKeyword(1, 4, "per", TokenType::kSuper);
+      return CheckKeyword(1, 4, "uper", TokenType::kSuper);
     case 't':
       if (current_ - start_ > 1) {
         switch (start_[1]) {
           case 'h':
-            return CheckKeyword(2, 2, "this", TokenType::kThis);
+            return CheckKeyword(2, 2, "is", TokenType::kThis);
           case 'r':
             return CheckKeyword(2, 2, "ue", TokenType::kTrue);
         }
@@ -168,7 +180,7 @@ TokenType Scanner::FindIdentifierType() const {
 }
 
 Token Scanner::HandleIdentifier() {
-  while (std::isalnum(Peek())) Advance();
+  while (std::isalnum(Peek()) || Peek() == '_') Advance();
   return MakeToken(FindIdentifierType());
 }
 
@@ -186,6 +198,27 @@ Token Scanner::HandleNumber() {
   return MakeToken(TokenType::kNumber);
 }
 
+double Scanner::ParseNumber(std::string_view lexeme) {
+  // Whole numbers of up to 15 digits are below 2^53, so adding up their
+  // digits is exact, and most literals are such numbers.
+  constexpr auto kMaxExactDigits = std::size_t{15};
+  if (lexeme.size() <= kMaxExactDigits) {
+    auto whole = std::uint64_t{0};
+    auto digits = std::size_t{0};
+    for (; digits < lexeme.size(); ++digits) {
+      auto digit = static_cast<unsigned>(lexeme[digits] - '0');
+      if (digit > 9) break;
+      whole = whole * 10 + digit;
+    }
+    if (digits == lexeme.size()) return static_cast<double>(whole);
+  }
+
+  // from_chars rounds correctly and ignores the locale.
+  auto value = 0.0;
+  std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), value);
+  return value;
+}
+
 Token Scanner::HandleString() {
   while (Peek() != '"' && !IsAtEnd()) {
     if (Peek() == '\n') line_++;
@@ -9,11 +9,15 @@ namespace lox {
 
 class Scanner {
  public:
-  explicit Scanner(std::string_view source);
+  // Scans source, which starts on the given line.
+  explicit Scanner(std::string_view source, std::size_t line = 1);
 
   char Advance();
   Token ScanToken();
 
+  // The value of a kNumber token's lexeme.
+  static double ParseNumber(std::string_view lexeme);
+
  private:
   [[nodiscard]] bool IsAtEnd() const;
   [[nodiscard]] char Peek() const;
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "scheduler.h"
+
+#include <algorithm>
+
+namespace lox {
+
+Scheduler::Scheduler(std::size_t slice) : slice_(slice) {}
+
+std::size_t Scheduler::Spawn(std::shared_ptr<const Chunk> chunk,
+                             std::optional<std::size_t> limit) {
+  std::size_t index = fibers_.size();
+  Fiber &fiber = fibers_.emplace_back();
+  if (chunk == nullptr) {
+    fiber.result.result = InterpretResult::kCompileError;
+    return index;
+  }
+  fiber.chunk = std::move(chunk);
+  fiber.fuel = limit;
+  fiber.vm = std::make_unique<VirtualMachine>();
+  fiber.vm->set_output(&fiber.out);
+  fiber.vm->set_error_output(&fiber.errors);
+  if (const auto &globals = fiber.chunk->GetGlobalTable()) {
+    fiber.vm->ResetGlobals(globals);
+  }
+  unfinished_.push_back(index);
+  return index;
+}
+
+bool Scheduler::Step() {
+  auto kept = std::size_t{0};
+  for (std::size_t index : unfinished_) {
+    Fiber &fiber = fibers_[index];
+    std::size_t slice = fiber.fuel ? std::min(slice_, *fiber.fuel) : slice_;
+    fiber.vm->set_fuel(slice);
+    InterpretResult result = fiber.started ? fiber.vm->Resume()
+                                           : fiber.vm->Execute(*fiber.chunk);
+    fiber.started = true;
+
+    if (fiber.fuel) *fiber.fuel -= slice - fiber.vm->get_fuel().value_or(0);
+    if (result == InterpretResult::kSuspended && fiber.fuel == 0u) {
+      fiber.errors << "Script ran out of fuel.\n";
+      result = InterpretResult::kRuntimeError;
+    }
+    if (result == InterpretResult::kSuspended) {
+      unfinished_[kept++] = index;
+    } else {
+      Finish(&fiber, result);
+    }
+  }
+  unfinished_.resize(kept);
+  return !unfinished_.empty();
+}
+
+std::vector<BatchResult> Scheduler::Run() {
+  while (Step()) {
+  }
+  auto results = std::vector<BatchResult>{};
+  results.reserve(fibers_.size());
+  for (const Fiber &fiber : fibers_) results.push_back(fiber.result);
+  return results;
+}
+
+std::size_t Scheduler::get_unfinished_count() const {
+  return unfinished_.size();
+}
+
+void Scheduler::Finish(Fiber *fiber, InterpretResult result) {
+  fiber->result.result = result;
+  fiber->result.output = fiber->out.str();
+  fiber->result.errors = fiber->errors.str();
+  fiber->vm.reset();
+  fiber->chunk.reset();
+}
+
+}  // namespace lox
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_SCHEDULER_H
+#define LOX_SRC_SCHEDULER_H
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+#include "batch.h"
+#include "chunk.h"
+#include "vm.h"
+
+namespace lox {
+
+// Runs many scripts on one thread by interleaving them, each in a fiber: a
+// VirtualMachine of its own, with its own stack and frames, whose run is
+// suspended every time it uses up a slice of fuel and resumed once every
+// other fiber has had a turn. A script that never finishes only holds the
+// others up for a slice at a time, and one given a limit fails once it has
+// used that much fuel in all.
+class Scheduler {
+ public:
+  static constexpr auto kDefaultSlice = std::size_t{1} << 16;
+
+  // Each turn a fiber gets is slice units of fuel long; see
+  // VirtualMachine::set_fuel().
+  explicit Scheduler(std::size_t slice = kDefaultSlice);
+
+  // Adds a fiber that runs chunk, failing with a runtime error if it has
+  // not finished after limit units of fuel. A null chunk, for a script that
+  // failed to compile, yields kCompileError. Returns the index of the
+  // fiber's result.
+  std::size_t Spawn(std::shared_ptr<const Chunk> chunk,
+                    std::optional<std::size_t> limit = std::nullopt);
+  // Gives every unfinished fiber a turn, in the order they were spawned.
+  // Returns whether any are still unfinished.
+  bool Step();
+  // Steps until every fiber has finished, and returns the results of all
+  // those spawned so far, in the order they were spawned.
+  std::vector<BatchResult> Run();
+  [[nodiscard]] std::size_t get_unfinished_count() const;
+
+ private:
+  struct Fiber {
+    std::shared_ptr<const Chunk> chunk;
+    // Dropped once the fiber finishes, along with everything it allocated.
+    std::unique_ptr<VirtualMachine> vm;
+    bool started = false;
+    // The fuel left of the fiber's limit, if it has one.
+    std::optional<std::size_t> fuel;
+    std::ostringstream out;
+    std::ostringstream errors;
+    BatchResult result;
+  };
+
+  void Finish(Fiber *fiber, InterpretResult result);
+
+  std::size_t slice_;
+  // Fibers refer to their own streams, so they must not move.
+  std::deque<Fiber> fibers_;
+  // The indices of the unfinished fibers, in the order they take turns.
+  std::vector<std::size_t> unfinished_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_SCHEDULER_H
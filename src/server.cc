@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "server.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <streambuf>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "compiler.h"
+
+namespace {
+
+using lox::BatchResult;
+using lox::ServerRequest;
+
+// Changed whenever requests or results change shape, so that a client and
+// server built apart fail cleanly rather than misread each other.
+constexpr auto kProtocolVersion = std::uint8_t{1};
+// The longest script a server accepts.
+constexpr auto kMaxScriptSize = std::uint32_t{1} << 26;
+
+void ReportError(std::string_view what, std::string_view path) {
+  std::cerr << "lox: " << what << " '" << path
+            << "': " << std::strerror(errno) << '\n';
+}
+
+// Not every platform has MSG_NOSIGNAL; those that lack it have SO_NOSIGPIPE,
+// which PrepareSocket() sets instead.
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+// Marks fd close-on-exec and, where the platform has the option, keeps a
+// peer that hangs up from raising SIGPIPE. Closes fd and returns -1 if
+// either fails, so that it can wrap socket() and accept() directly; Linux
+// could do the first with SOCK_CLOEXEC, but macOS cannot.
+int PrepareSocket(int fd) {
+  if (fd < 0) return -1;
+  bool prepared = fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  prepared = prepared &&
+             setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) == 0;
+#endif
+  if (!prepared) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+// Fills address with path, or returns false if it is too long for one.
+bool MakeAddress(const std::string &path, sockaddr_un *address) {
+  *address = sockaddr_un{};
+  address->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address->sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  std::memcpy(address->sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// Returns a socket connected to the server at path, or -1.
+int Connect(const std::string &path) {
+  auto address = sockaddr_un{};
+  if (!MakeAddress(path, &address)) return -1;
+  int fd = PrepareSocket(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (fd < 0) return -1;
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&address),
+              sizeof(address)) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+bool WriteAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    // A client that hangs up must not kill the server with SIGPIPE.
+    ssize_t written = send(fd, data.data(), data.size(), kSendFlags);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    data.remove_prefix(static_cast<std::size_t>(written));
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void *data, std::size_t size) {
+  auto *bytes = static_cast<char *>(data);
+  while (size > 0) {
+    ssize_t count = recv(fd, bytes, size, 0);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    bytes += count;
+    size -= static_cast<std::size_t>(count);
+  }
+  return true;
+}
+
+// Appends str to message, after its length.
+void AppendString(std::string *message, std::string_view str) {
+  auto size = static_cast<std::uint32_t>(str.size());
+  message->append(reinterpret_cast<const char *>(&size), sizeof(size));
+  message->append(str);
+}
+
+// Reads a string AppendString() appended, failing if it is longer than
+// max_size.
+std::optional<std::string> ReadString(int fd, std::uint32_t max_size) {
+  auto size = std::uint32_t{0};
+  if (!ReadAll(fd, &size, sizeof(size)) || size > max_size) {
+    return std::nullopt;
+  }
+  auto str = std::string(size, '\0');
+  if (!ReadAll(fd, str.data(), size)) return std::nullopt;
+  return str;
+}
+
+// A request is the protocol version, whether the script is a path, the
+// optimization level and whether to use the JIT, a byte each, and then the
+// script.
+std::optional<ServerRequest> ReadRequest(int fd) {
+  auto header = std::array<std::uint8_t, 4>{};
+  if (!ReadAll(fd, header.data(), header.size()) ||
+      header[0] != kProtocolVersion || header[1] > 1 || header[2] > 2 ||
+      header[3] > 1) {
+    return std::nullopt;
+  }
+  std::optional<std::string> script = ReadString(fd, kMaxScriptSize);
+  if (!script) return std::nullopt;
+  return ServerRequest{std::move(*script), header[1] != 0,
+                       static_cast<lox::OptimizationLevel>(header[2]),
+                       header[3] != 0};
+}
+
+// A result is the InterpretResult, a byte, and then the output and errors.
+std::optional<BatchResult> ReadResult(int fd) {
+  constexpr auto kMaxSize = std::numeric_limits<std::uint32_t>::max();
+  auto result = std::uint8_t{0};
+  if (!ReadAll(fd, &result, sizeof(result)) ||
+      result > static_cast<std::uint8_t>(lox::InterpretResult::kSuspended)) {
+    return std::nullopt;
+  }
+  std::optional<std::string> output = ReadString(fd, kMaxSize);
+  if (!output) return std::nullopt;
+  std::optional<std::string> errors = ReadString(fd, kMaxSize);
+  if (!errors) return std::nullopt;
+  return BatchResult{static_cast<lox::InterpretResult>(result),
+                     std::move(*output), std::move(*errors)};
+}
+
+// Keeps what is written to it, up to a limit, and drops the rest.
+class LimitedBuffer : public std::streambuf {
+ public:
+  explicit LimitedBuffer(std::size_t limit) : limit_(limit) {}
+
+  [[nodiscard]] bool is_full() const { return full_; }
+  std::string TakeString() { return std::move(str_); }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return 0;
+    char ch = traits_type::to_char_type(c);
+    return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize count) override {
+    auto size = static_cast<std::size_t>(count);
+    if (size > limit_ - str_.size()) {
+      size = limit_ - str_.size();
+      full_ = true;
+    }
+    str_.append(s, size);
+    return static_cast<std::streamsize>(size);
+  }
+
+ private:
+  std::size_t limit_;
+  std::string str_;
+  bool full_ = false;
+};
+
+std::optional<std::string> ReadFile(const std::string &path) {
+  auto stream = std::ifstream{path, std::ios::binary};
+  if (!stream) return std::nullopt;
+  auto source = std::ostringstream{};
+  source << stream.rdbuf();
+  if (stream.bad()) return std::nullopt;
+  return std::move(source).str();
+}
+
+}  // namespace
+
+namespace lox {
+
+Server::Server(std::size_t jobs) : jobs_(std::max<std::size_t>(jobs, 1)) {}
+
+Server::~Server() {
+  if (listener_ >= 0) close(listener_);
+}
+
+bool Server::Listen(const std::string &path) {
+  auto address = sockaddr_un{};
+  if (!MakeAddress(path, &address)) {
+    ReportError("Could not listen on", path);
+    return false;
+  }
+  listener_ = PrepareSocket(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (listener_ < 0) {
+    ReportError("Could not listen on", path);
+    return false;
+  }
+  const auto *name = reinterpret_cast<const sockaddr *>(&address);
+  int bound = bind(listener_, name, sizeof(address));
+  if (bound != 0 && errno == EADDRINUSE) {
+    if (int other = Connect(path); other >= 0) {
+      close(other);
+      std::cerr << "lox: A server is already listening on '" << path
+                << "'.\n";
+      return false;
+    }
+    // A server that died left its socket behind.
+    bound = unlink(path.c_str()) == 0 ? bind(listener_, name, sizeof(address))
+                                      : -1;
+  }
+  if (bound != 0 || listen(listener_, SOMAXCONN) != 0) {
+    ReportError("Could not listen on", path);
+    return false;
+  }
+  return true;
+}
+
+void Server::Serve() {
+  auto workers = std::vector<std::thread>{};
+  for (auto i = std::size_t{0}; i < jobs_; ++i) {
+    workers.emplace_back([this] { Work(); });
+  }
+
+  while (true) {
+    int client = PrepareSocket(accept(listener_, nullptr, nullptr));
+    if (client < 0) {
+      // A client that gave up before it was accepted is no reason to stop.
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      std::cerr << "lox: Could not accept a client: " << std::strerror(errno)
+                << '\n';
+      break;
+    }
+    // Nor is one that never sends its request or takes its result.
+    auto timeout = timeval{kClientTimeout, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    auto lock = std::lock_guard{clients_mutex_};
+    clients_.push_back(client);
+    clients_changed_.notify_one();
+  }
+
+  {
+    auto lock = std::lock_guard{clients_mutex_};
+    stopping_ = true;
+    clients_changed_.notify_all();
+  }
+  for (std::thread &worker : workers) worker.join();
+}
+
+void Server::Work() {
+  auto vm = VirtualMachine{};
+  while (true) {
+    auto lock = std::unique_lock{clients_mutex_};
+    clients_changed_.wait(lock,
+                          [this] { return stopping_ || !clients_.empty(); });
+    // The clients already accepted are answered before stopping.
+    if (clients_.empty()) return;
+    int client = clients_.front();
+    clients_.pop_front();
+    lock.unlock();
+    Answer(client, &vm);
+    close(client);
+  }
+}
+
+void Server::Answer(int client, VirtualMachine *vm) {
+  std::optional<ServerRequest> request = ReadRequest(client);
+  if (!request) return;
+  BatchResult result = Run(*request, vm);
+  auto message = std::string(1, static_cast<char>(result.result));
+  AppendString(&message, result.output);
+  AppendString(&message, result.errors);
+  WriteAll(client, message);
+}
+
+BatchResult Server::Run(const ServerRequest &request, VirtualMachine *vm) {
+  auto result = BatchResult{};
+  auto out_buffer = LimitedBuffer{kMaxOutputSize};
+  auto errors_buffer = LimitedBuffer{kMaxOutputSize};
+  auto out = std::ostream{&out_buffer};
+  auto errors = std::ostream{&errors_buffer};
+  std::optional<std::string> source = request.script;
+  if (request.is_path) {
+    source = ReadFile(request.script);
+    if (!source) errors << "Could not read '" << request.script << "'.\n";
+  }
+  std::shared_ptr<const Chunk> chunk =
+      source ? Compile(*source, request.level, &errors) : nullptr;
+  // Why the run was stopped, if it was.
+  const char *stopped = nullptr;
+  if (chunk == nullptr) {
+    result.result = InterpretResult::kCompileError;
+  } else {
+    vm->set_jit_enabled(request.jit);
+    vm->set_output(&out);
+    vm->set_error_output(&errors);
+    // As in a batch, each script starts with its own globals, undefined.
+    if (const auto &globals = chunk->GetGlobalTable()) {
+      vm->ResetGlobals(globals);
+    }
+    auto deadline = std::chrono::steady_clock::now() + kTimeLimit;
+    vm->set_fuel(kFuelSlice);
+    result.result = vm->Execute(*chunk);
+    while (result.result == InterpretResult::kSuspended) {
+      if (out_buffer.is_full() || errors_buffer.is_full()) {
+        stopped = "Script wrote too much output.\n";
+      } else if (std::chrono::steady_clock::now() >= deadline) {
+        stopped = "Script ran out of time.\n";
+      } else {
+        vm->set_fuel(kFuelSlice);
+        result.result = vm->Resume();
+        continue;
+      }
+      result.result = InterpretResult::kRuntimeError;
+    }
+    // A script may write too much in its last slice, too.
+    if (stopped == nullptr &&
+        (out_buffer.is_full() || errors_buffer.is_full())) {
+      stopped = "Script wrote too much output.\n";
+    }
+    // The machine keeps no pointers to this request's streams, and a script
+    // that was stopped is abandoned when the next one runs.
+    vm->set_fuel(std::nullopt);
+    vm->set_output(&std::cout);
+    vm->set_error_output(&std::cerr);
+  }
+  result.output = out_buffer.TakeString();
+  result.errors = errors_buffer.TakeString();
+  if (stopped != nullptr) result.errors += stopped;
+  return result;
+}
+
+std::shared_ptr<const Chunk> Server::Compile(const std::string &source,
+                                             OptimizationLevel level,
+                                             std::ostream *errors) {
+  ChunkCache &cache = caches_[static_cast<std::size_t>(level)];
+  {
+    auto lock = std::lock_guard{cache_mutex_};
+    if (std::shared_ptr<const Chunk> chunk = cache.Find(source)) return chunk;
+  }
+  // Other workers go on running scripts while this one compiles. Two that
+  // miss on the same source both compile it, and the second's chunk wins.
+  auto compiler = Compiler{source, level};
+  compiler.set_error_output(errors);
+  std::shared_ptr<const Chunk> chunk = CompileShared(&compiler);
+  if (chunk != nullptr) {
+    auto lock = std::lock_guard{cache_mutex_};
+    cache.Insert(source, chunk);
+  }
+  return chunk;
+}
+
+std::optional<BatchResult> RunOnServer(const std::string &path,
+                                       const ServerRequest &request) {
+  int fd = Connect(path);
+  if (fd < 0) return std::nullopt;
+  auto message = std::string{
+      static_cast<char>(kProtocolVersion), static_cast<char>(request.is_path),
+      static_cast<char>(request.level), static_cast<char>(request.jit)};
+  AppendString(&message, request.script);
+  std::optional<BatchResult> result;
+  if (WriteAll(fd, message)) result = ReadResult(fd);
+  close(fd);
+  return result;
+}
+
+}  // namespace lox
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_SERVER_H
+#define LOX_SRC_SERVER_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+
+#include "batch.h"
+#include "chunk.h"
+#include "chunk_cache.h"
+#include "ir.h"
+#include "vm.h"
+
+namespace lox {
+
+// What a client asks a server to run.
+struct ServerRequest {
+  // The script's source, or with is_path, the path of a file holding it,
+  // which the server reads.
+  std::string script;
+  bool is_path = false;
+  OptimizationLevel level = OptimizationLevel::kO0;
+  bool jit = false;
+};
+
+// Runs scripts for clients of a Unix domain socket, so that running one
+// costs a round trip rather than starting a process and compiling it. Each
+// script is compiled once, into a cache keyed by its source and
+// optimization level, and run on one of a pool of worker threads, each
+// keeping its VirtualMachine warm from one script to the next. A script
+// starts with its own globals, undefined, as though it ran on its own, and
+// its output and errors go back to the client. Scripts are metered, so
+// that one that runs too long or prints too much is stopped with a runtime
+// error rather than holding on to its worker; metered runs are not JITed.
+//
+// A client connects, sends one request and reads one result, each a few
+// bytes followed by length-prefixed strings, in the byte order of the
+// machine, which both ends share.
+class Server {
+ public:
+  // The most bytes of compiled chunks kept for each optimization level.
+  static constexpr auto kCacheCapacity = std::size_t{64} << 20;
+  // How long a worker waits for a client to send its request or take its
+  // result, in seconds.
+  static constexpr auto kClientTimeout = 10;
+  // How long a script may run, and the fuel it runs on between checks.
+  static constexpr auto kTimeLimit = std::chrono::seconds{30};
+  static constexpr auto kFuelSlice = std::size_t{1} << 20;
+  // The most bytes of output, and of errors, a script may write.
+  static constexpr auto kMaxOutputSize = std::size_t{16} << 20;
+
+  // A server with jobs workers.
+  explicit Server(std::size_t jobs);
+  Server(const Server &) = delete;
+  Server &operator=(const Server &) = delete;
+  ~Server();
+
+  // Listens on a socket at path, replacing any socket there that no server
+  // is listening on. Returns false after reporting an error.
+  bool Listen(const std::string &path);
+  // Accepts clients and runs their scripts until accepting fails, which is
+  // reported.
+  void Serve();
+
+ private:
+  // Serves the clients accepted, one at a time, until the server stops.
+  void Work();
+  // Reads a client's request, runs it on vm and sends back the result.
+  void Answer(int client, VirtualMachine *vm);
+  BatchResult Run(const ServerRequest &request, VirtualMachine *vm);
+  // Returns the chunk compiled from source at level, compiling and caching
+  // it if it is not cached, or nullptr after reporting a compile error to
+  // errors.
+  std::shared_ptr<const Chunk> Compile(const std::string &source,
+                                       OptimizationLevel level,
+                                       std::ostream *errors);
+
+  std::size_t jobs_;
+  int listener_ = -1;
+
+  std::mutex clients_mutex_;
+  std::condition_variable clients_changed_;
+  // The clients accepted that no worker has taken yet.
+  std::deque<int> clients_;
+  bool stopping_ = false;
+
+  std::mutex cache_mutex_;
+  // Indexed by optimization level.
+  std::array<ChunkCache, 3> caches_{ChunkCache{kCacheCapacity},
+                                    ChunkCache{kCacheCapacity},
+                                    ChunkCache{kCacheCapacity}};
+};
+
+// Asks the server listening at path to run request, and returns the
+// result, or nullopt if no server answers.
+std::optional<BatchResult> RunOnServer(const std::string &path,
+                                       const ServerRequest &request);
+
+}  // namespace lox
+
+#endif  // LOX_SRC_SERVER_H
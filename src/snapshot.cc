@@ -0,0 +1,861 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "class.h"
+#include "function.h"
+#include "list.h"
+#include "map.h"
+#include "verifier.h"
+
+namespace {
+
+using lox::Object;
+using lox::ObjectType;
+
+// Identifies the format, and its version, which changes whenever it does.
+constexpr auto kMagic = std::string_view{"LOXIMG01"};
+
+enum class ValueTag : std::uint8_t { kNil, kNumber, kBool, kString, kObject };
+
+// The order objects of each type are created in when loading, so that an
+// object only needs those created before it to be constructed. What else
+// objects refer to is filled in once they all exist.
+int GetPhase(ObjectType type) {
+  switch (type) {
+    case ObjectType::kFunction:
+      return 0;
+    case ObjectType::kClass:
+      return 1;
+    case ObjectType::kClosure:
+      return 2;
+    case ObjectType::kInstance:
+    case ObjectType::kList:
+    case ObjectType::kMap:
+      return 3;
+    case ObjectType::kBoundMethod:
+      return 4;
+  }
+  return 5;
+}
+
+// Appends sizes in LEB128, so that small ones take a byte, and doubles as
+// their bits, least significant byte first.
+class ImageWriter {
+ public:
+  void WriteByte(std::uint8_t byte) {
+    bytes_.push_back(static_cast<char>(byte));
+  }
+  void WriteSize(std::size_t size) {
+    while (size >= 0x80) {
+      WriteByte(static_cast<std::uint8_t>(size | 0x80));
+      size >>= 7;
+    }
+    WriteByte(static_cast<std::uint8_t>(size));
+  }
+  void WriteDouble(double number) {
+    auto bits = std::uint64_t{0};
+    std::memcpy(&bits, &number, sizeof(bits));
+    for (auto i = 0; i < 8; ++i) {
+      WriteByte(static_cast<std::uint8_t>(bits >> (8 * i)));
+    }
+  }
+  void WriteString(std::string_view str) {
+    WriteSize(str.size());
+    bytes_.append(str);
+  }
+
+  [[nodiscard]] const std::string &get_bytes() const { return bytes_; }
+
+ private:
+  std::string bytes_;
+};
+
+// Reads what an ImageWriter wrote. Reading past the end fails the reader,
+// after which everything reads as zero or empty.
+class ImageReader {
+ public:
+  ImageReader(const std::uint8_t *data, std::size_t size)
+      : data_(data), end_(data + size) {}
+
+  std::uint8_t ReadByte() {
+    if (data_ == end_) {
+      failed_ = true;
+      return 0;
+    }
+    return *data_++;
+  }
+  std::size_t ReadSize() {
+    auto size = std::size_t{0};
+    for (auto shift = 0; shift < 64; shift += 7) {
+      std::uint8_t byte = ReadByte();
+      size |= std::size_t{byte & 0x7fu} << shift;
+      if ((byte & 0x80) == 0) return size;
+    }
+    failed_ = true;
+    return 0;
+  }
+  // A count of elements that each take at least a byte, so that a
+  // malformed image cannot make the reader allocate more than it holds.
+  std::size_t ReadCount() {
+    std::size_t count = ReadSize();
+    if (count > static_cast<std::size_t>(end_ - data_)) {
+      failed_ = true;
+      return 0;
+    }
+    return count;
+  }
+  double ReadDouble() {
+    auto bits = std::uint64_t{0};
+    for (auto i = 0; i < 8; ++i) {
+      bits |= std::uint64_t{ReadByte()} << (8 * i);
+    }
+    auto number = 0.0;
+    std::memcpy(&number, &bits, sizeof(number));
+    return number;
+  }
+  std::string ReadString() {
+    std::size_t size = ReadCount();
+    auto str = std::string{reinterpret_cast<const char *>(data_), size};
+    data_ += size;
+    return str;
+  }
+
+  [[nodiscard]] bool failed() const { return failed_; }
+  [[nodiscard]] bool AtEnd() const { return data_ == end_; }
+
+ private:
+  const std::uint8_t *data_;
+  const std::uint8_t *end_;
+  bool failed_ = false;
+};
+
+// A file mapped into memory, read-only, for as long as this lives.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat status {};
+    if (fstat(fd, &status) == 0 && status.st_size > 0) {
+      auto size = static_cast<std::size_t>(status.st_size);
+      void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const std::uint8_t *>(data);
+        size_ = size;
+      }
+    }
+    close(fd);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile(MappedFile &&) = delete;
+  void operator=(const MappedFile &) = delete;
+  void operator=(MappedFile &&) = delete;
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<std::uint8_t *>(data_), size_);
+    }
+  }
+
+  // Null if the file could not be mapped.
+  [[nodiscard]] const std::uint8_t *get_data() const { return data_; }
+  [[nodiscard]] std::size_t get_size() const { return size_; }
+
+ private:
+  const std::uint8_t *data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+// Everything reachable from the globals that the image has to hold, each
+// numbered by its index in the image.
+class ImageEncoder {
+ public:
+  // Numbers the objects, upvalues and function contexts globals reach.
+  explicit ImageEncoder(const std::vector<std::optional<lox::Value>> &globals);
+
+  void WriteContexts(ImageWriter *writer) const;
+  // Writes the objects and the upvalues of their closures.
+  void WriteObjects(ImageWriter *writer) const;
+  void WriteValue(ImageWriter *writer, const lox::Value &value) const;
+
+ private:
+  void Add(const lox::Value &value);
+  void Add(const Object *object);
+  void WriteChunk(ImageWriter *writer, const lox::Chunk &chunk) const;
+
+  std::vector<const Object *> objects_;
+  std::unordered_map<const Object *, std::size_t> object_ids_;
+  std::vector<const lox::Upvalue *> upvalues_;
+  std::unordered_map<const lox::Upvalue *, std::size_t> upvalue_ids_;
+  std::vector<const lox::FunctionContext *> contexts_;
+  std::unordered_map<const lox::FunctionContext *, std::size_t> context_ids_;
+};
+
+ImageEncoder::ImageEncoder(
+    const std::vector<std::optional<lox::Value>> &globals) {
+  for (const std::optional<lox::Value> &global : globals) {
+    if (global) Add(*global);
+  }
+  // Objects are found in any order, and only numbered once sorted into
+  // the order they are created in.
+  for (auto next = std::size_t{0}; next < objects_.size(); ++next) {
+    const Object *object = objects_[next];
+    switch (object->get_type()) {
+      case ObjectType::kFunction: {
+        const auto &function = static_cast<const lox::Function &>(*object);
+        const lox::FunctionContext *context = function.get_context().get();
+        if (context_ids_.try_emplace(context, contexts_.size()).second) {
+          contexts_.push_back(context);
+        }
+        if (auto chunk = function.GetCompiledChunk()) {
+          for (auto i = std::size_t{0}; i < chunk->GetConstantCount(); ++i) {
+            Add(chunk->GetValueAtIndex(i));
+          }
+        }
+        break;
+      }
+      case ObjectType::kClosure: {
+        const auto &closure = static_cast<const lox::Closure &>(*object);
+        Add(&closure.get_function());
+        for (auto i = std::size_t{0}; i < closure.get_upvalue_count(); ++i) {
+          const lox::Upvalue *upvalue = closure.GetUpvalue(i).get();
+          if (upvalue_ids_.try_emplace(upvalue, upvalues_.size()).second) {
+            upvalues_.push_back(upvalue);
+            Add(*upvalue->location);
+          }
+        }
+        break;
+      }
+      case ObjectType::kClass: {
+        const auto &klass = static_cast<const lox::Class &>(*object);
+        for (auto i = std::size_t{0}; i < klass.get_method_count(); ++i) {
+          Add(klass.GetMethod(i).get());
+        }
+        break;
+      }
+      case ObjectType::kInstance: {
+        const auto &instance = static_cast<const lox::Instance &>(*object);
+        Add(&instance.get_class());
+        std::size_t fields = instance.get_shape().get_field_count();
+        for (auto i = std::size_t{0}; i < fields; ++i) {
+          Add(instance.GetField(i));
+        }
+        break;
+      }
+      case ObjectType::kBoundMethod: {
+        const auto &bound = static_cast<const lox::BoundMethod &>(*object);
+        Add(bound.get_receiver());
+        Add(bound.get_method().get());
+        break;
+      }
+      case ObjectType::kList: {
+        const auto &list = static_cast<const lox::List &>(*object);
+        if (list.is_boxed()) {
+          for (auto i = std::size_t{0}; i < list.get_size(); ++i) {
+            Add(list.Get(i));
+          }
+        }
+        break;
+      }
+      case ObjectType::kMap:
+        // Keys are never objects.
+        for (const lox::Map::Entry &entry :
+             static_cast<const lox::Map &>(*object).get_entries()) {
+          Add(entry.value);
+        }
+        break;
+    }
+  }
+  std::stable_sort(objects_.begin(), objects_.end(),
+                   [](const Object *a, const Object *b) {
+                     return GetPhase(a->get_type()) < GetPhase(b->get_type());
+                   });
+  for (auto i = std::size_t{0}; i < objects_.size(); ++i) {
+    object_ids_[objects_[i]] = i;
+  }
+}
+
+void ImageEncoder::Add(const lox::Value &value) {
+  if (const auto *object = std::get_if<std::shared_ptr<Object>>(&value)) {
+    Add(object->get());
+  }
+}
+
+void ImageEncoder::Add(const Object *object) {
+  if (object_ids_.try_emplace(object, 0).second) objects_.push_back(object);
+}
+
+void ImageEncoder::WriteContexts(ImageWriter *writer) const {
+  writer->WriteSize(contexts_.size());
+  for (const lox::FunctionContext *context : contexts_) {
+    writer->WriteString(context->source);
+    writer->WriteByte(static_cast<std::uint8_t>(context->optimization_level));
+    writer->WriteSize(context->input_names.size());
+    for (const std::string &name : context->input_names) {
+      writer->WriteString(name);
+    }
+    writer->WriteSize(context->input_types.size());
+    for (lox::ValueType type : context->input_types) {
+      writer->WriteByte(static_cast<std::uint8_t>(type));
+    }
+  }
+}
+
+void ImageEncoder::WriteObjects(ImageWriter *writer) const {
+  // First what each object is constructed from, after the number of
+  // upvalues, which closures are constructed with...
+  writer->WriteSize(upvalues_.size());
+  writer->WriteSize(objects_.size());
+  for (const Object *object : objects_) {
+    writer->WriteByte(static_cast<std::uint8_t>(object->get_type()));
+    switch (object->get_type()) {
+      case ObjectType::kFunction: {
+        const auto &function = static_cast<const lox::Function &>(*object);
+        writer->WriteString(function.get_name());
+        writer->WriteByte(static_cast<std::uint8_t>(function.get_kind()));
+        writer->WriteSize(function.get_arity());
+        writer->WriteSize(context_ids_.at(function.get_context().get()));
+        writer->WriteSize(function.get_start());
+        writer->WriteSize(function.get_end());
+        writer->WriteSize(function.get_line());
+        writer->WriteSize(function.get_captures().size());
+        for (const lox::Capture &capture : function.get_captures()) {
+          writer->WriteString(capture.name);
+          writer->WriteByte(capture.is_local ? 1 : 0);
+          writer->WriteSize(capture.index);
+        }
+        break;
+      }
+      case ObjectType::kClass:
+        writer->WriteString(
+            static_cast<const lox::Class &>(*object).get_name());
+        break;
+      case ObjectType::kClosure: {
+        const auto &closure = static_cast<const lox::Closure &>(*object);
+        writer->WriteSize(object_ids_.at(&closure.get_function()));
+        writer->WriteSize(closure.get_upvalue_count());
+        for (auto i = std::size_t{0}; i < closure.get_upvalue_count(); ++i) {
+          writer->WriteSize(upvalue_ids_.at(closure.GetUpvalue(i).get()));
+        }
+        break;
+      }
+      case ObjectType::kInstance:
+        writer->WriteSize(object_ids_.at(
+            &static_cast<const lox::Instance &>(*object).get_class()));
+        break;
+      case ObjectType::kBoundMethod: {
+        const auto &bound = static_cast<const lox::BoundMethod &>(*object);
+        WriteValue(writer, bound.get_receiver());
+        writer->WriteSize(object_ids_.at(bound.get_method().get()));
+        break;
+      }
+      case ObjectType::kList:
+      case ObjectType::kMap:
+        break;
+    }
+  }
+
+  // ...then what is filled in once they all exist.
+  for (const Object *object : objects_) {
+    switch (object->get_type()) {
+      case ObjectType::kFunction: {
+        auto chunk =
+            static_cast<const lox::Function &>(*object).GetCompiledChunk();
+        writer->WriteByte(chunk != nullptr ? 1 : 0);
+        if (chunk != nullptr) WriteChunk(writer, *chunk);
+        break;
+      }
+      case ObjectType::kClass: {
+        const auto &klass = static_cast<const lox::Class &>(*object);
+        writer->WriteSize(klass.get_method_count());
+        for (auto i = std::size_t{0}; i < klass.get_method_count(); ++i) {
+          writer->WriteString(klass.GetMethodName(i));
+          writer->WriteSize(object_ids_.at(klass.GetMethod(i).get()));
+        }
+        break;
+      }
+      case ObjectType::kInstance: {
+        const auto &instance = static_cast<const lox::Instance &>(*object);
+        const lox::Shape &shape = instance.get_shape();
+        writer->WriteSize(shape.get_field_count());
+        for (auto i = std::size_t{0}; i < shape.get_field_count(); ++i) {
+          writer->WriteString(shape.GetName(i));
+          WriteValue(writer, instance.GetField(i));
+        }
+        break;
+      }
+      case ObjectType::kList: {
+        const auto &list = static_cast<const lox::List &>(*object);
+        writer->WriteSize(list.get_size());
+        for (auto i = std::size_t{0}; i < list.get_size(); ++i) {
+          WriteValue(writer, list.Get(i));
+        }
+        break;
+      }
+      case ObjectType::kMap: {
+        const auto &map = static_cast<const lox::Map &>(*object);
+        writer->WriteSize(map.get_size());
+        for (const lox::Map::Entry &entry : map.get_entries()) {
+          if (std::holds_alternative<std::monostate>(entry.key)) continue;
+          WriteValue(writer, entry.key);
+          WriteValue(writer, entry.value);
+        }
+        break;
+      }
+      case ObjectType::kClosure:
+      case ObjectType::kBoundMethod:
+        break;
+    }
+  }
+  // ...including the values of the upvalues.
+  for (const lox::Upvalue *upvalue : upvalues_) {
+    WriteValue(writer, *upvalue->location);
+  }
+}
+
+void ImageEncoder::WriteValue(ImageWriter *writer,
+                              const lox::Value &value) const {
+  if (const auto *number = std::get_if<double>(&value)) {
+    writer->WriteByte(static_cast<std::uint8_t>(ValueTag::kNumber));
+    writer->WriteDouble(*number);
+  } else if (const auto *boolean = std::get_if<bool>(&value)) {
+    writer->WriteByte(static_cast<std::uint8_t>(ValueTag::kBool));
+    writer->WriteByte(*boolean ? 1 : 0);
+  } else if (const auto *str = std::get_if<std::string>(&value)) {
+    writer->WriteByte(static_cast<std::uint8_t>(ValueTag::kString));
+    writer->WriteString(*str);
+  } else if (const auto *object =
+                 std::get_if<std::shared_ptr<Object>>(&value)) {
+    writer->WriteByte(static_cast<std::uint8_t>(ValueTag::kObject));
+    writer->WriteSize(object_ids_.at(object->get()));
+  } else {
+    writer->WriteByte(static_cast<std::uint8_t>(ValueTag::kNil));
+  }
+}
+
+void ImageEncoder::WriteChunk(ImageWriter *writer,
+                              const lox::Chunk &chunk) const {
+  writer->WriteSize(chunk.GetCodeSize());
+  for (auto i = std::size_t{0}; i < chunk.GetCodeSize(); ++i) {
+    writer->WriteByte(chunk.GetCodePtr()[i]);
+    writer->WriteSize(chunk.GetLineAtIndex(i));
+  }
+  writer->WriteSize(chunk.GetConstantCount());
+  for (auto i = std::size_t{0}; i < chunk.GetConstantCount(); ++i) {
+    WriteValue(writer, chunk.GetValueAtIndex(i));
+  }
+  // Natives are the host's, so only their names are saved.
+  writer->WriteSize(chunk.GetNativeCount());
+  for (auto i = std::size_t{0}; i < chunk.GetNativeCount(); ++i) {
+    writer->WriteString(chunk.GetNative(i).get_name());
+    writer->WriteSize(chunk.GetNative(i).get_arity());
+  }
+  writer->WriteSize(chunk.GetInlineCacheCount());
+  for (auto i = std::size_t{0}; i < chunk.GetInlineCacheCount(); ++i) {
+    writer->WriteString(chunk.GetInlineCache(i).get_name());
+  }
+  writer->WriteSize(chunk.GetInputTypes().size());
+  for (lox::ValueType type : chunk.GetInputTypes()) {
+    writer->WriteByte(static_cast<std::uint8_t>(type));
+  }
+  writer->WriteByte(chunk.HasResult() ? 1 : 0);
+  writer->WriteSize(chunk.GetArgumentSlots());
+  writer->WriteSize(chunk.GetUpvalueCount());
+  writer->WriteByte(chunk.GetGlobalTable() != nullptr ? 1 : 0);
+}
+
+// Recreates what an ImageEncoder wrote, resolving the indices objects refer
+// to each other by into pointers. Any inconsistency fails the decoder.
+class ImageDecoder {
+ public:
+  ImageDecoder(ImageReader *reader, const lox::NativeTable &natives,
+               std::shared_ptr<lox::GlobalTable> globals)
+      : reader_(reader),
+        natives_(natives),
+        context_natives_(std::make_shared<const lox::NativeTable>(natives)),
+        globals_(std::move(globals)) {}
+
+  void ReadContexts();
+  void ReadObjects();
+  lox::Value ReadValue();
+
+  [[nodiscard]] bool failed() const { return failed_ || reader_->failed(); }
+  // The native an image's chunk called that the host has not defined, if
+  // that is why decoding failed.
+  [[nodiscard]] const std::optional<std::string> &get_missing_native() const {
+    return missing_native_;
+  }
+
+ private:
+  // Returns the object at the index read next if it exists yet and has one
+  // of types, or null after failing.
+  std::shared_ptr<Object> ReadObject(
+      std::initializer_list<ObjectType> types);
+  void ReadConstruction(ObjectType type);
+  void ReadFilling(const std::shared_ptr<Object> &object);
+  std::shared_ptr<const lox::Chunk> ReadChunk();
+  template <typename Enum>
+  Enum ReadEnum(Enum last);
+
+  ImageReader *reader_;
+  const lox::NativeTable &natives_;
+  std::shared_ptr<const lox::NativeTable> context_natives_;
+  std::shared_ptr<lox::GlobalTable> globals_;
+  std::vector<std::shared_ptr<const lox::FunctionContext>> contexts_;
+  std::vector<std::shared_ptr<lox::Upvalue>> upvalues_;
+  std::vector<std::shared_ptr<Object>> objects_;
+  std::optional<std::string> missing_native_;
+  bool failed_ = false;
+};
+
+template <typename Enum>
+Enum ImageDecoder::ReadEnum(Enum last) {
+  std::uint8_t value = reader_->ReadByte();
+  if (value > static_cast<std::uint8_t>(last)) failed_ = true;
+  return failed_ ? Enum{} : static_cast<Enum>(value);
+}
+
+void ImageDecoder::ReadContexts() {
+  std::size_t count = reader_->ReadCount();
+  for (auto i = std::size_t{0}; i < count && !failed(); ++i) {
+    auto context = lox::FunctionContext{};
+    context.source = reader_->ReadString();
+    context.optimization_level = ReadEnum(lox::OptimizationLevel::kO2);
+    context.input_names.resize(reader_->ReadCount());
+    for (std::string &name : context.input_names) name = reader_->ReadString();
+    context.input_types.resize(reader_->ReadCount());
+    for (lox::ValueType &type : context.input_types) {
+      type = ReadEnum(lox::ValueType::kObject);
+    }
+    context.natives = context_natives_;
+    context.globals = globals_;
+    contexts_.push_back(
+        std::make_shared<const lox::FunctionContext>(std::move(context)));
+  }
+}
+
+void ImageDecoder::ReadObjects() {
+  // Every upvalue is closed by the time the image is saved.
+  upvalues_.resize(reader_->ReadCount());
+  for (std::shared_ptr<lox::Upvalue> &upvalue : upvalues_) {
+    upvalue = std::make_shared<lox::Upvalue>();
+    upvalue->location = &upvalue->closed;
+  }
+  std::size_t count = reader_->ReadCount();
+  objects_.reserve(count);
+  for (auto i = std::size_t{0}; i < count && !failed(); ++i) {
+    ReadConstruction(ReadEnum(ObjectType::kMap));
+  }
+  for (auto i = std::size_t{0}; i < objects_.size() && !failed(); ++i) {
+    ReadFilling(objects_[i]);
+  }
+  for (const std::shared_ptr<lox::Upvalue> &upvalue : upvalues_) {
+    upvalue->closed = ReadValue();
+  }
+}
+
+void ImageDecoder::ReadConstruction(ObjectType type) {
+  switch (type) {
+    case ObjectType::kFunction: {
+      std::string name = reader_->ReadString();
+      auto kind = ReadEnum(lox::FunctionKind::kInitializer);
+      std::size_t arity = reader_->ReadSize();
+      std::size_t context = reader_->ReadSize();
+      std::size_t start = reader_->ReadSize();
+      std::size_t end = reader_->ReadSize();
+      std::size_t line = reader_->ReadSize();
+      auto captures = std::vector<lox::Capture>(reader_->ReadCount());
+      for (lox::Capture &capture : captures) {
+        capture.name = reader_->ReadString();
+        capture.is_local = reader_->ReadByte() != 0;
+        capture.index = reader_->ReadSize();
+      }
+      if (context >= contexts_.size() || start > end ||
+          end > contexts_[context]->source.size()) {
+        failed_ = true;
+        return;
+      }
+      objects_.push_back(std::make_shared<lox::Function>(
+          std::move(name), kind, arity, contexts_[context], start, end, line,
+          std::move(captures)));
+      break;
+    }
+    case ObjectType::kClass:
+      objects_.push_back(std::make_shared<lox::Class>(reader_->ReadString()));
+      break;
+    case ObjectType::kClosure: {
+      auto function = std::static_pointer_cast<const lox::Function>(
+          ReadObject({ObjectType::kFunction}));
+      auto upvalues = std::vector<std::shared_ptr<lox::Upvalue>>(
+          reader_->ReadCount());
+      for (std::shared_ptr<lox::Upvalue> &upvalue : upvalues) {
+        std::size_t index = reader_->ReadSize();
+        if (index >= upvalues_.size()) {
+          failed_ = true;
+          return;
+        }
+        upvalue = upvalues_[index];
+      }
+      // Compiled code trusts a closure to hold what its function captures.
+      if (function == nullptr ||
+          upvalues.size() != function->get_captures().size()) {
+        failed_ = true;
+        return;
+      }
+      objects_.push_back(std::make_shared<lox::Closure>(std::move(function),
+                                                        std::move(upvalues)));
+      break;
+    }
+    case ObjectType::kInstance: {
+      auto klass = std::static_pointer_cast<lox::Class>(
+          ReadObject({ObjectType::kClass}));
+      if (klass == nullptr) return;
+      objects_.push_back(std::make_shared<lox::Instance>(std::move(klass)));
+      break;
+    }
+    case ObjectType::kBoundMethod: {
+      lox::Value receiver = ReadValue();
+      auto method =
+          ReadObject({ObjectType::kFunction, ObjectType::kClosure});
+      if (method == nullptr) return;
+      objects_.push_back(std::make_shared<lox::BoundMethod>(
+          std::move(receiver), std::move(method)));
+      break;
+    }
+    case ObjectType::kList:
+      objects_.push_back(std::make_shared<lox::List>());
+      break;
+    case ObjectType::kMap:
+      objects_.push_back(std::make_shared<lox::Map>());
+      break;
+  }
+}
+
+void ImageDecoder::ReadFilling(const std::shared_ptr<Object> &object) {
+  switch (object->get_type()) {
+    case ObjectType::kFunction:
+      if (reader_->ReadByte() != 0) {
+        auto chunk = ReadChunk();
+        if (chunk != nullptr) {
+          static_cast<lox::Function &>(*object).SetChunk(std::move(chunk));
+        }
+      }
+      break;
+    case ObjectType::kClass: {
+      auto &klass = static_cast<lox::Class &>(*object);
+      std::size_t count = reader_->ReadCount();
+      for (auto i = std::size_t{0}; i < count && !failed(); ++i) {
+        std::string name = reader_->ReadString();
+        auto method =
+            ReadObject({ObjectType::kFunction, ObjectType::kClosure});
+        if (method != nullptr) klass.SetMethod(name, std::move(method));
+      }
+      break;
+    }
+    case ObjectType::kInstance: {
+      auto &instance = static_cast<lox::Instance &>(*object);
+      std::size_t count = reader_->ReadCount();
+      for (auto i = std::size_t{0}; i < count && !failed(); ++i) {
+        std::string name = reader_->ReadString();
+        instance.AddField(name, ReadValue());
+      }
+      break;
+    }
+    case ObjectType::kList: {
+      auto &list = static_cast<lox::List &>(*object);
+      std::size_t count = reader_->ReadCount();
+      for (auto i = std::size_t{0}; i < count && !failed(); ++i) {
+        list.Push(ReadValue());
+      }
+      break;
+    }
+    case ObjectType::kMap: {
+      auto &map = static_cast<lox::Map &>(*object);
+      std::size_t count = reader_->ReadCount();
+      for (auto i = std::size_t{0}; i < count && !failed(); ++i) {
+        lox::Value key = ReadValue();
+        lox::Value value = ReadValue();
+        if (failed()) break;
+        if (lox::Map::CheckKey(key) != nullptr) {
+          failed_ = true;
+          break;
+        }
+        map.Set(key, std::move(value));
+      }
+      break;
+    }
+    case ObjectType::kClosure:
+    case ObjectType::kBoundMethod:
+      break;
+  }
+}
+
+lox::Value ImageDecoder::ReadValue() {
+  switch (ReadEnum(ValueTag::kObject)) {
+    case ValueTag::kNil:
+      return std::monostate{};
+    case ValueTag::kNumber:
+      return reader_->ReadDouble();
+    case ValueTag::kBool:
+      return reader_->ReadByte() != 0;
+    case ValueTag::kString:
+      return reader_->ReadString();
+    case ValueTag::kObject:
+      return ReadObject({ObjectType::kFunction, ObjectType::kClosure,
+                         ObjectType::kClass, ObjectType::kInstance,
+                         ObjectType::kBoundMethod, ObjectType::kList,
+                         ObjectType::kMap});
+  }
+  return std::monostate{};
+}
+
+std::shared_ptr<Object> ImageDecoder::ReadObject(
+    std::initializer_list<ObjectType> types) {
+  std::size_t index = reader_->ReadSize();
+  if (index >= objects_.size() ||
+      std::find(types.begin(), types.end(), objects_[index]->get_type()) ==
+          types.end()) {
+    failed_ = true;
+    return nullptr;
+  }
+  return objects_[index];
+}
+
+std::shared_ptr<const lox::Chunk> ImageDecoder::ReadChunk() {
+  auto chunk = std::make_shared<lox::Chunk>();
+  std::size_t code_size = reader_->ReadCount();
+  for (auto i = std::size_t{0}; i < code_size; ++i) {
+    std::uint8_t code = reader_->ReadByte();
+    chunk->Write(code, reader_->ReadSize());
+  }
+  std::size_t constants = reader_->ReadCount();
+  for (auto i = std::size_t{0}; i < constants && !failed(); ++i) {
+    chunk->AddConstant(ReadValue());
+  }
+  std::size_t natives = reader_->ReadCount();
+  for (auto i = std::size_t{0}; i < natives && !failed(); ++i) {
+    std::string name = reader_->ReadString();
+    std::size_t arity = reader_->ReadSize();
+    auto native = natives_.Find(name);
+    if (native == nullptr || native->get_arity() != arity) {
+      missing_native_ = std::move(name);
+      failed_ = true;
+      return nullptr;
+    }
+    if (chunk->AddNative(std::move(native)) != i) failed_ = true;
+  }
+  std::size_t caches = reader_->ReadCount();
+  for (auto i = std::size_t{0}; i < caches; ++i) {
+    chunk->AddInlineCache(reader_->ReadString());
+  }
+  auto input_types = std::vector<lox::ValueType>(reader_->ReadCount());
+  for (lox::ValueType &type : input_types) {
+    type = ReadEnum(lox::ValueType::kObject);
+  }
+  chunk->SetInputTypes(std::move(input_types));
+  chunk->SetHasResult(reader_->ReadByte() != 0);
+  chunk->SetArgumentSlots(reader_->ReadSize());
+  chunk->SetUpvalueCount(reader_->ReadSize());
+  if (reader_->ReadByte() != 0) chunk->SetGlobalTable(globals_);
+  if (failed()) return nullptr;
+
+  // The image is not trusted: a chunk that fails verification runs
+  // checked, as it would have had it been compiled here.
+  auto verifier = lox::Verifier{};
+  verifier.Verify(chunk.get());
+  chunk->Freeze();
+  return chunk;
+}
+
+}  // namespace
+
+namespace lox {
+
+bool Snapshot::Save(const VirtualMachine &vm, const std::string &path) {
+  if (vm.IsSuspended()) {
+    *vm.errors_ << "Can't save a snapshot of a suspended run.\n";
+    return false;
+  }
+  auto encoder = ImageEncoder{vm.globals_};
+  auto writer = ImageWriter{};
+  for (char c : kMagic) writer.WriteByte(static_cast<std::uint8_t>(c));
+  // The names come first, so that chunks are verified against them all.
+  std::size_t count = vm.global_table_->GetCount();
+  writer.WriteSize(count);
+  for (auto slot = std::size_t{0}; slot < count; ++slot) {
+    writer.WriteString(vm.global_table_->GetName(slot));
+  }
+  encoder.WriteContexts(&writer);
+  encoder.WriteObjects(&writer);
+  for (auto slot = std::size_t{0}; slot < count; ++slot) {
+    bool defined = slot < vm.globals_.size() && vm.globals_[slot];
+    writer.WriteByte(defined ? 1 : 0);
+    if (defined) encoder.WriteValue(&writer, *vm.globals_[slot]);
+  }
+
+  auto file = std::ofstream{path, std::ios::binary | std::ios::trunc};
+  const std::string &bytes = writer.get_bytes();
+  file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  file.close();
+  if (!file) {
+    *vm.errors_ << "Can't write snapshot to '" << path << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+bool Snapshot::Load(const std::string &path, VirtualMachine *vm) {
+  auto file = MappedFile{path};
+  if (file.get_data() == nullptr) {
+    *vm->errors_ << "Can't read snapshot '" << path << "'.\n";
+    return false;
+  }
+  auto reader = ImageReader{file.get_data(), file.get_size()};
+  auto malformed = [vm, &path]() {
+    *vm->errors_ << "Snapshot '" << path << "' is malformed.\n";
+    return false;
+  };
+  for (char c : kMagic) {
+    if (reader.ReadByte() != static_cast<std::uint8_t>(c)) return malformed();
+  }
+
+  auto table = std::make_shared<GlobalTable>();
+  auto globals = std::vector<std::optional<Value>>(reader.ReadCount());
+  for (auto slot = std::size_t{0}; slot < globals.size(); ++slot) {
+    std::optional<std::size_t> resolved = table->Resolve(reader.ReadString());
+    if (resolved != slot) return malformed();
+  }
+  auto decoder = ImageDecoder{&reader, vm->natives_, table};
+  decoder.ReadContexts();
+  decoder.ReadObjects();
+  for (std::optional<Value> &global : globals) {
+    if (reader.ReadByte() != 0) global = decoder.ReadValue();
+  }
+  if (const auto &native = decoder.get_missing_native()) {
+    *vm->errors_ << "Snapshot '" << path << "' needs native function '"
+                 << *native << "'.\n";
+    return false;
+  }
+  if (decoder.failed() || !reader.AtEnd()) return malformed();
+
+  vm->ResetGlobals(std::move(table));
+  vm->globals_ = std::move(globals);
+  return true;
+}
+
+}  // namespace lox
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_SNAPSHOT_H
+#define LOX_SRC_SNAPSHOT_H
+
+#include <string>
+
+#include "vm.h"
+
+namespace lox {
+
+// Saves the state a machine is left in by running a script, such as a
+// prelude defining functions and classes, as an image another process can
+// start from instead of running the script again. The image holds the
+// global variables and their names, every object they reach, the source
+// the functions among them are compiled from, and the chunks of those that
+// have been compiled already. Objects refer to each other by index into
+// the image, which is mapped into memory when loading and decoded in one
+// pass, resolving the indices into pointers to the objects it creates.
+class Snapshot {
+ public:
+  // Writes vm's state to the file at path. Returns false after reporting
+  // an error to vm's error output.
+  static bool Save(const VirtualMachine &vm, const std::string &path);
+  // Replaces vm's global variables with those in the image at path. The
+  // natives the image's functions call must have been defined on vm
+  // first, with the same arity. Returns false after reporting an error,
+  // leaving vm as it was.
+  static bool Load(const std::string &path, VirtualMachine *vm);
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_SNAPSHOT_H
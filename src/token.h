@@ -14,7 +14,8 @@ enum class TokenType {
   // Single character tokens.
   kLeftParen, kRightParen,
   kLeftBrace, kRightBrace,
-  kComma, kDot, kMinus, kPlus,
+  kLeftBracket, kRightBracket,
+  kColon, kComma, kDot, kMinus, kPlus,
   kSemicolon, kSlash, kStar,
 
   // One or two character tokens
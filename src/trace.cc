@@ -0,0 +1,796 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "trace.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <variant>
+
+#include "list.h"
+#include "map.h"
+#include "runtime.h"
+#include "vm.h"
+
+namespace {
+
+using lox::Value;
+
+// The exit of an instruction that cannot exit.
+constexpr auto kNoExit = std::numeric_limits<std::uint32_t>::max();
+
+template <typename T>
+T *GetObject(const Value &value, lox::ObjectType type) {
+  const auto *object = std::get_if<std::shared_ptr<lox::Object>>(&value);
+  if (object == nullptr || (*object)->get_type() != type) return nullptr;
+  return static_cast<T *>(object->get());
+}
+
+// Stores op applied to doubles a and b in *result, or returns false if they
+// are not both doubles. result may be either operand.
+template <typename Operator>
+bool DoubleOp(const Value &a, const Value &b, Value *result, Operator op) {
+  const auto *x = std::get_if<double>(&a);
+  const auto *y = std::get_if<double>(&b);
+  if (x == nullptr || y == nullptr) return false;
+  double value = op(*x, *y);
+  *result = value;
+  return true;
+}
+
+// Likewise for any numbers, as NumberOp() would, returning false where it
+// would raise an error.
+template <typename Operator>
+bool GenericOp(const Value &a, const Value &b, Value *result, Operator op) {
+  Value value = a;
+  if (lox::NumberOp(&value, b, op) != nullptr) return false;
+  *result = std::move(value);
+  return true;
+}
+
+// Returns whether op holds for a and b, or nullopt unless they are both Ts.
+template <typename T, typename Operator>
+std::optional<bool> Compare(const Value &a, const Value &b, Operator op) {
+  const auto *x = std::get_if<T>(&a);
+  const auto *y = std::get_if<T>(&b);
+  if (x == nullptr || y == nullptr) return std::nullopt;
+  return op(*x, *y);
+}
+
+// kGetIndex and kSetIndex, which return false where the machine would
+// raise an error. kSetIndex works in place, on the container, index and
+// value beneath top, like the bytecode.
+bool GetIndex(const Value &container, const Value &key, Value *result) {
+  auto element = Value{};
+  if (auto *map = GetObject<lox::Map>(container, lox::ObjectType::kMap)) {
+    if (lox::Map::CheckKey(key) != nullptr) return false;
+    if (const Value *value = map->Find(key)) element = *value;
+  } else if (auto *list =
+                 GetObject<lox::List>(container, lox::ObjectType::kList)) {
+    std::optional<std::size_t> index = list->GetIndex(key);
+    if (!index) return false;
+    element = list->Get(*index);
+  } else {
+    return false;
+  }
+  *result = std::move(element);
+  return true;
+}
+
+bool SetIndex(Value *top) {
+  if (auto *map = GetObject<lox::Map>(top[-3], lox::ObjectType::kMap)) {
+    if (lox::Map::CheckKey(top[-2]) != nullptr) return false;
+    map->Set(top[-2], top[-1]);
+  } else if (auto *list =
+                 GetObject<lox::List>(top[-3], lox::ObjectType::kList)) {
+    std::optional<std::size_t> index = list->GetIndex(top[-2]);
+    if (!index) return false;
+    list->Set(*index, top[-1]);
+  } else {
+    return false;
+  }
+  top[-3] = std::move(top[-1]);
+  return true;
+}
+
+// The kExitUnless* instruction fusing comparison with the guard on its
+// result, or nullopt if there is none.
+std::optional<lox::TraceOpcode> GetGuard(lox::TraceOpcode comparison) {
+  using lox::TraceOpcode;
+  switch (comparison) {
+    case TraceOpcode::kGreaterDouble:
+      return TraceOpcode::kExitUnlessGreaterDouble;
+    case TraceOpcode::kGreaterEqualDouble:
+      return TraceOpcode::kExitUnlessGreaterEqualDouble;
+    case TraceOpcode::kLessDouble:
+      return TraceOpcode::kExitUnlessLessDouble;
+    case TraceOpcode::kLessEqualDouble:
+      return TraceOpcode::kExitUnlessLessEqualDouble;
+    default:
+      return std::nullopt;
+  }
+}
+
+// Whether an instruction does nothing but compute a value into dst, which
+// could as well be any other slot.
+bool OnlyWritesDst(lox::TraceOpcode opcode) {
+  using lox::TraceOpcode;
+  switch (opcode) {
+    case TraceOpcode::kSetGlobal:
+    case TraceOpcode::kSetUpvalue:
+    case TraceOpcode::kSetIndex:
+    case TraceOpcode::kPrint:
+      return false;
+    default:
+      // The guards come last.
+      return opcode < TraceOpcode::kExitIfFalsey;
+  }
+}
+
+}  // namespace
+
+namespace lox {
+
+// Compiles the steps of a recording into a trace, following where each
+// value the bytecode would have on the stack is as it goes: in its own
+// slot, or still wherever it was copied from.
+class TraceBuilder {
+ public:
+  TraceBuilder(const Chunk &chunk, std::size_t depth, Trace *trace)
+      : chunk_(chunk), base_(depth), trace_(trace) {}
+
+  // Returns false if a step cannot be replayed after all.
+  bool Build(const std::vector<Trace::Step> &steps);
+
+ private:
+  using Space = TraceOperand::Space;
+
+  [[nodiscard]] std::uint32_t get_depth() const {
+    return static_cast<std::uint32_t>(base_ + stack_.size());
+  }
+  // Whether the value at depth in the stack is in its own slot.
+  [[nodiscard]] bool IsInPlace(std::size_t depth) const {
+    return RefersTo(stack_[depth - base_], depth);
+  }
+  [[nodiscard]] static bool RefersTo(const TraceOperand &value,
+                                     std::size_t slot) {
+    return value.space == Space::kSlot && value.index == slot;
+  }
+
+  bool AddStep(const Trace::Step &step);
+  // Where the value in slot is, or nullopt if it is past the stack.
+  [[nodiscard]] std::optional<TraceOperand> Read(std::size_t slot) const;
+  TraceOperand AddConstant(Value value);
+  TraceOperand Pop();
+  // Emits instruction, which computes the value pushed next.
+  void PushResult(TraceInstruction instruction);
+  // Copies the value at depth in the stack into its own slot.
+  void Materialize(std::size_t depth);
+  // Copies every value still where it was copied from into its own slot,
+  // if it was copied from slot, or with nullopt, from any slot.
+  void MaterializeCopiesOf(std::optional<std::size_t> slot);
+  void SetLocal(std::size_t slot);
+  // Returns the exit of an instruction standing for the one at ip.
+  std::uint32_t AddExit(const std::uint8_t *ip);
+  void Emit(TraceInstruction instruction);
+
+  const Chunk &chunk_;
+  // How deep the stack is at the start of the loop.
+  std::size_t base_;
+  Trace *trace_;
+  // Where each value the bytecode would have on the stack above base_ is.
+  std::vector<TraceOperand> stack_;
+};
+
+bool TraceBuilder::Build(const std::vector<Trace::Step> &steps) {
+  for (const Trace::Step &step : steps) {
+    if (step.depth != get_depth() || !AddStep(step)) return false;
+  }
+  // An iteration leaves the stack as it found it.
+  return stack_.empty();
+}
+
+bool TraceBuilder::AddStep(const Trace::Step &step) {
+  const std::uint8_t *ip = step.ip;
+  auto instruction = TraceInstruction{};
+  instruction.opcode = step.opcode;
+  instruction.exit = kNoExit;
+  auto get_index = [ip](bool is_long) {
+    return static_cast<std::uint32_t>(is_long ? ReadLongOperand(ip + 1)
+                                              : std::size_t{ip[1]});
+  };
+
+  auto opcode = static_cast<Opcode>(*ip);
+  switch (opcode) {
+    case Opcode::kConstant:
+    case Opcode::kConstantLong:
+      stack_.push_back(AddConstant(chunk_.GetValueAtIndex(
+          get_index(opcode == Opcode::kConstantLong))));
+      return true;
+    case Opcode::kNil:
+      stack_.push_back(AddConstant(std::monostate{}));
+      return true;
+    case Opcode::kTrue:
+    case Opcode::kFalse:
+      stack_.push_back(AddConstant(opcode == Opcode::kTrue));
+      return true;
+    case Opcode::kPop:
+      Pop();
+      return true;
+    case Opcode::kPopN:
+      for (auto i = 0; i < ip[1]; ++i) Pop();
+      return true;
+    case Opcode::kPick: {
+      std::optional<TraceOperand> value = Read(get_depth() - 1u - ip[1]);
+      if (!value) return false;
+      stack_.push_back(*value);
+      return true;
+    }
+    case Opcode::kSlide: {
+      TraceOperand value = Pop();
+      for (auto i = 0; i < ip[1]; ++i) Pop();
+      auto slot = get_depth();
+      stack_.push_back(value);
+      // A value still in a slot popped is copied down before the slot is
+      // used again.
+      if (value.space == Space::kSlot && value.index > slot) {
+        Materialize(slot);
+      }
+      return true;
+    }
+    case Opcode::kGetLocal:
+    case Opcode::kGetLocalLong: {
+      std::optional<TraceOperand> value =
+          Read(get_index(opcode == Opcode::kGetLocalLong));
+      if (!value) return false;
+      stack_.push_back(*value);
+      return true;
+    }
+    case Opcode::kSetLocal:
+    case Opcode::kSetLocalLong: {
+      std::uint32_t slot = get_index(opcode == Opcode::kSetLocalLong);
+      if (slot + 1 >= get_depth()) return false;
+      SetLocal(slot);
+      return true;
+    }
+    case Opcode::kGetInput:
+    case Opcode::kGetGlobal:
+    case Opcode::kGetGlobalLong:
+    case Opcode::kGetUpvalue:
+      if (opcode == Opcode::kGetInput) {
+        instruction.opcode = TraceOpcode::kGetInput;
+      } else if (opcode == Opcode::kGetUpvalue) {
+        instruction.opcode = TraceOpcode::kGetUpvalue;
+      } else {
+        instruction.opcode = TraceOpcode::kGetGlobal;
+        instruction.exit = AddExit(ip);
+      }
+      instruction.a.index = get_index(opcode == Opcode::kGetGlobalLong);
+      PushResult(instruction);
+      return true;
+    case Opcode::kSetGlobal:
+    case Opcode::kSetGlobalLong:
+      instruction.opcode = TraceOpcode::kSetGlobal;
+      instruction.exit = AddExit(ip);
+      instruction.a = stack_.back();
+      instruction.b.index = get_index(opcode == Opcode::kSetGlobalLong);
+      Emit(instruction);
+      return true;
+    case Opcode::kSetUpvalue:
+      // An upvalue may be one of the frame's slots, so no value is left
+      // where it was copied from.
+      MaterializeCopiesOf(std::nullopt);
+      instruction.opcode = TraceOpcode::kSetUpvalue;
+      instruction.a = stack_.back();
+      instruction.b.index = ip[1];
+      Emit(instruction);
+      return true;
+    case Opcode::kEqual:
+    case Opcode::kNotEqual:
+      instruction.opcode = opcode == Opcode::kEqual ? TraceOpcode::kEqual
+                                                    : TraceOpcode::kNotEqual;
+      instruction.b = Pop();
+      instruction.a = Pop();
+      PushResult(instruction);
+      return true;
+    case Opcode::kNot:
+      instruction.opcode = TraceOpcode::kNot;
+      instruction.a = Pop();
+      PushResult(instruction);
+      return true;
+    case Opcode::kNegate:
+    case Opcode::kNegateNumber:
+      instruction.opcode = TraceOpcode::kNegate;
+      instruction.exit = AddExit(ip);
+      instruction.a = Pop();
+      PushResult(instruction);
+      return true;
+    case Opcode::kAdd:
+    case Opcode::kAddNumber:
+    case Opcode::kAddString:
+    case Opcode::kSubtract:
+    case Opcode::kSubtractNumber:
+    case Opcode::kMultiply:
+    case Opcode::kMultiplyNumber:
+    case Opcode::kDivide:
+    case Opcode::kDivideNumber:
+    case Opcode::kGreater:
+    case Opcode::kGreaterNumber:
+    case Opcode::kGreaterEqual:
+    case Opcode::kGreaterEqualNumber:
+    case Opcode::kLess:
+    case Opcode::kLessNumber:
+    case Opcode::kLessEqual:
+    case Opcode::kLessEqualNumber:
+    case Opcode::kGetIndex:
+      instruction.exit = AddExit(ip);
+      instruction.b = Pop();
+      instruction.a = Pop();
+      PushResult(instruction);
+      return true;
+    case Opcode::kSetIndex:
+      for (std::size_t depth = get_depth() - 3; depth < get_depth(); ++depth) {
+        Materialize(depth);
+      }
+      instruction.exit = AddExit(ip);
+      Pop();
+      Pop();
+      Pop();
+      PushResult(instruction);
+      return true;
+    case Opcode::kPrint:
+      instruction.opcode = TraceOpcode::kPrint;
+      instruction.a = Pop();
+      Emit(instruction);
+      return true;
+    case Opcode::kJump:
+    case Opcode::kLoop:
+      return true;
+    case Opcode::kJumpIfFalse: {
+      // A comparison just made is fused with the guard, after which its
+      // result is known.
+      auto expected = instruction.opcode == TraceOpcode::kExitIfFalsey;
+      std::vector<TraceInstruction> &instructions = trace_->instructions_;
+      std::optional<TraceOpcode> guard;
+      if (!instructions.empty() && IsInPlace(get_depth() - 1) &&
+          instructions.back().dst == get_depth() - 1) {
+        guard = GetGuard(instructions.back().opcode);
+      }
+      if (guard) {
+        instructions.back().opcode = *guard;
+        instructions.back().expected = expected;
+        stack_.back() = AddConstant(expected);
+        return true;
+      }
+      instruction.exit = AddExit(ip);
+      instruction.a = stack_.back();
+      Emit(instruction);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+std::optional<TraceOperand> TraceBuilder::Read(std::size_t slot) const {
+  if (slot < base_) {
+    return TraceOperand{Space::kSlot, static_cast<std::uint32_t>(slot)};
+  }
+  if (slot >= get_depth()) return std::nullopt;
+  return stack_[slot - base_];
+}
+
+TraceOperand TraceBuilder::AddConstant(Value value) {
+  trace_->constants_.push_back(std::move(value));
+  return TraceOperand{
+      Space::kConstant,
+      static_cast<std::uint32_t>(trace_->constants_.size() - 1)};
+}
+
+TraceOperand TraceBuilder::Pop() {
+  TraceOperand value = stack_.back();
+  stack_.pop_back();
+  return value;
+}
+
+void TraceBuilder::PushResult(TraceInstruction instruction) {
+  instruction.dst = get_depth();
+  stack_.push_back(TraceOperand{Space::kSlot, get_depth()});
+  Emit(instruction);
+}
+
+void TraceBuilder::Materialize(std::size_t depth) {
+  if (IsInPlace(depth)) return;
+  auto instruction = TraceInstruction{};
+  instruction.opcode = TraceOpcode::kCopy;
+  instruction.a = stack_[depth - base_];
+  instruction.dst = static_cast<std::uint32_t>(depth);
+  instruction.exit = kNoExit;
+  Emit(instruction);
+  stack_[depth - base_] = TraceOperand{Space::kSlot, instruction.dst};
+}
+
+void TraceBuilder::MaterializeCopiesOf(std::optional<std::size_t> slot) {
+  for (std::size_t depth = base_; depth < get_depth(); ++depth) {
+    const TraceOperand &value = stack_[depth - base_];
+    if (value.space == Space::kSlot && (!slot || value.index == *slot)) {
+      Materialize(depth);
+    }
+  }
+}
+
+void TraceBuilder::SetLocal(std::size_t slot) {
+  auto local = TraceOperand{Space::kSlot, static_cast<std::uint32_t>(slot)};
+  if (RefersTo(stack_.back(), slot)) return;
+  std::size_t top = get_depth() - 1u;
+  bool copied = std::any_of(
+      stack_.begin(), stack_.end(),
+      [slot](const TraceOperand &value) { return RefersTo(value, slot); });
+  // The instruction that computed the value can as well store it in the
+  // local, for the stack to read from there, unless the stack still has
+  // the local's old value.
+  std::vector<TraceInstruction> &instructions = trace_->instructions_;
+  if (!copied && IsInPlace(top) && !instructions.empty() &&
+      instructions.back().dst == top &&
+      OnlyWritesDst(instructions.back().opcode)) {
+    instructions.back().dst = local.index;
+    stack_.back() = local;
+  } else {
+    MaterializeCopiesOf(slot);
+    auto instruction = TraceInstruction{};
+    instruction.opcode = TraceOpcode::kCopy;
+    instruction.a = stack_.back();
+    instruction.dst = local.index;
+    instruction.exit = kNoExit;
+    Emit(instruction);
+  }
+  if (slot >= base_) stack_[slot - base_] = local;
+}
+
+std::uint32_t TraceBuilder::AddExit(const std::uint8_t *ip) {
+  std::vector<Trace::Copy> &copies = trace_->copies_;
+  auto first_copy = static_cast<std::uint32_t>(copies.size());
+  for (std::size_t depth = base_; depth < get_depth(); ++depth) {
+    if (!IsInPlace(depth)) {
+      copies.push_back(Trace::Copy{static_cast<std::uint32_t>(depth),
+                                   stack_[depth - base_]});
+    }
+  }
+  trace_->exits_.push_back(Trace::ExitInfo{
+      ip, get_depth(), first_copy,
+      static_cast<std::uint32_t>(copies.size() - first_copy)});
+  return static_cast<std::uint32_t>(trace_->exits_.size() - 1);
+}
+
+void TraceBuilder::Emit(TraceInstruction instruction) {
+  trace_->instructions_.push_back(instruction);
+}
+
+std::unique_ptr<const Trace> Trace::Compile(const Chunk &chunk,
+                                            const std::vector<Step> &steps) {
+  auto trace = std::unique_ptr<Trace>{new Trace{}};
+  trace->header_ = steps.front().ip;
+  trace->depth_ = steps.front().depth;
+  if (!TraceBuilder{chunk, trace->depth_, trace.get()}.Build(steps)) {
+    return nullptr;
+  }
+  return trace;
+}
+
+Trace::Exit Trace::Run(VirtualMachine *vm, Value *slots,
+                       const Closure *closure) const {
+#define EXIT_UNLESS(condition)                               \
+  do {                                                       \
+    if (!(condition)) {                                      \
+      return Leave(vm, slots, instruction.exit, iterations); \
+    }                                                        \
+  } while (false)
+#define BINARY_OP(kind, op)                                              \
+  EXIT_UNLESS(kind(get(instruction.a), get(instruction.b), &dst, op{})); \
+  break
+#define COMPARE_OP(type, op)                                         \
+  do {                                                               \
+    std::optional<bool> result =                                     \
+        Compare<type>(get(instruction.a), get(instruction.b), op{}); \
+    EXIT_UNLESS(result);                                             \
+    dst = *result;                                                   \
+  } while (false);                                                   \
+  break
+#define EXIT_UNLESS_COMPARE(type, op)                                \
+  do {                                                               \
+    std::optional<bool> result =                                     \
+        Compare<type>(get(instruction.a), get(instruction.b), op{}); \
+    EXIT_UNLESS(result && *result == instruction.expected);          \
+  } while (false);                                                   \
+  break
+
+  // Every run of the loop starts at the same depth, unless the trace is
+  // another frame's of the same chunk, and the frame is somewhere else.
+  if (vm->stack_top_ != slots + depth_) return {header_, 0};
+  const Value *const spaces[] = {slots, constants_.data()};
+  auto get = [&spaces](TraceOperand operand) -> const Value & {
+    return spaces[operand.space][operand.index];
+  };
+  for (auto iterations = std::size_t{0};; ++iterations) {
+    for (const TraceInstruction &instruction : instructions_) {
+      Value &dst = slots[instruction.dst];
+      switch (instruction.opcode) {
+        case TraceOpcode::kCopy:
+          dst = get(instruction.a);
+          break;
+        case TraceOpcode::kGetInput:
+          dst = (*vm->inputs_)[instruction.a.index];
+          break;
+        case TraceOpcode::kGetGlobal: {
+          const std::optional<Value> &global =
+              vm->globals_[instruction.a.index];
+          EXIT_UNLESS(global);
+          dst = *global;
+          break;
+        }
+        case TraceOpcode::kSetGlobal: {
+          std::optional<Value> &global = vm->globals_[instruction.b.index];
+          EXIT_UNLESS(global);
+          *global = get(instruction.a);
+          break;
+        }
+        case TraceOpcode::kGetUpvalue:
+          dst = *closure->GetUpvalue(instruction.a.index)->location;
+          break;
+        case TraceOpcode::kSetUpvalue:
+          *closure->GetUpvalue(instruction.b.index)->location =
+              get(instruction.a);
+          break;
+        case TraceOpcode::kEqual:
+        case TraceOpcode::kNotEqual: {
+          bool equal = get(instruction.a) == get(instruction.b);
+          dst = equal == (instruction.opcode == TraceOpcode::kEqual);
+          break;
+        }
+        case TraceOpcode::kNot: {
+          bool falsey = IsFalsey(get(instruction.a));
+          dst = falsey;
+          break;
+        }
+        case TraceOpcode::kNegate: {
+          Value value = get(instruction.a);
+          EXIT_UNLESS(lox::Negate(&value) == nullptr);
+          dst = std::move(value);
+          break;
+        }
+        case TraceOpcode::kAdd: {
+          Value value = get(instruction.a);
+          EXIT_UNLESS(lox::Add(&value, get(instruction.b)) == nullptr);
+          dst = std::move(value);
+          break;
+        }
+        case TraceOpcode::kSubtract:
+          BINARY_OP(GenericOp, std::minus<>);
+        case TraceOpcode::kMultiply:
+          BINARY_OP(GenericOp, std::multiplies<>);
+        case TraceOpcode::kDivide:
+          BINARY_OP(GenericOp, std::divides<>);
+        case TraceOpcode::kGreater:
+          BINARY_OP(GenericOp, std::greater<>);
+        case TraceOpcode::kGreaterEqual:
+          BINARY_OP(GenericOp, std::greater_equal<>);
+        case TraceOpcode::kLess:
+          BINARY_OP(GenericOp, std::less<>);
+        case TraceOpcode::kLessEqual:
+          BINARY_OP(GenericOp, std::less_equal<>);
+        case TraceOpcode::kAddDouble:
+          BINARY_OP(DoubleOp, std::plus<>);
+        case TraceOpcode::kSubtractDouble:
+          BINARY_OP(DoubleOp, std::minus<>);
+        case TraceOpcode::kMultiplyDouble:
+          BINARY_OP(DoubleOp, std::multiplies<>);
+        case TraceOpcode::kDivideDouble:
+          BINARY_OP(DoubleOp, std::divides<>);
+        case TraceOpcode::kGreaterDouble:
+          COMPARE_OP(double, std::greater<>);
+        case TraceOpcode::kGreaterEqualDouble:
+          COMPARE_OP(double, std::greater_equal<>);
+        case TraceOpcode::kLessDouble:
+          COMPARE_OP(double, std::less<>);
+        case TraceOpcode::kLessEqualDouble:
+          COMPARE_OP(double, std::less_equal<>);
+        case TraceOpcode::kGetIndex:
+          EXIT_UNLESS(GetIndex(get(instruction.a), get(instruction.b), &dst));
+          break;
+        case TraceOpcode::kSetIndex:
+          EXIT_UNLESS(SetIndex(&dst + 3));
+          break;
+        case TraceOpcode::kPrint:
+          vm->out_.Print(get(instruction.a));
+          break;
+        case TraceOpcode::kExitIfFalsey:
+          EXIT_UNLESS(!IsFalsey(get(instruction.a)));
+          break;
+        case TraceOpcode::kExitIfTruthy:
+          EXIT_UNLESS(IsFalsey(get(instruction.a)));
+          break;
+        case TraceOpcode::kExitUnlessGreaterDouble:
+          EXIT_UNLESS_COMPARE(double, std::greater<>);
+        case TraceOpcode::kExitUnlessGreaterEqualDouble:
+          EXIT_UNLESS_COMPARE(double, std::greater_equal<>);
+        case TraceOpcode::kExitUnlessLessDouble:
+          EXIT_UNLESS_COMPARE(double, std::less<>);
+        case TraceOpcode::kExitUnlessLessEqualDouble:
+          EXIT_UNLESS_COMPARE(double, std::less_equal<>);
+      }
+    }
+  }
+#undef EXIT_UNLESS_COMPARE
+#undef COMPARE_OP
+#undef BINARY_OP
+#undef EXIT_UNLESS
+}
+
+Trace::Exit Trace::Leave(VirtualMachine *vm, Value *slots, std::uint32_t exit,
+                         std::size_t iterations) const {
+  const ExitInfo &info = exits_[exit];
+  for (auto i = std::uint32_t{0}; i < info.copy_count; ++i) {
+    const Copy &copy = copies_[info.first_copy + i];
+    slots[copy.slot] = copy.value.space == TraceOperand::kSlot
+                           ? slots[copy.value.index]
+                           : constants_[copy.value.index];
+  }
+  vm->stack_top_ = slots + info.depth;
+  return {info.ip, iterations};
+}
+
+const std::uint8_t *LoopTracer::OnLoop(VirtualMachine *vm, const Chunk &chunk,
+                                       Value *slots, const Closure *closure,
+                                       const std::uint8_t *header,
+                                       const std::uint8_t *back_edge) {
+  // A loop jumped back to while recording another is either part of its
+  // path, or a loop inside it, which abandons the recording.
+  if (recording_) return header;
+  if (loops_.size() >= kMaxLoops && loops_.count(header) == 0) {
+    loops_.clear();
+  }
+  Loop &loop = loops_[header];
+  if (loop.chunk_id != chunk.get_id()) {
+    loop = Loop{};
+    loop.chunk_id = chunk.get_id();
+  }
+
+  if (loop.trace != nullptr) {
+    Trace::Exit exit = loop.trace->Run(vm, slots, closure);
+    // A trace that keeps exiting straight away was recorded on a path, or
+    // with types, the loop no longer takes.
+    if (exit.iterations != 0) {
+      loop.early_exits = 0;
+    } else if (++loop.early_exits > kMaxEarlyExits) {
+      loop.trace.reset();
+      loop.early_exits = 0;
+    }
+    return exit.ip;
+  }
+  if (loop.recordings >= kMaxRecordings || ++loop.count < kHotLoop) {
+    return header;
+  }
+  loop.count = 0;
+  ++loop.recordings;
+  recording_ =
+      Recording{&loop, &chunk, header, back_edge, vm->frame_count_, {}};
+  return header;
+}
+
+void LoopTracer::Record(const VirtualMachine &vm, const std::uint8_t *ip) {
+  Recording &recording = *recording_;
+  if (ip == recording.header && !recording.steps.empty()) {
+    recording.loop->trace = Trace::Compile(*recording.chunk, recording.steps);
+    recording_.reset();
+    return;
+  }
+  // Leaving the loop, or the frame, abandons the recording too.
+  std::optional<TraceOpcode> opcode;
+  if (ip <= recording.back_edge && vm.frame_count_ == recording.frame_count &&
+      recording.steps.size() < kMaxTraceLength) {
+    opcode = Specialise(ip, vm.stack_top_);
+  }
+  if (!opcode) {
+    StopRecording();
+    return;
+  }
+  const Value *slots = vm.frames_[vm.frame_count_ - 1].slots;
+  recording.steps.push_back(Trace::Step{
+      ip, static_cast<std::size_t>(vm.stack_top_ - slots), *opcode});
+}
+
+void LoopTracer::StopRecording() { recording_.reset(); }
+
+std::optional<TraceOpcode> LoopTracer::Specialise(const std::uint8_t *ip,
+                                                  const Value *top) const {
+  // Specialises arithmetic to the operands on the stack.
+  auto binary = [top](TraceOpcode generic, TraceOpcode real) {
+    return std::holds_alternative<double>(top[-2]) &&
+                   std::holds_alternative<double>(top[-1])
+               ? real
+               : generic;
+  };
+
+  switch (static_cast<Opcode>(*ip)) {
+    case Opcode::kConstant:
+    case Opcode::kConstantLong:
+    case Opcode::kNil:
+    case Opcode::kTrue:
+    case Opcode::kFalse:
+    case Opcode::kPop:
+    case Opcode::kPopN:
+    case Opcode::kPick:
+    case Opcode::kSlide:
+    case Opcode::kGetInput:
+    case Opcode::kGetLocal:
+    case Opcode::kGetLocalLong:
+    case Opcode::kSetLocal:
+    case Opcode::kSetLocalLong:
+    case Opcode::kGetGlobal:
+    case Opcode::kGetGlobalLong:
+    case Opcode::kSetGlobal:
+    case Opcode::kSetGlobalLong:
+    case Opcode::kGetUpvalue:
+    case Opcode::kSetUpvalue:
+    case Opcode::kEqual:
+    case Opcode::kNotEqual:
+    case Opcode::kNot:
+    case Opcode::kNegate:
+    case Opcode::kNegateNumber:
+    case Opcode::kPrint:
+    case Opcode::kJump:
+      // The bytecode instruction says all there is to say.
+      return TraceOpcode::kCopy;
+    case Opcode::kAdd:
+    case Opcode::kAddNumber:
+    case Opcode::kAddString:
+      return binary(TraceOpcode::kAdd, TraceOpcode::kAddDouble);
+    case Opcode::kSubtract:
+    case Opcode::kSubtractNumber:
+      return binary(TraceOpcode::kSubtract, TraceOpcode::kSubtractDouble);
+    case Opcode::kMultiply:
+    case Opcode::kMultiplyNumber:
+      return binary(TraceOpcode::kMultiply, TraceOpcode::kMultiplyDouble);
+    case Opcode::kDivide:
+    case Opcode::kDivideNumber:
+      return binary(TraceOpcode::kDivide, TraceOpcode::kDivideDouble);
+    case Opcode::kGreater:
+    case Opcode::kGreaterNumber:
+      return binary(TraceOpcode::kGreater, TraceOpcode::kGreaterDouble);
+    case Opcode::kGreaterEqual:
+    case Opcode::kGreaterEqualNumber:
+      return binary(TraceOpcode::kGreaterEqual,
+                    TraceOpcode::kGreaterEqualDouble);
+    case Opcode::kLess:
+    case Opcode::kLessNumber:
+      return binary(TraceOpcode::kLess, TraceOpcode::kLessDouble);
+    case Opcode::kLessEqual:
+    case Opcode::kLessEqualNumber:
+      return binary(TraceOpcode::kLessEqual, TraceOpcode::kLessEqualDouble);
+    case Opcode::kGetIndex:
+      return TraceOpcode::kGetIndex;
+    case Opcode::kSetIndex:
+      return TraceOpcode::kSetIndex;
+    case Opcode::kJumpIfFalse:
+      return IsFalsey(top[-1]) ? TraceOpcode::kExitIfTruthy
+                               : TraceOpcode::kExitIfFalsey;
+    case Opcode::kLoop: {
+      // Jumping back into what was recorded is an inner loop.
+      const std::uint8_t *target = ip + 3 - ReadJumpOffset(ip + 1);
+      const std::vector<Trace::Step> &steps = recording_->steps;
+      if (target != recording_->header &&
+          std::any_of(steps.begin(), steps.end(),
+                      [target](const Trace::Step &step) {
+                        return step.ip == target;
+                      })) {
+        return std::nullopt;
+      }
+      return TraceOpcode::kCopy;
+    }
+    default:
+      return std::nullopt;
+  }
+}
+
+}  // namespace lox
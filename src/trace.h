@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_TRACE_H
+#define LOX_SRC_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk.h"
+#include "function.h"
+#include "value.h"
+
+namespace lox {
+
+class VirtualMachine;
+
+// The instructions of a trace, each replaying one or more bytecode
+// instructions. Most compute a value from operands a and b into the slot
+// dst. The arithmetic is specialised to the operand types seen while
+// recording: the Double forms exit unless both operands are doubles, and
+// the rest exit wherever the bytecode would raise an error.
+// Jumps leave nothing behind, since a trace only follows the path
+// recorded, and a conditional jump becomes a guard that exits unless the
+// condition is as it was. kExitUnless* fuse a specialised comparison with
+// the guard on its result.
+enum class TraceOpcode : std::uint8_t {
+  kCopy,
+  kGetInput,
+  kGetGlobal,
+  kSetGlobal,
+  kGetUpvalue,
+  kSetUpvalue,
+  kEqual,
+  kNotEqual,
+  kNot,
+  kNegate,
+  kAdd,
+  kSubtract,
+  kMultiply,
+  kDivide,
+  kGreater,
+  kGreaterEqual,
+  kLess,
+  kLessEqual,
+  kAddDouble,
+  kSubtractDouble,
+  kMultiplyDouble,
+  kDivideDouble,
+  kGreaterDouble,
+  kGreaterEqualDouble,
+  kLessDouble,
+  kLessEqualDouble,
+  kGetIndex,
+  kSetIndex,
+  kPrint,
+  kExitIfFalsey,
+  kExitIfTruthy,
+  kExitUnlessGreaterDouble,
+  kExitUnlessGreaterEqualDouble,
+  kExitUnlessLessDouble,
+  kExitUnlessLessEqualDouble,
+};
+
+// Where a trace instruction finds a value: in a slot of the frame,
+// counting its locals and then the stack above them, or in one of the
+// trace's constants.
+struct TraceOperand {
+  enum Space : std::uint8_t { kSlot, kConstant };
+
+  Space space;
+  std::uint32_t index;
+};
+
+struct TraceInstruction {
+  TraceOpcode opcode;
+  // What kExitUnless* expect the comparison to be.
+  bool expected;
+  TraceOperand a;
+  TraceOperand b;
+  // The slot written, if any. kGetInput, kGetGlobal and kGetUpvalue read
+  // the input, global or upvalue a.index, and kSetGlobal and kSetUpvalue
+  // write the one b.index.
+  std::uint32_t dst;
+  // What to do if the instruction exits, as an index into the trace's
+  // exits.
+  std::uint32_t exit;
+};
+
+// One path through a loop, from its first instruction back to it, replayed
+// over and over without decoding or dispatching the bytecode. A trace keeps
+// what the bytecode would keep on the stack in the frame's slots, which
+// lie at the same depth on every iteration, so that its instructions read
+// and write them directly; a value the bytecode would only copy onto the
+// stack, such as a local or constant, is read from where it is. Where an
+// instruction exits, the values the bytecode would have on the stack by
+// then are copied there, and the machine resumes at the bytecode
+// instruction the trace instruction stood for, exactly as though the
+// bytecode had run all along.
+class Trace {
+ public:
+  // A bytecode instruction as it ran while recording: ip, how deep the
+  // stack was above the frame's slots, and the trace instruction it is
+  // specialised to, for the arithmetic and conditional jumps, or kCopy
+  // where the bytecode says all there is to say.
+  struct Step {
+    const std::uint8_t *ip;
+    std::size_t depth;
+    TraceOpcode opcode;
+  };
+
+  // Where a trace exited, and how many times it had gone all the way
+  // round the loop by then.
+  struct Exit {
+    const std::uint8_t *ip;
+    std::size_t iterations;
+  };
+
+  // Compiles the steps recorded through chunk, from the loop's first
+  // instruction back to it, or returns nullptr if they cannot be replayed.
+  static std::unique_ptr<const Trace> Compile(const Chunk &chunk,
+                                              const std::vector<Step> &steps);
+
+  // Runs the loop on vm, in a frame whose locals start at slots and that
+  // runs closure, until an instruction exits.
+  Exit Run(VirtualMachine *vm, Value *slots, const Closure *closure) const;
+
+ private:
+  friend class TraceBuilder;
+
+  // What an exit does: copies the values the bytecode has on the stack but
+  // the trace does not into their slots, and resumes at ip.
+  struct ExitInfo {
+    const std::uint8_t *ip;
+    std::uint32_t depth;
+    std::uint32_t first_copy;
+    std::uint32_t copy_count;
+  };
+  struct Copy {
+    std::uint32_t slot;
+    TraceOperand value;
+  };
+
+  Trace() = default;
+
+  Exit Leave(VirtualMachine *vm, Value *slots, std::uint32_t exit,
+             std::size_t iterations) const;
+
+  const std::uint8_t *header_ = nullptr;
+  std::size_t depth_ = 0;
+  std::vector<TraceInstruction> instructions_;
+  std::vector<Value> constants_;
+  std::vector<ExitInfo> exits_;
+  std::vector<Copy> copies_;
+};
+
+// Finds the loops a machine runs often, records an iteration of each as
+// the interpreter runs it and from then on replays the trace compiled from
+// it in the interpreter's place, for as long as its guards hold. Only the
+// innermost loops are traced: a trace ends where it started, and recording
+// is abandoned if it meets another loop, a call or anything else a trace
+// cannot replay.
+class LoopTracer {
+ public:
+  // How many times a loop jumps back before it is recorded.
+  static constexpr auto kHotLoop = std::uint32_t{64};
+  static constexpr auto kMaxTraceLength = std::size_t{1024};
+  // How many times a loop is recorded, and its trace thrown away because
+  // it kept exiting before going round once, before the loop is left to
+  // the interpreter for good.
+  static constexpr auto kMaxRecordings = std::uint8_t{3};
+  static constexpr auto kMaxEarlyExits = std::uint32_t{16};
+  // Loops are forgotten once there are this many, so that those of chunks
+  // long gone do not pile up.
+  static constexpr auto kMaxLoops = std::size_t{4096};
+
+  // Notes that the frame on top of vm, whose locals start at slots and
+  // that runs closure, jumped back from the instruction at back_edge to the
+  // start of a loop at header in chunk. Replays the loop's trace if it has
+  // one, or starts recording it once it is hot. Returns the instruction the
+  // interpreter continues at: header, or where a trace exited.
+  const std::uint8_t *OnLoop(VirtualMachine *vm, const Chunk &chunk,
+                             Value *slots, const Closure *closure,
+                             const std::uint8_t *header,
+                             const std::uint8_t *back_edge);
+  [[nodiscard]] bool is_recording() const { return recording_.has_value(); }
+  // Records the instruction at ip, which the interpreter is about to run,
+  // finishing the trace if the loop has come round to where it started.
+  void Record(const VirtualMachine &vm, const std::uint8_t *ip);
+  // Abandons the recording, if there is one.
+  void StopRecording();
+
+ private:
+  struct Loop {
+    std::uint64_t chunk_id = 0;
+    std::uint32_t count = 0;
+    std::uint32_t early_exits = 0;
+    std::uint8_t recordings = 0;
+    std::unique_ptr<const Trace> trace;
+  };
+  struct Recording {
+    Loop *loop;
+    const Chunk *chunk;
+    const std::uint8_t *header;
+    const std::uint8_t *back_edge;
+    std::size_t frame_count;
+    // Every instruction recorded, jumps included.
+    std::vector<Trace::Step> steps;
+  };
+
+  // Returns how the instruction at ip, about to run with the values
+  // beneath top on the stack, is replayed, or nullopt if a trace cannot
+  // replay it.
+  std::optional<TraceOpcode> Specialise(const std::uint8_t *ip,
+                                        const Value *top) const;
+
+  std::unordered_map<const std::uint8_t *, Loop> loops_;
+  std::optional<Recording> recording_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_TRACE_H
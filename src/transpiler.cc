@@ -0,0 +1,563 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "transpiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+void WriteStringLiteral(std::ostream &out, std::string_view str) {
+  out << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c >= ' ' && c <= '~') {
+      out << c;
+    } else {
+      // Octal escapes end after three digits, unlike hex ones.
+      char escape[5];
+      std::snprintf(escape, sizeof(escape), "\\%03o",
+                    static_cast<unsigned char>(c));
+      out << escape;
+    }
+  }
+  out << '"';
+}
+
+void WriteNumberLiteral(std::ostream &out, double number) {
+  if (std::isnan(number)) {
+    // The sign of a NaN shows when it is printed, and the NaN that 0/0
+    // gives on x86 has it set.
+    out << (std::signbit(number) ? "-" : "")
+        << "std::numeric_limits<double>::quiet_NaN()";
+  } else if (std::isinf(number)) {
+    out << (number < 0 ? "-" : "") << "std::numeric_limits<double>::infinity()";
+  } else {
+    // Hexadecimal floating point literals round-trip exactly.
+    char literal[32];
+    std::snprintf(literal, sizeof(literal), "%a", number);
+    out << literal;
+  }
+}
+
+void WriteValue(std::ostream &out, const lox::Value &value) {
+  if (const auto *number = std::get_if<double>(&value)) {
+    out << "double{";
+    WriteNumberLiteral(out, *number);
+    out << '}';
+  } else if (const auto *b = std::get_if<bool>(&value)) {
+    out << (*b ? "true" : "false");
+  } else if (const auto *str = std::get_if<std::string>(&value)) {
+    out << "std::string{";
+    WriteStringLiteral(out, *str);
+    out << '}';
+  } else {
+    out << "std::monostate{}";
+  }
+}
+
+}  // namespace
+
+namespace lox {
+
+bool Transpiler::Transpile(const Chunk &chunk, std::string_view source_name,
+                           std::ostream &out) {
+  error_.clear();
+  functions_.clear();
+  global_count_ = 0;
+
+  // Generate the code first, so that nothing is written if some instruction
+  // cannot be lowered. Lowering a chunk finds the functions it loads, so
+  // lowering them can find more.
+  auto script = std::ostringstream{};
+  if (!TranspileChunk(chunk, nullptr, script)) return false;
+  auto functions = std::ostringstream{};
+  for (auto i = std::size_t{0}; i < functions_.size(); ++i) {
+    const Function &function = *functions_[i];
+    const Chunk *body = function.GetChunk(std::cerr);
+    if (body == nullptr) {
+      error_ = "Function '" + function.get_name() + "' does not compile.";
+      return false;
+    }
+    functions << "\nint F" << i << "(lox::Value *args, lox::Value *result) {\n"
+              << "  auto s = std::array<lox::Value, "
+              << body->GetMaxStackDepth() << ">{};\n"
+              << "  std::move(args, args + " << body->GetArgumentSlots()
+              << ", s.begin());\n";
+    if (!TranspileChunk(*body, &function, functions)) return false;
+    functions << "}\n";
+  }
+
+  out << "// Generated by loxc from " << source_name << ".\n"
+      << "\n"
+      << "#include <sysexits.h>\n"
+      << "\n"
+      << "#include <algorithm>\n"
+      << "#include <array>\n"
+      << "#include <cstdlib>\n"
+      << "#include <functional>\n"
+      << "#include <iostream>\n"
+      << "#include <limits>\n"
+      << "#include <memory>\n"
+      << "#include <optional>\n"
+      << "#include <string>\n"
+      << "\n"
+      << "#include <lox/runtime.h>\n"
+      << "\n"
+      << "namespace {\n"
+      << "\n"
+      << "// A Lox function, lowered to code that runs it on the function and\n"
+      << "// its arguments and stores its result.\n"
+      << "class Function : public lox::Object {\n"
+      << " public:\n"
+      << "  using Code = int (*)(lox::Value *args, lox::Value *result);\n"
+      << "\n"
+      << "  Function(const char *name, std::size_t arity, Code code)\n"
+      << "      : lox::Object(lox::ObjectType::kFunction),\n"
+      << "        name(name),\n"
+      << "        arity(arity),\n"
+      << "        code(code) {}\n"
+      << "\n"
+      << "  void Print(std::ostream &os) const override {\n"
+      << "    os << \"<fn \" << name << '>';\n"
+      << "  }\n"
+      << "\n"
+      << "  const char *name;\n"
+      << "  std::size_t arity;\n"
+      << "  Code code;\n"
+      << "};\n"
+      << "\n"
+      << "constexpr auto kFramesMax = std::size_t{1024};\n"
+      << "// What a function returns when it ends in a tail call, having left\n"
+      << "// the callee and its arguments in tail for Call() to run in its\n"
+      << "// place.\n"
+      << "constexpr auto kTailCalled = -1;\n"
+      << "\n"
+      << "lox::OutputBuffer out{&std::cout};\n"
+      << "auto g = std::array<std::optional<lox::Value>, " << global_count_
+      << ">{};\n"
+      << "// How many frames are running, counting the script's.\n"
+      << "auto depth = std::size_t{1};\n"
+      << "auto tail = std::array<lox::Value, 256>{};\n"
+      << "\n";
+  for (auto i = std::size_t{0}; i < functions_.size(); ++i) {
+    out << "int F" << i << "(lox::Value *args, lox::Value *result);\n";
+  }
+  for (auto i = std::size_t{0}; i < functions_.size(); ++i) {
+    out << "const auto f" << i
+        << " = std::shared_ptr<lox::Object>{std::make_shared<Function>(";
+    WriteStringLiteral(out, functions_[i]->get_name());
+    out << ", " << functions_[i]->get_arity() << ", &F" << i << ")};\n";
+  }
+  out << "\n"
+      << "int Fail(const char *message, std::size_t line, const char *where) "
+         "{\n"
+      << "  out.Flush();\n"
+      << "  lox::ReportRuntimeError(std::cerr, message, line, where);\n"
+      << "  return EX_SOFTWARE;\n"
+      << "}\n"
+      << "\n"
+      << "// Returns the function callee, or nullptr after reporting an error\n"
+      << "// if it cannot be called on count arguments.\n"
+      << "const Function *GetCallee(const lox::Value &callee, std::size_t "
+         "count,\n"
+      << "                          std::size_t line, const char *where) {\n"
+      << "  const auto *object = "
+         "std::get_if<std::shared_ptr<lox::Object>>(&callee);\n"
+      << "  if (object == nullptr ||\n"
+      << "      (*object)->get_type() != lox::ObjectType::kFunction) {\n"
+      << "    Fail(\"Can only call functions and classes.\", line, where);\n"
+      << "    return nullptr;\n"
+      << "  }\n"
+      << "  const auto *function = static_cast<const Function "
+         "*>(object->get());\n"
+      << "  if (count != function->arity) {\n"
+      << "    auto message = \"Expected \" + std::to_string(function->arity) "
+         "+\n"
+      << "                   \" arguments but got \" + std::to_string(count) "
+         "+ \".\";\n"
+      << "    Fail(message.c_str(), line, where);\n"
+      << "    return nullptr;\n"
+      << "  }\n"
+      << "  return function;\n"
+      << "}\n"
+      << "\n"
+      << "// Calls the function in slots[0] on the count arguments after it,\n"
+      << "// leaving its result in slots[0].\n"
+      << "int Call(lox::Value *slots, std::size_t count, std::size_t line,\n"
+      << "         const char *where) {\n"
+      << "  const Function *function = GetCallee(slots[0], count, line, "
+         "where);\n"
+      << "  if (function == nullptr) return EX_SOFTWARE;\n"
+      << "  if (depth == kFramesMax) return Fail(\"Stack overflow.\", line, "
+         "where);\n"
+      << "  ++depth;\n"
+      << "  int status = function->code(slots, slots);\n"
+      << "  while (status == kTailCalled) {\n"
+      << "    function = static_cast<const Function *>(\n"
+      << "        std::get<std::shared_ptr<lox::Object>>(tail[0]).get());\n"
+      << "    status = function->code(tail.data(), slots);\n"
+      << "  }\n"
+      << "  --depth;\n"
+      << "  if (status != EXIT_SUCCESS) lox::ReportCaller(std::cerr, line, "
+         "where);\n"
+      << "  return status;\n"
+      << "}\n"
+      << "\n"
+      << "// Leaves the function in slots[0] and the count arguments after it\n"
+      << "// in tail, for Call() to run in place of the caller.\n"
+      << "int TailCall(lox::Value *slots, std::size_t count, std::size_t "
+         "line,\n"
+      << "             const char *where) {\n"
+      << "  if (GetCallee(slots[0], count, line, where) == nullptr) {\n"
+      << "    return EX_SOFTWARE;\n"
+      << "  }\n"
+      << "  std::move(slots, slots + count + 1, tail.begin());\n"
+      << "  return kTailCalled;\n"
+      << "}\n"
+      << functions.str() << "\n"
+      << "}  // namespace\n"
+      << "\n"
+      << "int main() {\n"
+      << "  auto s = std::array<lox::Value, " << chunk.GetMaxStackDepth()
+      << ">{};\n"
+      << script.str() << "}\n";
+  return true;
+}
+
+bool Transpiler::TranspileChunk(const Chunk &chunk, const Function *function,
+                                std::ostream &body) {
+  if (!chunk.IsVerified()) {
+    error_ = "Only verified chunks can be compiled.";
+    return false;
+  }
+  if (const auto &globals = chunk.GetGlobalTable(); globals != nullptr) {
+    global_count_ = std::max(global_count_, globals->GetCount());
+  }
+
+  const std::uint8_t *code = chunk.GetCodePtr();
+  std::size_t size = chunk.GetCodeSize();
+  // Fails with message about the instruction at offset.
+  auto fail = [this, &chunk, function](std::size_t offset,
+                                       std::string_view message) {
+    error_ = "[line " + std::to_string(chunk.GetLineAtIndex(offset)) + "] in " +
+             (function != nullptr ? function->get_name() + "()" : "script") +
+             ": " + std::string{message};
+    return false;
+  };
+  // What runtime errors name as where they happened: the function, or the
+  // script.
+  auto where = std::ostringstream{};
+  WriteStringLiteral(where, function != nullptr ? function->get_name() : "");
+
+  // The verifier has proven that the stack has the same depth on every path
+  // to an instruction, so follow the paths to find the depth at each one
+  // reached. Jumps become gotos, so note which instructions need a label.
+  // Those no path reaches are left out.
+  auto depths = std::vector<std::optional<std::size_t>>(size);
+  auto targets = std::vector<bool>(size);
+  auto worklist = std::vector<std::size_t>{0};
+  depths[0] = chunk.GetArgumentSlots();
+  while (!worklist.empty()) {
+    std::size_t offset = worklist.back();
+    worklist.pop_back();
+    auto info = GetInstructionInfo(code + offset, size - offset);
+    std::size_t depth = *depths[offset] - info->pops + info->pushes;
+    auto reach = [&depths, &worklist, depth](std::size_t target) {
+      if (depths[target]) return;
+      depths[target] = depth;
+      worklist.push_back(target);
+    };
+
+    auto instruction = static_cast<Opcode>(code[offset]);
+    std::size_t next = offset + info->length;
+    if (instruction == Opcode::kJump || instruction == Opcode::kJumpIfFalse) {
+      targets[next + ReadJumpOffset(code + offset + 1)] = true;
+      reach(next + ReadJumpOffset(code + offset + 1));
+    } else if (instruction == Opcode::kLoop) {
+      targets[next - ReadJumpOffset(code + offset + 1)] = true;
+      reach(next - ReadJumpOffset(code + offset + 1));
+    }
+    if (instruction != Opcode::kJump && instruction != Opcode::kLoop &&
+        instruction != Opcode::kReturn) {
+      reach(next);
+    }
+  }
+
+  auto offset = std::size_t{0};
+  while (offset < size) {
+    auto info = GetInstructionInfo(code + offset, size - offset);
+    if (!depths[offset]) {
+      offset += info->length;
+      continue;
+    }
+    std::size_t depth = *depths[offset];
+    std::size_t line = chunk.GetLineAtIndex(offset);
+    if (targets[offset]) body << "L" << offset << ":;\n";
+    // The slots of the top two values before the instruction runs.
+    auto a = "s[" + std::to_string(depth - 2) + "]";
+    auto b = "s[" + std::to_string(depth - 1) + "]";
+    auto top = "s[" + std::to_string(depth) + "]";
+
+    // Where a runtime error happened, as Fail() and Call() take it.
+    auto at = std::to_string(line) + ", " + where.str();
+    auto check = [&body, &at](const std::string &call) {
+      body << "  if (const char *error = " << call << ") return Fail(error, "
+           << at << ");\n";
+    };
+    auto number_op = [&check, &a, &b](std::string_view op) {
+      check("lox::NumberOp(&" + a + ", " + b + ", " + std::string{op} + "{})");
+    };
+    auto proven_number = [](const std::string &slot) {
+      return "*std::get_if<double>(&" + slot + ")";
+    };
+    auto proven_compare = [&body, &a, &b, &proven_number](std::string_view op) {
+      body << "  " << a << " = " << proven_number(a) << ' ' << op << ' '
+           << proven_number(b) << ";\n";
+    };
+    // Globals live in a local array too, indexed by slot. Writes the check
+    // that the global in slot is defined and returns its element.
+    auto global = [&chunk, &body, &at](std::size_t slot) {
+      auto g = "g[" + std::to_string(slot) + "]";
+      body << "  if (!" << g << ") return Fail(";
+      WriteStringLiteral(body, "Undefined variable '" +
+                                   chunk.GetGlobalTable()->GetName(slot) +
+                                   "'.");
+      body << ", " << at << ");\n";
+      return g;
+    };
+    auto proven_arithmetic = [&body, &a, &b,
+                              &proven_number](std::string_view op) {
+      body << "  " << proven_number(a) << ' ' << op << "= "
+           << proven_number(b) << ";\n";
+    };
+
+    auto instruction = static_cast<Opcode>(code[offset]);
+    switch (instruction) {
+      case Opcode::kConstant:
+      case Opcode::kConstantLong: {
+        std::size_t index = code[offset + 1];
+        if (instruction == Opcode::kConstantLong) {
+          index = ReadLongOperand(code + offset + 1);
+        }
+        if (const auto *object = std::get_if<std::shared_ptr<Object>>(
+                &chunk.GetValueAtIndex(index))) {
+          if ((*object)->get_type() != ObjectType::kFunction) {
+            return fail(offset, "Cannot compile object constants.");
+          }
+          body << "  " << top << " = f"
+               << GetFunctionIndex(
+                      std::static_pointer_cast<const Function>(*object))
+               << ";\n";
+          break;
+        }
+        body << "  " << top << " = ";
+        WriteValue(body, chunk.GetValueAtIndex(index));
+        body << ";\n";
+        break;
+      }
+      case Opcode::kNil:
+        body << "  " << top << " = std::monostate{};\n";
+        break;
+      case Opcode::kTrue:
+        body << "  " << top << " = true;\n";
+        break;
+      case Opcode::kFalse:
+        body << "  " << top << " = false;\n";
+        break;
+      case Opcode::kEqual:
+        body << "  " << a << " = " << a << " == " << b << ";\n";
+        break;
+      case Opcode::kNotEqual:
+        body << "  " << a << " = " << a << " != " << b << ";\n";
+        break;
+      case Opcode::kGreater:
+        number_op("std::greater<>");
+        break;
+      case Opcode::kGreaterEqual:
+        number_op("std::greater_equal<>");
+        break;
+      case Opcode::kLess:
+        number_op("std::less<>");
+        break;
+      case Opcode::kLessEqual:
+        number_op("std::less_equal<>");
+        break;
+      case Opcode::kAdd:
+        check("lox::Add(&" + a + ", " + b + ")");
+        break;
+      case Opcode::kSubtract:
+        number_op("std::minus<>");
+        break;
+      case Opcode::kMultiply:
+        number_op("std::multiplies<>");
+        break;
+      case Opcode::kDivide:
+        number_op("std::divides<>");
+        break;
+      case Opcode::kNot:
+        body << "  " << b << " = lox::IsFalsey(" << b << ");\n";
+        break;
+      case Opcode::kNegate:
+        check("lox::Negate(&" + b + ")");
+        break;
+      case Opcode::kReturn:
+        if (function != nullptr) {
+          body << "  *result = std::move(" << b << ");\n";
+        } else if (chunk.HasResult()) {
+          body << "  out.Print(" << b << ");\n";
+        }
+        body << "  return EXIT_SUCCESS;\n";
+        break;
+      case Opcode::kAddNumber:
+        proven_arithmetic("+");
+        break;
+      case Opcode::kAddString:
+        body << "  std::get_if<std::string>(&" << a << ")->append("
+             << "*std::get_if<std::string>(&" << b << "));\n";
+        break;
+      case Opcode::kSubtractNumber:
+        proven_arithmetic("-");
+        break;
+      case Opcode::kMultiplyNumber:
+        proven_arithmetic("*");
+        break;
+      case Opcode::kDivideNumber:
+        proven_arithmetic("/");
+        break;
+      case Opcode::kGreaterNumber:
+        proven_compare(">");
+        break;
+      case Opcode::kGreaterEqualNumber:
+        proven_compare(">=");
+        break;
+      case Opcode::kLessNumber:
+        proven_compare("<");
+        break;
+      case Opcode::kLessEqualNumber:
+        proven_compare("<=");
+        break;
+      case Opcode::kNegateNumber:
+        body << "  " << proven_number(b) << " = -" << proven_number(b)
+             << ";\n";
+        break;
+      case Opcode::kPick:
+        body << "  " << top << " = s[" << depth - 1 - code[offset + 1]
+             << "];\n";
+        break;
+      case Opcode::kSlide:
+        body << "  s[" << depth - 1 - code[offset + 1] << "] = std::move(" << b
+             << ");\n";
+        break;
+      case Opcode::kDefineGlobal:
+      case Opcode::kDefineGlobalLong: {
+        std::size_t slot = instruction == Opcode::kDefineGlobal
+                               ? code[offset + 1]
+                               : ReadLongOperand(code + offset + 1);
+        body << "  g[" << slot << "] = std::move(" << b << ");\n";
+        break;
+      }
+      case Opcode::kGetGlobal:
+      case Opcode::kGetGlobalLong: {
+        std::size_t slot = instruction == Opcode::kGetGlobal
+                               ? code[offset + 1]
+                               : ReadLongOperand(code + offset + 1);
+        std::string g = global(slot);
+        body << "  " << top << " = *" << g << ";\n";
+        break;
+      }
+      case Opcode::kSetGlobal:
+      case Opcode::kSetGlobalLong: {
+        std::size_t slot = instruction == Opcode::kSetGlobal
+                               ? code[offset + 1]
+                               : ReadLongOperand(code + offset + 1);
+        std::string g = global(slot);
+        body << "  *" << g << " = " << b << ";\n";
+        break;
+      }
+      case Opcode::kPop:
+      case Opcode::kPopN:
+        break;
+      case Opcode::kGetLocal:
+      case Opcode::kGetLocalLong: {
+        std::size_t slot = instruction == Opcode::kGetLocal
+                               ? code[offset + 1]
+                               : ReadLongOperand(code + offset + 1);
+        body << "  " << top << " = s[" << slot << "];\n";
+        break;
+      }
+      case Opcode::kSetLocal:
+      case Opcode::kSetLocalLong: {
+        std::size_t slot = instruction == Opcode::kSetLocal
+                               ? code[offset + 1]
+                               : ReadLongOperand(code + offset + 1);
+        body << "  s[" << slot << "] = " << b << ";\n";
+        break;
+      }
+      case Opcode::kJump:
+      case Opcode::kJumpIfFalse:
+      case Opcode::kLoop: {
+        std::size_t jump = ReadJumpOffset(code + offset + 1);
+        std::size_t target = instruction == Opcode::kLoop
+                                 ? offset + 3 - jump
+                                 : offset + 3 + jump;
+        if (instruction == Opcode::kJumpIfFalse) {
+          body << "  if (lox::IsFalsey(" << b << ")) ";
+        } else {
+          body << "  ";
+        }
+        body << "goto L" << target << ";\n";
+        break;
+      }
+      case Opcode::kPrint:
+        body << "  out.Print(" << b << ");\n";
+        break;
+      case Opcode::kCall:
+      case Opcode::kTailCall: {
+        std::size_t count = code[offset + 1];
+        auto callee = "&s[" + std::to_string(depth - count - 1) + "], " +
+                      std::to_string(count) + ", " + at;
+        // The script's frame stays, so a tail call there is a plain call.
+        if (instruction == Opcode::kTailCall && function != nullptr) {
+          body << "  return TailCall(" << callee << ");\n";
+        } else {
+          body << "  if (int status = Call(" << callee
+               << ")) return status;\n";
+        }
+        break;
+      }
+      case Opcode::kClosure:
+      case Opcode::kClosureLong:
+        return fail(offset, "Cannot compile closures.");
+      case Opcode::kClass:
+        return fail(offset, "Cannot compile classes.");
+      default:
+        return fail(offset, "Cannot compile instruction at offset " +
+                                std::to_string(offset) + ".");
+    }
+
+    offset += info->length;
+  }
+
+  return true;
+}
+
+std::size_t Transpiler::GetFunctionIndex(
+    std::shared_ptr<const Function> function) {
+  auto it = std::find(functions_.begin(), functions_.end(), function);
+  if (it != functions_.end()) {
+    return static_cast<std::size_t>(it - functions_.begin());
+  }
+  functions_.push_back(std::move(function));
+  return functions_.size() - 1;
+}
+
+const std::string &Transpiler::get_error() const { return error_; }
+
+}  // namespace lox
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_TRANSPILER_H
+#define LOX_SRC_TRANSPILER_H
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chunk.h"
+#include "function.h"
+
+namespace lox {
+
+// Lowers a verified chunk to a standalone C++ program for loxc. The stack
+// depth at every instruction is known statically, so the stack becomes a local
+// array, local variables fixed slots of it, and each instruction a line of code
+// over those slots, with jumps as gotos, calling into the runtime library for
+// anything but proven arithmetic. Each function the script declares becomes a
+// C++ function of its own, lowered the same way from the chunk its body
+// compiles to; closures and classes cannot be lowered.
+class Transpiler {
+ public:
+  Transpiler() = default;
+
+  bool Transpile(const Chunk &chunk, std::string_view source_name,
+                 std::ostream &out);
+  [[nodiscard]] const std::string &get_error() const;
+
+ private:
+  // Writes chunk to out as the body of the C++ function running it: that
+  // of the script if function is nullptr.
+  bool TranspileChunk(const Chunk &chunk, const Function *function,
+                      std::ostream &out);
+  // Returns the index of the C++ function function is lowered to, adding it
+  // to those still to lower if it is new.
+  std::size_t GetFunctionIndex(std::shared_ptr<const Function> function);
+
+  std::string error_;
+  std::vector<std::shared_ptr<const Function>> functions_;
+  std::size_t global_count_ = 0;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_TRANSPILER_H
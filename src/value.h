@@ -3,11 +3,62 @@
 #ifndef LOX_SRC_VALUE_H
 #define LOX_SRC_VALUE_H
 
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <ostream>
+#include <string>
 #include <variant>
 
 namespace lox {
 
+enum class ObjectType : std::uint8_t {
+  kFunction,
+  kClosure,
+  kClass,
+  kInstance,
+  kBoundMethod,
+  kList,
+  kMap,
+};
+
+// A value that lives on the heap, such as a function. Values refer to objects
+// by shared pointer, so copying one never copies the object, and two values
+// are equal only if they refer to the same object.
+class Object {
+ public:
+  Object(const Object &) = delete;
+  Object(Object &&) = delete;
+  void operator=(const Object &) = delete;
+  void operator=(Object &&) = delete;
+  virtual ~Object() = default;
+
+  [[nodiscard]] ObjectType get_type() const { return type_; }
+  virtual void Print(std::ostream &os) const = 0;
+
+ protected:
+  explicit Object(ObjectType type) : type_(type) {}
+
+ private:
+  ObjectType type_;
+};
+
+// Enough room for any number FormatNumber() writes.
+inline constexpr auto kMaxNumberLength = std::size_t{32};
+
+// Writes number to buffer in as few digits as read back as the same double,
+// returning the end of what it wrote. Whole numbers of up to 15 digits are
+// written out in full, and others as %g would, but with every digit needed.
+inline char *FormatNumber(double number, char *buffer) {
+  char *end = buffer + kMaxNumberLength;
+  if (std::trunc(number) == number && std::fabs(number) < 1e15) {
+    return std::to_chars(buffer, end, number, std::chars_format::fixed).ptr;
+  }
+  return std::to_chars(buffer, end, number, std::chars_format::general).ptr;
+}
+
 namespace internal {
 
 struct FalsinessVisitor {
@@ -26,18 +77,54 @@ struct OstreamVisitor {
 
   void operator()(const std::monostate /* unused */) const { os << "nil"; }
 
-  void operator()(const double value) const { os << value; }
+  void operator()(const double value) const {
+    char buffer[kMaxNumberLength];
+    os.write(buffer, FormatNumber(value, buffer) - buffer);
+  }
 
   void operator()(const bool value) const {
     os << std::boolalpha << value << std::noboolalpha;
   }
 
   void operator()(std::string_view str) const { os << str; }
+
+  void operator()(const std::shared_ptr<Object> &object) const {
+    object->Print(os);
+  }
 };
 
 }  // namespace internal
 
-using Value = std::variant<std::monostate, double, bool, std::string>;
+using Value = std::variant<std::monostate, double, bool, std::string,
+                           std::shared_ptr<Object>>;
+
+// The type of a value as far as it is known before running, inferred by the
+// compiler and re-derived by the verifier.
+enum class ValueType : std::uint8_t {
+  kUnknown,
+  kNil,
+  kBool,
+  kNumber,
+  kString,
+  kObject,
+};
+
+inline ValueType GetValueType(const Value &value) {
+  switch (value.index()) {
+    case 0:
+      return ValueType::kNil;
+    case 1:
+      return ValueType::kNumber;
+    case 2:
+      return ValueType::kBool;
+    case 3:
+      return ValueType::kString;
+    case 4:
+      return ValueType::kObject;
+    default:
+      return ValueType::kUnknown;
+  }
+}
 
 inline std::ostream &operator<<(std::ostream &os, const Value &value) {
   std::visit(internal::OstreamVisitor{os}, value);
@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "verifier.h"
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "function.h"
+
+namespace lox {
+
+bool Verifier::Verify(Chunk *chunk) {
+  error_.clear();
+
+  const std::uint8_t *code = chunk->GetCodePtr();
+  const std::size_t size = chunk->GetCodeSize();
+
+  // Decode the code once to find where every instruction starts, so that
+  // jumps can be checked to land on one.
+  auto starts = std::vector<bool>(size);
+  for (auto offset = std::size_t{0}; offset < size;) {
+    auto info = GetInstructionInfo(code + offset, size - offset);
+    if (!info) return Error(offset, "Malformed instruction.");
+    starts[offset] = true;
+    offset += info->length;
+  }
+
+  // The abstract stack on entry to each instruction reached so far: what is
+  // known about the type of each slot, and which slots a closure may have
+  // captured, since any call can change those. Where control flow merges,
+  // slots whose types disagree become kUnknown, and the instruction is
+  // visited again until nothing changes.
+  struct State {
+    std::vector<ValueType> types;
+    std::vector<bool> captured;
+  };
+  auto states = std::vector<std::optional<State>>(size);
+  auto worklist = std::vector<std::size_t>{};
+  auto max_depth = std::size_t{0};
+  auto offset = std::size_t{0};
+
+  auto flow = [this, &states, &worklist, &starts, &offset, size](
+                  std::size_t target, const State &incoming) -> bool {
+    if (target >= size) {
+      return Error(offset, "Chunk does not end with a return.");
+    }
+    if (!starts[target]) {
+      return Error(offset, "Jump into the middle of an instruction.");
+    }
+    std::optional<State> &state = states[target];
+    if (!state) {
+      state = incoming;
+      worklist.push_back(target);
+      return true;
+    }
+    if (state->types.size() != incoming.types.size()) {
+      return Error(target, "Stack depth differs between paths.");
+    }
+    auto changed = false;
+    for (auto i = std::size_t{0}; i < incoming.types.size(); ++i) {
+      ValueType &type = state->types[i];
+      if (type != incoming.types[i] && type != ValueType::kUnknown) {
+        type = ValueType::kUnknown;
+        changed = true;
+      }
+      if (incoming.captured[i] && !state->captured[i]) {
+        state->captured[i] = true;
+        changed = true;
+      }
+    }
+    if (changed) worklist.push_back(target);
+    return true;
+  };
+
+  auto constant_type = [chunk](std::size_t index) -> std::optional<ValueType> {
+    if (index >= chunk->GetConstantCount()) return std::nullopt;
+    return GetValueType(chunk->GetValueAtIndex(index));
+  };
+
+  if (size == 0) return Error(0, "Chunk does not end with a return.");
+  // A function starts with itself and its arguments on the stack.
+  states[0].emplace();
+  states[0]->types.resize(chunk->GetArgumentSlots(), ValueType::kUnknown);
+  states[0]->captured.resize(chunk->GetArgumentSlots());
+  worklist.push_back(0);
+  while (!worklist.empty()) {
+    offset = worklist.back();
+    worklist.pop_back();
+    State state = *states[offset];
+    std::vector<ValueType> &types = state.types;
+    auto info = GetInstructionInfo(code + offset, size - offset);
+    if (types.size() < info->pops) return Error(offset, "Stack underflow.");
+
+    auto instruction = static_cast<Opcode>(code[offset]);
+    // Operand types of binary and unary instructions, before they are popped.
+    ValueType a = info->pops >= 2 ? types[types.size() - 2] : ValueType::kUnknown;
+    ValueType b = info->pops >= 1 ? types.back() : ValueType::kUnknown;
+    auto both = [a, b](ValueType type) { return a == type && b == type; };
+    auto result = ValueType::kUnknown;
+    // The function a kClosure instruction makes a closure of.
+    const Function *closure = nullptr;
+
+    switch (instruction) {
+      case Opcode::kConstant: {
+        auto type = constant_type(code[offset + 1]);
+        if (!type) return Error(offset, "Constant index out of range.");
+        result = *type;
+        break;
+      }
+      case Opcode::kConstantLong: {
+        auto type = constant_type(ReadLongOperand(code + offset + 1));
+        if (!type) return Error(offset, "Constant index out of range.");
+        result = *type;
+        break;
+      }
+      case Opcode::kNil:
+        result = ValueType::kNil;
+        break;
+      case Opcode::kTrue:
+      case Opcode::kFalse:
+      case Opcode::kEqual:
+      case Opcode::kNotEqual:
+      case Opcode::kGreater:
+      case Opcode::kGreaterEqual:
+      case Opcode::kLess:
+      case Opcode::kLessEqual:
+      case Opcode::kNot:
+        result = ValueType::kBool;
+        break;
+      case Opcode::kAdd:
+        if (both(ValueType::kNumber) || both(ValueType::kString)) result = a;
+        break;
+      // The generic arithmetic instructions fail unless given numbers, so
+      // whatever they leave behind is a number.
+      case Opcode::kSubtract:
+      case Opcode::kMultiply:
+      case Opcode::kDivide:
+      case Opcode::kNegate:
+        result = ValueType::kNumber;
+        break;
+      case Opcode::kAddNumber:
+      case Opcode::kSubtractNumber:
+      case Opcode::kMultiplyNumber:
+      case Opcode::kDivideNumber:
+        if (!both(ValueType::kNumber)) {
+          return Error(offset, "Operands not proven to be numbers.");
+        }
+        result = ValueType::kNumber;
+        break;
+      case Opcode::kGreaterNumber:
+      case Opcode::kGreaterEqualNumber:
+      case Opcode::kLessNumber:
+      case Opcode::kLessEqualNumber:
+        if (!both(ValueType::kNumber)) {
+          return Error(offset, "Operands not proven to be numbers.");
+        }
+        result = ValueType::kBool;
+        break;
+      case Opcode::kAddString:
+        if (!both(ValueType::kString)) {
+          return Error(offset, "Operands not proven to be strings.");
+        }
+        result = ValueType::kString;
+        break;
+      case Opcode::kNegateNumber:
+        if (b != ValueType::kNumber) {
+          return Error(offset, "Operand not proven to be a number.");
+        }
+        result = ValueType::kNumber;
+        break;
+      case Opcode::kReturn:
+      case Opcode::kCall:
+        break;
+      case Opcode::kTailCall:
+        if (offset + info->length >= size ||
+            code[offset + info->length] !=
+                static_cast<std::uint8_t>(Opcode::kReturn)) {
+          return Error(offset, "Tail call not followed by a return.");
+        }
+        break;
+      case Opcode::kPick:
+        result = types[types.size() - 1 - code[offset + 1]];
+        break;
+      case Opcode::kSlide:
+        // Only the top value survives a slide.
+        result = b;
+        break;
+      case Opcode::kDefineGlobal:
+      case Opcode::kDefineGlobalLong:
+      case Opcode::kGetGlobal:
+      case Opcode::kGetGlobalLong:
+      case Opcode::kSetGlobal:
+      case Opcode::kSetGlobalLong: {
+        bool is_long = info->length == 4;
+        std::size_t slot =
+            is_long ? ReadLongOperand(code + offset + 1) : code[offset + 1];
+        const std::shared_ptr<GlobalTable> &globals = chunk->GetGlobalTable();
+        if (globals == nullptr || slot >= globals->GetCount()) {
+          return Error(offset, "Global slot out of range.");
+        }
+        // Globals may hold anything; an assignment's result is its value.
+        if (instruction == Opcode::kSetGlobal ||
+            instruction == Opcode::kSetGlobalLong) {
+          result = b;
+        }
+        break;
+      }
+      case Opcode::kPop:
+      case Opcode::kPrint:
+      case Opcode::kPopN:
+      case Opcode::kJump:
+      case Opcode::kLoop:
+        break;
+      case Opcode::kGetLocal:
+      case Opcode::kGetLocalLong:
+      case Opcode::kSetLocal:
+      case Opcode::kSetLocalLong: {
+        bool is_long = info->length == 4;
+        std::size_t slot =
+            is_long ? ReadLongOperand(code + offset + 1) : code[offset + 1];
+        // A local lies beneath whatever the instruction pops.
+        if (slot + info->pops >= types.size()) {
+          return Error(offset, "Local slot out of range.");
+        }
+        result = info->pops == 0 ? types[slot] : b;
+        break;
+      }
+      case Opcode::kJumpIfFalse:
+        result = b;
+        break;
+      case Opcode::kCallNative: {
+        if (code[offset + 1] >= chunk->GetNativeCount()) {
+          return Error(offset, "Native function index out of range.");
+        }
+        const NativeFunction &native = chunk->GetNative(code[offset + 1]);
+        if (code[offset + 2] != native.get_arity()) {
+          return Error(offset, "Wrong number of arguments to native function.");
+        }
+        result = native.get_result_type();
+        break;
+      }
+      case Opcode::kGetInput: {
+        const std::vector<ValueType> &inputs = chunk->GetInputTypes();
+        if (code[offset + 1] >= inputs.size()) {
+          return Error(offset, "Input index out of range.");
+        }
+        result = inputs[code[offset + 1]];
+        break;
+      }
+      case Opcode::kClosure:
+      case Opcode::kClosureLong: {
+        std::size_t index = info->length == 4
+                                ? ReadLongOperand(code + offset + 1)
+                                : code[offset + 1];
+        if (index < chunk->GetConstantCount()) {
+          const auto *object = std::get_if<std::shared_ptr<Object>>(
+              &chunk->GetValueAtIndex(index));
+          if (object != nullptr &&
+              (*object)->get_type() == ObjectType::kFunction) {
+            closure = static_cast<const Function *>(object->get());
+          }
+        }
+        if (closure == nullptr) {
+          return Error(offset, "Closure constant is not a function.");
+        }
+        // A local function captures itself from the slot it is pushed to.
+        for (const Capture &capture : closure->get_captures()) {
+          if (capture.is_local ? capture.index > types.size()
+                               : capture.index >= chunk->GetUpvalueCount()) {
+            return Error(offset, "Captured variable out of range.");
+          }
+        }
+        result = ValueType::kObject;
+        break;
+      }
+      case Opcode::kGetUpvalue:
+      case Opcode::kSetUpvalue:
+        if (code[offset + 1] >= chunk->GetUpvalueCount()) {
+          return Error(offset, "Upvalue index out of range.");
+        }
+        result = b;
+        break;
+      case Opcode::kCloseUpvalues:
+        break;
+      case Opcode::kClass:
+      case Opcode::kMethod: {
+        std::size_t index = ReadLongOperand(code + offset + 1);
+        if (constant_type(index) != ValueType::kString) {
+          return Error(offset, "Name constant is not a string.");
+        }
+        result = instruction == Opcode::kClass ? ValueType::kObject : a;
+        break;
+      }
+      case Opcode::kInherit:
+        // The superclass stays on the stack.
+        result = a;
+        break;
+      case Opcode::kGetProperty:
+      case Opcode::kSetProperty:
+      case Opcode::kInvoke:
+      case Opcode::kGetSuper:
+        if (ReadLongOperand(code + offset + 1) >=
+            chunk->GetInlineCacheCount()) {
+          return Error(offset, "Inline cache index out of range.");
+        }
+        if (instruction == Opcode::kSetProperty) result = b;
+        break;
+      case Opcode::kBuildList:
+      case Opcode::kBuildMap:
+        result = ValueType::kObject;
+        break;
+      case Opcode::kGetIndex:
+        break;
+      case Opcode::kSetIndex:
+        result = b;
+        break;
+    }
+
+    if (instruction == Opcode::kPick) {
+      types.push_back(result);
+    } else {
+      types.resize(types.size() - info->pops);
+      for (auto i = std::size_t{0}; i < info->pushes; ++i) {
+        types.push_back(result);
+      }
+    }
+    if (instruction == Opcode::kSetLocal) {
+      types[code[offset + 1]] = result;
+    } else if (instruction == Opcode::kSetLocalLong) {
+      types[ReadLongOperand(code + offset + 1)] = result;
+    }
+    state.captured.resize(types.size());
+    if (closure != nullptr) {
+      for (const Capture &capture : closure->get_captures()) {
+        if (capture.is_local) state.captured[capture.index] = true;
+      }
+    }
+    for (auto i = std::size_t{0}; i < types.size(); ++i) {
+      if (state.captured[i]) types[i] = ValueType::kUnknown;
+    }
+    if (types.size() > max_depth) max_depth = types.size();
+
+    std::size_t next = offset + info->length;
+    switch (instruction) {
+      case Opcode::kReturn:
+        // Whatever else is on the stack belongs to the frame kReturn
+        // discards.
+        break;
+      case Opcode::kJump:
+        if (!flow(next + ReadJumpOffset(code + offset + 1), state)) {
+          return false;
+        }
+        break;
+      case Opcode::kJumpIfFalse:
+        if (!flow(next + ReadJumpOffset(code + offset + 1), state) ||
+            !flow(next, state)) {
+          return false;
+        }
+        break;
+      case Opcode::kLoop: {
+        std::size_t jump = ReadJumpOffset(code + offset + 1);
+        if (jump > next) return Error(offset, "Loop before the chunk.");
+        if (!flow(next - jump, state)) return false;
+        break;
+      }
+      default:
+        if (!flow(next, state)) return false;
+        break;
+    }
+  }
+
+  // Code no path reaches is never run, so it is not checked beyond being
+  // well formed.
+  chunk->MarkVerified(max_depth);
+  return true;
+}
+
+const std::string &Verifier::get_error() const { return error_; }
+
+bool Verifier::Error(std::size_t offset, std::string_view message) {
+  error_ = "[offset " + std::to_string(offset) + "] " + std::string{message};
+  return false;
+}
+
+}  // namespace lox
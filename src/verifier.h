@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef LOX_SRC_VERIFIER_H
+#define LOX_SRC_VERIFIER_H
+
+#include <string>
+#include <string_view>
+
+#include "chunk.h"
+
+namespace lox {
+
+// Checks a chunk before it is run: every instruction and its operands lie
+// inside the code, jumps land on instructions, constant, local and upvalue
+// slots are in range, the stack never underflows and has the same depth on
+// every path to an instruction, and the operands of type-specialised
+// instructions are proven to have that type on every path, where locals a
+// closure captured are never proven to have any type. Chunks that pass are marked as
+// verified, together with their maximum stack depth, so that the virtual
+// machine can execute them without any per-instruction checks.
+class Verifier {
+ public:
+  Verifier() = default;
+
+  bool Verify(Chunk *chunk);
+  [[nodiscard]] const std::string &get_error() const;
+
+ private:
+  bool Error(std::size_t offset, std::string_view message);
+
+  std::string error_;
+};
+
+}  // namespace lox
+
+#endif  // LOX_SRC_VERIFIER_H
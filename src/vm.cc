@@ -2,81 +2,823 @@
 
 #include "vm.h"
 
+#include <algorithm>
 #include <array>
 #include <cstdarg>
 #include <iostream>
 
+#include "batch.h"
+#include "jit.h"
+#include "runtime.h"
+
 namespace lox {
 
-template <typename... Ts>
-struct Overloaded : Ts... {
-  using Ts::operator()...;
-};
+namespace {
+
+// What an inline cache maps a shape to: the slot of a field, or with
+// kMethodBit set, the index of a method of the instance's class.
+constexpr auto kMethodBit = std::uint32_t{1}
+                            << (InlineCache::kResolutionBits - 1);
+
+// Fields shadow methods.
+std::optional<std::uint32_t> ResolveProperty(const Instance &instance,
+                                             std::string_view name) {
+  if (auto slot = instance.get_shape().Find(name)) {
+    return static_cast<std::uint32_t>(*slot);
+  }
+  if (auto method = instance.get_class().FindMethod(name)) {
+    return static_cast<std::uint32_t>(*method) | kMethodBit;
+  }
+  return std::nullopt;
+}
+
+// Returns value's object if it is one of type, or nullptr.
+template <typename T>
+T *GetObject(const Value &value, ObjectType type) {
+  const auto *object = std::get_if<std::shared_ptr<Object>>(&value);
+  if (object == nullptr || (*object)->get_type() != type) return nullptr;
+  return static_cast<T *>(object->get());
+}
 
-template <typename... Ts>
-Overloaded(Ts...) -> Overloaded<Ts...>;
+}  // namespace
 
 template <typename Operator>
 bool VirtualMachine::BinaryOp(const std::uint8_t *ip, Operator op) {
-  if (!(std::holds_alternative<double>(Peek(0)) &&
-        std::holds_alternative<double>(Peek(1)))) {
-    RuntimeError(ip, "Operands must be numbers.");
+  if (const char *error = lox::NumberOp(stack_top_ - 2, *(stack_top_ - 1), op)) {
+    RuntimeError(ip, "%s", error);
     return false;
   }
+  --stack_top_;
+  return true;
+}
+
+VirtualMachine::VirtualMachine()
+    : stack_(kStackMax),
+      stack_top_(stack_.data()),
+      out_(&std::cout),
+      errors_(&std::cerr),
+      global_table_(std::make_shared<GlobalTable>()) {}
+
+// Defined here, where JitCode is complete.
+VirtualMachine::~VirtualMachine() = default;
+
+void VirtualMachine::set_optimization_level(OptimizationLevel level) {
+  // Cached chunks were compiled at the old level.
+  if (level != optimization_level_) chunk_cache_.Clear();
+  optimization_level_ = level;
+}
+
+void VirtualMachine::set_jit_enabled(bool enabled) { jit_enabled_ = enabled; }
+
+void VirtualMachine::set_tracing_enabled(bool enabled) {
+  tracing_enabled_ = enabled;
+}
+
+void VirtualMachine::set_fuel(std::optional<std::size_t> fuel) {
+  fuel_ = fuel;
+}
+
+std::optional<std::size_t> VirtualMachine::get_fuel() const { return fuel_; }
+
+void VirtualMachine::set_output(std::ostream *out) { out_.set_output(out); }
+
+void VirtualMachine::set_error_output(std::ostream *errors) {
+  errors_ = errors;
+}
 
-  auto b = std::get<double>(PopValue());
-  auto a = std::get<double>(PopValue());
-  PushValue(op(a, b));
+void VirtualMachine::set_inputs(std::vector<Value> inputs) {
+  owned_inputs_ = std::move(inputs);
+}
+
+ChunkCache &VirtualMachine::get_chunk_cache() { return chunk_cache_; }
+
+void VirtualMachine::ResetGlobals(std::shared_ptr<GlobalTable> globals) {
+  // Cached chunks refer to slots in the old table.
+  chunk_cache_.Clear();
+  global_table_ = std::move(globals);
+  globals_.clear();
+}
+
+bool VirtualMachine::CheckInputs() {
+  const std::vector<ValueType> &types = chunk_->GetInputTypes();
+  if (inputs_->size() < types.size()) {
+    *errors_ << "Expected " << types.size() << " inputs but got "
+             << inputs_->size() << ".\n";
+    return false;
+  }
+  for (auto i = std::size_t{0}; i < types.size(); ++i) {
+    if (types[i] != ValueType::kUnknown &&
+        types[i] != GetValueType((*inputs_)[i])) {
+      *errors_ << "Input " << i << " does not have its declared type.\n";
+      return false;
+    }
+  }
   return true;
 }
 
-void VirtualMachine::PushValue(const Value &value) { stack_.push_back(value); }
+bool VirtualMachine::Add(const std::uint8_t *ip) {
+  if (const char *error = lox::Add(stack_top_ - 2, *(stack_top_ - 1))) {
+    RuntimeError(ip, "%s", error);
+    return false;
+  }
+  --stack_top_;
+  return true;
+}
 
-Value VirtualMachine::PopValue() {
-  Value result = *(stack_.end() - 1);
-  stack_.pop_back();
-  return result;
+bool VirtualMachine::CallValue(const std::uint8_t *ip, std::uint8_t count) {
+  const auto *callee = std::get_if<std::shared_ptr<Object>>(&Peek(count));
+  if (callee == nullptr) {
+    RuntimeError(ip, "Can only call functions and classes.");
+    return false;
+  }
+  switch ((*callee)->get_type()) {
+    case ObjectType::kClass: {
+      // The instance takes the class's place, as the initializer's 'this'.
+      auto klass = std::static_pointer_cast<Class>(*callee);
+      Peek(count) =
+          Value{std::shared_ptr<Object>{std::make_shared<Instance>(klass)}};
+      if (const std::shared_ptr<Object> &initializer =
+              klass->GetInitializer()) {
+        return CallFunction(ip, *initializer, count);
+      }
+      if (count != 0) {
+        RuntimeError(ip, "Expected 0 arguments but got %u.",
+                     static_cast<unsigned>(count));
+        return false;
+      }
+      return true;
+    }
+    case ObjectType::kBoundMethod: {
+      // The class keeps the method alive once the receiver replaces it.
+      const auto &bound = static_cast<const BoundMethod &>(**callee);
+      const Object &method = *bound.get_method();
+      Value receiver = bound.get_receiver();
+      Peek(count) = std::move(receiver);
+      return CallFunction(ip, method, count);
+    }
+    default:
+      return CallFunction(ip, **callee, count);
+  }
+}
+
+bool VirtualMachine::CallFunction(const std::uint8_t *ip, const Object &callee,
+                                  std::uint8_t count) {
+  const Function *function = nullptr;
+  const Closure *closure = nullptr;
+  if (callee.get_type() == ObjectType::kClosure) {
+    closure = static_cast<const Closure *>(&callee);
+    function = &closure->get_function();
+  } else if (callee.get_type() == ObjectType::kFunction) {
+    function = static_cast<const Function *>(&callee);
+  }
+  // A function with captures can only run with the closure holding them.
+  if (function == nullptr ||
+      (closure == nullptr && !function->get_captures().empty())) {
+    RuntimeError(ip, "Can only call functions and classes.");
+    return false;
+  }
+  if (count != function->get_arity()) {
+    RuntimeError(ip, "Expected %zu arguments but got %u.",
+                 function->get_arity(), static_cast<unsigned>(count));
+    return false;
+  }
+  if (frame_count_ == kFramesMax) {
+    RuntimeError(ip, "Stack overflow.");
+    return false;
+  }
+  const Chunk *chunk = function->GetChunk(*errors_);
+  if (chunk == nullptr) {
+    RuntimeError(ip, "Function '%s' does not compile.",
+                 function->get_name().c_str());
+    return false;
+  }
+  // A body is normally scanned for globals along with the script declaring
+  // it, but one restored from a snapshot may name more once compiled.
+  if (const auto &table = chunk->GetGlobalTable();
+      table != nullptr && table->GetCount() > globals_.size()) {
+    globals_.resize(table->GetCount());
+  }
+  // A verified chunk runs unchecked, so it needs all its stack up front.
+  if (chunk->IsVerified() && !EnsureStack(chunk->GetMaxStackDepth())) {
+    RuntimeError(ip, "Stack overflow.");
+    return false;
+  }
+  // The callee and its arguments are already where the frame's slots start.
+  frames_[frame_count_++] = CallFrame{
+      function, closure, chunk, chunk->GetCodePtr(), stack_top_ - count - 1};
+  return true;
+}
+
+std::shared_ptr<Upvalue> VirtualMachine::CaptureUpvalue(Value *local) {
+  auto it = open_upvalues_.end();
+  while (it != open_upvalues_.begin() && (*(it - 1))->location >= local) {
+    --it;
+    if ((*it)->location == local) return *it;
+  }
+  return *open_upvalues_.insert(it,
+                                std::make_shared<Upvalue>(Upvalue{local, {}}));
+}
+
+void VirtualMachine::CloseUpvalues(Value *last) {
+  while (!open_upvalues_.empty() && open_upvalues_.back()->location >= last) {
+    Upvalue &upvalue = *open_upvalues_.back();
+    upvalue.closed = std::move(*upvalue.location);
+    upvalue.location = &upvalue.closed;
+    open_upvalues_.pop_back();
+  }
+}
+
+bool VirtualMachine::CallNative(const std::uint8_t *ip, std::uint8_t index,
+                                std::uint8_t count) {
+  const NativeFunction &native = chunk_->GetNative(index);
+  // The result replaces the arguments, or takes a new slot if there are none.
+  Value *args = stack_top_ - count;
+  if (!native.Call(args, args)) {
+    RuntimeError(ip, "Wrong argument types for %s.", native.get_name().c_str());
+    return false;
+  }
+  stack_top_ = args + 1;
+  return true;
+}
+
+bool VirtualMachine::GetGlobal(const std::uint8_t *ip, std::size_t slot) {
+  const std::optional<Value> &global = globals_[slot];
+  if (!global) {
+    RuntimeError(ip, "Undefined variable '%s'.",
+                 global_table_->GetName(slot).c_str());
+    return false;
+  }
+  PushValue(*global);
+  return true;
+}
+
+void VirtualMachine::DefineClass(std::size_t index) {
+  const auto &name = std::get<std::string>(chunk_->GetValueAtIndex(index));
+  PushValue(std::shared_ptr<Object>{std::make_shared<Class>(name)});
+}
+
+bool VirtualMachine::DefineMethod(const std::uint8_t *ip, std::size_t index) {
+  auto *klass = GetObject<Class>(Peek(1), ObjectType::kClass);
+  const auto *method = std::get_if<std::shared_ptr<Object>>(&Peek(0));
+  if (klass == nullptr || method == nullptr ||
+      ((*method)->get_type() != ObjectType::kFunction &&
+       (*method)->get_type() != ObjectType::kClosure)) {
+    RuntimeError(ip, "Methods must be functions defined on a class.");
+    return false;
+  }
+  klass->SetMethod(std::get<std::string>(chunk_->GetValueAtIndex(index)),
+                   *method);
+  --stack_top_;
+  return true;
+}
+
+bool VirtualMachine::Inherit(const std::uint8_t *ip) {
+  auto *superclass = GetObject<Class>(Peek(1), ObjectType::kClass);
+  auto *subclass = GetObject<Class>(Peek(0), ObjectType::kClass);
+  if (superclass == nullptr || subclass == nullptr) {
+    RuntimeError(ip, "Superclass must be a class.");
+    return false;
+  }
+  subclass->Inherit(*superclass);
+  --stack_top_;
+  return true;
+}
+
+std::optional<std::uint32_t> VirtualMachine::FindProperty(
+    const std::uint8_t *ip, const Instance &instance, std::size_t index) {
+  const InlineCache &cache = chunk_->GetInlineCache(index);
+  std::uint64_t shape = instance.get_shape().get_id();
+  if (auto resolution = cache.Find(shape)) return resolution;
+
+  auto resolution = ResolveProperty(instance, cache.get_name());
+  if (!resolution) {
+    RuntimeError(ip, "Undefined property '%s'.", cache.get_name().c_str());
+    return std::nullopt;
+  }
+  cache.Insert(shape, *resolution);
+  return resolution;
+}
+
+bool VirtualMachine::GetProperty(const std::uint8_t *ip, std::size_t index) {
+  Value &receiver = Peek(0);
+  auto *instance = GetObject<Instance>(receiver, ObjectType::kInstance);
+  if (instance == nullptr) {
+    RuntimeError(ip, "Only instances have properties.");
+    return false;
+  }
+  std::optional<std::uint32_t> resolution =
+      FindProperty(ip, *instance, index);
+  if (!resolution) return false;
+
+  // Whatever replaces the receiver is made before the receiver, which may
+  // be all that keeps the instance alive, is overwritten.
+  if (*resolution & kMethodBit) {
+    const std::shared_ptr<Object> &method =
+        instance->get_class().GetMethod(*resolution & ~kMethodBit);
+    receiver = Value{std::shared_ptr<Object>{
+        std::make_shared<BoundMethod>(receiver, method)}};
+  } else {
+    Value field = instance->GetField(*resolution);
+    receiver = std::move(field);
+  }
+  return true;
+}
+
+bool VirtualMachine::SetProperty(const std::uint8_t *ip, std::size_t index) {
+  auto *instance = GetObject<Instance>(Peek(1), ObjectType::kInstance);
+  if (instance == nullptr) {
+    RuntimeError(ip, "Only instances have fields.");
+    return false;
+  }
+  const InlineCache &cache = chunk_->GetInlineCache(index);
+  std::uint64_t shape = instance->get_shape().get_id();
+  if (auto slot = cache.Find(shape)) {
+    instance->GetField(*slot) = Peek(0);
+  } else if (auto field = instance->get_shape().Find(cache.get_name())) {
+    cache.Insert(shape, static_cast<std::uint32_t>(*field));
+    instance->GetField(*field) = Peek(0);
+  } else {
+    instance->AddField(cache.get_name(), Peek(0));
+  }
+  // The value is the assignment's result.
+  Value value = PopValue();
+  Peek(0) = std::move(value);
+  return true;
+}
+
+bool VirtualMachine::Invoke(const std::uint8_t *ip, std::size_t index,
+                            std::uint8_t count) {
+  if (auto *list = GetObject<List>(Peek(count), ObjectType::kList)) {
+    return InvokeBuiltinMethod(ip, list, &FindListMethod, index, count);
+  }
+  if (auto *map = GetObject<Map>(Peek(count), ObjectType::kMap)) {
+    return InvokeBuiltinMethod(ip, map, &FindMapMethod, index, count);
+  }
+  auto *instance = GetObject<Instance>(Peek(count), ObjectType::kInstance);
+  if (instance == nullptr) {
+    RuntimeError(ip, "Only instances, lists and maps have methods.");
+    return false;
+  }
+  std::optional<std::uint32_t> resolution =
+      FindProperty(ip, *instance, index);
+  if (!resolution) return false;
+
+  // A method runs with the instance where it is, as 'this'.
+  if (*resolution & kMethodBit) {
+    return CallFunction(
+        ip, *instance->get_class().GetMethod(*resolution & ~kMethodBit),
+        count);
+  }
+  Value field = instance->GetField(*resolution);
+  Peek(count) = std::move(field);
+  return CallValue(ip, count);
+}
+
+template <typename T, typename Method>
+bool VirtualMachine::InvokeBuiltinMethod(
+    const std::uint8_t *ip, T *object, const Method *(*find)(std::string_view),
+    std::size_t index, std::uint8_t count) {
+  const std::string &name = chunk_->GetInlineCache(index).get_name();
+  const Method *method = find(name);
+  if (method == nullptr) {
+    RuntimeError(ip, "Undefined property '%s'.", name.c_str());
+    return false;
+  }
+  if (count != method->arity) {
+    RuntimeError(ip, "Expected %zu arguments but got %u.", method->arity,
+                 static_cast<unsigned>(count));
+    return false;
+  }
+  // The receiver keeps the object alive until the result replaces it.
+  auto result = Value{};
+  if (const char *error =
+          method->function(object, stack_top_ - count, &result)) {
+    RuntimeError(ip, "%s", error);
+    return false;
+  }
+  stack_top_ -= count;
+  Peek(0) = std::move(result);
+  return true;
+}
+
+void VirtualMachine::BuildList(std::uint8_t count) {
+  Value *elements = stack_top_ - count;
+  auto list = std::make_shared<List>(
+      std::vector<Value>{std::make_move_iterator(elements),
+                         std::make_move_iterator(stack_top_)});
+  stack_top_ = elements;
+  PushValue(std::shared_ptr<Object>{std::move(list)});
+}
+
+bool VirtualMachine::BuildMap(const std::uint8_t *ip, std::uint8_t count) {
+  Value *entries = stack_top_ - 2 * std::size_t{count};
+  auto map = std::make_shared<Map>();
+  // A key given twice maps to the last value given for it.
+  for (Value *entry = entries; entry != stack_top_; entry += 2) {
+    if (const char *error = Map::CheckKey(entry[0])) {
+      RuntimeError(ip, "%s", error);
+      return false;
+    }
+    map->Set(entry[0], std::move(entry[1]));
+  }
+  stack_top_ = entries;
+  PushValue(std::shared_ptr<Object>{std::move(map)});
+  return true;
+}
+
+bool VirtualMachine::GetIndex(const std::uint8_t *ip) {
+  if (auto *map = GetObject<Map>(Peek(1), ObjectType::kMap)) {
+    if (const char *error = Map::CheckKey(Peek(0))) {
+      RuntimeError(ip, "%s", error);
+      return false;
+    }
+    const Value *value = map->Find(Peek(0));
+    Value element = value != nullptr ? *value : Value{};
+    --stack_top_;
+    Peek(0) = std::move(element);
+    return true;
+  }
+  auto *list = GetObject<List>(Peek(1), ObjectType::kList);
+  if (list == nullptr) {
+    RuntimeError(ip, "Only lists and maps can be indexed.");
+    return false;
+  }
+  std::optional<std::size_t> index = list->GetIndex(Peek(0));
+  if (!index) {
+    RuntimeError(ip, "%s",
+                 std::holds_alternative<double>(Peek(0))
+                     ? "List index out of range."
+                     : "List index must be a number.");
+    return false;
+  }
+  Value element = list->Get(*index);
+  --stack_top_;
+  Peek(0) = std::move(element);
+  return true;
+}
+
+bool VirtualMachine::SetIndex(const std::uint8_t *ip) {
+  if (auto *map = GetObject<Map>(Peek(2), ObjectType::kMap)) {
+    if (const char *error = Map::CheckKey(Peek(1))) {
+      RuntimeError(ip, "%s", error);
+      return false;
+    }
+    map->Set(Peek(1), Peek(0));
+  } else if (auto *list = GetObject<List>(Peek(2), ObjectType::kList)) {
+    std::optional<std::size_t> index = list->GetIndex(Peek(1));
+    if (!index) {
+      RuntimeError(ip, "%s",
+                   std::holds_alternative<double>(Peek(1))
+                       ? "List index out of range."
+                       : "List index must be a number.");
+      return false;
+    }
+    list->Set(*index, Peek(0));
+  } else {
+    RuntimeError(ip, "Only lists and maps can be indexed.");
+    return false;
+  }
+  // The value is the assignment's result.
+  Value value = PopValue();
+  --stack_top_;
+  Peek(0) = std::move(value);
+  return true;
+}
+
+bool VirtualMachine::GetSuper(const std::uint8_t *ip, std::size_t index) {
+  auto *superclass = GetObject<Class>(Peek(0), ObjectType::kClass);
+  if (superclass == nullptr) {
+    RuntimeError(ip, "Superclass must be a class.");
+    return false;
+  }
+  const std::string &name = chunk_->GetInlineCache(index).get_name();
+  std::optional<std::size_t> method = superclass->FindMethod(name);
+  if (!method) {
+    RuntimeError(ip, "Undefined property '%s'.", name.c_str());
+    return false;
+  }
+  Value &receiver = Peek(1);
+  receiver = Value{std::shared_ptr<Object>{std::make_shared<BoundMethod>(
+      receiver, superclass->GetMethod(*method))}};
+  --stack_top_;
+  return true;
+}
+
+void VirtualMachine::DefineGlobal(std::size_t slot) {
+  globals_[slot] = PopValue();
+}
+
+bool VirtualMachine::SetGlobal(const std::uint8_t *ip, std::size_t slot) {
+  std::optional<Value> &global = globals_[slot];
+  if (!global) {
+    RuntimeError(ip, "Undefined variable '%s'.",
+                 global_table_->GetName(slot).c_str());
+    return false;
+  }
+  // Assignment is an expression, so the value stays on the stack.
+  *global = Peek(0);
+  return true;
+}
+
+bool VirtualMachine::EnsureStack(std::size_t count) {
+  auto depth = static_cast<std::size_t>(stack_top_ - stack_.data());
+  if (depth + count <= stack_.size()) return true;
+  if (depth + count > kStackLimit) return false;
+
+  // Frames and open upvalues point into the stack, so they move along with
+  // it.
+  auto bases = std::vector<std::size_t>{};
+  bases.reserve(frame_count_ + open_upvalues_.size());
+  for (auto i = std::size_t{0}; i < frame_count_; ++i) {
+    bases.push_back(static_cast<std::size_t>(frames_[i].slots - stack_.data()));
+  }
+  for (const std::shared_ptr<Upvalue> &upvalue : open_upvalues_) {
+    bases.push_back(
+        static_cast<std::size_t>(upvalue->location - stack_.data()));
+  }
+  stack_.resize(
+      std::min(kStackLimit, std::max(depth + count, 2 * stack_.size())));
+  for (auto i = std::size_t{0}; i < frame_count_; ++i) {
+    frames_[i].slots = stack_.data() + bases[i];
+  }
+  for (auto i = std::size_t{0}; i < open_upvalues_.size(); ++i) {
+    open_upvalues_[i]->location = stack_.data() + bases[frame_count_ + i];
+  }
+  stack_top_ = stack_.data() + depth;
+  return true;
+}
+
+void VirtualMachine::MakeClosure(std::size_t index) {
+  std::shared_ptr<Object> object =
+      *std::get_if<std::shared_ptr<Object>>(&chunk_->GetValueAtIndex(index));
+  auto function = std::static_pointer_cast<const Function>(std::move(object));
+  const CallFrame &frame = frames_[frame_count_ - 1];
+  auto upvalues = std::vector<std::shared_ptr<Upvalue>>{};
+  upvalues.reserve(function->get_captures().size());
+  for (const Capture &capture : function->get_captures()) {
+    if (capture.is_local) {
+      upvalues.push_back(CaptureUpvalue(frame.slots + capture.index));
+    } else {
+      upvalues.push_back(frame.closure->GetUpvalue(capture.index));
+    }
+  }
+  PushValue(std::shared_ptr<Object>{
+      std::make_shared<Closure>(std::move(function), std::move(upvalues))});
+}
+
+void VirtualMachine::ReplaceCaller() {
+  CallFrame &caller = frames_[frame_count_ - 2];
+  CallFrame &callee = frames_[frame_count_ - 1];
+  // The caller's locals go out of scope as they would on return. The callee
+  // has not run yet, so none of its own slots are captured.
+  CloseUpvalues(caller.slots);
+  auto size = stack_top_ - callee.slots;
+  std::move(callee.slots, stack_top_, caller.slots);
+  stack_top_ = caller.slots + size;
+  callee.slots = caller.slots;
+  caller = callee;
+  --frame_count_;
+}
+
+bool VirtualMachine::Negate(const std::uint8_t *ip) {
+  if (const char *error = lox::Negate(stack_top_ - 1)) {
+    RuntimeError(ip, "%s", error);
+    return false;
+  }
+  return true;
+}
+
+template <bool kChecked, typename Operator>
+bool VirtualMachine::NumberOp(const std::uint8_t *ip, Operator op) {
+  if constexpr (kChecked) {
+    return BinaryOp(ip, op);
+  } else {
+    double b = *std::get_if<double>(stack_top_ - 1);
+    Value &a = *(stack_top_ - 2);
+    a = op(*std::get_if<double>(&a), b);
+    --stack_top_;
+    return true;
+  }
 }
 
+void VirtualMachine::PushValue(const Value &value) { *stack_top_++ = value; }
+
+Value VirtualMachine::PopValue() { return std::move(*--stack_top_); }
+
 Value &VirtualMachine::Peek(long distance) {
-  return *(stack_.end() - distance - 1);
+  return *(stack_top_ - distance - 1);
 }
 
-InterpretResult VirtualMachine::Run() {
+template <bool kChecked>
+InterpretResult VirtualMachine::Run(std::size_t base) {
 #define BINARY_OP(op)                                                        \
   do {                                                                       \
     if (!BinaryOp(ip, [](double a, double b) -> Value { return a op b; })) { \
       return InterpretResult::kRuntimeError;                                 \
     }                                                                        \
   } while (false)
+#define NUMBER_OP(op)                                                      \
+  do {                                                                     \
+    if (!NumberOp<kChecked>(                                               \
+            ip, [](double a, double b) -> Value { return a op b; })) {     \
+      return InterpretResult::kRuntimeError;                               \
+    }                                                                      \
+  } while (false)
 
-  const std::uint8_t *ip = chunk_->GetCodePtr();
+  CallFrame *frame = nullptr;
+  const std::uint8_t *ip = nullptr;
+  [[maybe_unused]] const std::uint8_t *code_end = nullptr;
+  auto enter_frame = [this, &frame, &ip, &code_end]() {
+    frame = &frames_[frame_count_ - 1];
+    chunk_ = frame->chunk;
+    ip = frame->ip;
+    code_end = chunk_->GetCodePtr() + chunk_->GetCodeSize();
+  };
+  enter_frame();
 
   auto read_byte = [&ip]() -> std::uint8_t { return *ip++; };
+  auto read_long_operand = [&ip]() -> std::size_t {
+    ip += 3;
+    return ReadLongOperand(ip - 3);
+  };
+  auto read_jump_offset = [&ip]() -> std::size_t {
+    ip += 2;
+    return ReadJumpOffset(ip - 2);
+  };
 
-  auto read_constant = [this, read_byte]() -> Value {
-    return this->chunk_->GetValueAtIndex(read_byte());
+  // Checks a constant index; only needed when the chunk is not verified.
+  auto check_constant = [this, &ip](std::size_t index) -> bool {
+    if constexpr (kChecked) {
+      if (index >= chunk_->GetConstantCount()) {
+        RuntimeError(ip, "Constant index out of range.");
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Checks a global slot; only needed when the chunk is not verified.
+  auto check_global = [this, &ip](std::size_t slot) -> bool {
+    if constexpr (kChecked) {
+      if (slot >= globals_.size()) {
+        RuntimeError(ip, "Global slot out of range.");
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Checks that a local slot lies beneath the count values on top of the
+  // stack; only needed when the chunk is not verified.
+  auto check_local = [this, &ip, &frame](std::size_t slot,
+                                         std::size_t count) -> bool {
+    if constexpr (kChecked) {
+      auto depth = static_cast<std::size_t>(stack_top_ - frame->slots);
+      if (slot + count >= depth) {
+        RuntimeError(ip, "Local slot out of range.");
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Checks that a jump stays inside the code; only needed when the chunk is
+  // not verified.
+  auto check_jump = [this, &ip, &code_end](long jump) -> bool {
+    if constexpr (kChecked) {
+      if (jump < chunk_->GetCodePtr() - ip || jump > code_end - ip) {
+        RuntimeError(ip, "Jump out of range.");
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Checks that a closure's constant is a function whose captures are in
+  // range; only needed when the chunk is not verified.
+  auto check_closure = [this, &ip, &frame](std::size_t index) -> bool {
+    if constexpr (kChecked) {
+      const auto *object = std::get_if<std::shared_ptr<Object>>(
+          &chunk_->GetValueAtIndex(index));
+      if (object == nullptr ||
+          (*object)->get_type() != ObjectType::kFunction) {
+        RuntimeError(ip, "Closure constant is not a function.");
+        return false;
+      }
+      auto depth = static_cast<std::size_t>(stack_top_ - frame->slots);
+      std::size_t upvalues =
+          frame->closure == nullptr ? 0 : frame->closure->get_upvalue_count();
+      for (const Capture &capture :
+           static_cast<const Function &>(**object).get_captures()) {
+        if (capture.is_local ? capture.index > depth
+                             : capture.index >= upvalues) {
+          RuntimeError(ip, "Captured variable out of range.");
+          return false;
+        }
+      }
+    }
+    return true;
+  };
+
+  // Checks that a constant is a class or method name, and that an inline
+  // cache exists; only needed when the chunk is not verified.
+  auto check_name = [this, &ip](std::size_t index) -> bool {
+    if constexpr (kChecked) {
+      if (index >= chunk_->GetConstantCount() ||
+          !std::holds_alternative<std::string>(
+              chunk_->GetValueAtIndex(index))) {
+        RuntimeError(ip, "Name constant is not a string.");
+        return false;
+      }
+    }
+    return true;
+  };
+  auto check_inline_cache = [this, &ip](std::size_t index) -> bool {
+    if constexpr (kChecked) {
+      if (index >= chunk_->GetInlineCacheCount()) {
+        RuntimeError(ip, "Inline cache index out of range.");
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Continues in the frame a call pushed, if it pushed one rather than
+  // returning at once, as a class without an initializer does.
+  auto enter_call = [this, &enter_frame](std::size_t frames) -> bool {
+    if (frame_count_ == frames) return true;
+    if constexpr (!kChecked) {
+      // Only a chunk that failed verification is not trusted; it runs
+      // checked in a run of its own, which returns once it does.
+      if (!frames_[frame_count_ - 1].chunk->IsVerified()) {
+        return Run<true>(frame_count_) == InterpretResult::kOk;
+      }
+    }
+    enter_frame();
+    return true;
+  };
+
+  // Charges cost to the fuel, if the run is metered, and returns whether
+  // that used it up, in which case the run is suspended at ip.
+  auto use_fuel = [this, base, &frame, &ip](std::size_t cost) -> bool {
+    if (!fuel_) return false;
+    if (*fuel_ > cost) {
+      *fuel_ -= cost;
+      return false;
+    }
+    *fuel_ = 0;
+    if (base != 1) return false;
+    frame->ip = ip;
+    return true;
+  };
+  // What a call that left frames beneath the frame on top costs: the
+  // callee's code, if it got a frame of its own.
+  auto call_cost = [this, &frame](std::size_t frames) -> std::size_t {
+    return frame_count_ > frames ? frame->chunk->GetCodeSize() : 1;
   };
 
   auto last_element = [this]() -> const Value & {
-    return *(this->stack_.end() - 1);
+    return *(this->stack_top_ - 1);
   };
 
   while (true) {
 #if DEBUG_TRACE_EXECUTION
     std::cout << "          ";
-    for (auto &slot : stack_) {
-      std::cout << "[ " << slot << " ]";
+    for (auto *slot = stack_.data(); slot != stack_top_; ++slot) {
+      std::cout << "[ " << *slot << " ]";
     }
     std::cout << '\n';
     chunk_->DisassembleInstruction(
         static_cast<std::size_t>(ip - chunk_->GetCodePtr()));
 #endif
+    if constexpr (!kChecked) {
+      if (tracer_.is_recording()) tracer_.Record(*this, ip);
+    }
+    if constexpr (kChecked) {
+      auto info =
+          GetInstructionInfo(ip, static_cast<std::size_t>(code_end - ip));
+      if (!info) {
+        RuntimeError(ip + 1, "Malformed instruction.");
+        return InterpretResult::kRuntimeError;
+      }
+      auto depth = static_cast<std::size_t>(stack_top_ - frame->slots);
+      if (depth < info->pops) {
+        RuntimeError(ip + 1, "Stack underflow.");
+        return InterpretResult::kRuntimeError;
+      }
+      if (info->pushes > info->pops &&
+          !EnsureStack(info->pushes - info->pops)) {
+        RuntimeError(ip + 1, "Stack overflow.");
+        return InterpretResult::kRuntimeError;
+      }
+    }
+
     auto instruction = static_cast<Opcode>(read_byte());
     switch (instruction) {
       case Opcode::kConstant: {
-        Value constant = read_constant();
-        PushValue(constant);
+        std::size_t index = read_byte();
+        if (!check_constant(index)) return InterpretResult::kRuntimeError;
+        PushValue(chunk_->GetValueAtIndex(index));
         break;
       }
       case Opcode::kConstantLong: {
@@ -84,9 +826,11 @@ InterpretResult VirtualMachine::Run() {
         for (auto i = std::size_t{0}; i < constant_bytes.size(); ++i) {
           constant_bytes[i] = read_byte();
         }
-        auto constant = (constant_bytes[0] << 16) | (constant_bytes[1] << 8) |
-                        constant_bytes[2];
-        PushValue(static_cast<double>(constant));
+        auto index = static_cast<std::size_t>(
+            (constant_bytes[0] << 16) | (constant_bytes[1] << 8) |
+            constant_bytes[2]);
+        if (!check_constant(index)) return InterpretResult::kRuntimeError;
+        PushValue(chunk_->GetValueAtIndex(index));
         break;
       }
       case Opcode::kNil:
@@ -122,30 +866,9 @@ InterpretResult VirtualMachine::Run() {
       case Opcode::kLessEqual:
         BINARY_OP(<=);
         break;
-      case Opcode::kAdd: {
-        bool success = std::visit(
-            Overloaded{
-                [this](double b, double a) -> bool {
-                  PopValue();
-                  PopValue();
-                  PushValue(a + b);
-                  return true;
-                },
-                [this](const std::string &b, const std::string &a) -> bool {
-                  PopValue();
-                  PopValue();
-                  PushValue(a + b);
-                  return true;
-                },
-                [this, ip](auto, auto) -> bool {
-                  this->RuntimeError(
-                      ip, "Operands must be two numbers or two strings.");
-                  return false;
-                }},
-            Peek(0), Peek(1));
-        if (!success) return InterpretResult::kRuntimeError;
+      case Opcode::kAdd:
+        if (!Add(ip)) return InterpretResult::kRuntimeError;
         break;
-      }
       case Opcode::kSubtract:
         BINARY_OP(-);
         break;
@@ -156,35 +879,391 @@ InterpretResult VirtualMachine::Run() {
         BINARY_OP(/);
         break;
       case Opcode::kNot:
-        stack_[stack_.size() - 1] = IsFalsey(last_element());
+        *(stack_top_ - 1) = IsFalsey(last_element());
+        break;
+      case Opcode::kNegate:
+        if (!Negate(ip)) return InterpretResult::kRuntimeError;
+        break;
+      case Opcode::kReturn: {
+        if (frame->function == nullptr) {
+          if (result_ != nullptr) {
+            *result_ = PopValue();
+          } else if (chunk_->HasResult()) {
+            out_.Print(PopValue());
+          }
+          return InterpretResult::kOk;
+        }
+        // The result takes the callee's place, and the rest of the frame is
+        // dropped, after moving whatever closures captured from it into
+        // their upvalues.
+        Value result = PopValue();
+        CloseUpvalues(frame->slots);
+        stack_top_ = frame->slots;
+        *stack_top_++ = std::move(result);
+        --frame_count_;
+        if (frame_count_ < base) {
+          chunk_ = frames_[frame_count_ - 1].chunk;
+          return InterpretResult::kOk;
+        }
+        enter_frame();
+        break;
+      }
+      case Opcode::kAddNumber:
+        NUMBER_OP(+);
+        break;
+      case Opcode::kAddString: {
+        if constexpr (kChecked) {
+          if (!(std::holds_alternative<std::string>(Peek(0)) &&
+                std::holds_alternative<std::string>(Peek(1)))) {
+            RuntimeError(ip, "Operands must be two strings.");
+            return InterpretResult::kRuntimeError;
+          }
+        }
+        std::get_if<std::string>(stack_top_ - 2)
+            ->append(*std::get_if<std::string>(stack_top_ - 1));
+        --stack_top_;
+        break;
+      }
+      case Opcode::kSubtractNumber:
+        NUMBER_OP(-);
+        break;
+      case Opcode::kMultiplyNumber:
+        NUMBER_OP(*);
+        break;
+      case Opcode::kDivideNumber:
+        NUMBER_OP(/);
+        break;
+      case Opcode::kGreaterNumber:
+        NUMBER_OP(>);
+        break;
+      case Opcode::kGreaterEqualNumber:
+        NUMBER_OP(>=);
+        break;
+      case Opcode::kLessNumber:
+        NUMBER_OP(<);
+        break;
+      case Opcode::kLessEqualNumber:
+        NUMBER_OP(<=);
+        break;
+      case Opcode::kPick: {
+        std::uint8_t distance = read_byte();
+        PushValue(Peek(distance));
+        break;
+      }
+      case Opcode::kSlide: {
+        std::uint8_t count = read_byte();
+        Value top = PopValue();
+        stack_top_ -= count;
+        PushValue(std::move(top));
+        break;
+      }
+      case Opcode::kGetInput: {
+        std::uint8_t index = read_byte();
+        if constexpr (kChecked) {
+          if (index >= inputs_->size()) {
+            RuntimeError(ip, "Input index out of range.");
+            return InterpretResult::kRuntimeError;
+          }
+        }
+        PushValue((*inputs_)[index]);
+        break;
+      }
+      case Opcode::kCallNative: {
+        std::uint8_t index = read_byte();
+        std::uint8_t count = read_byte();
+        if constexpr (kChecked) {
+          if (index >= chunk_->GetNativeCount() ||
+              count != chunk_->GetNative(index).get_arity()) {
+            RuntimeError(ip, "Invalid native function call.");
+            return InterpretResult::kRuntimeError;
+          }
+        }
+        if (!CallNative(ip, index, count)) {
+          return InterpretResult::kRuntimeError;
+        }
+        break;
+      }
+      case Opcode::kDefineGlobal:
+      case Opcode::kDefineGlobalLong: {
+        std::size_t slot = instruction == Opcode::kDefineGlobal
+                               ? read_byte()
+                               : read_long_operand();
+        if (!check_global(slot)) return InterpretResult::kRuntimeError;
+        DefineGlobal(slot);
+        break;
+      }
+      case Opcode::kGetGlobal:
+      case Opcode::kGetGlobalLong: {
+        std::size_t slot = instruction == Opcode::kGetGlobal
+                               ? read_byte()
+                               : read_long_operand();
+        if (!check_global(slot) || !GetGlobal(ip, slot)) {
+          return InterpretResult::kRuntimeError;
+        }
+        break;
+      }
+      case Opcode::kSetGlobal:
+      case Opcode::kSetGlobalLong: {
+        std::size_t slot = instruction == Opcode::kSetGlobal
+                               ? read_byte()
+                               : read_long_operand();
+        if (!check_global(slot) || !SetGlobal(ip, slot)) {
+          return InterpretResult::kRuntimeError;
+        }
+        break;
+      }
+      case Opcode::kPop:
+        --stack_top_;
         break;
-      case Opcode::kNegate: {
-        if (!std::holds_alternative<double>(Peek(0))) {
-          RuntimeError(ip, "Operand must be a number");
+      case Opcode::kPrint:
+        out_.Print(PopValue());
+        break;
+      case Opcode::kGetLocal:
+      case Opcode::kGetLocalLong: {
+        std::size_t slot = instruction == Opcode::kGetLocal
+                               ? read_byte()
+                               : read_long_operand();
+        if (!check_local(slot, 0)) return InterpretResult::kRuntimeError;
+        PushValue(frame->slots[slot]);
+        break;
+      }
+      case Opcode::kSetLocal:
+      case Opcode::kSetLocalLong: {
+        std::size_t slot = instruction == Opcode::kSetLocal
+                               ? read_byte()
+                               : read_long_operand();
+        if (!check_local(slot, 1)) return InterpretResult::kRuntimeError;
+        frame->slots[slot] = Peek(0);
+        break;
+      }
+      case Opcode::kPopN:
+        stack_top_ -= read_byte();
+        break;
+      case Opcode::kJump: {
+        auto jump = static_cast<long>(read_jump_offset());
+        if (!check_jump(jump)) return InterpretResult::kRuntimeError;
+        ip += jump;
+        break;
+      }
+      case Opcode::kJumpIfFalse: {
+        auto jump = static_cast<long>(read_jump_offset());
+        if (!check_jump(jump)) return InterpretResult::kRuntimeError;
+        if (IsFalsey(Peek(0))) ip += jump;
+        break;
+      }
+      case Opcode::kLoop: {
+        auto jump = -static_cast<long>(read_jump_offset());
+        if (!check_jump(jump)) return InterpretResult::kRuntimeError;
+        const std::uint8_t *back_edge = ip - 3;
+        ip += jump;
+        if (use_fuel(static_cast<std::size_t>(-jump))) {
+          return InterpretResult::kSuspended;
+        }
+        if constexpr (!kChecked) {
+          // A trace runs to its end without using fuel.
+          if (tracing_enabled_ && !fuel_) {
+            ip = tracer_.OnLoop(this, *chunk_, frame->slots, frame->closure,
+                                ip, back_edge);
+          }
+        }
+        break;
+      }
+      case Opcode::kCall: {
+        std::uint8_t count = read_byte();
+        frame->ip = ip;
+        std::size_t frames = frame_count_;
+        if (!CallValue(ip, count) || !enter_call(frames)) {
           return InterpretResult::kRuntimeError;
         }
-        stack_[stack_.size() - 1] = -std::get<double>(last_element());
+        if (use_fuel(call_cost(frames))) return InterpretResult::kSuspended;
+        break;
+      }
+      case Opcode::kTailCall: {
+        std::uint8_t count = read_byte();
+        frame->ip = ip;
+        std::size_t frames = frame_count_;
+        if (!CallValue(ip, count)) return InterpretResult::kRuntimeError;
+        // The script's frame stays, and so does one whose callee has to run
+        // checked in a run of its own; either just returns the result.
+        bool reuse = frame_count_ != frames && frame->function != nullptr;
+        if constexpr (!kChecked) {
+          reuse = reuse && frames_[frame_count_ - 1].chunk->IsVerified();
+        }
+        if (reuse) {
+          ReplaceCaller();
+          enter_frame();
+        } else if (!enter_call(frames)) {
+          return InterpretResult::kRuntimeError;
+        }
+        if (use_fuel(call_cost(frames - (reuse ? 1 : 0)))) {
+          return InterpretResult::kSuspended;
+        }
+        break;
+      }
+      case Opcode::kClass: {
+        std::size_t index = read_long_operand();
+        if (!check_name(index)) return InterpretResult::kRuntimeError;
+        DefineClass(index);
+        break;
+      }
+      case Opcode::kMethod: {
+        std::size_t index = read_long_operand();
+        if (!check_name(index) || !DefineMethod(ip, index)) {
+          return InterpretResult::kRuntimeError;
+        }
+        break;
+      }
+      case Opcode::kInherit:
+        if (!Inherit(ip)) return InterpretResult::kRuntimeError;
+        break;
+      case Opcode::kGetProperty: {
+        std::size_t index = read_long_operand();
+        if (!check_inline_cache(index) || !GetProperty(ip, index)) {
+          return InterpretResult::kRuntimeError;
+        }
+        break;
+      }
+      case Opcode::kSetProperty: {
+        std::size_t index = read_long_operand();
+        if (!check_inline_cache(index) || !SetProperty(ip, index)) {
+          return InterpretResult::kRuntimeError;
+        }
+        break;
+      }
+      case Opcode::kInvoke: {
+        std::size_t index = read_long_operand();
+        std::uint8_t count = read_byte();
+        frame->ip = ip;
+        std::size_t frames = frame_count_;
+        if (!check_inline_cache(index) || !Invoke(ip, index, count) ||
+            !enter_call(frames)) {
+          return InterpretResult::kRuntimeError;
+        }
+        if (use_fuel(call_cost(frames))) return InterpretResult::kSuspended;
+        break;
+      }
+      case Opcode::kGetSuper: {
+        std::size_t index = read_long_operand();
+        if (!check_inline_cache(index) || !GetSuper(ip, index)) {
+          return InterpretResult::kRuntimeError;
+        }
+        break;
+      }
+      case Opcode::kBuildList:
+        BuildList(read_byte());
+        break;
+      case Opcode::kGetIndex:
+        if (!GetIndex(ip)) return InterpretResult::kRuntimeError;
+        break;
+      case Opcode::kSetIndex:
+        if (!SetIndex(ip)) return InterpretResult::kRuntimeError;
+        break;
+      case Opcode::kBuildMap: {
+        std::uint8_t count = read_byte();
+        if (!BuildMap(ip, count)) return InterpretResult::kRuntimeError;
+        break;
+      }
+      case Opcode::kClosure:
+      case Opcode::kClosureLong: {
+        std::size_t index = instruction == Opcode::kClosure
+                                ? read_byte()
+                                : read_long_operand();
+        if (!check_constant(index) || !check_closure(index)) {
+          return InterpretResult::kRuntimeError;
+        }
+        MakeClosure(index);
+        break;
+      }
+      case Opcode::kGetUpvalue:
+      case Opcode::kSetUpvalue: {
+        std::uint8_t index = read_byte();
+        if constexpr (kChecked) {
+          if (frame->closure == nullptr ||
+              index >= frame->closure->get_upvalue_count()) {
+            RuntimeError(ip, "Upvalue index out of range.");
+            return InterpretResult::kRuntimeError;
+          }
+        }
+        Value *location = frame->closure->GetUpvalue(index)->location;
+        if (instruction == Opcode::kGetUpvalue) {
+          PushValue(*location);
+        } else {
+          *location = Peek(0);
+        }
+        break;
+      }
+      case Opcode::kCloseUpvalues: {
+        std::uint8_t count = read_byte();
+        CloseUpvalues(stack_top_ - count);
+        stack_top_ -= count;
+        break;
+      }
+      case Opcode::kNegateNumber: {
+        if constexpr (kChecked) {
+          if (!std::holds_alternative<double>(Peek(0))) {
+            RuntimeError(ip, kNumberOperandError);
+            return InterpretResult::kRuntimeError;
+          }
+        }
+        auto *number = std::get_if<double>(stack_top_ - 1);
+        *number = -*number;
         break;
       }
-      case Opcode::kReturn:
-        std::cout << PopValue() << '\n';
-        return InterpretResult::kOk;
     }
   }
+#undef NUMBER_OP
 #undef BINARY_OP
 }
 
 void VirtualMachine::RuntimeError(const std::uint8_t *ip,
                                   const char *format...) {
+  auto message = std::array<char, 256>{};
   va_list args;
   va_start(args, format);
-  std::vfprintf(stderr, format, args);
+  std::vsnprintf(message.data(), message.size(), format, args);
   va_end(args);
 
-  auto instruction = static_cast<std::size_t>(ip - chunk_->GetCodePtr() - 1);
-  std::size_t line = chunk_->GetLineAtIndex(instruction);
-  std::cerr << "[line " << line << "] in script\n";
-  stack_.clear();
+  // Trace the calls that led here, from the innermost frame, which is at ip,
+  // to the script; the others are each at their call. What the script
+  // printed first is written out first, in case both go to a terminal.
+  out_.Flush();
+  *errors_ << message.data() << '\n';
+  for (auto i = frame_count_; i-- > 0;) {
+    const CallFrame &frame = frames_[i];
+    const std::uint8_t *at = i + 1 == frame_count_ ? ip : frame.ip;
+    auto instruction =
+        static_cast<std::size_t>(at - frame.chunk->GetCodePtr() - 1);
+    if (instruction < frame.chunk->GetCodeSize()) {
+      *errors_ << "[line " << frame.chunk->GetLineAtIndex(instruction) << ']';
+    } else {
+      *errors_ << "[end of chunk]";
+    }
+    if (frame.function != nullptr) {
+      *errors_ << " in " << frame.function->get_name() << "()\n";
+    } else {
+      *errors_ << " in script\n";
+    }
+  }
+  stack_top_ = stack_.data();
+}
+
+InterpretResult VirtualMachine::RunFrame() {
+  return frames_[frame_count_ - 1].chunk->IsVerified()
+             ? Run<false>(frame_count_)
+             : Run<true>(frame_count_);
+}
+
+InterpretResult VirtualMachine::EndRun(InterpretResult result) {
+  out_.Flush();
+  // A run that failed may have been recording.
+  tracer_.StopRecording();
+  // A suspended run keeps its frames and stack until it is resumed.
+  if (result == InterpretResult::kSuspended) return result;
+  // Closures that outlive the run keep the values they captured.
+  CloseUpvalues(stack_.data());
+  chunk_ = nullptr;
+  frame_count_ = 0;
+  return result;
 }
 
 /*
@@ -201,16 +1280,99 @@ https://stackoverflow.com/questions/27375089/what-is-the-easiest-way-to-print-a-
 }
 */
 InterpretResult VirtualMachine::Interpret(std::string_view source) {
-  auto compiler = Compiler{source};
-  auto chunk = Chunk{};
+  std::shared_ptr<const Chunk> chunk = chunk_cache_.Find(source);
+  if (chunk == nullptr) {
+    // The compiler's output always verifies; if it somehow does not, or
+    // needs more stack than we have, Execute() checks every instruction
+    // instead.
+    chunk = Compile(source);
+    if (chunk == nullptr) return InterpretResult::kCompileError;
+    chunk_cache_.Insert(source, chunk);
+  }
+  return Execute(*chunk);
+}
 
-  if (!compiler.Compile(&chunk)) return InterpretResult::kCompileError;
+std::shared_ptr<const Chunk> VirtualMachine::Compile(
+    std::string_view source, const std::vector<std::string> &inputs) {
+  auto compiler = Compiler{source, optimization_level_};
+  compiler.set_natives(&natives_);
+  compiler.set_globals(global_table_);
+  for (const std::string &input : inputs) {
+    if (!compiler.DeclareInput(input)) {
+      *errors_ << "Too many inputs.\n";
+      return nullptr;
+    }
+  }
+  return CompileShared(&compiler);
+}
 
+InterpretResult VirtualMachine::Evaluate(const Chunk &chunk,
+                                         const std::vector<Value> &inputs,
+                                         Value *result) {
+  // inputs and result are only borrowed until this returns, so the run has
+  // to finish by then.
+  std::optional<std::size_t> fuel = fuel_;
+  fuel_.reset();
+  inputs_ = &inputs;
+  result_ = result;
+  InterpretResult status = Execute(chunk);
+  inputs_ = &owned_inputs_;
+  result_ = nullptr;
+  fuel_ = fuel;
+  return status;
+}
+
+InterpretResult VirtualMachine::Execute(const Chunk &chunk) {
+  // A suspended run is abandoned.
+  CloseUpvalues(stack_.data());
   chunk_ = &chunk;
+  frame_count_ = 0;
+  stack_top_ = stack_.data();
+  if (!CheckInputs()) {
+    chunk_ = nullptr;
+    return InterpretResult::kRuntimeError;
+  }
+  if (const auto &table = chunk.GetGlobalTable(); table != nullptr) {
+    if (table != global_table_) {
+      *errors_ << "Chunk was compiled for other global variables.\n";
+      chunk_ = nullptr;
+      return InterpretResult::kRuntimeError;
+    }
+    // Code compiled since the last run may have added globals.
+    globals_.resize(table->GetCount());
+  }
 
-  InterpretResult result = Run();
-  chunk_ = nullptr;
-  return result;
+  bool trusted =
+      chunk.IsVerified() && EnsureStack(chunk.GetMaxStackDepth());
+  frames_[0] =
+      CallFrame{nullptr, nullptr, &chunk, chunk.GetCodePtr(), stack_.data()};
+  frame_count_ = 1;
+  // Native code cannot be suspended part way through.
+  const JitCode *jit_code =
+      jit_enabled_ && trusted && !fuel_ ? GetJitCode(chunk) : nullptr;
+  if (jit_code != nullptr) return EndRun(jit_code->Run(this));
+  checked_ = !trusted;
+  return Resume();
+}
+
+const JitCode *VirtualMachine::GetJitCode(const Chunk &chunk) {
+  if (jit_code_.size() >= kMaxJitChunks && jit_code_.count(&chunk) == 0) {
+    jit_code_.clear();
+  }
+  auto [it, inserted] = jit_code_.try_emplace(&chunk);
+  JitEntry &entry = it->second;
+  if (inserted || entry.chunk_id != chunk.get_id()) {
+    entry = JitEntry{chunk.get_id(), JitCode::Compile(chunk)};
+  }
+  return entry.code.get();
+}
+
+InterpretResult VirtualMachine::Resume() {
+  if (!IsSuspended()) {
+    *errors_ << "No run to resume.\n";
+    return InterpretResult::kRuntimeError;
+  }
+  return EndRun(checked_ ? Run<true>(1) : Run<false>(1));
 }
 
 }  // namespace lox
@@ -3,39 +3,267 @@
 #ifndef LOX_SRC_VM_H
 #define LOX_SRC_VM_H
 
-#define DEBUG_TRACE_EXECUTION true
+#define DEBUG_TRACE_EXECUTION false
 
+#include <array>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "chunk.h"
+#include "chunk_cache.h"
+#include "class.h"
 #include "compiler.h"
+#include "function.h"
+#include "globals.h"
+#include "list.h"
+#include "map.h"
+#include "native.h"
+#include "runtime.h"
+#include "trace.h"
 
 namespace lox {
 
-enum class InterpretResult { kOk, kCompileError, kRuntimeError };
+class JitCode;
+
+// kSuspended means the run used up its fuel and can be resumed.
+enum class InterpretResult { kOk, kCompileError, kRuntimeError, kSuspended };
 
 class VirtualMachine {
  public:
-  VirtualMachine() = default;
+  // The stack's initial size. It grows as calls and verified chunks need
+  // more, up to kStackLimit values.
+  static constexpr auto kStackMax = std::size_t{256};
+  static constexpr auto kFramesMax = std::size_t{1024};
+  static constexpr auto kStackLimit = kFramesMax * kStackMax;
+  static constexpr auto kChunkCacheCapacity = std::size_t{1} << 20;
+  // The JIT's code is forgotten once there is this much of it, so that
+  // that of chunks long gone does not pile up.
+  static constexpr auto kMaxJitChunks = std::size_t{256};
+
+  VirtualMachine();
+  ~VirtualMachine();
 
+  // Compiles and runs source, reusing the chunk compiled the last time the
+  // same source was interpreted if it is still in the chunk cache.
   InterpretResult Interpret(std::string_view source);
+  // Compiles source into a verified chunk that can be run any number of
+  // times, by any machine. Each of inputs names the input of the same index.
+  // Returns nullptr after reporting a compile error.
+  std::shared_ptr<const Chunk> Compile(
+      std::string_view source, const std::vector<std::string> &inputs = {});
+  // Runs chunk on inputs and stores the value it returns in *result instead
+  // of printing it. inputs is only referred to, not copied.
+  InterpretResult Evaluate(const Chunk &chunk, const std::vector<Value> &inputs,
+                           Value *result);
+  // Makes function callable from code compiled by this machine; see
+  // NativeTable::Define().
+  template <typename Signature, typename F>
+  bool DefineNative(std::string name, F function) {
+    if (!natives_.Define<Signature>(std::move(name), std::move(function))) {
+      return false;
+    }
+    // Cached chunks were compiled when the name meant a global.
+    chunk_cache_.Clear();
+    return true;
+  }
+  template <typename R, typename... Args>
+  bool DefineNative(std::string name, R (*function)(Args...)) {
+    return DefineNative<R(Args...)>(std::move(name), function);
+  }
+  // Runs an already compiled chunk. The chunk is only read, so a frozen chunk
+  // can be run by several machines on different threads at once. A run
+  // that is suspended keeps the chunk, which has to outlive it.
+  InterpretResult Execute(const Chunk &chunk);
+  // Continues the suspended run, with whatever fuel there is now.
+  InterpretResult Resume();
+  [[nodiscard]] bool IsSuspended() const { return frame_count_ != 0; }
+  // Meters runs: every backward jump uses as much fuel as the bytes of code
+  // it jumps back over, and every call the size of the callee's code, and
+  // once the fuel is used up the run is suspended. The charges bound the
+  // instructions run since the last one, so fuel roughly counts
+  // instructions. Without fuel, which is the default, runs are not metered.
+  // Runs under Evaluate() always finish, and metered runs are never JITed.
+  void set_fuel(std::optional<std::size_t> fuel);
+  // The fuel left, if runs are metered.
+  [[nodiscard]] std::optional<std::size_t> get_fuel() const;
+  void set_optimization_level(OptimizationLevel level);
+  // Runs chunks as native code where the JIT supports the platform and the
+  // chunk, falling back to the interpreter otherwise.
+  void set_jit_enabled(bool enabled);
+  // Replays traces of the hot loops of verified chunks in the interpreter;
+  // see LoopTracer. On by default, and off for metered runs.
+  void set_tracing_enabled(bool enabled);
+  // Where returned values and runtime errors are written, std::cout and
+  // std::cerr by default.
+  void set_output(std::ostream *out);
+  void set_error_output(std::ostream *errors);
+  // The values kGetInput reads, which must match the types the chunk being
+  // run declares for them.
+  void set_inputs(std::vector<Value> inputs);
+  // The chunks Interpret() compiled, kChunkCacheCapacity bytes of them by
+  // default.
+  ChunkCache &get_chunk_cache();
+  // Forgets every global variable and starts resolving them against
+  // globals, which chunks run from then on must have been compiled with.
+  void ResetGlobals(std::shared_ptr<GlobalTable> globals);
   void PushValue(const Value &value);
   Value PopValue();
 
  private:
+  friend class JitCode;
+  friend struct JitRuntime;
+  friend class LoopTracer;
+  friend class Snapshot;
+  friend class Trace;
+
+  // A function running on the stack: its locals start at slots, with the
+  // function itself in slot 0, and ip is where it resumes once the function
+  // it called returns. The script is the frame at the bottom, without a
+  // function. closure holds the function's upvalues, if it captured any.
+  struct CallFrame {
+    const Function *function;
+    const Closure *closure;
+    const Chunk *chunk;
+    const std::uint8_t *ip;
+    Value *slots;
+  };
+
+  bool Add(const std::uint8_t *ip);
+  // Calls the value beneath the count arguments on top of the stack. A
+  // function is called by pushing a frame for it, and a class by creating
+  // an instance and pushing a frame for its initializer, if it has one.
+  // Returns false after reporting an error.
+  bool CallValue(const std::uint8_t *ip, std::uint8_t count);
+  // Pushes a frame for callee, a function or closure, whose slots start
+  // beneath the count arguments on top of the stack, compiling it first if
+  // this is its first call.
+  bool CallFunction(const std::uint8_t *ip, const Object &callee,
+                    std::uint8_t count);
+  // Returns the open upvalue for the stack slot at local, creating it unless
+  // a closure already captured the slot.
+  std::shared_ptr<Upvalue> CaptureUpvalue(Value *local);
+  // Closes the open upvalues for last and the slots above it.
+  void CloseUpvalues(Value *last);
+  // Reports an error unless the inputs fit what chunk_ declares.
+  bool CheckInputs();
   template <typename Operator>
   bool BinaryOp(const std::uint8_t *ip, Operator op);
+  // Like BinaryOp, but for instructions whose operands were proven to be
+  // numbers, which are only tested when kChecked.
+  template <bool kChecked, typename Operator>
+  bool NumberOp(const std::uint8_t *ip, Operator op);
 
+  bool CallNative(const std::uint8_t *ip, std::uint8_t index,
+                  std::uint8_t count);
+  // Pushes, defines or assigns the global in slot, reporting an error when
+  // reading or assigning one that was never defined.
+  bool GetGlobal(const std::uint8_t *ip, std::size_t slot);
+  // The class instructions. The name of a class or method is the constant
+  // at index.
+  void DefineClass(std::size_t index);
+  bool DefineMethod(const std::uint8_t *ip, std::size_t index);
+  bool Inherit(const std::uint8_t *ip);
+  // The property instructions, through the chunk's inline cache at index.
+  bool GetProperty(const std::uint8_t *ip, std::size_t index);
+  bool SetProperty(const std::uint8_t *ip, std::size_t index);
+  bool Invoke(const std::uint8_t *ip, std::size_t index, std::uint8_t count);
+  bool GetSuper(const std::uint8_t *ip, std::size_t index);
+  // Calls the built-in method of a list or map the inline cache at index
+  // names, found with find, on object beneath count arguments.
+  template <typename T, typename Method>
+  bool InvokeBuiltinMethod(const std::uint8_t *ip, T *object,
+                           const Method *(*find)(std::string_view),
+                           std::size_t index, std::uint8_t count);
+  // The list and map instructions.
+  void BuildList(std::uint8_t count);
+  bool BuildMap(const std::uint8_t *ip, std::uint8_t count);
+  bool GetIndex(const std::uint8_t *ip);
+  bool SetIndex(const std::uint8_t *ip);
+  // Returns what the property the inline cache at index names resolves to
+  // on instance, looking it up only if the cache has not seen the
+  // instance's shape. Reports an error if there is no such property.
+  std::optional<std::uint32_t> FindProperty(const std::uint8_t *ip,
+                                            const Instance &instance,
+                                            std::size_t index);
+  void DefineGlobal(std::size_t slot);
+  bool SetGlobal(const std::uint8_t *ip, std::size_t slot);
+  // Makes room for count more values on the stack, moving it if it has to
+  // grow. Returns false if that would take it past kStackLimit.
+  bool EnsureStack(std::size_t count);
+  // Pushes a closure over the function in the constant at index, capturing
+  // the variables it names from the frame on top.
+  void MakeClosure(std::size_t index);
+  // Makes the frame on top, just pushed for a call in tail position, take
+  // the place of the caller's frame beneath it, moving the callee and its
+  // arguments down to where the caller's slots start.
+  void ReplaceCaller();
+  bool Negate(const std::uint8_t *ip);
   Value &Peek(long distance);
-  InterpretResult Run();
+  // Executes the frame on top until the frame at base - 1 returns, along
+  // with whatever it calls. With kChecked every instruction is validated
+  // before it runs; without it the frame's chunk must have passed the
+  // Verifier and fit the stack, since operands, constant indices and stack
+  // bounds are trusted. Only the outermost run, whose base is 1, can be
+  // suspended: the others are nested in a call from the JIT or from a
+  // verified chunk to one that is not, and run on without fuel until they
+  // return to it.
+  template <bool kChecked>
+  InterpretResult Run(std::size_t base);
+  // Runs the frame on top, checked unless its chunk is verified.
+  InterpretResult RunFrame();
+  // Cleans up after a run, unless it was only suspended.
+  InterpretResult EndRun(InterpretResult result);
+  // Returns the JIT's code for chunk, compiling it unless it was before, or
+  // nullptr if it cannot be compiled.
+  const JitCode *GetJitCode(const Chunk &chunk);
   /*
   template <typename Arg, typename... Args>
   void RuntimeError(const std::uint8_t *ip, Arg &&arg, Args &&...args);
   */
   void RuntimeError(const std::uint8_t *ip, const char *format...);
 
-  Chunk *chunk_ = nullptr;
+  // The chunk of the frame on top.
+  const Chunk *chunk_ = nullptr;
+  std::array<CallFrame, kFramesMax> frames_{};
+  std::size_t frame_count_ = 0;
   std::vector<Value> stack_;
+  Value *stack_top_ = nullptr;
+  // The upvalues still pointing into the stack, in order of the slots they
+  // point at, so that closing the ones above a slot pops them off the end.
+  std::vector<std::shared_ptr<Upvalue>> open_upvalues_;
+  OptimizationLevel optimization_level_ = OptimizationLevel::kO0;
+  bool jit_enabled_ = false;
+  // The native code the JIT compiled for each chunk it was asked to run, or
+  // nullptr for one it could not compile, so that a chunk run again is not
+  // compiled again. As with the tracer's loops, the id tells a chunk from
+  // one allocated in its place after it was freed.
+  struct JitEntry {
+    std::uint64_t chunk_id = 0;
+    std::unique_ptr<const JitCode> code;
+  };
+  std::unordered_map<const Chunk *, JitEntry> jit_code_;
+  bool tracing_enabled_ = true;
+  LoopTracer tracer_;
+  OutputBuffer out_;
+  std::ostream *errors_;
+  // The inputs of the chunk being run: either those set_inputs() stored in
+  // owned_inputs_, or those passed to Evaluate().
+  const std::vector<Value> *inputs_ = &owned_inputs_;
+  std::vector<Value> owned_inputs_;
+  // Where kReturn stores its value, or null to print it.
+  Value *result_ = nullptr;
+  std::optional<std::size_t> fuel_;
+  // Whether the run, if it is resumed, checks every instruction.
+  bool checked_ = false;
+  NativeTable natives_;
+  // Global variables by slot in global_table_, empty until defined.
+  std::shared_ptr<GlobalTable> global_table_;
+  std::vector<std::optional<Value>> globals_;
+  ChunkCache chunk_cache_{kChunkCacheCapacity};
 };
 
 }  // namespace lox
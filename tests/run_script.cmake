@@ -0,0 +1,43 @@
+# Runs a golden script: cmake -DLOX=<lox> -DFLAGS=<flags> -DSCRIPT=<path> -P
+#
+# The script's output must match <name>.out beside it, and what it writes to
+# stderr <name>.err, or nothing if there is no such file. It must exit with
+# the status a "// exit: N" line in it gives, or 0.
+
+get_filename_component(directory ${SCRIPT} DIRECTORY)
+get_filename_component(name ${SCRIPT} NAME_WE)
+separate_arguments(flags UNIX_COMMAND "${FLAGS}")
+
+execute_process(
+        COMMAND ${LOX} ${flags} ${SCRIPT}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE errors
+        RESULT_VARIABLE status)
+
+file(READ ${directory}/${name}.out expected_output)
+set(expected_errors "")
+if (EXISTS ${directory}/${name}.err)
+    file(READ ${directory}/${name}.err expected_errors)
+endif ()
+set(expected_status 0)
+file(STRINGS ${SCRIPT} exit_line REGEX "^// exit: [0-9]+$" LIMIT_COUNT 1)
+if (exit_line)
+    string(REGEX REPLACE "^// exit: " "" expected_status "${exit_line}")
+endif ()
+
+set(failed FALSE)
+if (NOT output STREQUAL expected_output)
+    message("Expected output:\n${expected_output}\nGot:\n${output}")
+    set(failed TRUE)
+endif ()
+if (NOT errors STREQUAL expected_errors)
+    message("Expected errors:\n${expected_errors}\nGot:\n${errors}")
+    set(failed TRUE)
+endif ()
+if (NOT status STREQUAL expected_status)
+    message("Expected exit status ${expected_status}, got ${status}")
+    set(failed TRUE)
+endif ()
+if (failed)
+    message(FATAL_ERROR "${name} failed under '${FLAGS}'")
+endif ()
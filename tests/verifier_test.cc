@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: Apache-2.0
+
+// Checks that the Verifier accepts well-formed chunks and rejects each kind
+// of malformed chunk with the error it should, since the VM runs verified
+// chunks without checking anything itself.
+
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "chunk.h"
+#include "globals.h"
+#include "verifier.h"
+
+namespace {
+
+using lox::Chunk;
+using lox::Opcode;
+
+constexpr std::uint8_t Op(Opcode opcode) {
+  return static_cast<std::uint8_t>(opcode);
+}
+
+void WriteCode(Chunk *chunk, std::initializer_list<std::uint8_t> code) {
+  for (std::uint8_t byte : code) chunk->Write(byte, 1);
+}
+
+struct TestCase {
+  const char *name;
+  void (*build)(Chunk *chunk);
+  // The error the verifier reports, without its offset, or nullptr if the
+  // chunk is well formed.
+  const char *error;
+};
+
+const TestCase kTestCases[] = {
+    {"well formed",
+     [](Chunk *chunk) {
+       chunk->AddConstant(1.0);
+       WriteCode(chunk, {Op(Opcode::kConstant), 0, Op(Opcode::kReturn)});
+     },
+     nullptr},
+    {"truncated operand",
+     [](Chunk *chunk) {
+       chunk->AddConstant(1.0);
+       WriteCode(chunk, {Op(Opcode::kReturn), Op(Opcode::kConstant)});
+     },
+     "Malformed instruction."},
+    {"truncated long operand",
+     [](Chunk *chunk) {
+       chunk->AddConstant(1.0);
+       WriteCode(chunk, {Op(Opcode::kConstantLong), 0, 0});
+     },
+     "Malformed instruction."},
+    {"truncated jump offset",
+     [](Chunk *chunk) {
+       WriteCode(chunk, {Op(Opcode::kNil), Op(Opcode::kReturn),
+                         Op(Opcode::kJump), 0});
+     },
+     "Malformed instruction."},
+    {"unknown opcode",
+     [](Chunk *chunk) { WriteCode(chunk, {0xff, Op(Opcode::kReturn)}); },
+     "Malformed instruction."},
+    {"constant index out of range",
+     [](Chunk *chunk) {
+       chunk->AddConstant(1.0);
+       WriteCode(chunk, {Op(Opcode::kConstant), 1, Op(Opcode::kReturn)});
+     },
+     "Constant index out of range."},
+    {"long constant index out of range",
+     [](Chunk *chunk) {
+       chunk->AddConstant(1.0);
+       WriteCode(chunk,
+                 {Op(Opcode::kConstantLong), 0, 1, 0, Op(Opcode::kReturn)});
+     },
+     "Constant index out of range."},
+    {"global without a table",
+     [](Chunk *chunk) {
+       WriteCode(chunk, {Op(Opcode::kGetGlobal), 0, Op(Opcode::kReturn)});
+     },
+     "Global slot out of range."},
+    {"global slot out of range",
+     [](Chunk *chunk) {
+       auto globals = std::make_shared<lox::GlobalTable>();
+       globals->Resolve("a");
+       chunk->SetGlobalTable(globals);
+       WriteCode(chunk, {Op(Opcode::kNil), Op(Opcode::kDefineGlobal), 1,
+                         Op(Opcode::kNil), Op(Opcode::kReturn)});
+     },
+     "Global slot out of range."},
+    {"long global slot out of range",
+     [](Chunk *chunk) {
+       auto globals = std::make_shared<lox::GlobalTable>();
+       globals->Resolve("a");
+       chunk->SetGlobalTable(globals);
+       WriteCode(chunk,
+                 {Op(Opcode::kGetGlobalLong), 0, 1, 0, Op(Opcode::kReturn)});
+     },
+     "Global slot out of range."},
+    {"jump into an operand",
+     [](Chunk *chunk) {
+       chunk->AddConstant(1.0);
+       // Lands on the kConstant's operand rather than on the instruction.
+       WriteCode(chunk, {Op(Opcode::kJump), 0, 1, Op(Opcode::kConstant), 0,
+                         Op(Opcode::kReturn)});
+     },
+     "Jump into the middle of an instruction."},
+    {"loop before the chunk",
+     [](Chunk *chunk) {
+       WriteCode(chunk, {Op(Opcode::kLoop), 0, 4, Op(Opcode::kNil),
+                         Op(Opcode::kReturn)});
+     },
+     "Loop before the chunk."},
+    {"stack underflow",
+     [](Chunk *chunk) {
+       WriteCode(chunk,
+                 {Op(Opcode::kPop), Op(Opcode::kNil), Op(Opcode::kReturn)});
+     },
+     "Stack underflow."},
+    {"unbalanced stack",
+     [](Chunk *chunk) {
+       // Falling through pushes a nil the jump skips, so the paths meet at
+       // kReturn with different depths.
+       WriteCode(chunk, {Op(Opcode::kTrue), Op(Opcode::kJumpIfFalse), 0, 1,
+                         Op(Opcode::kNil), Op(Opcode::kReturn)});
+     },
+     "Stack depth differs between paths."},
+    {"tail call not followed by a return",
+     [](Chunk *chunk) {
+       WriteCode(chunk, {Op(Opcode::kNil), Op(Opcode::kTailCall), 0,
+                         Op(Opcode::kPop), Op(Opcode::kNil),
+                         Op(Opcode::kReturn)});
+     },
+     "Tail call not followed by a return."},
+    {"tail call at the end",
+     [](Chunk *chunk) {
+       WriteCode(chunk, {Op(Opcode::kNil), Op(Opcode::kTailCall), 0});
+     },
+     "Tail call not followed by a return."},
+    {"no return",
+     [](Chunk *chunk) { WriteCode(chunk, {Op(Opcode::kNil)}); },
+     "Chunk does not end with a return."},
+    {"empty",
+     [](Chunk * /* unused */) {},
+     "Chunk does not end with a return."},
+};
+
+// Returns whether the verifier treats the chunk test_case builds as it
+// should, reporting it if not.
+bool Run(const TestCase &test_case) {
+  auto chunk = Chunk{};
+  test_case.build(&chunk);
+  auto verifier = lox::Verifier{};
+  bool verified = verifier.Verify(&chunk);
+  const std::string &error = verifier.get_error();
+
+  if (test_case.error == nullptr) {
+    if (verified && chunk.IsVerified()) return true;
+    std::cerr << test_case.name << ": rejected: " << error << '\n';
+    return false;
+  }
+  // Errors start with the offset they were found at.
+  auto message = std::string_view{error};
+  if (auto end = message.find("] "); end != std::string_view::npos) {
+    message.remove_prefix(end + 2);
+  }
+  if (!verified && !chunk.IsVerified() && message == test_case.error) {
+    return true;
+  }
+  std::cerr << test_case.name << ": expected '" << test_case.error << "', ";
+  if (verified) {
+    std::cerr << "but the chunk was verified\n";
+  } else {
+    std::cerr << "got '" << error << "'\n";
+  }
+  return false;
+}
+
+}  // namespace
+
+int main() {
+  auto failures = 0;
+  for (const TestCase &test_case : kTestCases) {
+    if (!Run(test_case)) ++failures;
+  }
+  if (failures != 0) {
+    std::cerr << failures << " verifier test(s) failed\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}